@@ -0,0 +1,382 @@
+#include <iostream>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "ParticleSimulator.hpp"
+#include "OpenCL/OpenClParticleSimulator.hpp"
+#include "batch/Scenario.hpp"
+#include "common/PhaseTimings.hpp"
+#include "common/ProcessMemory.hpp"
+#include "io/Checkpoint.hpp"
+#include "io/TrajectoryRecorder.hpp"
+#include "metrics/Metrics.hpp"
+#include "profiling/Profiler.hpp"
+
+using std::cout;
+using std::endl;
+
+namespace {
+    /// A phase name as a CSV column, "velocity solves" becomes "phase_velocity_solves_ms"
+    std::string get_phase_column(const std::string &phase) {
+        std::string column = "phase_" + phase + "_ms";
+        std::replace(column.begin(), column.end(), ' ', '_');
+        return column;
+    }
+
+    /// Reads a whole argument as an unsigned number, false if it is not one or is above max_value
+    bool read_unsigned(const std::string &argument, unsigned long max_value, unsigned long &value) {
+        std::istringstream in(argument);
+        return (in >> value) && in.eof() && value <= max_value && argument[0] != '-';
+    }
+}
+
+/// Runs a scenario file without a window and reports the throughput of its simulator:
+///     SPH_batch <scenario file> [key=value ...] [--csv <file>] [--trace <file>]
+///               [--metrics <file>] [--metrics-interval <steps>] [--metrics-port <port>]
+///               [--restart <checkpoint>] [--checkpoint <file>] [--checkpoint-interval <steps>]
+///               [--record <file>] [--record-interval <steps>]
+/// See Scenario for the format of the file. The key=value arguments override the file's lines, so that a sweep
+/// (see scripts/scaling.py) can reuse one scenario. --csv also writes the results as a header and one row, with
+/// the phases as ms/step columns. --trace profiles the setup and the steps, and writes the zones as a Chrome trace.
+/// --metrics writes a JSON line of Metrics every --metrics-interval steps (default 100) of the run, and
+/// --metrics-port serves them for Prometheus on 127.0.0.1 while it lasts; both time the OpenCL kernels as well.
+/// --restart starts from a checkpoint's parameters, particles and solver state instead of the scenario's layout,
+/// the key=value arguments still apply on top. --checkpoint writes one after the run, and every
+/// --checkpoint-interval steps of it if given, on a background thread. --record streams the particles of every
+/// --record-interval-th step of the run (default 10) to a compressed trajectory, see TrajectoryRecorder
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <scenario file> [key=value ...] [--csv <file>] [--trace <file>]"
+                  << " [--metrics <file>] [--metrics-interval <steps>] [--metrics-port <port>]"
+                  << " [--restart <checkpoint>] [--checkpoint <file>] [--checkpoint-interval <steps>]"
+                  << " [--record <file>] [--record-interval <steps>]" << endl;
+        return EXIT_FAILURE;
+    }
+
+    Scenario scenario;
+    if (!Scenario::load(argv[1], scenario)) {
+        return EXIT_FAILURE;
+    }
+
+    std::string csv_file_name;
+    std::string trace_file_name;
+    std::string metrics_file_name;
+    unsigned long metrics_interval = 100;
+    unsigned long metrics_port = 0;
+    std::string restart_file_name;
+    std::string checkpoint_file_name;
+    unsigned long checkpoint_interval = 0;
+    std::string record_file_name;
+    unsigned long record_interval = 10;
+
+    // Applied once the checkpoint to restart from, if any, has replaced the scenario's parameters
+    std::vector<std::string> assignments;
+
+    for (int i = 2; i < argc; ++i) {
+        const std::string argument = argv[i];
+        std::string error;
+
+        if (argument == "--csv" && i + 1 < argc) {
+            csv_file_name = argv[++i];
+        } else if (argument == "--trace" && i + 1 < argc) {
+            trace_file_name = argv[++i];
+        } else if (argument == "--metrics" && i + 1 < argc) {
+            metrics_file_name = argv[++i];
+        } else if (argument == "--metrics-interval" && i + 1 < argc) {
+            if (!read_unsigned(argv[++i], std::numeric_limits<unsigned int>::max(), metrics_interval) ||
+                metrics_interval == 0) {
+                std::cerr << argument << ": expected a number of steps" << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (argument == "--metrics-port" && i + 1 < argc) {
+            if (!read_unsigned(argv[++i], 65535, metrics_port) || metrics_port == 0) {
+                std::cerr << argument << ": expected a port number" << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (argument == "--restart" && i + 1 < argc) {
+            restart_file_name = argv[++i];
+        } else if (argument == "--checkpoint" && i + 1 < argc) {
+            checkpoint_file_name = argv[++i];
+        } else if (argument == "--checkpoint-interval" && i + 1 < argc) {
+            if (!read_unsigned(argv[++i], std::numeric_limits<unsigned int>::max(), checkpoint_interval)) {
+                std::cerr << argument << ": expected a number of steps" << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (argument == "--record" && i + 1 < argc) {
+            record_file_name = argv[++i];
+        } else if (argument == "--record-interval" && i + 1 < argc) {
+            if (!read_unsigned(argv[++i], std::numeric_limits<unsigned int>::max(), record_interval) ||
+                record_interval == 0) {
+                std::cerr << argument << ": expected a number of steps" << endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            assignments.push_back(argument);
+        }
+    }
+
+    std::string error;
+    Checkpoint checkpoint;
+    if (!restart_file_name.empty()) {
+        if (!checkpoint.open(restart_file_name, error)) {
+            std::cerr << restart_file_name << ": " << error << endl;
+            return EXIT_FAILURE;
+        }
+        scenario.set_parameters(checkpoint.get_parameters());
+    }
+
+    for (const std::string &assignment : assignments) {
+        if (!scenario.set(assignment, error)) {
+            std::cerr << assignment << ": " << error << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!scenario.finish(error)) {
+        std::cerr << argv[1] << ": " << error << endl;
+        return EXIT_FAILURE;
+    }
+
+    Metrics metrics;
+    const bool use_metrics = !metrics_file_name.empty() || metrics_port != 0;
+    PhaseTimings kernel_timings;
+
+    if (!metrics_file_name.empty() && !metrics.open_log(metrics_file_name, metrics_interval)) {
+        std::cerr << "Could not write " << metrics_file_name << endl;
+        return EXIT_FAILURE;
+    }
+    if (metrics_port != 0) {
+        if (!metrics.serve(static_cast<unsigned short>(metrics_port))) {
+            std::cerr << "Could not serve the metrics on port " << metrics_port << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "Metrics on http://127.0.0.1:" << metrics_port << "/metrics" << endl;
+    }
+
+    Parameters &params = scenario.params;
+
+    // A restart takes the particles straight from the mapped checkpoint
+    std::vector<glm::vec3> generated_positions;
+    std::vector<glm::vec3> generated_velocities;
+    Span<const glm::vec3> positions = checkpoint.get_positions();
+    Span<const glm::vec3> velocities = checkpoint.get_velocities();
+    if (restart_file_name.empty()) {
+        generated_positions = scenario.generate_positions();
+        generated_velocities.assign(params.n_particles, scenario.initial_velocity);
+        positions = generated_positions;
+        velocities = generated_velocities;
+    }
+
+    // Every backend, OpenCL included, keeps the particles in its own memory, so no window or context is needed
+    ParticleSimulator *simulator = scenario.create_simulator();
+
+    OpenClParticleSimulator *opencl_simulator = dynamic_cast<OpenClParticleSimulator *>(simulator);
+    if (opencl_simulator && use_metrics) {
+        opencl_simulator->setKernelTimings(&kernel_timings);
+    }
+
+    // The profiler's zones cover the whole run, so the warm-up steps are in the trace too
+    Profiler::set_enabled(!trace_file_name.empty());
+
+    std::chrono::high_resolution_clock::time_point tp_start = std::chrono::high_resolution_clock::now();
+    std::string setup_error;
+    if (!simulator->setupSimulation(params, positions, velocities, setup_error)) {
+        std::cerr << setup_error << endl;
+        return EXIT_FAILURE;
+    }
+    if (!restart_file_name.empty()) {
+        simulator->setSolverState(checkpoint.get_solver_state());
+    }
+    const double setup_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                               tp_start).count();
+
+    // The first steps fill the caches and build the solvers' state, they are left out of the measurements
+    float dt_s = scenario.dt;
+    for (unsigned int step = 0; step < scenario.warmup_steps; ++step) {
+        tp_start = std::chrono::high_resolution_clock::now();
+        simulator->updateSimulation(params, dt_s);
+        const double step_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                                  tp_start).count();
+
+        // The metrics count every step, the simulator's counters do as well
+        if (use_metrics) {
+            metrics.record_step(*simulator, step_seconds, nullptr, opencl_simulator ? &kernel_timings : nullptr);
+        }
+
+        if (scenario.dt_policy == TimestepPolicy::WallClock) {
+            dt_s = static_cast<float>(step_seconds);
+        }
+    }
+
+    PhaseTimings timings;
+    if (scenario.phase_timings) {
+        simulator->setPhaseTimings(&timings);
+    }
+
+    const unsigned int start_particles = simulator->getParticleDrawCount();
+    unsigned long long particle_updates = 0;
+    double simulated_seconds = 0.0;
+    double min_step_seconds = std::numeric_limits<double>::max();
+    double max_step_seconds = 0.0;
+
+    CheckpointWriter checkpoint_writer;
+
+    TrajectoryRecorder recorder;
+    if (!record_file_name.empty() &&
+        !recorder.open(record_file_name, params, static_cast<unsigned int>(record_interval), error)) {
+        std::cerr << record_file_name << ": " << error << endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::chrono::high_resolution_clock::time_point tp_run = std::chrono::high_resolution_clock::now();
+    for (unsigned int step = 0; step < scenario.steps; ++step) {
+        // Every particle alive at the start of the step is updated by it
+        particle_updates += simulator->getParticleDrawCount();
+        simulated_seconds += dt_s;
+
+        tp_start = std::chrono::high_resolution_clock::now();
+        simulator->updateSimulation(params, dt_s);
+        const double step_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                                  tp_start).count();
+
+        min_step_seconds = std::min(min_step_seconds, step_seconds);
+        max_step_seconds = std::max(max_step_seconds, step_seconds);
+
+        if (use_metrics) {
+            metrics.record_step(*simulator, step_seconds, scenario.phase_timings ? &timings : nullptr,
+                                opencl_simulator ? &kernel_timings : nullptr);
+        }
+
+        // Only the copy of the recorded frames is in the run time, they are compressed and written on a thread
+        recorder.record_step(*simulator, dt_s);
+
+        if (scenario.dt_policy == TimestepPolicy::WallClock) {
+            dt_s = static_cast<float>(step_seconds);
+        }
+
+        // Only the copy of the particles is in the run time, the file is written while the steps go on
+        if (!checkpoint_file_name.empty() && checkpoint_interval > 0 && (step + 1) % checkpoint_interval == 0 &&
+            step + 1 < scenario.steps) {
+            checkpoint_writer.write_async(checkpoint_file_name, params, *simulator);
+        }
+    }
+    const double run_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                             tp_run).count();
+
+    simulator->setPhaseTimings(nullptr);
+    const bool recorded = recorder.close();
+
+    // Of the whole process, so including the scenario's initial particles
+    const double peak_memory_bytes = get_peak_memory_bytes();
+
+    cout << std::fixed << std::setprecision(3);
+    cout << "Scenario:           " << argv[1] << "\n";
+    cout << "Backend:            " << Scenario::get_backend_name(scenario.backend) << "\n";
+    cout << "Particles:          " << start_particles << " at the start, "
+         << simulator->getParticleDrawCount() << " at the end\n";
+    cout << "Setup:              " << 1e3 * setup_seconds << " ms\n";
+    cout << "Steps:              " << scenario.steps << " after " << scenario.warmup_steps << " warm-up steps, "
+         << simulated_seconds << " s simulated\n";
+    cout << "Peak memory:        " << peak_memory_bytes / (1024.0 * 1024.0) << " MiB\n";
+
+    if (scenario.steps == 0) {
+        cout << endl;
+    } else {
+        cout << "Run:                " << run_seconds << " s\n";
+        cout << "Step time:          " << 1e3 * min_step_seconds << " / " << 1e3 * run_seconds / scenario.steps
+             << " / " << 1e3 * max_step_seconds << " ms (min / mean / max)\n";
+        cout << "Steps/s:            " << scenario.steps / run_seconds << "\n";
+        cout << "Particle-updates/s: " << std::scientific << particle_updates / run_seconds << std::fixed << "\n";
+
+        if (!timings.get_phases().empty()) {
+            // The phases only add up to the step time when the simulator times all of its work
+            double total_seconds = 0.0;
+            for (const PhaseTimings::Phase &phase : timings.get_phases()) {
+                total_seconds += phase.total_seconds;
+            }
+
+            cout << "\n" << std::left << std::setw(20) << "Phase" << std::right
+                 << std::setw(12) << "total ms" << std::setw(12) << "ms/step" << std::setw(10) << "share" << "\n";
+            for (const PhaseTimings::Phase &phase : timings.get_phases()) {
+                cout << std::left << std::setw(20) << phase.name << std::right
+                     << std::setw(12) << 1e3 * phase.total_seconds
+                     << std::setw(12) << 1e3 * phase.total_seconds / scenario.steps
+                     << std::setw(9) << 100.0 * phase.total_seconds / total_seconds << "%\n";
+            }
+        }
+        cout << endl;
+    }
+
+    bool success = true;
+    if (!checkpoint_file_name.empty()) {
+        checkpoint_writer.write_async(checkpoint_file_name, params, *simulator);
+        success = checkpoint_writer.wait();
+        if (success) {
+            cout << "Wrote the checkpoint " << checkpoint_file_name << "\n" << endl;
+        }
+    }
+
+    if (!record_file_name.empty()) {
+        if (recorded) {
+            cout << "Recorded " << recorder.get_frame_count() << " frames to " << record_file_name << ", "
+                 << recorder.get_file_bytes() / (1024.0 * 1024.0) << " MiB, "
+                 << 100.0 * recorder.get_file_bytes() / std::max(recorder.get_raw_bytes(), 1ull)
+                 << "% of the particles as floats\n" << endl;
+        } else {
+            std::cerr << "Could not write the trajectory " << record_file_name << endl;
+            success = false;
+        }
+    }
+
+    if (!csv_file_name.empty()) {
+        std::ofstream csv(csv_file_name.c_str());
+        if (!csv.is_open()) {
+            std::cerr << "Could not write " << csv_file_name << endl;
+            success = false;
+        }
+
+        const double steps = std::max(1u, scenario.steps);
+
+        csv << "backend,opencl_device,pressure_solver,particles,end_particles,steps,warmup_steps,dt,setup_s,run_s,"
+               "steps_per_s,ns_per_particle_step,peak_memory_mib";
+        for (const PhaseTimings::Phase &phase : timings.get_phases()) {
+            csv << "," << get_phase_column(phase.name);
+        }
+        csv << "\n";
+
+        csv << std::setprecision(9);
+        csv << Scenario::get_backend_name(scenario.backend) << ","
+            << (scenario.backend == SimulatorBackend::OpenCL ? scenario.opencl_device : 0) << ","
+            << Scenario::get_pressure_solver_name(params.pressure_solver) << ","
+            << start_particles << "," << simulator->getParticleDrawCount() << ","
+            << scenario.steps << "," << scenario.warmup_steps << "," << scenario.dt << ","
+            << setup_seconds << "," << run_seconds << ","
+            << scenario.steps / run_seconds << ","
+            << (particle_updates > 0 ? 1e9 * run_seconds / particle_updates : 0.0) << ","
+            << peak_memory_bytes / (1024.0 * 1024.0);
+        for (const PhaseTimings::Phase &phase : timings.get_phases()) {
+            csv << "," << 1e3 * phase.total_seconds / steps;
+        }
+        csv << "\n";
+    }
+
+    if (!trace_file_name.empty()) {
+        Profiler::set_enabled(false);
+        Profiler::print_zone_statistics(cout);
+        cout << endl;
+
+        if (!Profiler::write_chrome_trace(trace_file_name)) {
+            std::cerr << "Could not write " << trace_file_name << endl;
+            success = false;
+        }
+    }
+
+    delete simulator;
+
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
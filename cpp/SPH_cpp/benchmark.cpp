@@ -0,0 +1,311 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "sph_kernels.h"
+#include "VoxelGrid.hpp"
+#include "CppParticleSimulator.hpp"
+#include "OpenCL/OpenClParticleSimulator.hpp"
+#include "batch/Scenario.hpp"
+#include "common/PhaseTimings.hpp"
+
+using std::cout;
+using std::endl;
+
+/// The measurements of one benchmark, one sample per repetition
+struct BenchmarkResult {
+    std::string name;
+
+    // How many items (particles, kernel evaluations) each repetition processes
+    unsigned long long items;
+
+    std::vector<double> seconds;
+};
+
+// Written to by the benchmarks so that the compiler cannot drop the work they measure
+volatile float benchmark_sink;
+
+/// Runs the function once to warm up and then once per repetition, timing each run
+template<typename Function>
+BenchmarkResult measure(const std::string &name, unsigned long long items, unsigned int repetitions,
+                        Function function) {
+    BenchmarkResult result = {name, items, {}};
+
+    function();
+    for (unsigned int repetition = 0; repetition < repetitions; ++repetition) {
+        const std::chrono::high_resolution_clock::time_point tp_start = std::chrono::high_resolution_clock::now();
+        function();
+        result.seconds.push_back(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+                                                               tp_start).count());
+    }
+
+    return result;
+}
+
+/// Adds one sample per phase of the timings to the results named prefix + phase, and clears the timings
+void add_phase_samples(PhaseTimings &timings, const std::string &prefix, unsigned long long items,
+                       std::vector<BenchmarkResult> &results) {
+    for (const PhaseTimings::Phase &phase : timings.get_phases()) {
+        const std::string name = prefix + phase.name;
+
+        std::vector<BenchmarkResult>::iterator result = std::find_if(
+                results.begin(), results.end(), [&](const BenchmarkResult &r) { return r.name == name; });
+        if (result == results.end()) {
+            results.push_back({name, items, {}});
+            result = results.end() - 1;
+        }
+
+        result->seconds.push_back(phase.total_seconds);
+    }
+
+    timings.clear();
+}
+
+/// The smoothing kernels, one call per offset against the batch overloads
+void benchmark_kernels(const Scenario &scenario, unsigned int repetitions, std::vector<BenchmarkResult> &results) {
+    const unsigned int count = 1 << 16;
+    const float h = scenario.params.kernel_size;
+
+    // Offsets within and just beyond the kernel size, like the pairs of a neighbour search
+    std::mt19937 generator(scenario.seed);
+    std::uniform_real_distribution<float> distribution(-h, h);
+    std::vector<glm::vec3> offsets(count);
+    for (glm::vec3 &offset : offsets) {
+        offset.x = distribution(generator);
+        offset.y = distribution(generator);
+        offset.z = distribution(generator);
+    }
+
+    std::vector<float> w(count);
+    std::vector<glm::vec3> gradients(count);
+
+    results.push_back(measure("kernels/Wpoly6/scalar", count, repetitions, [&]() {
+        for (unsigned int i = 0; i < count; ++i) {
+            w[i] = Wpoly6(offsets[i], h);
+        }
+        benchmark_sink = w[count / 2];
+    }));
+
+    results.push_back(measure("kernels/Wpoly6/batch", count, repetitions, [&]() {
+        Wpoly6(offsets.data(), w.data(), count, h);
+        benchmark_sink = w[count / 2];
+    }));
+
+    results.push_back(measure("kernels/gradWspiky/scalar", count, repetitions, [&]() {
+        for (unsigned int i = 0; i < count; ++i) {
+            gradients[i] = gradWspiky(offsets[i], h);
+        }
+        benchmark_sink = gradients[count / 2].x;
+    }));
+
+    results.push_back(measure("kernels/gradWspiky/batch", count, repetitions, [&]() {
+        gradWspiky(offsets.data(), gradients.data(), count, h);
+        benchmark_sink = gradients[count / 2].x;
+    }));
+}
+
+/// Building the voxel grid from the scenario's particles
+void benchmark_grid(const Scenario &scenario, unsigned int repetitions, std::vector<BenchmarkResult> &results) {
+    const std::vector<glm::vec3> positions = scenario.generate_positions();
+
+    clVoxelGridInfo grid_info;
+    scenario.params.set_voxel_grid_info(grid_info);
+
+    VoxelGrid grid;
+    results.push_back(measure("grid/build", positions.size(), repetitions, [&]() {
+        grid.build(grid_info, positions);
+        benchmark_sink = static_cast<float>(grid.get_cell_start()[grid_info.total_grid_cells / 2]);
+    }));
+}
+
+/// The phases of CppParticleSimulator's steps: grid, densities, forces and integration
+void benchmark_cpp_simulator(const Scenario &scenario, unsigned int repetitions,
+                             std::vector<BenchmarkResult> &results) {
+    const std::vector<glm::vec3> positions = scenario.generate_positions();
+    const std::vector<glm::vec3> velocities(positions.size(), scenario.initial_velocity);
+
+    CppParticleSimulator simulator;
+    std::string error;
+    simulator.setupSimulation(scenario.params, positions, velocities, error);
+
+    for (unsigned int step = 0; step < scenario.warmup_steps; ++step) {
+        simulator.updateSimulation(scenario.params, scenario.dt);
+    }
+
+    PhaseTimings timings;
+    simulator.setPhaseTimings(&timings);
+    for (unsigned int repetition = 0; repetition < repetitions; ++repetition) {
+        simulator.updateSimulation(scenario.params, scenario.dt);
+        add_phase_samples(timings, "cpp/", simulator.getParticleDrawCount(), results);
+    }
+    simulator.setPhaseTimings(nullptr);
+}
+
+/// Every OpenCL kernel of the simulator's steps, timed on the device. Returns false if the simulator could not be
+/// set up, i.e. without an OpenCL device. The simulator keeps the particles in plain OpenCL buffers, so this needs no display, and runs on CPU runtimes too
+bool benchmark_opencl_simulator(const Scenario &scenario, unsigned int repetitions,
+                                std::vector<BenchmarkResult> &results) {
+    const std::vector<glm::vec3> positions = scenario.generate_positions();
+    const std::vector<glm::vec3> velocities(positions.size(), scenario.initial_velocity);
+
+    PhaseTimings timings;
+    OpenClParticleSimulator simulator;
+    simulator.setDeviceId(scenario.opencl_device);
+    simulator.setKernelTimings(&timings);
+    std::string error;
+    if (!simulator.setupSimulation(scenario.params, positions, velocities, error)) {
+        std::cerr << error << ", skipping the OpenCL kernels" << endl;
+        return false;
+    }
+
+    for (unsigned int step = 0; step < scenario.warmup_steps; ++step) {
+        simulator.updateSimulation(scenario.params, scenario.dt);
+    }
+
+    // A kernel enqueued several times in a step, i.e. by the solvers' iterations, gets the sum of them as its sample
+    timings.clear();
+    for (unsigned int repetition = 0; repetition < repetitions; ++repetition) {
+        simulator.updateSimulation(scenario.params, scenario.dt);
+        add_phase_samples(timings, "opencl/", simulator.getParticleDrawCount(), results);
+    }
+
+    return true;
+}
+
+double get_percentile(std::vector<double> seconds, double fraction) {
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[static_cast<size_t>(fraction * (seconds.size() - 1) + 0.5)];
+}
+
+void write_json(std::ostream &out, const Scenario &scenario, unsigned int repetitions, bool opencl,
+                const std::vector<BenchmarkResult> &results) {
+    out << std::setprecision(9);
+    out << "{\n";
+    out << "  \"particles\": " << scenario.params.n_particles << ",\n";
+    out << "  \"repetitions\": " << repetitions << ",\n";
+    out << "  \"seed\": " << scenario.seed << ",\n";
+    out << "  \"opencl_device\": ";
+    if (opencl) {
+        out << scenario.opencl_device << ",\n";
+    } else {
+        out << "null,\n";
+    }
+    out << "  \"benchmarks\": [";
+
+    bool first = true;
+    for (const BenchmarkResult &result : results) {
+        if (result.seconds.empty()) {
+            continue;
+        }
+
+        double sum = 0.0;
+        for (const double seconds : result.seconds) {
+            sum += seconds;
+        }
+        const double median = get_percentile(result.seconds, 0.5);
+
+        out << (first ? "\n" : ",\n");
+        first = false;
+
+        out << "    {\"name\": \"" << result.name << "\", "
+            << "\"items\": " << result.items << ", "
+            << "\"samples\": " << result.seconds.size() << ", "
+            << "\"min_ns\": " << 1e9 * *std::min_element(result.seconds.begin(), result.seconds.end()) << ", "
+            << "\"median_ns\": " << 1e9 * median << ", "
+            << "\"mean_ns\": " << 1e9 * sum / result.seconds.size() << ", "
+            << "\"p90_ns\": " << 1e9 * get_percentile(result.seconds, 0.9) << ", "
+            << "\"max_ns\": " << 1e9 * *std::max_element(result.seconds.begin(), result.seconds.end()) << ", "
+            << "\"items_per_second\": " << (median > 0.0 ? result.items / median : 0.0) << "}";
+    }
+
+    out << "\n  ]\n";
+    out << "}\n";
+}
+
+/// Micro-benchmarks of the simulation's hot spots, with inputs from a fixed seed so that runs can be compared:
+///     SPH_benchmark [--output <file>] [--particles <count>] [--repetitions <count>] [--scenario <file>]
+///                   [--opencl-device <id>] [--no-opencl]
+/// The results are written as JSON to the output file, benchmark.json by default, and summarised on stdout.
+/// A scenario file sets the parameters and the particle layout, see Scenario
+int main(int argc, char **argv) {
+    std::string output_file_name = "benchmark.json";
+    unsigned int repetitions = 50;
+    int particles = -1;
+    int opencl_device = -1;
+    bool run_opencl = true;
+
+    Scenario scenario;
+    scenario.layout = ParticleLayout::Lattice;
+    scenario.layout_min = glm::vec3(-2.0f, 0.0f, -2.0f);
+    scenario.layout_max = glm::vec3(2.0f, 2.0f, 2.0f);
+    scenario.params.n_particles = 10000;
+    scenario.params.max_particles = 2 * scenario.params.n_particles;
+
+    for (int i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+
+        if (std::strcmp(argv[i], "--output") == 0 && has_value) {
+            output_file_name = argv[++i];
+        } else if (std::strcmp(argv[i], "--particles") == 0 && has_value) {
+            particles = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--repetitions") == 0 && has_value) {
+            repetitions = static_cast<unsigned int>(std::max(1, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--scenario") == 0 && has_value) {
+            if (!Scenario::load(argv[++i], scenario)) {
+                return EXIT_FAILURE;
+            }
+        } else if (std::strcmp(argv[i], "--opencl-device") == 0 && has_value) {
+            opencl_device = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--no-opencl") == 0) {
+            run_opencl = false;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--output <file>] [--particles <count>] [--repetitions <count>]"
+                      << " [--scenario <file>] [--opencl-device <id>] [--no-opencl]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The options override the scenario, whichever order they are given in
+    if (particles > 0) {
+        scenario.params.n_particles = static_cast<unsigned int>(particles);
+        scenario.params.max_particles = 2 * scenario.params.n_particles;
+    }
+    if (opencl_device > 0) {
+        scenario.opencl_device = opencl_device;
+    }
+
+    std::vector<BenchmarkResult> results;
+    benchmark_kernels(scenario, repetitions, results);
+    benchmark_grid(scenario, repetitions, results);
+    benchmark_cpp_simulator(scenario, repetitions, results);
+    const bool opencl = run_opencl && benchmark_opencl_simulator(scenario, repetitions, results);
+
+    std::ofstream output_file(output_file_name.c_str());
+    if (!output_file.is_open()) {
+        std::cerr << "Could not open " << output_file_name << endl;
+        return EXIT_FAILURE;
+    }
+    write_json(output_file, scenario, repetitions, opencl, results);
+
+    cout << "\n" << std::left << std::setw(48) << "Benchmark" << std::right
+         << std::setw(14) << "median us" << std::setw(14) << "items/s" << "\n";
+    cout << std::fixed;
+    for (const BenchmarkResult &result : results) {
+        const double median = get_percentile(result.seconds, 0.5);
+        cout << std::left << std::setw(48) << result.name << std::right
+             << std::setw(14) << std::setprecision(1) << 1e6 * median
+             << std::setw(14) << std::setprecision(0) << (median > 0.0 ? result.items / median : 0.0) << "\n";
+    }
+    cout << "\nWrote " << output_file_name << endl;
+
+    return EXIT_SUCCESS;
+}
@@ -1,29 +1,189 @@
 #pragma once
 
+#include <random>
+
 #include "ParticleSimulator.hpp"
+#include "ParticleFlow.hpp"
 #include "Parameters.h"
+#include "VoxelGrid.hpp"
+#include "SleepingCells.hpp"
+#include "ShallowWater.hpp"
+#include "boundary/SignedDistanceField.hpp"
+#include "boundary/BoundaryParticles.hpp"
 
 class CppParticleSimulator : public ParticleSimulator {
 public:
-    void setupSimulation(const Parameters &params,
-                         const std::vector<glm::vec3> &particle_positions,
-                         const std::vector<glm::vec3> &particle_velocities,
-                         const GLuint &vbo_positions,
-                         const GLuint &vbo_velocities);
+    bool setupSimulation(const Parameters &params,
+                         Span<const glm::vec3> particle_positions,
+                         Span<const glm::vec3> particle_velocities,
+                         std::string &error);
 
     void updateSimulation(const Parameters &params, float dt_seconds);
 
-    void checkBoundaries(const Parameters &params);
+    /// The alive particles are always kept compacted at the start of the buffers
+    unsigned int getParticleDrawCount();
+
+    /// The alive particles, straight from the simulator's own vectors
+    void readParticleState(const ParticleStateCallback &callback);
 
-    void checkBoundariesGlass(const Parameters &params);
+    /// Moves particles that have penetrated the container back inside it and reflects their velocities
+    void checkBoundaries(const Parameters &params);
 
+    /// The force pushing particle i away from the container walls
     glm::vec3 calculateBoundaryForce(const Parameters &params, int i);
 
-    glm::vec3 calculateBoundaryForceGlass(const Parameters &params, int i);
+    /// How many iterations the incompressible pressure solvers needed in the last update, over all its sub-steps
+    unsigned int getSolverIterations();
+
+    const ShallowWater *getShallowWater();
+
+    bool getGridOccupancy(GridOccupancy &occupancy);
+
+    void getSolverState(SolverState &state);
+
+    void setSolverState(const SolverState &state);
 
 private:
+    /// Advances the particles by one sub-step of the frame, recalculating the densities and forces of the
+    /// particles whose timestep level is due
+    void stepSimulation(const Parameters &params, float dt_seconds);
+
+    /// Gives each particle the coarsest timestep level whose step keeps it within Parameters::courant_number of
+    /// its smoothing length, and returns how many sub-steps the frame needs for the finest of them
+    unsigned int assignTimestepLevels(const Parameters &params, float dt_seconds);
+
+    /// Whether particle i's level has a step starting at the current sub-step. The other particles move with the
+    /// forces of their last step
+    inline bool isTimestepActive(unsigned int i) const {
+        return timestep_info.substep % (1u << (timestep_info.finest_level - timestepLevels[i])) == 0;
+    }
+
+    /// Predictive-corrective incompressible SPH (Solenthaler & Pajarola 2009)
+    /// Iterates the pressures until the predicted density error is below Parameters::density_error_tolerance,
+    /// then integrates the particles. Expects the non-pressure forces to have been calculated.
+    /// As a safety limit the pressure alone moves a particle at most a tenth of a kernel size per step, so that
+    /// overlapping particles, i.e. from a random initial state, separate calmly instead of being flung apart. The
+    /// particles it holds back are counted in SimulationCounters::limited_pressure_particles.
+    void solvePressurePCISPH(const Parameters &params, float dt_seconds);
+
+    /// Divergence-free SPH (Bender & Koschier 2015)
+    /// Finds each particle's density and the factor turning a density error into a stiffness
+    void calculateFactorsDFSPH(const Parameters &params);
+
+    /// How fast particle i's density changes with the current velocities
+    float densityChangeDFSPH(const Parameters &params, unsigned int i);
+
+    /// Changes the velocities by the pressure accelerations of the given stiffnesses, at most a tenth of a kernel size
+    /// of movement per step as in PCISPH. Returns how many particles that safety limit held back
+    unsigned int applyStiffnessDFSPH(const Parameters &params, const std::vector<float> &stiffness, float dt_seconds);
+
+    /// Corrects the velocities until the density stops changing, returns the iteration count
+    unsigned int solveDivergenceDFSPH(const Parameters &params, float dt_seconds);
+
+    /// Corrects the velocities with the non-pressure forces until they keep the rest density, then integrates the
+    /// particles. Returns the iteration count
+    unsigned int solveDensityDFSPH(const Parameters &params, float dt_seconds);
+
+    /// Solves (I - dt * viscosity) v' = v for the new velocities with conjugate gradients, in place of the
+    /// explicit viscosity force. The particles in sleeping cells keep their velocities. Returns the iteration count
+    unsigned int solveViscosityImplicit(const Parameters &params, float dt_seconds);
+
+    /// product = (I - dt * viscosity) x for the awake particles, product = x for the sleeping ones
+    void applyViscosityOperator(const Parameters &params, float dt_seconds, const std::vector<glm::vec3> &x,
+                                std::vector<glm::vec3> &product);
+
+    // Conjugate gradient state of the viscosity solve, kept between steps to avoid reallocation
+    std::vector<glm::vec3> viscosityResidual;
+    std::vector<glm::vec3> viscosityDirection;
+    std::vector<glm::vec3> viscosityProduct;
+
+    /// Moves the particles with the state equation's forces, see TimeIntegrator
+    void integrate(const Parameters &params, float dt_seconds);
+
+    unsigned int solverIterations = 0;
+
+    // The integrator of the last step, the integrator state is reset when it changes
+    TimeIntegrator activeIntegrator = TimeIntegrator::SemiImplicitEuler;
+
+    // Leapfrog's velocities half a step ahead of the positions, and velocity Verlet's accelerations of the last step
+    std::vector<glm::vec3> halfStepVelocities;
+    std::vector<glm::vec3> previousAccelerations;
+
+    // PCISPH state, kept between steps to avoid reallocation
+    std::vector<glm::vec3> predictedPositions;
+    std::vector<glm::vec3> pressureAccelerations;
+    std::vector<float> pressures;
+
+    // The rest density and limits of the DFSPH solves, set each step
+    clSolverInfo solver_info;
+
+    // The frame's finest timestep level and the sub-step being simulated, and each particle's level. A particle of
+    // level L takes steps of 1 / 2^L frames
+    clTimestepInfo timestep_info;
+    std::vector<unsigned char> timestepLevels;
+
+    // DFSPH state. The stiffnesses are kept between steps, without the time step, to warm start the solves
+    std::vector<float> solverDensities;
+    std::vector<float> solverFactors;
+    std::vector<float> stiffnessIncrements;
+    std::vector<float> divergenceStiffness;
+    std::vector<float> densityStiffness;
+
+    /// Splits particles near the surface and in swirling flow in two, and merges pairs of split particles in calm
+    /// fluid deep below the surface back into one. Uses this step's neighbour grid, so it runs at the end of the step
+    void adaptResolution(const Parameters &params);
+
+    /// Removes particle i by swapping it with the last alive one, keeping the alive range compact
+    void removeParticle(unsigned int i);
+
+    /// Appends a particle with the given split level, the rest of its state is sized by updateParticlePool
+    void addParticle(const glm::vec3 &position, const glm::vec3 &velocity, unsigned char splitLevel);
+
+    /// Sets the masses and smoothing lengths from the split levels
+    void updateParticleSizes(const Parameters &params);
+
+    /// The kernel size between particles i and j, the mean of their smoothing lengths
+    inline float pairKernelSize(unsigned int i, unsigned int j) const {
+        return 0.5f * (smoothingLengths[i] + smoothingLengths[j]);
+    }
+
+    /// Spawns particles from the emitters and removes the ones that entered a sink
+    /// Removed particles are swapped with the last alive one, keeping the alive range compact. With
+    /// Parameters::shallow_water the particles are also exchanged with the heightfield, and it is advanced
+    void updateParticlePool(const Parameters &params, float dt_seconds);
+
+    ParticleFlow particle_flow;
+
+    std::mt19937 random_generator;
+
+    SignedDistanceField boundary_sdf;
+    BoundaryParticles boundary_particles;
+
+    VoxelGrid grid;
+    SleepingCells sleeping_cells;
+
+    ShallowWater shallow_water;
+    bool shallow_water_enabled = false;
+
     std::vector<glm::vec3> positions, velocities;
-    GLuint vbo_pos, vbo_vel;
+
+    // How many times each particle has been split, and the mass and smoothing length that follow from it. Every
+    // split halves the mass and shrinks the smoothing length by 2^(1/3), so the rest density stays the same. They are
+    // recalculated each step from the parameters' particle mass and kernel size, which can change at runtime
+    std::vector<unsigned char> splitLevels;
+    std::vector<float> masses;
+    std::vector<float> smoothingLengths;
+
+    // How fast the fluid swirls around each particle (1/s), found with the forces while the resolution is adaptive
+    std::vector<float> vorticities;
+
     std::vector<glm::vec3> forces;
     std::vector<float> densities;
+
+    // Each particle's acceleration over its last step, with the pressure of whichever solver took it. Chooses the
+    // particles' time step levels, spawned particles start without one
+    std::vector<glm::vec3> accelerations;
+
+    // How many fluid and boundary particles lie within one kernel size of each particle, used to find the surface
+    std::vector<unsigned int> neighbourCounts;
 };
\ No newline at end of file
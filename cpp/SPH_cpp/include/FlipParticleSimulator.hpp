@@ -0,0 +1,71 @@
+#pragma once
+
+#include <random>
+
+#include "ParticleSimulator.hpp"
+#include "ParticleFlow.hpp"
+#include "Parameters.hpp"
+#include "boundary/SignedDistanceField.hpp"
+#include "flip/MacGrid.hpp"
+#include "flip/MultigridPoissonSolver.hpp"
+
+/// @brief A hybrid FLIP/PIC simulator (Zhu & Bridson 2005) for large bodies of water
+/// The particles only carry the fluid, the pressure is solved on a MAC grid with the voxel grid's cells. Each step
+/// the particle velocities are splatted onto the grid, made divergence free with multigrid-preconditioned conjugate
+/// gradients and interpolated back, so the cost grows with the number of cells rather than the number of neighbours.
+/// Parameters::flip_ratio blends the noisy but lively FLIP update with the dissipative PIC one.
+class FlipParticleSimulator : public ParticleSimulator {
+public:
+    bool setupSimulation(const Parameters &params,
+                         Span<const glm::vec3> particle_positions,
+                         Span<const glm::vec3> particle_velocities,
+                         std::string &error);
+
+    void updateSimulation(const Parameters &params, float dt_seconds);
+
+    /// The alive particles are always kept compacted at the start of the buffers
+    unsigned int getParticleDrawCount();
+
+    /// The alive particles, straight from the simulator's own vectors
+    void readParticleState(const ParticleStateCallback &callback);
+
+    /// The conjugate gradient iterations of the last pressure solve
+    unsigned int getSolverIterations();
+
+    void getSolverState(SolverState &state);
+
+    void setSolverState(const SolverState &state);
+
+private:
+    /// Makes the grid velocities divergence free
+    void projectPressure(const Parameters &params);
+
+    /// Blends the grid's velocity change (FLIP) with its velocity (PIC) into the particle velocities
+    void gridToParticles(const Parameters &params);
+
+    /// Moves the particles through the grid velocity field with a midpoint step
+    void advectParticles(float dt_seconds);
+
+    /// Pushes the particles that left the container back inside and removes their outward velocity
+    void checkBoundaries();
+
+    /// Spawns particles from the emitters and removes the ones that entered a sink, see CppParticleSimulator
+    void updateParticlePool(const Parameters &params, float dt_seconds);
+
+    unsigned int solverIterations = 0;
+
+    std::vector<glm::vec3> positions, velocities;
+
+    // The pressure of each cell, kept to warm-start the next solve
+    std::vector<float> pressure;
+    std::vector<float> divergence;
+
+    ParticleFlow particle_flow;
+
+    std::mt19937 random_generator;
+
+    SignedDistanceField boundary_sdf;
+
+    MacGrid grid;
+    MultigridPoissonSolver pressure_solver;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifdef __APPLE__
+
+#include <OpenCL/opencl.h>
+
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include <vector>
+
+/// @brief Lets OpenClParticleSimulator work on particle buffers that belong to another API, i.e. the OpenGL VBOs the
+/// particles are drawn from, see GlParticleBuffers
+/// Without one the simulator creates plain OpenCL buffers and needs no window or OpenGL context at all.
+class OpenClBufferSharing {
+public:
+    virtual ~OpenClBufferSharing() {}
+
+    /// The device extension the sharing needs, reported at setup
+    virtual const char *get_sharing_extension() const = 0;
+
+    /// Adds what the context needs for the sharing to its properties, without the terminating zero
+    virtual void add_context_properties(cl_platform_id platform, std::vector<cl_context_properties> &properties) = 0;
+
+    /// Creates the position and velocity buffers in the context, three floats per particle of the pool each
+    virtual void create_buffers(cl_context context, cl_mem &positions, cl_mem &velocities) = 0;
+
+    /// Hands the buffers over to OpenCL, after the owner's pending commands on them. Called before the simulator
+    /// enqueues anything using them
+    virtual void acquire_buffers(cl_command_queue queue) = 0;
+
+    /// Hands the buffers back to the owner, after the simulator's commands using them
+    virtual void release_buffers(cl_command_queue queue) = 0;
+};
@@ -5,44 +5,129 @@
 #ifdef __APPLE__
 
 #include <OpenCL/opencl.h>
-#include <OpenGL/OpenGL.h>
 
 #else
 #include <CL/cl.hpp>
 #endif
 
-#ifdef _WIN32
-#include <windows.h>
-#endif
-
 #include <vector>
 #include <iostream>
 #include <string>
 
 #include "OpenCL/clVoxelGridInfo.hpp"
 #include "OpenCL/clFluidInfo.hpp"
-
+#include "OpenCL/clBoundaryInfo.hpp"
+#include "OpenCL/clSleepInfo.hpp"
+#include "OpenCL/clSolverInfo.hpp"
+#include "OpenCL/clTimestepInfo.hpp"
+#include "OpenCL/OpenClBufferSharing.hpp"
+#include "boundary/SignedDistanceField.hpp"
+#include "boundary/BoundaryParticles.hpp"
+
+// The work group size of the implicit viscosity's per-float kernels, a power of two for the sum reduction
+#define VISCOSITY_WORK_GROUP_SIZE 64
+
+/// @brief The SPH simulator on OpenCL
+/// On its own it keeps the particles in plain OpenCL buffers and runs without any window, i.e. on a headless
+/// machine's CPU runtime. Given an OpenClBufferSharing it works directly on the buffers the particles are drawn from
+/// instead, see GlParticleBuffers.
 class OpenClParticleSimulator : public ParticleSimulator {
 public:
+    OpenClParticleSimulator();
+
+    /// Shares the particle buffers through the sharing, which must stay alive as long as the simulator
+    explicit OpenClParticleSimulator(OpenClBufferSharing *sharing);
+
     ~OpenClParticleSimulator();
 
-    void setupSimulation(const Parameters &parameters,
-                         const std::vector<glm::vec3> &particle_positions,
-                         const std::vector<glm::vec3> &particle_velocities,
-                         const GLuint &vbo_positions,
-                         const GLuint &vbo_velocities);
+    bool setupSimulation(const Parameters &parameters,
+                         Span<const glm::vec3> particle_positions,
+                         Span<const glm::vec3> particle_velocities,
+                         std::string &error);
 
     void updateSimulation(const Parameters &parameters, float dt_seconds);
 
+    /// The pool's high-water mark; dead particles below it are NaN and skipped by the geometry shader
+    unsigned int getParticleDrawCount();
+
+    unsigned int getSolverIterations();
+
+    /// There is no PCISPH
+    bool supportsPressureSolver(PressureSolver solver) const;
+
+    /// Reads the particles back from the device, dead ones included. Drawing from shared buffers does not need this,
+    /// they are updated in place
+    void readParticleState(const ParticleStateCallback &callback);
+
+    /// The grid is cleared at the end of every step, so this asks for the cells' particle counts to be read back
+    /// before that in the next step, and returns those of the previous request. False until the first has been read.
+    /// The cells hold at most VOXEL_CELL_PARTICLE_COUNT particles
+    bool getGridOccupancy(GridOccupancy &occupancy);
+
+    /// The kernels run asynchronously, so each phase waits for its kernels while the timings are measured
+    void setPhaseTimings(PhaseTimings *timings);
+
+    /// Runs on the given device, counted from 1 in the order of getDeviceNames, instead of the first one
+    void setDeviceId(int device_id);
+
+    /// The names of the devices the simulator can run on, empty if there is no OpenCL platform
+    static std::vector<std::string> getDeviceNames();
+
+    /// Times every kernel on the device with OpenCL's event profiling, adding the times to the timings under the
+    /// kernels' names. After setupSimulation the command queue is created again with profiling turned on or off,
+    /// so that the kernels only pay for the events while they are timed
+    void setKernelTimings(PhaseTimings *timings);
+
 private:
-    std::vector<glm::vec3> positions;
+    // Where the particle buffers come from, nullptr for plain OpenCL buffers. Not owned by the simulator
+    OpenClBufferSharing *buffer_sharing = nullptr;
+
+    // Host copies of the particles, set at setup and by readParticleState
+    std::vector<glm::vec3> positions, velocities;
+
+    // The global work size of the per-particle kernels: the pool's high-water mark
+    size_t n_particles;
+
+    // The size of the particle pool
+    size_t max_particles;
+
+    // Host copy of the pool counters, [free count, high-water mark]. Only read back when the pool changes
+    cl_uint pool_counters[2];
 
-    std::vector<cl_mem> cgl_objects;
+    // How many particles each emitter has left to spawn, carried over between steps
+    std::vector<float> emitter_accumulators;
 
-    int n_particles;
+    cl_uint spawn_seed;
 
     clVoxelGridInfo grid_info;
     clFluidInfo fluid_info;
+    clBoundaryInfo boundary_info;
+    clSleepInfo sleep_info;
+    clSolverInfo solver_info;
+    clTimestepInfo timestep_info;
+
+    // Whether the density and force passes only process the cells in cl_active_cells this frame
+    cl_uint use_active_cells = 0;
+
+    // Iterations of the DFSPH solves in the last step
+    unsigned int solver_iterations = 0;
+
+    // The time step the stored DFSPH stiffnesses were found with, zero when they are not valid
+    float previous_dt = 0.0f;
+
+    // The integrator of the last step, the integrator state is reset when it changes
+    TimeIntegrator active_integrator = TimeIntegrator::SemiImplicitEuler;
+
+    // Whether sleeping was turned on last step, so that turning it on can wake every cell
+    bool sleeping_enabled = false;
+
+    // Whether the fallback from PCISPH to the state equation has been reported, it is again after another solver
+    bool pressure_solver_fallback_reported = false;
+
+    SignedDistanceField boundary_sdf;
+    BoundaryParticles boundary_particles;
+
+    cl_uint use_boundary_particles;
 
     // points to array of 3 size_t
     size_t *grid_cells_count;
@@ -51,34 +136,159 @@ private:
 
     cl_mem cl_voxel_cell_particle_count;
 
-    void *cl_positions_buffer, *cl_velocities_buffer;
-
     cl_mem cl_positions, cl_velocities;
 
     cl_mem cl_densities;
 
+    // How many neighbours each particle has, laid out like cl_densities. Used to find the surface particles
+    cl_mem cl_neighbour_counts;
+
     cl_mem cl_forces;
 
+    // Non-zero for each alive particle, [max_particles] long
+    cl_mem cl_alive;
+
+    // Stack of dead particle slots, [max_particles] long
+    cl_mem cl_free_list;
+
+    // [free count, high-water mark]
+    cl_mem cl_pool_counters;
+
+    // The last step each voxel cell or one of its neighbours was active, [total_grid_cells] long
+    cl_mem cl_cell_last_active;
+
+    // The density of each particle in particle order, kept for the particles in sleeping cells. [max_particles] long
+    cl_mem cl_particle_densities;
+
+    // The mean density of each voxel cell's particles and how much it changed last step, [total_grid_cells] long each
+    cl_mem cl_cell_mean_densities;
+    cl_mem cl_cell_density_changes;
+
+    // The density and DFSPH factor of each particle in particle order, [max_particles] long each
+    cl_mem cl_solver_densities;
+    cl_mem cl_solver_factors;
+
+    // This iteration's stiffness of each particle, and the summed divergence and density stiffnesses kept for the
+    // warm start, [max_particles] long each
+    cl_mem cl_stiffness_increments;
+    cl_mem cl_divergence_stiffness;
+    cl_mem cl_density_stiffness;
+
+    // Leapfrog's velocities half a step ahead of the positions and velocity Verlet's accelerations of the last
+    // step, laid out like the velocities
+    cl_mem cl_half_step_velocities;
+    cl_mem cl_previous_accelerations;
+
+    // The density of each particle in particle order for the implicit viscosity, [max_particles] long
+    cl_mem cl_viscosity_densities;
+
+    // Conjugate gradient state of the implicit viscosity, laid out like the velocities
+    cl_mem cl_viscosity_residual;
+    cl_mem cl_viscosity_direction;
+    cl_mem cl_viscosity_product;
+
+    // One dot product sum per work group, added up on the host
+    cl_mem cl_viscosity_partial_sums;
+    std::vector<cl_float> viscosity_partial_sums;
+
+    // The summed density error of a solver iteration, in fixed point
+    cl_mem cl_solver_error;
+
+    // The particles the safety limit held back in the last DFSPH correction
+    cl_mem cl_limited_particles;
+
+    // The timestep level of each particle, [max_particles] long, and the finest of them
+    cl_mem cl_timestep_levels;
+    cl_mem cl_finest_timestep_level;
+
+    // The voxel cells with a particle taking a step this sub-step, [total_grid_cells] long, and how many there are
+    cl_mem cl_active_cells;
+    cl_mem cl_active_cell_count;
+
+    // The container's signed distance field, (normal.xyz, distance) per node
+    cl_mem cl_boundary_sdf;
+
+    // Position (xyz) and volume weight (w) of each boundary particle, ordered by voxel cell
+    cl_mem cl_boundary_particles;
+
+    // Where each voxel cell's boundary particles start in cl_boundary_particles, [total_grid_cells + 1] long
+    cl_mem cl_boundary_cell_start;
+
     std::vector<cl_platform_id> platformIds;
 
     std::vector<cl_device_id> deviceIds;
 
-    int chosen_device_id;
+    // Counted from 1, see setDeviceId
+    int chosen_device_id = 1;
 
     cl_context context;
 
-    cl_command_queue command_queue;
+    // Created with profiling on while the kernels are timed
+    cl_command_queue command_queue = NULL;
 
     cl_mem cl_dt_obj;
 
-    void initOpenCL();
+    /// Creates the context on the first platform's devices and the command queue on the chosen one. Returns false
+    /// with the reason in error_message if there is no such device or the calls fail
+    bool initOpenCL(std::string &error_message);
+
+    /// Creates the command queue on the chosen device, with profiling while there are kernel timings
+    cl_int createCommandQueue();
+
+    /// Enqueues the kernel without an offset, with an event for its timing while the kernels are timed
+    cl_int enqueueKernel(cl_kernel kernel, cl_uint work_dim, const size_t *global_work_size,
+                         const size_t *local_work_size);
+
+    /// Adds the device times of the kernels enqueued since the last call to the kernel timings, once they have run
+    void collectKernelTimings();
+
+    // Where the kernels are timed, usually nullptr. Not owned by the simulator
+    PhaseTimings *kernel_timings = nullptr;
+
+    // The kernels enqueued since the last collectKernelTimings, with the events timing them
+    std::vector<std::pair<cl_kernel, cl_event>> kernel_events;
 
-    void setupSharedBuffers(const GLuint &vbo_positions, const GLuint &vbo_velocities);
+    // Set by getGridOccupancy, the next step reads the grid's cell particle counts into grid_cell_particle_counts
+    bool grid_occupancy_requested = false;
+    std::vector<cl_uint> grid_cell_particle_counts;
 
-    void createAndBuildKernel(cl_kernel &kernel_out, std::string kernel_name, std::string kernel_file_name);
+    /// Creates the particle buffers, or has the sharing create them, and writes the initial particles to them
+    void createParticleBuffers(Span<const glm::vec3> particle_positions, Span<const glm::vec3> particle_velocities);
+
+    /// Hand the particle buffers to OpenCL and back around the commands using them, if they are shared
+    void acquireParticleBuffers();
+
+    void releaseParticleBuffers();
+
+    /// Returns false with the reason, and the build log if the build failed, in error_message
+    bool createAndBuildKernel(cl_kernel &kernel_out, std::string kernel_name, std::string kernel_file_name,
+                              std::string &error_message);
 
     void allocateVoxelGridBuffer(const Parameters &params);
 
+    void allocateBoundaryBuffer(const Parameters &params);
+
+    void allocateParticlePoolBuffers(const Parameters &params);
+
+    void allocateSleepingCellBuffers(const Parameters &params);
+
+    void allocateSolverBuffers(const Parameters &params);
+
+    void allocateIntegratorBuffers(const Parameters &params);
+
+    void allocateViscosityBuffers(const Parameters &params);
+
+    void allocateTimestepBuffers(const Parameters &params);
+
+    /// Advances the particles by one sub-step of the frame, see CppParticleSimulator::stepSimulation
+    void stepSimulation(const Parameters &parameters, float dt_seconds, bool use_dfsph);
+
+    /// Starts the leapfrog and velocity Verlet state over from the current velocities
+    void resetIntegratorState();
+
+    /// Wakes every cell, so that the per-particle densities are up to date before anything falls asleep
+    void resetSleepingCells();
+
     /* Kernels */
 
     /// A simple, stand-alone kernel that integrates the positions based on the velocities
@@ -99,15 +309,86 @@ private:
 
     cl_kernel simple_voxel_grid_move = NULL;
 
+    void runUpdateSleepingCellsKernel();
+
+    cl_kernel update_sleeping_cells = NULL;
+
     void runCalculateParticleDensitiesKernel(float dt_seconds);
 
     cl_kernel calculate_particle_densities = NULL;
 
-    void runCalculateParticleForcesKernel();
+    /// Without explicit_viscosity the viscosity is left out of the forces, for when it has been solved implicitly
+    void runCalculateParticleForcesKernel(bool explicit_viscosity);
 
     cl_kernel calculate_particle_forces = NULL;
 
-    void runIntegrateParticleStatesKernel(float dt_seconds);
+    /// velocities_predicted: a pressure solver already added the forces to the velocities
+    /// Integrates with active_integrator, see TimeIntegrator
+    void runIntegrateParticleStatesKernel(float dt_seconds, bool velocities_predicted);
 
     cl_kernel integrate_particle_states;
+
+    /// Removes the particles inside the sinks and spawns new ones from the emitters
+    void runParticlePoolKernels(const Parameters &params, float dt_seconds);
+
+    cl_kernel despawn_particles = NULL;
+
+    cl_kernel spawn_particles = NULL;
+
+    /// Divergence-free SPH (Bender & Koschier 2015), see CppParticleSimulator for the C++ version
+    void runCalculateDFSPHFactorsKernel();
+
+    cl_kernel calculate_dfsph_factors = NULL;
+
+    /// Warm starts the stiffness, then iterates until the average density error is below the tolerance
+    /// Returns the iteration count
+    unsigned int runDFSPHSolve(const Parameters &params, cl_uint solve_mode, cl_mem &stiffness,
+                               float warm_start_scale);
+
+    cl_kernel calculate_dfsph_stiffness = NULL;
+
+    cl_kernel warm_start_dfsph_stiffness = NULL;
+
+    /// Counts the particles the safety limit holds back in cl_limited_particles
+    void runApplyDFSPHStiffnessKernel(cl_mem &stiffness);
+
+    cl_kernel apply_dfsph_stiffness = NULL;
+
+    void runPredictDFSPHVelocitiesKernel(float dt_seconds);
+
+    cl_kernel predict_dfsph_velocities = NULL;
+
+    /// Solves the viscosity implicitly with conjugate gradients, see CppParticleSimulator for the C++ version
+    /// Returns the iteration count
+    unsigned int runImplicitViscositySolve(const Parameters &params, float dt_seconds);
+
+    cl_kernel calculate_viscosity_densities = NULL;
+
+    /// residual_mode: x is the velocities, and product gets the first residual instead
+    void runApplyViscosityOperatorKernel(float dt_seconds, cl_mem &x, cl_mem &product, bool residual_mode);
+
+    cl_kernel apply_viscosity_operator = NULL;
+
+    cl_kernel update_viscosity_solution = NULL;
+
+    cl_kernel update_viscosity_direction = NULL;
+
+    /// The dot product of a and b over the alive particles
+    float runSumViscosityProductsKernel(cl_mem &a, cl_mem &b);
+
+    cl_kernel sum_viscosity_products = NULL;
+
+    /// Gives each particle its timestep level from its speed and last force, returns the finest level
+    /// The only read back per frame, skipped while multi-rate timestepping is off
+    unsigned int runAssignTimestepLevelsKernel();
+
+    cl_kernel assign_timestep_levels = NULL;
+
+    /// Lists the voxel cells whose particles take a step this sub-step
+    void runBuildActiveCellListKernel();
+
+    cl_kernel build_active_cell_list = NULL;
+
+    /// Three floats per particle, rounded up to whole work groups
+    size_t viscosityGlobalWorkSize() const;
 };
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#ifdef __APPLE__
+
+#include <OpenCL/opencl.h>
+
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include <sstream>
+
+struct clBoundaryInfo {
+    // How many nodes the signed distance field has in each dimension
+    cl_uint3 sdf_dimensions;
+
+    // The position of node [0 0 0]
+    cl_float3 sdf_origin;
+
+    // The distance between two neighbouring nodes
+    cl_float sdf_cell_size;
+
+    // The distance from the boundary at which the wall starts pushing particles
+    cl_float force_range;
+
+    // Non-zero if the wall force should be applied, zero if boundary particles keep the fluid in
+    cl_uint use_penalty_force;
+};
+
+inline std::string print_clBoundaryInfo(const clBoundaryInfo &inf) {
+    std::stringstream ss;
+
+    ss <<
+    "clBoundaryInfo: {sdf_dimensions=[" << inf.sdf_dimensions.s[0] << " " << inf.sdf_dimensions.s[1] << " " <<
+    inf.sdf_dimensions.s[2] <<
+    "] sdf_origin=[" << inf.sdf_origin.s[0] << " " << inf.sdf_origin.s[1] << " " << inf.sdf_origin.s[2] <<
+    "] sdf_cell_size=" << inf.sdf_cell_size <<
+    " force_range=" << inf.force_range <<
+    " use_penalty_force=" << inf.use_penalty_force <<
+    "}";
+
+    return ss.str();
+}
@@ -3,7 +3,6 @@
 #ifdef __APPLE__
 
 #include <OpenCL/opencl.h>
-#include <OpenGL/OpenGL.h>
 
 #else
 #include <CL/cl.hpp>
@@ -22,6 +21,10 @@ struct clFluidInfo {
     cl_float rest_density;
     cl_float sigma;
     cl_float k_threshold;
+
+    // Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+    cl_uint surface_neighbour_count;
+
     cl_float k_wall_damper;
     cl_float k_wall_friction;
 
@@ -0,0 +1,38 @@
+#pragma once
+
+#ifdef __APPLE__
+
+#include <OpenCL/opencl.h>
+
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include <sstream>
+
+struct clSleepInfo {
+    // Counts the simulation steps, compared against each cell's last active step
+    cl_uint step;
+
+    // How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+    cl_uint sleep_step_count;
+
+    // A cell is active while any of its particles is faster than this...
+    cl_float velocity_threshold;
+
+    // ...or while its mean density changes more than this fraction per step
+    cl_float density_threshold;
+};
+
+inline std::string print_clSleepInfo(const clSleepInfo &inf) {
+    std::stringstream ss;
+
+    ss <<
+    "clSleepInfo: {step=" << inf.step <<
+    " sleep_step_count=" << inf.sleep_step_count <<
+    " velocity_threshold=" << inf.velocity_threshold <<
+    " density_threshold=" << inf.density_threshold <<
+    "}";
+
+    return ss.str();
+}
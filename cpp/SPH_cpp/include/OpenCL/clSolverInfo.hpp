@@ -0,0 +1,49 @@
+#pragma once
+
+#ifdef __APPLE__
+
+#include <OpenCL/opencl.h>
+
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include <sstream>
+
+// Which constraint calculate_dfsph_stiffness in kernels/dfsph.cl corrects
+#define DFSPH_SOLVE_DIVERGENCE 0
+#define DFSPH_SOLVE_DENSITY 1
+
+struct clSolverInfo {
+    // The density the incompressible solvers keep, that of a particle with a full neighbourhood
+    cl_float rest_density;
+
+    // Scales the boundary particle volume weights, which are for Parameters::rest_density
+    cl_float boundary_scale;
+
+    // The smallest DFSPH factor denominator, so that nearly overlapping particles get a bounded stiffness
+    cl_float min_denominator;
+
+    cl_float dt;
+
+    // The largest velocity change a single pressure correction may give a particle
+    cl_float max_velocity_change;
+
+    // The density errors are summed as fixed point numbers with this many steps per unit
+    cl_float error_scale;
+};
+
+inline std::string print_clSolverInfo(const clSolverInfo &inf) {
+    std::stringstream ss;
+
+    ss <<
+    "clSolverInfo: {rest_density=" << inf.rest_density <<
+    " boundary_scale=" << inf.boundary_scale <<
+    " min_denominator=" << inf.min_denominator <<
+    " dt=" << inf.dt <<
+    " max_velocity_change=" << inf.max_velocity_change <<
+    " error_scale=" << inf.error_scale <<
+    "}";
+
+    return ss.str();
+}
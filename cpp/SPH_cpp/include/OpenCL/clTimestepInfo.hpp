@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef __APPLE__
+
+#include <OpenCL/opencl.h>
+
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include <sstream>
+
+struct clTimestepInfo {
+    // The length of the whole frame, the step of timestep level 0
+    cl_float frame_dt;
+
+    // The fraction of its smoothing length a particle may move in one of its steps
+    cl_float courant_number;
+
+    // The finest level a particle may be given. Zero turns multi-rate timestepping off
+    cl_uint max_timestep_level;
+
+    // The finest level of any particle this frame, which splits it into 2^finest_level sub-steps...
+    cl_uint finest_level;
+
+    // ...and the one being simulated
+    cl_uint substep;
+};
+
+inline std::string print_clTimestepInfo(const clTimestepInfo &inf) {
+    std::stringstream ss;
+
+    ss <<
+    "clTimestepInfo: {frame_dt=" << inf.frame_dt <<
+    " courant_number=" << inf.courant_number <<
+    " max_timestep_level=" << inf.max_timestep_level <<
+    " finest_level=" << inf.finest_level <<
+    " substep=" << inf.substep <<
+    "}";
+
+    return ss.str();
+}
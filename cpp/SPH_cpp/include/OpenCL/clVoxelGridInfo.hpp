@@ -16,6 +16,9 @@ struct clVoxelGridInfo {
     cl_float grid_cell_size;
     cl_float3 grid_origin;
     cl_uint max_cell_particle_count;
+
+    // Non-zero on the axes that wrap around, with a period of the grid's extent along them
+    cl_uint3 periodic_axes;
 };
 
 inline std::string print_clVoxelGridInfo(const clVoxelGridInfo &inf) {
@@ -28,7 +31,9 @@ inline std::string print_clVoxelGridInfo(const clVoxelGridInfo &inf) {
     " grid_cell_size=" << inf.grid_cell_size <<
     " grid_origin=[" << inf.grid_origin.s[0] << " " << inf.grid_origin.s[1] << " " << inf.grid_origin.s[2] <<
     "] max_cell_particle_count=" << inf.max_cell_particle_count <<
-    "}";
+    " periodic_axes=[" << inf.periodic_axes.s[0] << " " << inf.periodic_axes.s[1] << " " <<
+    inf.periodic_axes.s[2] <<
+    "]}";
 
     return ss.str();
 }
\ No newline at end of file
@@ -15,7 +15,7 @@
 
 #include <vector>
 
-std::string GetPlatformName(cl_platform_id id) {
+inline std::string GetPlatformName(cl_platform_id id) {
     size_t size = 0;
     clGetPlatformInfo(id, CL_PLATFORM_NAME, 0, nullptr, &size);
 
@@ -27,7 +27,7 @@ std::string GetPlatformName(cl_platform_id id) {
     return result;
 }
 
-std::string GetDeviceName(cl_device_id id) {
+inline std::string GetDeviceName(cl_device_id id) {
     size_t size = 0;
     clGetDeviceInfo(id, CL_DEVICE_NAME, 0, nullptr, &size);
 
@@ -39,7 +39,7 @@ std::string GetDeviceName(cl_device_id id) {
     return result;
 }
 
-std::string GetErrorString(cl_int error) {
+inline std::string GetErrorString(cl_int error) {
     switch (error) {
         // run-time and JIT compiler errors
         case 0:
@@ -181,14 +181,14 @@ std::string GetErrorString(cl_int error) {
     }
 }
 
-void CheckError(cl_int error) {
+inline void CheckError(cl_int error) {
     if (error != CL_SUCCESS) {
         std::cerr << "OpenCL call failed with error: " << GetErrorString(error) << std::endl;
         std::exit(1);
     }
 }
 
-int PrintOpenClContextInfo() {
+inline int PrintOpenClContextInfo() {
     // http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clGetPlatformIDs.html
     cl_uint platformIdCount = 0;
     clGetPlatformIDs(0, nullptr, &platformIdCount);
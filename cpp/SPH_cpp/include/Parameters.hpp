@@ -6,6 +6,8 @@
 
 #include <iostream>
 #include <algorithm>
+#include <string>
+#include <vector>
 
 #include "glm/glm.hpp"
 #include "glm/ext.hpp"
@@ -20,11 +22,51 @@
 
 #include "OpenCL/clFluidInfo.hpp"
 #include "OpenCL/clVoxelGridInfo.hpp"
+#include "OpenCL/clSleepInfo.hpp"
+#include "OpenCL/clSolverInfo.hpp"
+#include "OpenCL/clTimestepInfo.hpp"
+
+#include "ParticleEmitter.hpp"
+#include "sph_kernels.h"
+
+/// The shape of the container that holds the fluid
+enum class ContainerType {
+    Glass, // Open-top cylinder standing on the bottom bound
+    Box,   // Axis-aligned box spanning the bounds
+    Mesh   // Closed OBJ-mesh read from Parameters::container_mesh_file
+};
+
+/// How the fluid is kept inside the container
+enum class BoundaryHandling {
+    Penalty,  // Repulsive forces from the container's signed distance field
+    Particles // Static boundary particles taking part in the density and pressure calculations
+};
+
+/// How the pressure keeping the fluid from compressing is found. The OpenCL simulator has no PCISPH, it falls back
+/// to the state equation
+enum class PressureSolver {
+    StateEquation, // p = k_gas * (density - rest_density), weakly compressible
+    PCISPH,        // Predictive-corrective iterations until the density error is below a tolerance
+    DFSPH          // Divergence-free SPH: a velocity divergence solve and a density solve, both warm started
+};
+
+/// How the state equation's forces move the particles. The incompressible solvers always integrate with
+/// semi-implicit Euler, their pressures are found for that. Leapfrog and velocity Verlet give the same
+/// second-order trajectory, they keep different state between steps
+enum class TimeIntegrator {
+    SemiImplicitEuler, // v += a * dt, x += v * dt
+    Leapfrog,          // Keeps the half-step velocities, the full-step ones are extrapolated for the forces
+    VelocityVerlet     // Keeps the last accelerations, and corrects the velocities once the new forces are known
+};
 
 struct Parameters {
-    Parameters(unsigned int particle_count) : n_particles(particle_count) {};
+    Parameters(unsigned int particle_count) : n_particles(particle_count), max_particles(particle_count) {};
 
+    // The initial particle count, which also sets the mass of each particle
     unsigned int n_particles;
+
+    // How many particles the simulation has room for, alive or not
+    unsigned int max_particles;
     float total_mass;
     float kernel_size;
     float k_gas;
@@ -32,6 +74,9 @@ struct Parameters {
     float rest_density;
     float sigma;
     float k_threshold;
+
+    // Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+    unsigned int surface_neighbour_count;
     glm::vec3 gravity;
     float left_bound;
     float right_bound;
@@ -42,6 +87,104 @@ struct Parameters {
     float k_wall_damper;
     float k_wall_friction;
 
+    ContainerType container;
+    std::string container_mesh_file;
+
+    // Axes the fluid wraps around on instead of meeting a wall. The period is the extent of the voxel grid, so the
+    // bounds should be a whole number of kernel sizes apart along them, at least three. Only the box container
+    // opens up on these axes, and FlipParticleSimulator and the shallow water keep their walls
+    glm::bvec3 periodic_axes;
+    BoundaryHandling boundary_handling;
+    PressureSolver pressure_solver;
+    TimeIntegrator time_integrator;
+
+    // Split each frame into sub-steps of the finest timestep level, and recalculate each particle's density and
+    // forces only on the sub-steps of its own level. The particles' levels follow from their speed and acceleration.
+    // The incompressible solvers keep every particle on the finest level
+    bool multi_rate_timestepping;
+
+    // Each level halves the step, so a frame has at most 2^max_timestep_level sub-steps
+    unsigned int max_timestep_level;
+
+    // The fraction of its smoothing length a particle may move in one of its steps
+    float courant_number;
+
+    // The incompressible solvers iterate until the average density error is below this fraction of the rest density...
+    float density_error_tolerance;
+
+    // DFSPH also solves until the average density change per step is below this fraction of the rest density
+    float divergence_error_tolerance;
+
+    // ...but at least and at most this many times
+    unsigned int min_solver_iterations;
+    unsigned int max_solver_iterations;
+
+    // Solve the viscosity implicitly with conjugate gradients, which stays stable for thick fluids like honey
+    bool implicit_viscosity;
+
+    // The viscosity solve iterates until the residual is below this fraction of the velocities...
+    float viscosity_error_tolerance;
+
+    // ...but at most this many times
+    unsigned int max_viscosity_iterations;
+
+    // PbfParticleSimulator solves its density constraints this many times per step
+    unsigned int pbf_iterations;
+
+    // How strongly XSPH pulls each particle's velocity towards its neighbours', 0 turns it off
+    float xsph_viscosity;
+
+    // FlipParticleSimulator blends this fraction of the FLIP velocity update with the rest of the PIC one.
+    // 1 keeps the most detail but gets noisy, 0 is smooth but loses energy quickly
+    float flip_ratio;
+
+    // FlipParticleSimulator solves the pressure until the residual is below this fraction of the divergence,
+    // but at most max_solver_iterations times
+    float flip_pressure_tolerance;
+
+    // Split the C++ simulator's particles where the detail is visible and merge them where it is not
+    bool adaptive_resolution;
+
+    // How many times a particle can be split, each split halves its mass
+    unsigned int max_split_level;
+
+    // Particles in fluid swirling faster than this (1/s) are split, and only merged once it is below half of it
+    float split_vorticity;
+
+    // Particles with at least this many neighbours are deep enough below the surface to be merged
+    unsigned int merge_neighbour_count;
+
+    // Distance between the nodes of the container's signed distance field
+    float sdf_cell_size;
+
+    // Only simulate particles above the active region and cover the rest of the floor with a shallow water
+    // heightfield, see ShallowWater
+    bool shallow_water;
+
+    // The lowest corner (x, z) and the size of the active region on the floor
+    glm::vec2 active_region_origin;
+    glm::vec2 active_region_size;
+
+    // The side of the heightfield's columns, and the depth of the still water it starts with
+    float shallow_water_cell_size;
+    float shallow_water_depth;
+
+    // Settled fluid is skipped by the simulation, see SleepingCells
+    bool allow_sleeping;
+
+    // A cell stays awake while any of its particles is faster than this (m/s)...
+    float sleep_velocity_threshold;
+
+    // ...or while its mean density changes more than this fraction per step
+    float sleep_density_threshold;
+
+    // How many quiet steps it takes for a cell to fall asleep
+    unsigned int sleep_step_count;
+
+    // Faucets and drains, may be changed while the simulation runs
+    std::vector<ParticleEmitter> emitters;
+    std::vector<ParticleSink> sinks;
+
     float fps;
 
     glm::vec3 bg_color;
@@ -50,6 +193,12 @@ struct Parameters {
         return total_mass / n_particles;
     }
 
+    /// The volume a particle fills at the lattice spacing latticeDensity assumes, i.e. at rest
+    inline float get_particle_rest_volume() const {
+        const float spacing = kernel_size / 2;
+        return spacing * spacing * spacing;
+    }
+
     inline float get_max_volume_side() const {
         return std::max(std::max(right_bound - left_bound, top_bound - bottom_bound), far_bound - near_bound);
     }
@@ -73,6 +222,7 @@ struct Parameters {
 
         fluid_info.k_gas = k_gas;
         fluid_info.k_threshold = k_threshold;
+        fluid_info.surface_neighbour_count = surface_neighbour_count;
         fluid_info.k_viscosity = k_viscosity;
         fluid_info.k_wall_damper = k_wall_damper;
         fluid_info.k_wall_friction = k_wall_friction;
@@ -95,11 +245,47 @@ struct Parameters {
 
         grid_info.max_cell_particle_count = VOXEL_CELL_PARTICLE_COUNT;
 
+        // The neighbour searches wrap around to the opposite side, with fewer than three cells they would visit the
+        // same cells twice
+        for (int axis = 0; axis < 3; ++axis) {
+            grid_info.periodic_axes.s[axis] = periodic_axes[axis] && grid_info.grid_dimensions.s[axis] >= 3;
+        }
+
         grid_info.total_grid_cells = grid_info.grid_dimensions.s[0] *
                                      grid_info.grid_dimensions.s[1] *
                                      grid_info.grid_dimensions.s[2];
     }
 
+    /// Sets everything but the step, which is counted by the simulator
+    inline void set_sleep_info(clSleepInfo &sleep_info) const {
+        sleep_info.sleep_step_count = allow_sleeping ? sleep_step_count : 0;
+        sleep_info.velocity_threshold = sleep_velocity_threshold;
+        sleep_info.density_threshold = sleep_density_threshold;
+    }
+
+    /// Sets everything but the sub-step and the frame's finest level, which are chosen by the simulator
+    inline void set_timestep_info(clTimestepInfo &timestep_info, float dt_seconds) const {
+        timestep_info.frame_dt = dt_seconds;
+        timestep_info.courant_number = courant_number;
+        timestep_info.max_timestep_level = multi_rate_timestepping ? max_timestep_level : 0;
+    }
+
+    /// The integrator the state equation's forces are integrated with this step
+    inline TimeIntegrator get_active_integrator() const {
+        return pressure_solver == PressureSolver::StateEquation ? time_integrator : TimeIntegrator::SemiImplicitEuler;
+    }
+
+    /// The same rest density, boundary scale and limits as the C++ simulator's incompressible solvers
+    inline void set_solver_info(clSolverInfo &solver_info, float dt_seconds) const {
+        const float mass = get_particle_mass();
+
+        solver_info.rest_density = latticeDensity(mass, kernel_size);
+        solver_info.boundary_scale = solver_info.rest_density / rest_density;
+        solver_info.min_denominator = 0.01f * latticeGradientSquaredSum(mass, kernel_size);
+        solver_info.dt = dt_seconds;
+        solver_info.max_velocity_change = 0.1f * kernel_size / dt_seconds;
+        solver_info.error_scale = 4096.0f;
+    }
 
     inline static Parameters set_default_parameters(Parameters &p) {
         p.total_mass = 1000000.0f;
@@ -109,6 +295,7 @@ struct Parameters {
         p.rest_density = 100.0f;
         p.sigma = 1.0f;
         p.k_threshold = 0.1f;
+        p.surface_neighbour_count = 30;
         p.gravity = glm::vec3(0.0f, -9.82f, 0.0f);
 
         p.left_bound = -7.5f;
@@ -121,8 +308,47 @@ struct Parameters {
         p.k_wall_damper = 0.75f;
         p.k_wall_friction = 1.0f;
 
+        p.container = ContainerType::Glass;
+        p.container_mesh_file = "";
+        p.periodic_axes = glm::bvec3(false, false, false);
+        p.boundary_handling = BoundaryHandling::Particles;
+        p.pressure_solver = PressureSolver::StateEquation;
+        p.time_integrator = TimeIntegrator::SemiImplicitEuler;
+        p.multi_rate_timestepping = false;
+        p.max_timestep_level = 4;
+        p.courant_number = 0.4f;
+        p.density_error_tolerance = 0.01f;
+        p.divergence_error_tolerance = 0.01f;
+        p.min_solver_iterations = 3;
+        p.max_solver_iterations = 50;
+        p.implicit_viscosity = false;
+        p.viscosity_error_tolerance = 0.001f;
+        p.max_viscosity_iterations = 100;
+        p.pbf_iterations = 4;
+        p.xsph_viscosity = 0.01f;
+        p.flip_ratio = 0.95f;
+        p.flip_pressure_tolerance = 1e-4f;
+        p.adaptive_resolution = false;
+        p.max_split_level = 2;
+        p.split_vorticity = 10.0f;
+        p.merge_neighbour_count = 33;
+        p.sdf_cell_size = p.kernel_size / 2;
+
+        p.shallow_water = false;
+        p.active_region_origin = glm::vec2(-2.0f, -2.0f);
+        p.active_region_size = glm::vec2(4.0f, 4.0f);
+        p.shallow_water_cell_size = p.kernel_size;
+        p.shallow_water_depth = 0.3f;
+
+        p.allow_sleeping = false;
+        p.sleep_velocity_threshold = 0.05f;
+        p.sleep_density_threshold = 0.001f;
+        p.sleep_step_count = 30;
+
         p.fps = 0.0f;
 
         p.bg_color = glm::vec3(0.1f, 0.1f, 0.1f);
+
+        return p;
     }
 };
\ No newline at end of file
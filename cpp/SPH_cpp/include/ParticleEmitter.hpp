@@ -0,0 +1,28 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+/// @brief A box that spawns fluid particles at a fixed rate, i.e. a faucet
+struct ParticleEmitter {
+    // The bottom-most corner and the size of the box the particles spawn in
+    glm::vec3 origin;
+    glm::vec3 size;
+
+    // The initial velocity of each spawned particle
+    glm::vec3 velocity;
+
+    // Spawned particles per second
+    float rate;
+};
+
+/// @brief A box that removes every fluid particle entering it, i.e. a drain
+struct ParticleSink {
+    // The bottom-most corner and the size of the box
+    glm::vec3 origin;
+    glm::vec3 size;
+
+    inline bool contains(const glm::vec3 &position) const {
+        return glm::all(glm::greaterThanEqual(position, origin)) &&
+               glm::all(glm::lessThan(position, origin + size));
+    }
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "ParticleEmitter.hpp"
+#include "ParticleSimulator.hpp"
+#include "SolverState.hpp"
+
+/// @brief Runs the emitters and sinks of the parameters on the particles of a simulator that keeps them in host memory
+/// The simulators keep more per particle than the positions and velocities, so the particles are removed and spawned
+/// through their callbacks. Between the steps each emitter carries over the fraction of a particle it has left to
+/// spawn, which goes into the simulator's checkpoints with get_state.
+class ParticleFlow {
+public:
+    /// Removes the particle, by moving the last one into its place
+    typedef std::function<void(unsigned int index)> RemoveCallback;
+
+    /// Returns true if the particle, which is in no sink, should be removed as well
+    typedef std::function<bool(unsigned int index)> RemoveTest;
+
+    /// Appends a particle
+    typedef std::function<void(const glm::vec3 &position, const glm::vec3 &velocity)> SpawnCallback;
+
+    /// Removes the particles that entered a sink, and those the test returns true for if it is not empty. The
+    /// positions are those the callback removes from, they are read again after each removal
+    void drain(const Parameters &params, const std::vector<glm::vec3> &positions, const RemoveCallback &remove,
+               SimulationCounters &counters, const RemoveTest &also_remove = RemoveTest());
+
+    /// Spawns rate * dt particles from each emitter, at random in its box, as long as the pool of
+    /// Parameters::max_particles has room for them next to the particle_count alive ones
+    void emit(const Parameters &params, float dt_seconds, unsigned int particle_count, std::mt19937 &random_generator,
+              const SpawnCallback &spawn, SimulationCounters &counters);
+
+    void get_state(SolverState &state) const;
+
+    void set_state(const SolverState &state);
+
+private:
+    // How many particles each emitter has left to spawn
+    std::vector<float> emitter_accumulators;
+};
@@ -1,24 +1,134 @@
 #pragma once
 
+#include <functional>
+#include <string>
 #include <vector>
 
-#ifdef _WIN32
-#include "GL/glew.h"
-#endif
-
-#include <GLFW/glfw3.h>
-
 #include "glm/glm.hpp"
 
 #include "Parameters.hpp"
+#include "SolverState.hpp"
+#include "common/PhaseTimings.hpp"
+#include "common/Span.hpp"
+
+class ShallowWater;
+
+struct GridOccupancy;
+
+/// Receives the particles getParticleDrawCount counts. The spans are only valid during the call
+typedef std::function<void(Span<const glm::vec3> positions, Span<const glm::vec3> velocities)> ParticleStateCallback;
+
+/// What a simulator has done since it was set up, summed over its updates. Counts it does not keep stay zero
+struct SimulationCounters {
+    // Updates, and the particles taking part in each of them summed
+    unsigned long long steps;
+    unsigned long long particle_steps;
+
+    // Pairs of particles, or of a particle and a boundary particle, within a kernel size of each other that the
+    // neighbour searches found
+    unsigned long long neighbour_pairs;
+
+    // Spawned by the emitters or the shallow water heightfield
+    unsigned long long spawned_particles;
 
+    // Taken out by the sinks or absorbed by the heightfield
+    unsigned long long removed_particles;
+
+    // Particles that should have been spawned, but the particle pool had no room for
+    unsigned long long dropped_particles;
+
+    // Particles whose pressure acceleration the safety limit of PCISPH, or of each DFSPH solve, cut down in the last
+    // iteration of a step. The solver can not correct their compression, so steps with many of them likely stopped
+    // at Parameters::max_solver_iterations above the error tolerance, and need a shorter time step
+    unsigned long long limited_pressure_particles;
+};
+
+/// @brief The interface of the simulators, without any dependency on a window or OpenGL
+/// The particles are passed in at setup and handed out through ParticleStateCallback, either on request with
+/// readParticleState or after every update. Drawing them is up to the caller, see GlParticleBuffers.
 class ParticleSimulator {
 public:
-    virtual void setupSimulation(const Parameters &parameters,
-                                 const std::vector<glm::vec3> &particle_positions,
-                                 const std::vector<glm::vec3> &particle_velocities,
-                                 const GLuint &vbo_positions,
-                                 const GLuint &vbo_velocities) = 0;
+    virtual ~ParticleSimulator() {}
+
+    /// Takes over the particles. Returns false with the reason in error if the simulator can not run, i.e. has no
+    /// device to run on; what to do then is up to the caller
+    virtual bool setupSimulation(const Parameters &parameters,
+                                 Span<const glm::vec3> particle_positions,
+                                 Span<const glm::vec3> particle_velocities,
+                                 std::string &error) = 0;
 
     virtual void updateSimulation(const Parameters &parameters, float dt_seconds) = 0;
-};
\ No newline at end of file
+
+    /// How many particles from the start of the position/velocity buffers that should be drawn
+    /// The buffers are allocated for Parameters::max_particles, of which only a part may be alive
+    virtual unsigned int getParticleDrawCount() = 0;
+
+    /// How many iterations the incompressible pressure solvers needed in the last update, summed over its sub-steps.
+    /// Zero for the state equation
+    virtual unsigned int getSolverIterations() = 0;
+
+    /// Whether the simulator has the pressure solver. It falls back to the state equation for those it does not have
+    virtual bool supportsPressureSolver(PressureSolver solver) const {
+        return true;
+    }
+
+    /// Calls the callback with the current particles
+    virtual void readParticleState(const ParticleStateCallback &callback) = 0;
+
+    /// The heightfield around the particles while Parameters::shallow_water is on, nullptr if there is none
+    virtual const ShallowWater *getShallowWater() {
+        return nullptr;
+    }
+
+    /// Fills in how full the cells of the neighbour grid were in the last step. Returns false if the simulator has
+    /// no such grid. May read the grid back from a device, so it is meant for a few times a second at most
+    virtual bool getGridOccupancy(GridOccupancy &occupancy) {
+        return false;
+    }
+
+    /// Adds what the simulator keeps between its steps besides the particles to the state, for a checkpoint
+    virtual void getSolverState(SolverState &state) {
+    }
+
+    /// Restores the state getSolverState added, after setupSimulation with the particles it was saved with. Arrays
+    /// that are missing or do not fit the particles are left as the setup made them
+    virtual void setSolverState(const SolverState &state) {
+    }
+
+    /// Makes the simulator add the time of each phase of its steps to the timings, nullptr stops it
+    virtual void setPhaseTimings(PhaseTimings *timings) {
+        phase_timings = timings;
+    }
+
+    /// Makes the simulator add the device time of each of its kernels to the timings, nullptr stops it. Only the
+    /// OpenCL simulator has kernels
+    virtual void setKernelTimings(PhaseTimings *timings) {
+    }
+
+    inline const SimulationCounters &getCounters() const {
+        return counters;
+    }
+
+    /// Makes the simulator hand its particles to the callback after every update, an empty callback stops it
+    void setParticleStateCallback(const ParticleStateCallback &callback) {
+        particle_state_callback = callback;
+    }
+
+protected:
+    /// Hands the particles to the particle state callback at the end of an update. Returns false if there is none
+    bool publishParticleState() {
+        if (!particle_state_callback) {
+            return false;
+        }
+
+        readParticleState(particle_state_callback);
+        return true;
+    }
+
+    // Where the phases of the steps are timed, usually nullptr. Not owned by the simulator
+    PhaseTimings *phase_timings = nullptr;
+
+    ParticleStateCallback particle_state_callback;
+
+    SimulationCounters counters = {};
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <random>
+
+#include "ParticleSimulator.hpp"
+#include "ParticleFlow.hpp"
+#include "Parameters.hpp"
+#include "VoxelGrid.hpp"
+#include "boundary/SignedDistanceField.hpp"
+#include "boundary/BoundaryParticles.hpp"
+
+/// @brief Position based fluids (Macklin & Müller 2013)
+/// Instead of integrating pressure forces, the predicted positions are moved until they satisfy a density
+/// constraint, which is stable for much larger time steps than the state equation. The constraints are solved a
+/// fixed number of times per step (Parameters::pbf_iterations) with the neighbour lists found once per step, and
+/// again when the corrections have moved a particle too far from where they were found. XSPH viscosity smooths the
+/// resulting velocities.
+class PbfParticleSimulator : public ParticleSimulator {
+public:
+    bool setupSimulation(const Parameters &params,
+                         Span<const glm::vec3> particle_positions,
+                         Span<const glm::vec3> particle_velocities,
+                         std::string &error);
+
+    void updateSimulation(const Parameters &params, float dt_seconds);
+
+    /// The alive particles are always kept compacted at the start of the buffers
+    unsigned int getParticleDrawCount();
+
+    /// The alive particles, straight from the simulator's own vectors
+    void readParticleState(const ParticleStateCallback &callback);
+
+    /// Always Parameters::pbf_iterations, the constraints are not solved to a tolerance
+    unsigned int getSolverIterations();
+
+    bool getGridOccupancy(GridOccupancy &occupancy);
+
+    void getSolverState(SolverState &state);
+
+    void setSolverState(const SolverState &state);
+
+private:
+    /// Finds the fluid and boundary neighbours of every predicted position, reused by the iterations until
+    /// getNeighbourDrift passes a tenth of a kernel size
+    void findNeighbours(const Parameters &params);
+
+    /// The farthest any predicted position has moved since the neighbours were found
+    float getNeighbourDrift() const;
+
+    /// One Jacobi iteration of the density constraints, moves the predicted positions
+    void solveDensityConstraints(const Parameters &params);
+
+    /// Projects the predicted positions that penetrated the container back inside it
+    void projectBoundaries(const Parameters &params);
+
+    /// Smooths the velocities towards their neighbours' mean
+    void applyXSPHViscosity(const Parameters &params);
+
+    /// Spawns particles from the emitters and removes the ones that entered a sink, see CppParticleSimulator
+    void updateParticlePool(const Parameters &params, float dt_seconds);
+
+    unsigned int solverIterations = 0;
+
+    // The rest density and limits of the constraint solve, set each step
+    clSolverInfo solver_info;
+
+    // Neighbour lists, particle i's neighbours are [neighbourStart[i], neighbourStart[i + 1]) of neighbours
+    std::vector<unsigned int> neighbourStart;
+    std::vector<unsigned int> neighbours;
+    std::vector<unsigned int> boundaryNeighbourStart;
+    std::vector<unsigned int> boundaryNeighbours;
+
+    // The predicted positions the neighbours were found at
+    std::vector<glm::vec3> neighbourPositions;
+
+    std::vector<glm::vec3> positions, velocities;
+    std::vector<glm::vec3> predictedPositions;
+    std::vector<glm::vec3> positionCorrections;
+    std::vector<glm::vec3> smoothedVelocities;
+    std::vector<float> lambdas;
+
+    ParticleFlow particle_flow;
+
+    std::mt19937 random_generator;
+
+    SignedDistanceField boundary_sdf;
+    BoundaryParticles boundary_particles;
+
+    VoxelGrid grid;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "boundary/SignedDistanceField.hpp"
+
+/// @brief A shallow water heightfield covering the container floor, the far field around the particles
+/// The floor is split into square columns of Parameters::shallow_water_cell_size. The columns above the active
+/// region are simulated with particles, the rest hold a water depth and the velocities between them (a staggered
+/// grid), which are advanced with the linearized shallow water equations. The two are coupled through the columns:
+/// particles that leave the active region are absorbed into the column they enter, the depth of the active columns
+/// is measured from the particles in them, and water flowing into an active column is handed back as particles.
+/// The floor is assumed flat at the bottom bound; columns whose centre is outside the container are dry land.
+class ShallowWater {
+public:
+    /// Covers the floor with still water of Parameters::shallow_water_depth outside the active region
+    void build(const Parameters &params, const SignedDistanceField &sdf);
+
+    /// Whether the position is above the active region, where the particles are simulated
+    bool is_active(const glm::vec3 &position) const;
+
+    /// Adds a particle that left the active region to the column below it
+    void absorb(const glm::vec3 &position, const glm::vec3 &velocity, float volume);
+
+    /// Measures the depth of the active columns from the particles above them, which the surrounding water sees as
+    /// a boundary
+    void set_active_depths(const std::vector<glm::vec3> &positions, float particle_volume);
+
+    /// Advances the water outside the active region, in as many sub-steps as the wave speed requires
+    void update(const Parameters &params, float dt_seconds);
+
+    /// Calls spawn(position, velocity) for every particle volume that has flowed into the active region, where
+    /// spawn returns false when there is no room for more particles. The rest is kept for later
+    template<typename Function>
+    void for_each_inflow_particle(float particle_volume, std::mt19937 &random_generator, Function spawn) {
+        std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+
+        const float particle_depth = particle_volume / (cell_size * cell_size);
+        const float spacing = std::cbrt(particle_volume);
+
+        for (unsigned int c = 0; c < depths.size(); ++c) {
+            while (inflow_volumes[c] >= particle_volume) {
+                // Stack the particles on top of the ones already in the column, so that they don't overlap
+                const glm::vec2 column = origin + (glm::vec2(c % dimensions.x, c / dimensions.x) +
+                                                   glm::vec2(distribution(random_generator),
+                                                             distribution(random_generator))) * cell_size;
+                const float height = floor_height + depths[c] + distribution(random_generator) * spacing;
+                const glm::vec2 velocity = inflow_momenta[c] / inflow_volumes[c];
+
+                if (!spawn(glm::vec3(column.x, height, column.y), glm::vec3(velocity.x, 0.0f, velocity.y))) {
+                    return;
+                }
+
+                depths[c] += particle_depth;
+                inflow_momenta[c] -= velocity * particle_volume;
+                inflow_volumes[c] -= particle_volume;
+            }
+        }
+    }
+
+    inline const glm::ivec2 &get_dimensions() const {
+        return dimensions;
+    }
+
+    /// The centre of column (0, 0) on the floor
+    inline glm::vec2 get_first_column_centre() const {
+        return origin + glm::vec2(0.5f * cell_size);
+    }
+
+    inline float get_cell_size() const {
+        return cell_size;
+    }
+
+    inline float get_floor() const {
+        return floor_height;
+    }
+
+    /// The water depth of each column, x-major
+    inline const std::vector<float> &get_depths() const {
+        return depths;
+    }
+
+    inline bool is_active_column(unsigned int column) const {
+        return column_types[column] == ColumnType::Active;
+    }
+
+    inline bool is_land_column(unsigned int column) const {
+        return column_types[column] == ColumnType::Land;
+    }
+
+private:
+    enum class ColumnType : unsigned char {
+        Water,
+        Active,
+        Land
+    };
+
+    inline unsigned int get_column_index(const glm::ivec2 &column) const {
+        return column.x + dimensions.x * column.y;
+    }
+
+    /// The column below the position, clamped into the grid
+    glm::ivec2 get_column(const glm::vec3 &position) const;
+
+    /// Accelerates the water downhill and damps it
+    void update_velocities(float gravity, float dt_seconds);
+
+    /// Moves the water between the columns with the current velocities
+    void transport(float dt_seconds);
+
+    /// Calls function(velocity, lower, upper, axis) for every face between two columns, with the face's velocity,
+    /// the columns below and above it and the direction (x, z) of its velocity
+    template<typename Function>
+    void for_each_inner_face(Function function) {
+        for (int z = 0; z < dimensions.y; ++z) {
+            for (int x = 1; x < dimensions.x; ++x) {
+                function(x_velocities[x + (dimensions.x + 1) * z], get_column_index(glm::ivec2(x - 1, z)),
+                         get_column_index(glm::ivec2(x, z)), glm::vec2(1, 0));
+            }
+        }
+
+        for (int z = 1; z < dimensions.y; ++z) {
+            for (int x = 0; x < dimensions.x; ++x) {
+                function(z_velocities[x + dimensions.x * z], get_column_index(glm::ivec2(x, z - 1)),
+                         get_column_index(glm::ivec2(x, z)), glm::vec2(0, 1));
+            }
+        }
+    }
+
+    glm::ivec2 dimensions;
+
+    // The lowest corner of the grid on the floor (x, z), and the floor's height
+    glm::vec2 origin;
+    float floor_height;
+    float cell_size;
+
+    std::vector<ColumnType> column_types;
+    std::vector<float> depths;
+
+    // The velocities on the faces between columns, [(dimensions.x + 1) * dimensions.y] and
+    // [dimensions.x * (dimensions.y + 1)] long. The faces on the edge of the grid are never used
+    std::vector<float> x_velocities;
+    std::vector<float> z_velocities;
+
+    // How much water leaves each column in a sub-step, which is limited to what is there, and how much its depth
+    // changes
+    std::vector<float> outflows;
+    std::vector<float> depth_changes;
+
+    // What has flowed into each active column and not been turned into particles yet, and its momentum
+    std::vector<float> inflow_volumes;
+    std::vector<glm::vec2> inflow_momenta;
+};
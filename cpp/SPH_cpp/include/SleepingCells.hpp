@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "VoxelGrid.hpp"
+
+/// @brief Tracks which voxel grid cells hold settled fluid, so that their particles can skip the simulation step
+/// A cell is active while any of its particles moves faster than Parameters::sleep_velocity_threshold, or while its
+/// mean density changes by more than the relative Parameters::sleep_density_threshold per step.
+/// A cell falls asleep when neither it nor any of its neighbours has been active for Parameters::sleep_step_count
+/// steps, and wakes up again as soon as one of them is. This mirrors kernels/sleeping_cells.cl.
+class SleepingCells {
+public:
+    /// Decides which cells are asleep this step, from the velocities and the density changes of the last step
+    void update(const Parameters &params, const VoxelGrid &grid, const std::vector<glm::vec3> &velocities);
+
+    /// Records how much the mean density of each awake cell changed, call after the densities are calculated
+    void update_densities(const Parameters &params, const VoxelGrid &grid, const std::vector<float> &densities);
+
+    inline bool is_asleep(unsigned int cell_index) const {
+        return sleep_step_count > 0 && step - last_active_steps[cell_index] >= sleep_step_count;
+    }
+
+    /// How many particles were in sleeping cells in the last update
+    inline unsigned int get_asleep_particle_count() const {
+        return asleep_particle_count;
+    }
+
+private:
+    // Zero when sleeping is turned off
+    unsigned int sleep_step_count = 0;
+    unsigned int asleep_particle_count = 0;
+
+    // Counts the updates, a cell is asleep when it and its neighbours were last active sleep_step_count steps ago
+    unsigned int step = 0;
+    std::vector<unsigned int> last_active_steps;
+
+    std::vector<float> mean_densities;
+    std::vector<float> density_changes;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// @brief What a simulator keeps between its steps besides the particles, as named arrays of plain values
+/// I.e. leapfrog's half-step velocities or DFSPH's warm-start stiffnesses. Saved in checkpoints, so that a restarted
+/// simulation continues as it would have, see ParticleSimulator::getSolverState and io/Checkpoint.hpp.
+/// The arrays are copied byte for byte, so T must be trivially copyable (float, glm::vec3, unsigned char, ...)
+class SolverState {
+public:
+    struct Array {
+        std::string name;
+        std::vector<char> bytes;
+    };
+
+    template<typename T>
+    void add(const std::string &name, const std::vector<T> &values) {
+        add_bytes(name, values.data(), values.size() * sizeof(T));
+    }
+
+    template<typename T>
+    void add_value(const std::string &name, const T &value) {
+        add_bytes(name, &value, sizeof(T));
+    }
+
+    /// Adds the value as the text its operator<< writes, i.e. the state of a standard random engine
+    template<typename T>
+    void add_text(const std::string &name, const T &value) {
+        std::ostringstream stream;
+        stream << value;
+        const std::string text = stream.str();
+        add_bytes(name, text.data(), text.size());
+    }
+
+    void add_bytes(const std::string &name, const void *data, size_t size) {
+        arrays.push_back({name, std::vector<char>(static_cast<const char *>(data),
+                                                  static_cast<const char *>(data) + size)});
+    }
+
+    /// Copies the named array into values if it holds exactly count elements of T. Returns false otherwise,
+    /// leaving values as they were
+    template<typename T>
+    bool get(const std::string &name, std::vector<T> &values, size_t count) const {
+        const Array *array = find(name);
+        return array && array->bytes.size() == count * sizeof(T) && copy(*array, values);
+    }
+
+    /// Copies the named array into values, however many elements of T it holds
+    template<typename T>
+    bool get(const std::string &name, std::vector<T> &values) const {
+        const Array *array = find(name);
+        return array && array->bytes.size() % sizeof(T) == 0 && copy(*array, values);
+    }
+
+    /// Copies the named single value into value if there is one of T's size
+    template<typename T>
+    bool get_value(const std::string &name, T &value) const {
+        const Array *array = find(name);
+        if (!array || array->bytes.size() != sizeof(T)) {
+            return false;
+        }
+
+        std::memcpy(&value, array->bytes.data(), sizeof(T));
+        return true;
+    }
+
+    /// Reads the value from the text add_text wrote. Returns false if there is no such array or it does not parse,
+    /// in which case the value may have been changed
+    template<typename T>
+    bool get_text(const std::string &name, T &value) const {
+        const Array *array = find(name);
+        if (!array) {
+            return false;
+        }
+
+        std::istringstream stream(std::string(array->bytes.begin(), array->bytes.end()));
+        return static_cast<bool>(stream >> value);
+    }
+
+    inline const std::vector<Array> &get_arrays() const {
+        return arrays;
+    }
+
+private:
+    template<typename T>
+    static bool copy(const Array &array, std::vector<T> &values) {
+        values.resize(array.bytes.size() / sizeof(T));
+        if (!values.empty()) {
+            std::memcpy(values.data(), array.bytes.data(), array.bytes.size());
+        }
+        return true;
+    }
+
+    const Array *find(const std::string &name) const {
+        for (const Array &array : arrays) {
+            if (array.name == name) {
+                return &array;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<Array> arrays;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "glm/glm.hpp"
+
+#include "OpenCL/clVoxelGridInfo.hpp"
+
+/// How the particles are spread over the cells of a neighbour grid, see ParticleSimulator::getGridOccupancy
+struct GridOccupancy {
+    unsigned int total_cells;
+    unsigned int occupied_cells;
+    unsigned int particles;
+
+    // In the fullest cell
+    unsigned int max_cell_particles;
+
+    // How many particles a cell can hold, zero if there is no limit. The cells at the limit may have turned particles
+    // away, which then have no neighbours in that step
+    unsigned int cell_capacity;
+    unsigned int full_cells;
+};
+
+/// @brief CPU counterpart of the OpenCL voxel grid, used for neighbour searches
+/// Particles are bucketed (counting sort) into cells of the same layout as described by clVoxelGridInfo,
+/// so a particle's neighbours within one kernel size are found in the 3x3x3 cells around its own cell.
+/// Positions outside the grid are clamped into the edge cells, like in calculate_voxel_grid.cl, except on the periodic
+/// axes, where the grid wraps around and neighbours are found across the opposite side.
+class VoxelGrid {
+public:
+    /// Rebuilds the grid for the given positions
+    void build(const clVoxelGridInfo &grid_info, const std::vector<glm::vec3> &positions);
+
+    /// The x/y/z indices of the cell containing the position
+    glm::ivec3 get_cell_indices(const glm::vec3 &position) const;
+
+    inline unsigned int get_cell_index(const glm::ivec3 &cell_indices) const {
+        return cell_indices.x + dimensions.x * (cell_indices.y + dimensions.y * cell_indices.z);
+    }
+
+    /// The x/y/z indices of the cell with the given 1D index
+    inline glm::ivec3 get_cell_indices(unsigned int cell_index) const {
+        return glm::ivec3(cell_index % dimensions.x,
+                          (cell_index / dimensions.x) % dimensions.y,
+                          cell_index / (dimensions.x * dimensions.y));
+    }
+
+    /// Wraps cell indices up to one cell outside the grid around to the other side. Only used on the periodic axes,
+    /// the indices on the others are always inside the grid
+    inline glm::ivec3 wrap_cell_indices(const glm::ivec3 &cell_indices) const {
+        return (cell_indices + dimensions) % dimensions;
+    }
+
+    /// The vector from b to a, through the periodic boundaries when that is shorter (the minimum image)
+    inline glm::vec3 get_relative_position(const glm::vec3 &a, const glm::vec3 &b) const {
+        const glm::vec3 relative_position = a - b;
+        return relative_position - period * glm::round(relative_position * inverse_period);
+    }
+
+    /// Moves a position that has left the grid on a periodic axis back in from the opposite side
+    inline glm::vec3 wrap_position(const glm::vec3 &position) const {
+        return position - period * glm::floor((position - origin) * inverse_period);
+    }
+
+    /// Calls function(cell_index) for every cell neighbouring (and including) the given cell
+    template<typename Function>
+    void for_each_neighbour_cell(const glm::ivec3 &cell, Function function) const {
+        glm::ivec3 first = cell - glm::ivec3(1);
+        glm::ivec3 last = cell + glm::ivec3(1);
+
+        // The periodic axes reach past the edges, to the cells on the opposite side
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!periodic[axis]) {
+                first[axis] = std::max(first[axis], 0);
+                last[axis] = std::min(last[axis], dimensions[axis] - 1);
+            }
+        }
+
+        for (int z = first.z; z <= last.z; ++z) {
+            for (int y = first.y; y <= last.y; ++y) {
+                for (int x = first.x; x <= last.x; ++x) {
+                    function(get_cell_index(wrap_cell_indices(glm::ivec3(x, y, z))));
+                }
+            }
+        }
+    }
+
+    /// Calls function(particle_index) for every particle in the cells neighbouring (and including) the position's cell
+    template<typename Function>
+    void for_each_neighbour(const glm::vec3 &position, Function function) const {
+        for_each_neighbour_cell(get_cell_indices(position), [&](unsigned int cell_index) {
+            for_each_in_cell(cell_index, function);
+        });
+    }
+
+    /// Calls function(particle_index) for every particle in the given cell
+    template<typename Function>
+    void for_each_in_cell(unsigned int cell_index, Function function) const {
+        for (unsigned int i = cell_start[cell_index]; i < cell_start[cell_index + 1]; ++i) {
+            function(sorted_indices[i]);
+        }
+    }
+
+    /// Calls function(cell_index) once for every cell that holds at least one particle
+    template<typename Function>
+    void for_each_occupied_cell(Function function) const {
+        for (unsigned int i = 0; i < sorted_indices.size(); i = cell_start[particle_cells[sorted_indices[i]] + 1]) {
+            function(particle_cells[sorted_indices[i]]);
+        }
+    }
+
+    inline unsigned int get_total_cells() const {
+        return static_cast<unsigned int>(cell_start.size()) - 1;
+    }
+
+    /// How the particles of the last build are spread over the cells
+    GridOccupancy get_occupancy() const {
+        GridOccupancy occupancy = {get_total_cells(), 0, static_cast<unsigned int>(sorted_indices.size()), 0, 0, 0};
+        for_each_occupied_cell([&](unsigned int cell_index) {
+            ++occupancy.occupied_cells;
+            occupancy.max_cell_particles = std::max(occupancy.max_cell_particles,
+                                                    cell_start[cell_index + 1] - cell_start[cell_index]);
+        });
+
+        return occupancy;
+    }
+
+    /// The cell that particle i was bucketed into by the last build
+    inline unsigned int get_particle_cell(unsigned int i) const {
+        return particle_cells[i];
+    }
+
+    /// Offsets into get_sorted_indices() where each cell's particles start, [total_grid_cells + 1] long
+    inline const std::vector<unsigned int> &get_cell_start() const {
+        return cell_start;
+    }
+
+    /// Particle indices ordered by cell
+    inline const std::vector<unsigned int> &get_sorted_indices() const {
+        return sorted_indices;
+    }
+
+private:
+    glm::ivec3 dimensions;
+    glm::vec3 origin;
+    float cell_size;
+
+    // Which axes wrap around, and the extent of the grid along them. Both period and its inverse are 0 on the other
+    // axes, which leaves the positions there untouched
+    glm::bvec3 periodic;
+    glm::vec3 period;
+    glm::vec3 inverse_period;
+
+    std::vector<unsigned int> cell_start;
+    std::vector<unsigned int> sorted_indices;
+
+    // The cell of each particle, kept between builds to avoid reallocation
+    std::vector<unsigned int> particle_cells;
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+
+class ParticleSimulator;
+
+/// The simulators a scenario can run on
+enum class SimulatorBackend {
+    Cpp,    // CppParticleSimulator
+    OpenCL, // OpenClParticleSimulator
+    Pbf,    // PbfParticleSimulator
+    Flip    // FlipParticleSimulator
+};
+
+/// How long each step of a scenario is
+enum class TimestepPolicy {
+    Fixed,    // Every step is Scenario::dt long
+    WallClock // Each step is as long as the last one took to compute, like the interactive frames
+};
+
+/// How the initial particles are placed in the layout box
+enum class ParticleLayout {
+    Random, // Uniformly distributed, from Scenario::seed
+    Lattice // A cubic lattice with Scenario::layout_spacing between the particles, filled from the bottom up
+};
+
+/// @brief Everything a headless run needs: the particles, the parameters, the simulator and how long to run it
+/// Read from a text file of "key = value" lines, '#' starts a comment. The keys are the fields below and every
+/// field of Parameters by its name, vectors are given as whitespace separated components and the enums by their
+/// names in snake_case (i.e. "pressure_solver = dfsph"). "emitter = ox oy oz sx sy sz vx vy vz rate" and
+/// "sink = ox oy oz sx sy sz" may be repeated. Anything not given keeps the interactive program's defaults.
+struct Scenario {
+    Scenario();
+
+    Parameters params;
+
+    SimulatorBackend backend;
+
+    // The initial particles are placed in the box from layout_min to layout_max
+    ParticleLayout layout;
+    glm::vec3 layout_min;
+    glm::vec3 layout_max;
+
+    // The distance between the lattice's particles, the rest spacing of the kernel size by default
+    float layout_spacing;
+
+    glm::vec3 initial_velocity;
+
+    // Seeds the random layout, so runs of the same scenario start from the same particles
+    unsigned int seed;
+
+    // Steps that are run and timed after the warm-up steps, which are run but not timed
+    unsigned int steps;
+    unsigned int warmup_steps;
+
+    TimestepPolicy dt_policy;
+
+    // The step length of the fixed policy, and the first step of the wall-clock one (s)
+    float dt;
+
+    // The OpenCL device, counted from 1 in the order the simulator lists them at setup
+    int opencl_device;
+
+    // Time the phases of the steps, which makes the OpenCL simulator wait for its kernels after every phase
+    bool phase_timings;
+
+    /// Reads the scenario from the file, reporting unknown keys and malformed values with their line to std::cerr.
+    /// Returns false if the file could not be read or had errors
+    static bool load(const std::string &file_name, Scenario &scenario);
+
+    /// Applies one "key = value" line on top of what was loaded, i.e. to sweep a parameter without editing the file.
+    /// Returns false with the reason in error if the key is unknown or the value malformed. Call finish afterwards
+    bool set(const std::string &assignment, std::string &error);
+
+    /// Replaces the parameters, i.e. with a checkpoint's, keeping their sizes rather than deriving them in finish.
+    /// Lines applied with set afterwards still change them
+    void set_parameters(const Parameters &parameters);
+
+    /// Fills in the sizes that follow particles and kernel_size unless they were given, and checks that the
+    /// scenario can run. Done by load, needed again after set
+    bool finish(std::string &error);
+
+    /// The initial particle positions of the layout, params.n_particles of them
+    std::vector<glm::vec3> generate_positions() const;
+
+    /// A new simulator of the scenario's backend, owned by the caller. The OpenCL one keeps the particles in its
+    /// own buffers and runs on opencl_device
+    ParticleSimulator *create_simulator() const;
+
+    /// The names the enums have in scenario files
+    static const char *get_backend_name(SimulatorBackend backend);
+    static const char *get_pressure_solver_name(PressureSolver solver);
+
+private:
+    // Whether the sizes finish would derive were given, so that they are kept
+    bool has_max_particles;
+    bool has_sdf_cell_size;
+    bool has_shallow_water_cell_size;
+};
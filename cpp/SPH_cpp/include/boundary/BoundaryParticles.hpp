@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "VoxelGrid.hpp"
+#include "boundary/SignedDistanceField.hpp"
+
+/// @brief Static particles covering the container walls (Akinci et al. 2012, "Versatile rigid-fluid coupling")
+/// The boundary particles take part in the density and pressure calculations as neighbours of the fluid, which
+/// keeps the fluid out of the walls without the stiff penalty forces. They never move, so their positions,
+/// their grid and their volume weights are all computed once.
+class BoundaryParticles {
+public:
+    /// Samples the zero level set of the field with a spacing of half a kernel size
+    void sample(const SignedDistanceField &sdf, const Parameters &params);
+
+    inline const std::vector<glm::vec3> &get_positions() const {
+        return positions;
+    }
+
+    /// psi_b = rest_density * V_b, the boundary particle's contribution in place of a fluid particle's mass
+    inline const std::vector<float> &get_volumes() const {
+        return volumes;
+    }
+
+    /// The boundary particles bucketed into the fluid's voxel grid layout
+    inline const VoxelGrid &get_grid() const {
+        return grid;
+    }
+
+    inline unsigned int size() const {
+        return static_cast<unsigned int>(positions.size());
+    }
+
+private:
+    std::vector<glm::vec3> positions;
+    std::vector<float> volumes;
+
+    VoxelGrid grid;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "OpenCL/clBoundaryInfo.hpp"
+
+/// @brief A container boundary voxelized into a 3D grid of signed distances
+/// Each grid node stores (normal.x, normal.y, normal.z, distance) where the distance is positive inside the
+/// container (where the fluid lives) and the normal points into the container. The grid is built once at setup,
+/// after which a boundary query is a single trilinear lookup regardless of the container's shape.
+class SignedDistanceField {
+public:
+    /// An empty field, to be replaced by one of the factories below
+    SignedDistanceField() = default;
+
+    /// Creates the container selected in the parameters (Parameters::container)
+    static SignedDistanceField create_from_parameters(const Parameters &params);
+
+    /// An open-top cylinder standing on the bottom bound, centered in the x/z-plane of the volume
+    static SignedDistanceField create_glass(const Parameters &params);
+
+    /// An axis-aligned box spanning the parameter bounds
+    static SignedDistanceField create_box(const Parameters &params);
+
+    /// A closed triangle mesh in Wavefront OBJ format describing the volume the fluid may occupy
+    static SignedDistanceField create_from_obj(const Parameters &params, const std::string &file_name);
+
+    /// Trilinearly interpolates the field at the given position
+    /// Positions outside the field are clamped to its border
+    /// @return (normal.xyz, distance), with the normal normalized
+    glm::vec4 sample(const glm::vec3 &position) const;
+
+    inline const std::vector<glm::vec4> &get_data() const {
+        return data;
+    }
+
+    inline glm::uvec3 get_dimensions() const {
+        return dimensions;
+    }
+
+    inline glm::vec3 get_origin() const {
+        return origin;
+    }
+
+    inline float get_cell_size() const {
+        return cell_size;
+    }
+
+    void set_boundary_info(clBoundaryInfo &boundary_info, const Parameters &params) const;
+
+private:
+    SignedDistanceField(const Parameters &params);
+
+    /// Evaluates the distance function at every grid node and derives the normals by central differences
+    void voxelize(const std::function<float(const glm::vec3 &)> &distance_function);
+
+    /// Derives the normal of every grid node from the stored distances
+    void calculate_normals();
+
+    inline unsigned int get_node_index(unsigned int x, unsigned int y, unsigned int z) const {
+        return x + dimensions.x * (y + dimensions.y * z);
+    }
+
+    inline glm::vec3 get_node_position(unsigned int x, unsigned int y, unsigned int z) const {
+        return origin + cell_size * glm::vec3(x, y, z);
+    }
+
+    glm::uvec3 dimensions;
+    glm::vec3 origin;
+    float cell_size;
+
+    std::vector<glm::vec4> data;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "profiling/Profiler.hpp"
+
+/// @brief The wall-clock time spent in each named phase of the simulation steps, summed over many steps
+/// A simulator given one through ParticleSimulator::setPhaseTimings splits its steps into phases with PhaseClock.
+/// The phases are kept in the order they were first measured, which is the order they run in.
+class PhaseTimings {
+public:
+    struct Phase {
+        std::string name;
+        double total_seconds;
+        unsigned int count;
+    };
+
+    /// Adds one measurement of the named phase
+    void add(const char *name, double seconds) {
+        for (Phase &phase : phases) {
+            if (phase.name == name) {
+                phase.total_seconds += seconds;
+                ++phase.count;
+                return;
+            }
+        }
+
+        phases.push_back({name, seconds, 1});
+    }
+
+    inline const std::vector<Phase> &get_phases() const {
+        return phases;
+    }
+
+    inline void clear() {
+        phases.clear();
+    }
+
+    /// Called before every measurement. Simulators with asynchronous work (OpenCL) set it to wait for that work,
+    /// so that it is counted in the phase that queued it rather than the one that happens to wait for it
+    std::function<void()> synchronize;
+
+private:
+    std::vector<Phase> phases;
+};
+
+/// @brief Splits a simulation step into consecutive phases: each lap adds the time since the previous lap, or since
+/// the clock was created or restarted, to the named phase. The phases are also zones of the Profiler while it is
+/// enabled. Does nothing otherwise, so the simulators can keep their laps in place when nothing is measured
+class PhaseClock {
+public:
+    explicit PhaseClock(PhaseTimings *timings) : timings(timings), last_lap_ns(-1) {
+        restart();
+    }
+
+    /// Starts the next phase now, leaving out the time since the last lap
+    inline void restart() {
+        if (timings || Profiler::is_enabled()) {
+            if (timings && timings->synchronize) {
+                timings->synchronize();
+            }
+
+            last_lap_ns = Profiler::now_ns();
+        }
+    }
+
+    /// Ends the current phase and starts the next one
+    inline void lap(const char *name) {
+        if (timings || Profiler::is_enabled()) {
+            if (timings && timings->synchronize) {
+                timings->synchronize();
+            }
+
+            const int64_t now_ns = Profiler::now_ns();
+            if (timings) {
+                timings->add(name, 1e-9 * (now_ns - last_lap_ns));
+            }
+            // Unless the profiler was only enabled since the last lap
+            if (Profiler::is_enabled() && last_lap_ns >= 0) {
+                Profiler::record(name, last_lap_ns, now_ns);
+            }
+            last_lap_ns = now_ns;
+        }
+    }
+
+private:
+    PhaseTimings *timings;
+
+    // On the profiler's clock, negative until the clock has been started
+    int64_t last_lap_ns;
+};
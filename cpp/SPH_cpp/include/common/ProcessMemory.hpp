@@ -0,0 +1,71 @@
+#pragma once
+
+#ifdef _WIN32
+// Keeps windows.h from defining min and max macros, which break std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#else
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+/// The memory this process has resident now (bytes), zero if the system does not tell
+inline double get_resident_memory_bytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return static_cast<double>(counters.WorkingSetSize);
+    }
+    return 0.0;
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) !=
+        KERN_SUCCESS) {
+        return 0.0;
+    }
+    return static_cast<double>(info.resident_size);
+#else
+    // The second field of statm is the resident set, in pages
+    long pages = 0;
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0.0;
+    }
+    if (std::fscanf(statm, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    std::fclose(statm);
+
+    return static_cast<double>(pages) * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/// The most memory this process has had resident so far (bytes), zero if the system does not tell
+inline double get_peak_memory_bytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return static_cast<double>(counters.PeakWorkingSetSize);
+    }
+    return 0.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+#ifdef __APPLE__
+    return static_cast<double>(usage.ru_maxrss);
+#else
+    // Linux counts in kilobytes
+    return 1024.0 * usage.ru_maxrss;
+#endif
+#endif
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/// @brief A view of contiguous elements owned by someone else, i.e. a std::vector or a mapped buffer
+/// Stands in for C++20's std::span, so that particle state can be passed in and out of the simulators without
+/// copying it into a particular container
+template<typename T>
+class Span {
+public:
+    Span() : elements(nullptr), count(0) {}
+
+    Span(T *data, size_t size) : elements(data), count(size) {}
+
+    /// Views the whole vector, which must outlive the span and not be resized while it is used
+    template<typename U>
+    Span(std::vector<U> &vector) : elements(vector.data()), count(vector.size()) {}
+
+    template<typename U>
+    Span(const std::vector<U> &vector) : elements(vector.data()), count(vector.size()) {}
+
+    inline T *data() const {
+        return elements;
+    }
+
+    inline size_t size() const {
+        return count;
+    }
+
+    inline bool empty() const {
+        return count == 0;
+    }
+
+    inline T &operator[](size_t i) const {
+        return elements[i];
+    }
+
+    inline T *begin() const {
+        return elements;
+    }
+
+    inline T *end() const {
+        return elements + count;
+    }
+
+private:
+    T *elements;
+    size_t count;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// The indices of a loop are split into this many contiguous chunks, which run on as many threads. The chunks do not
+// depend on the machine, so sums added up chunk by chunk come out the same on every machine, threads or not
+const unsigned int PARALLEL_CHUNK_COUNT = 4;
+
+// Shorter loops run their chunks on the calling thread, starting the threads would cost more than they save
+const unsigned int PARALLEL_MIN_COUNT = 8192;
+
+/// Runs body(chunk, begin, end) for each chunk of the indices [0, count), the first on the calling thread and the rest
+/// on their own threads, and returns once all have run. The body must only write to its own chunk's indices
+template<typename Body>
+inline void parallel_chunks(unsigned int count, const Body &body) {
+    const unsigned int chunk_size = (count + PARALLEL_CHUNK_COUNT - 1) / PARALLEL_CHUNK_COUNT;
+
+    if (count < PARALLEL_MIN_COUNT) {
+        for (unsigned int chunk = 0; chunk < PARALLEL_CHUNK_COUNT; ++chunk) {
+            body(chunk, std::min(chunk * chunk_size, count), std::min((chunk + 1) * chunk_size, count));
+        }
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned int chunk = 1; chunk < PARALLEL_CHUNK_COUNT; ++chunk) {
+        threads.push_back(std::thread([&body, chunk, chunk_size, count]() {
+            body(chunk, std::min(chunk * chunk_size, count), std::min((chunk + 1) * chunk_size, count));
+        }));
+    }
+
+    body(0, 0, std::min(chunk_size, count));
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/// Sums what body(begin, end) returns for each chunk of the indices [0, count), in the order of the chunks
+template<typename T, typename Body>
+inline T parallel_sum(unsigned int count, const Body &body) {
+    T chunk_sums[PARALLEL_CHUNK_COUNT];
+
+    parallel_chunks(count, [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+        chunk_sums[chunk] = body(begin, end);
+    });
+
+    T sum = chunk_sums[0];
+    for (unsigned int chunk = 1; chunk < PARALLEL_CHUNK_COUNT; ++chunk) {
+        sum += chunk_sums[chunk];
+    }
+
+    return sum;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "OpenCL/clVoxelGridInfo.hpp"
+#include "boundary/SignedDistanceField.hpp"
+
+enum class CellType : unsigned char {
+    Air,
+    Fluid,
+    Solid
+};
+
+/// @brief A staggered (marker-and-cell) velocity grid over the voxel grid's cells, used by FlipParticleSimulator
+/// Each velocity component is stored at the centres of the cell faces it is normal to, so the x component of
+/// cell (i, j, k) sits on the face between cells (i - 1, j, k) and (i, j, k). Cells outside the grid count as solid.
+class MacGrid {
+public:
+    /// Sizes the grid like the voxel grid and marks the cells whose centres are outside the container as solid
+    void build(const clVoxelGridInfo &grid_info, const SignedDistanceField &sdf);
+
+    /// Marks the non-solid cells holding a particle as fluid and the rest as air
+    void mark_fluid_cells(const std::vector<glm::vec3> &positions);
+
+    /// Splats the particle velocities onto the faces with trilinear weights, then extrapolates them into the air
+    void particles_to_grid(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &velocities);
+
+    /// Keeps a copy of the face velocities, for the FLIP velocity change
+    void save_velocities();
+
+    void add_acceleration(const glm::vec3 &acceleration, float dt_seconds);
+
+    /// Zeroes the velocities through the faces of solid cells
+    void enforce_solid_walls();
+
+    /// The right hand side of the pressure solve: minus the velocity divergence of each fluid cell times the
+    /// squared cell size, and zero elsewhere
+    void calculate_divergence(std::vector<float> &rhs) const;
+
+    /// Subtracts the gradient of the scaled pressure (pressure * dt / density) from the face velocities between
+    /// fluid cells and their non-solid neighbours, then extrapolates into the air again
+    void subtract_pressure_gradient(const std::vector<float> &pressure);
+
+    /// The trilinearly interpolated velocity at the position
+    glm::vec3 sample_velocity(const glm::vec3 &position) const;
+
+    /// How much the interpolated velocity changed since save_velocities
+    glm::vec3 sample_velocity_change(const glm::vec3 &position) const;
+
+    inline const glm::ivec3 &get_dimensions() const {
+        return dimensions;
+    }
+
+    inline const std::vector<CellType> &get_cells() const {
+        return cells;
+    }
+
+    inline unsigned int get_cell_index(const glm::ivec3 &cell) const {
+        return cell.x + dimensions.x * (cell.y + dimensions.y * cell.z);
+    }
+
+private:
+    /// One velocity component on its faces, [dimensions + unit vector of the component] long
+    struct FaceField {
+        glm::ivec3 dimensions;
+
+        // Where face (0, 0, 0) is, in cells
+        glm::vec3 offset;
+
+        std::vector<float> values;
+        std::vector<float> weights;
+        std::vector<char> valid;
+
+        inline unsigned int index(const glm::ivec3 &face) const {
+            return face.x + dimensions.x * (face.y + dimensions.y * face.z);
+        }
+
+        /// The lowest face of the 2x2x2 faces around the position and the weights of the upper ones
+        void find_stencil(const glm::vec3 &grid_position, glm::ivec3 &first, glm::vec3 &t) const;
+
+        float sample(const glm::vec3 &grid_position, const std::vector<float> &field) const;
+
+        /// Fills the invalid faces next to valid ones with the mean of their valid neighbours, layer by layer
+        void extrapolate(unsigned int layers);
+    };
+
+    inline CellType get_cell(const glm::ivec3 &cell) const {
+        if (cell.x < 0 || cell.y < 0 || cell.z < 0 ||
+            cell.x >= dimensions.x || cell.y >= dimensions.y || cell.z >= dimensions.z) {
+            return CellType::Solid;
+        }
+
+        return cells[get_cell_index(cell)];
+    }
+
+    /// The position in cells, with cell (0, 0, 0) spanning [0, 1)
+    inline glm::vec3 to_grid(const glm::vec3 &position) const {
+        return (position - origin) / cell_size;
+    }
+
+    glm::ivec3 dimensions;
+    glm::vec3 origin;
+    float cell_size;
+
+    // Solid cells never change, the rest are re-marked every step
+    std::vector<CellType> cells;
+    std::vector<char> solid_cells;
+
+    FaceField faces[3];
+
+    // The face velocities at save_velocities
+    std::vector<float> saved_values[3];
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "flip/MacGrid.hpp"
+
+/// @brief Solves the pressure Poisson equation of a MacGrid with multigrid-preconditioned conjugate gradients
+/// The matrix is the 7-point Laplacian over the fluid cells with zero pressure in the air cells and no flow through
+/// the solid ones. The preconditioner is one V-cycle over a hierarchy of 2x coarsened grids, which keeps the
+/// iteration count almost independent of the grid size (McAdams et al. 2010)
+class MultigridPoissonSolver {
+public:
+    /// Rebuilds the level hierarchy for the current fluid cells
+    void build(const glm::ivec3 &dimensions, const std::vector<CellType> &cells);
+
+    /// Solves for pressure, starting from its current values
+    /// @return The number of iterations it took to get the residual below tolerance * |rhs|
+    unsigned int solve(const std::vector<float> &rhs, std::vector<float> &pressure, float tolerance,
+                       unsigned int max_iterations);
+
+private:
+    struct Level {
+        glm::ivec3 dimensions;
+        std::vector<CellType> cells;
+
+        // The Laplacian of a level is the fine one's scaled by 1 / scale, for the coarser cell size
+        float scale;
+
+        std::vector<float> x, b, r;
+
+        inline unsigned int index(const glm::ivec3 &cell) const {
+            return cell.x + dimensions.x * (cell.y + dimensions.y * cell.z);
+        }
+
+        inline glm::ivec3 cell(unsigned int index) const {
+            return glm::ivec3(index % dimensions.x, (index / dimensions.x) % dimensions.y,
+                              index / (dimensions.x * dimensions.y));
+        }
+    };
+
+    /// y = A x on the level, zero outside the fluid cells
+    void apply_laplacian(const Level &level, const std::vector<float> &x, std::vector<float> &y) const;
+
+    /// Damped Jacobi sweeps on A x = b
+    void smooth(Level &level, unsigned int sweeps) const;
+
+    /// z = M^-1 r, one V-cycle starting from zero
+    void apply_preconditioner(const std::vector<float> &r, std::vector<float> &z);
+
+    std::vector<Level> levels;
+
+    std::vector<float> residual, search_direction, product, preconditioned;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "ParticleSimulator.hpp"
+#include "SolverState.hpp"
+#include "common/Span.hpp"
+#include "io/MappedFile.hpp"
+
+/// @brief A binary snapshot of a simulation to restart it from: its Parameters, its particles and the simulator's
+/// SolverState, so that a settled scene does not have to be simulated again every run
+/// The file is a header, a table of named sections and the sections, each starting at a multiple of 64 bytes:
+///  - "parameters": every field of Parameters in declaration order, the layout depends on the version
+///  - "positions" and "velocities": the particles as packed float triples
+///  - "state/<name>": the arrays of the SolverState
+/// A checkpoint is opened by mapping the file, and the particles are handed to setupSimulation straight from the
+/// mapping, without reading them into memory first. Files are written in the byte order of the machine, and
+/// only opened on machines of the same byte order.
+class Checkpoint {
+public:
+    // Raised whenever the layout of a section changes. Older versions can not be read by newer programs
+    static const uint32_t version = 1;
+
+    Checkpoint();
+
+    /// Writes a checkpoint of the particles and the state. The file is written under a temporary name and then
+    /// renamed, so an interrupted write leaves the previous checkpoint in place. Returns false with the reason in
+    /// error if it could not be written
+    static bool write(const std::string &file_name, const Parameters &params, Span<const glm::vec3> positions,
+                      Span<const glm::vec3> velocities, const SolverState &state, std::string &error);
+
+    /// Maps the checkpoint and checks it. Returns false with the reason in error if it could not be read, was
+    /// written by another version or is truncated
+    bool open(const std::string &file_name, std::string &error);
+
+    inline const Parameters &get_parameters() const {
+        return params;
+    }
+
+    /// The particles, in place in the mapped file, valid while the checkpoint is open. Their number can differ
+    /// from the parameters' n_particles, which sets the particles' mass, once emitters and sinks have run
+    inline Span<const glm::vec3> get_positions() const {
+        return positions;
+    }
+
+    inline Span<const glm::vec3> get_velocities() const {
+        return velocities;
+    }
+
+    inline const SolverState &get_solver_state() const {
+        return solver_state;
+    }
+
+private:
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    MappedFile file;
+
+    Parameters params;
+    Span<const glm::vec3> positions;
+    Span<const glm::vec3> velocities;
+    SolverState solver_state;
+};
+
+/// @brief Writes checkpoints of a running simulation on a background thread
+/// Only the copy of the particles and the solver state holds up the caller, the file is written while the
+/// simulation goes on. A write that fails is reported on std::cerr.
+class CheckpointWriter {
+public:
+    CheckpointWriter();
+
+    /// Waits for the write in progress
+    ~CheckpointWriter();
+
+    /// Copies the simulator's particles and state and starts writing them to the file, after waiting for the
+    /// previous write. Dead particles, which the OpenCL simulator keeps as NaN positions, are left out
+    void write_async(const std::string &file_name, const Parameters &params, ParticleSimulator &simulator);
+
+    /// Waits for the write in progress. Returns false if the last write failed
+    bool wait();
+
+    inline bool is_writing() const {
+        return writing;
+    }
+
+private:
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+    std::thread thread;
+    std::atomic<bool> writing;
+
+    // Set by the thread, read once it has been joined
+    bool last_write_succeeded = true;
+};
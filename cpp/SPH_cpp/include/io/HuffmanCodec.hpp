@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// @brief Entropy codes byte streams with a static, canonical Huffman code per block
+/// The trajectory frames are mostly small deltas, so a few byte values take most of a block and a per-block code
+/// gets close to their entropy. A block starts with its method: stored, a single repeated byte, or Huffman coded
+/// with the 256 code lengths as nibbles followed by the bits, least significant first. Codes are at most
+/// max_code_length bits, so that decoding is one table lookup per byte.
+class HuffmanCodec {
+public:
+    static const unsigned int max_code_length = 12;
+
+    /// Appends the coded block to out. Falls back to storing the bytes if coding would not make them smaller
+    static void encode(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+
+    /// Decodes a block encode wrote into exactly size bytes. Returns false if the block is not valid or does not
+    /// hold size bytes
+    static bool decode(const uint8_t *block, size_t block_size, uint8_t *data, size_t size);
+
+private:
+    enum Method : uint8_t {
+        Stored = 0,
+        Repeated = 1,
+        Coded = 2
+    };
+
+    /// Fills the code lengths of the 256 byte values, 0 for the ones that do not occur
+    static void build_code_lengths(const uint64_t frequencies[256], uint8_t lengths[256]);
+
+    /// Assigns the canonical codes of the lengths, bit reversed for writing least significant bit first. Returns
+    /// false if the lengths do not make a prefix code
+    static bool build_codes(const uint8_t lengths[256], uint16_t codes[256]);
+};
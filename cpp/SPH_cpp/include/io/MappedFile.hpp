@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/// @brief A whole file mapped read-only into memory, so that its contents can be used in place
+/// The pages are read from disk as they are first touched, so opening even a large file is instant and only the
+/// parts that are used cost anything.
+class MappedFile {
+public:
+    MappedFile() {}
+
+    ~MappedFile();
+
+    /// Maps the file, unmapping the one mapped before. Returns false if it could not be opened or mapped
+    bool open(const std::string &file_name);
+
+    void close();
+
+    inline bool is_open() const {
+        return bytes != nullptr;
+    }
+
+    inline const char *data() const {
+        return bytes;
+    }
+
+    inline size_t size() const {
+        return length;
+    }
+
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *bytes = nullptr;
+    size_t length = 0;
+
+#ifdef _WIN32
+    // The file and mapping HANDLEs
+    void *file_handle = nullptr;
+    void *mapping_handle = nullptr;
+#endif
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "common/Span.hpp"
+
+/// The layout of the trajectory files TrajectoryRecorder writes, see TrajectoryFrameCodec for the frames:
+///  - a TrajectoryFileHeader
+///  - the frames, each a TrajectoryFrameHeader followed by its coded blocks
+///  - when the recording was closed properly, an index of the frames and a TrajectoryFooter at the very end
+/// Every keyframe_interval-th frame is a keyframe, which decodes on its own. The others decode only after the frames
+/// before them back to the last keyframe. All numbers are in the byte order of the writing machine.
+const uint32_t trajectory_version = 1;
+
+const char trajectory_magic[8] = {'S', 'P', 'H', 'T', 'R', 'A', 'J', '\0'};
+const char trajectory_index_magic[8] = {'S', 'P', 'H', 'T', 'I', 'D', 'X', '\0'};
+
+// "FRAM" in little endian, lets a reader without the index find its way from frame to frame
+const uint32_t trajectory_frame_magic = 0x4d415246;
+
+// Written as a number, read back in another byte order it comes out differently
+const uint32_t trajectory_byte_order = 0x01020304;
+
+struct TrajectoryFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    // The positions are quantized over cells of this size from the origin, the container's bounds
+    float origin[3];
+    float size[3];
+
+    // Steps of the simulation per frame and frames per keyframe
+    uint32_t step_interval;
+    uint32_t keyframe_interval;
+
+    // The most particles the simulation could have
+    uint32_t max_particles;
+
+    uint32_t reserved[3];
+};
+
+struct TrajectoryFrameHeader {
+    uint32_t magic;
+    uint32_t is_keyframe;
+
+    // The step of the simulation after which the frame was taken, and the simulated time (s)
+    uint64_t step;
+    double time;
+
+    uint32_t particle_count;
+
+    // The largest velocity component, the velocities are quantized as fractions of it (m/s)
+    float velocity_scale;
+
+    // The coded blocks, in the order of TrajectoryFrameCodec::Block
+    uint32_t block_sizes[6];
+
+    uint32_t reserved[2];
+};
+
+struct TrajectoryIndexEntry {
+    uint64_t offset;
+    uint64_t step;
+    double time;
+    uint32_t particle_count;
+    uint32_t is_keyframe;
+};
+
+struct TrajectoryFooter {
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char magic[8];
+    uint64_t reserved;
+};
+
+static_assert(sizeof(TrajectoryFileHeader) == 64 && sizeof(TrajectoryFrameHeader) == 64 &&
+              sizeof(TrajectoryIndexEntry) == 32 && sizeof(TrajectoryFooter) == 32,
+              "the header layouts are part of the format");
+
+/// @brief Turns particle frames into the compressed blocks of trajectory files and back
+/// A frame is compressed in three stages:
+///  - the positions are quantized relative to cells the size of the container: 16 bits for the place in the cell,
+///    1/65536 of the container's side, and 16 bits for the cell, which is the container itself unless a particle
+///    left it. The velocities are quantized to signed 16 bits of the frame's largest component
+///  - each value is replaced with its difference from the same particle's value in the previous frame, zigzag
+///    coded so that small differences either way are small numbers. Keyframes take the difference from zero
+///  - the differences are split into byte planes, coordinate by coordinate, and each plane is entropy coded with
+///    HuffmanCodec. The high bytes of particles that barely moved are all zero, and code to almost nothing
+/// A particle is the same particle in two frames if it is in the same place of the arrays. Particles removed by a
+/// sink reorder the arrays, which only costs compression. The codec keeps the previous frame, so an encoder has to
+/// see every frame in order, and a decoder every frame from the last keyframe on.
+class TrajectoryFrameCodec {
+public:
+    enum Block {
+        PositionsByte0,
+        PositionsByte1,
+        PositionsByte2,
+        PositionsByte3,
+        VelocitiesByte0,
+        VelocitiesByte1,
+        BlockCount
+    };
+
+    TrajectoryFrameCodec(const glm::vec3 &origin, const glm::vec3 &size);
+
+    /// Appends the frame's blocks to out, and fills in the header's particle count, velocity scale and block sizes
+    void encode(Span<const glm::vec3> positions, Span<const glm::vec3> velocities, bool is_keyframe,
+                TrajectoryFrameHeader &header, std::vector<uint8_t> &out);
+
+    /// Decodes the frame whose blocks follow the header. Returns false if they are not valid, in which case the
+    /// frames up to the next keyframe can not be decoded either
+    bool decode(const TrajectoryFrameHeader &header, const uint8_t *blocks, size_t blocks_size,
+                std::vector<glm::vec3> &positions, std::vector<glm::vec3> &velocities);
+
+private:
+    /// Replaces the count particles' quantized values with their zigzag coded differences from previous, and keeps
+    /// the values as previous. Particles previous does not have yet take the difference from zero
+    template<typename T>
+    static void difference(std::vector<T> &values, std::vector<T> &previous, size_t count, bool is_keyframe);
+
+    /// Undoes difference
+    template<typename T>
+    static void accumulate(std::vector<T> &values, std::vector<T> &previous, size_t count, bool is_keyframe);
+
+    /// Appends each byte plane of the values as a block, and sets the blocks' sizes starting at block_sizes
+    template<typename T>
+    void encode_planes(const std::vector<T> &values, std::vector<uint8_t> &out, uint32_t *block_sizes);
+
+    /// Decodes the byte planes starting at blocks into values, which has the size of the frame
+    template<typename T>
+    bool decode_planes(const uint8_t *blocks, const uint32_t *block_sizes, std::vector<T> &values);
+
+    glm::vec3 origin;
+    glm::vec3 size;
+
+    // The quantized values of the last frame, coordinate by coordinate: all x, then all y, then all z
+    std::vector<uint32_t> previous_positions;
+    std::vector<uint16_t> previous_velocities;
+
+    // Scratch space, kept between frames
+    std::vector<uint32_t> quantized_positions;
+    std::vector<uint16_t> quantized_velocities;
+    std::vector<uint8_t> plane;
+};
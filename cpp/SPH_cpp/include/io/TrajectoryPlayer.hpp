@@ -0,0 +1,114 @@
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ParticleSimulator.hpp"
+#include "io/TrajectoryReader.hpp"
+
+/// @brief Plays a recorded trajectory back in place of a simulator, for reviewing a run without simulating it again
+/// Each update moves the playhead on by the update's time and hands the frame there to the particle state callback,
+/// so the program draws it like it would the particles of a simulation. seek jumps anywhere in the recording.
+/// The frames are decoded ahead of the playhead by worker threads. A frame can only be decoded after the ones
+/// before it back to its keyframe, so each worker decodes from a keyframe on, and keeps the frames that fall in
+/// the lookahead_frames after the playhead. When a frame is not decoded yet, after a seek, the last one stays shown.
+class TrajectoryPlayer : public ParticleSimulator {
+public:
+    // Decoded frames kept ahead of the playhead, each takes 24 bytes per particle
+    static const unsigned int lookahead_frames = 16;
+
+    explicit TrajectoryPlayer(unsigned int thread_count = 2);
+
+    /// Stops the workers
+    ~TrajectoryPlayer();
+
+    /// Opens the trajectory and starts decoding from its first frame. Returns false with the reason in error if it
+    /// could not be read
+    bool open(const std::string &file_name, std::string &error);
+
+    inline const TrajectoryReader &get_reader() const {
+        return reader;
+    }
+
+    /// From the first frame to the last (s)
+    double get_duration() const;
+
+    /// Where the playhead is, from the first frame (s)
+    inline double get_time() const {
+        return time;
+    }
+
+    /// Moves the playhead, to the frame taken at or before the time from the first frame (s)
+    void seek(double seconds);
+
+    /// Hands the playhead's frame to the callback if it has been decoded and is not shown yet. Updates and seeks do
+    /// this already, but while paused after a seek the frame is only shown once this is called after its decoding
+    void show_playhead_frame();
+
+    /// The frame shown, or rather handed to the callback last
+    inline size_t get_shown_frame() const {
+        return shown_frame_index;
+    }
+
+    /// The particles of the first frame are shown once decoded, the ones passed in are not used
+    bool setupSimulation(const Parameters &parameters,
+                         Span<const glm::vec3> particle_positions,
+                         Span<const glm::vec3> particle_velocities,
+                         std::string &error);
+
+    /// Moves the playhead on by dt_seconds, back to the start after the last frame, and shows the frame there
+    void updateSimulation(const Parameters &parameters, float dt_seconds);
+
+    unsigned int getParticleDrawCount();
+
+    unsigned int getSolverIterations();
+
+    void readParticleState(const ParticleStateCallback &callback);
+
+private:
+    struct DecodedFrame {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> velocities;
+    };
+
+    /// A worker: decodes from the keyframes of the frames ahead of the playhead until stopped
+    void decode_frames();
+
+    void stop_workers();
+
+    /// The keyframe of the first frame ahead of the playhead that is neither decoded nor being decoded. Returns false
+    /// if there is none. Called under the mutex
+    bool find_keyframe_to_decode(size_t &keyframe) const;
+
+    /// Moves the playhead to the frame and drops the decoded frames no longer ahead of it
+    void set_playhead(size_t frame);
+
+    TrajectoryReader reader;
+    unsigned int thread_count;
+    std::vector<std::thread> threads;
+
+    // Only used by the caller's thread
+    double time = 0.0;
+    std::shared_ptr<const DecodedFrame> shown_frame;
+    size_t shown_frame_index = 0;
+
+    // Guard everything below, the workers wait on work_changed for the playhead to move or a keyframe to be freed
+    std::mutex mutex;
+    std::condition_variable work_changed;
+    size_t playhead = 0;
+    std::map<size_t, std::shared_ptr<const DecodedFrame>> decoded_frames;
+    std::set<size_t> keyframes_in_progress;
+
+    // Whose frames could not be decoded, they are not tried again
+    std::set<size_t> damaged_keyframes;
+
+    // Raised when the playhead moves back, the workers then start over from the new playhead's keyframe
+    unsigned long long seek_generation = 0;
+    bool stopping = false;
+};
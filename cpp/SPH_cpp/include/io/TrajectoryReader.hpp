@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "io/MappedFile.hpp"
+#include "io/TrajectoryFormat.hpp"
+
+/// @brief Random access to the frames of a trajectory file TrajectoryRecorder wrote
+/// The file is mapped, so opening even a long recording only reads its index, and a frame's pages are read from disk
+/// when it is decoded. A recording that was not closed properly has no index, it is then found by walking from frame
+/// to frame. The reader is not changed by decoding, so any number of threads can decode with it at once, each with
+/// its own TrajectoryFrameCodec from create_codec.
+class TrajectoryReader {
+public:
+    TrajectoryReader() {}
+
+    /// Maps the trajectory and reads its index. Returns false with the reason in error if it could not be read, was
+    /// written by another version or has no frames
+    bool open(const std::string &file_name, std::string &error);
+
+    inline const TrajectoryFileHeader &get_header() const {
+        return header;
+    }
+
+    /// The box the positions were quantized over, the recorded container
+    inline glm::vec3 get_origin() const {
+        return glm::vec3(header.origin[0], header.origin[1], header.origin[2]);
+    }
+
+    inline glm::vec3 get_size() const {
+        return glm::vec3(header.size[0], header.size[1], header.size[2]);
+    }
+
+    inline size_t get_frame_count() const {
+        return index.size();
+    }
+
+    inline const TrajectoryIndexEntry &get_frame(size_t frame) const {
+        return index[frame];
+    }
+
+    /// The keyframe decoding has to start from to get to the frame
+    size_t get_keyframe(size_t frame) const;
+
+    /// The last frame taken at or before the time, the first frame for times before it
+    size_t find_frame(double time) const;
+
+    /// A codec for decoding the frames of this file
+    inline TrajectoryFrameCodec create_codec() const {
+        return TrajectoryFrameCodec(get_origin(), get_size());
+    }
+
+    /// Decodes the frame with the codec, which has to have decoded the frame before it unless it is a keyframe.
+    /// Returns false if the frame is damaged
+    bool decode_frame(size_t frame, TrajectoryFrameCodec &codec, std::vector<glm::vec3> &positions,
+                      std::vector<glm::vec3> &velocities) const;
+
+private:
+    TrajectoryReader(const TrajectoryReader &) = delete;
+    TrajectoryReader &operator=(const TrajectoryReader &) = delete;
+
+    /// Reads the index the footer points to. Returns false if there is no valid footer
+    bool read_index();
+
+    /// Rebuilds the index of an unfinished recording from the frame headers, up to the first incomplete frame
+    void scan_frames();
+
+    MappedFile file;
+    TrajectoryFileHeader header;
+    std::vector<TrajectoryIndexEntry> index;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "Parameters.hpp"
+#include "ParticleSimulator.hpp"
+#include "io/TrajectoryFormat.hpp"
+
+/// @brief Streams every step_interval-th step of a simulation to a compressed trajectory file, for rendering or
+/// reviewing a long run afterwards without simulating it again
+/// record_step only copies the particles into one of a few frame buffers. Compressing them with a
+/// TrajectoryFrameCodec and writing them to the file happens on a background thread, which hands the buffers back
+/// once written. If the disk falls behind by all of the buffers, record_step waits for one. Recording every few steps,
+/// a frame takes about a third of the particles' floats, see TrajectoryFormat.hpp for the format.
+class TrajectoryRecorder {
+public:
+    // Frames per keyframe, where playback can start decoding
+    static const unsigned int keyframe_interval = 32;
+
+    // Frames copied but not yet written, at most
+    static const unsigned int frame_buffer_count = 4;
+
+    TrajectoryRecorder();
+
+    /// Closes the recording
+    ~TrajectoryRecorder();
+
+    /// Starts recording to the file, a frame every step_interval steps. The positions are quantized over the
+    /// parameters' container. Returns false with the reason in error if the file could not be created
+    bool open(const std::string &file_name, const Parameters &params, unsigned int step_interval,
+              std::string &error);
+
+    /// Counts a step of dt_seconds, and records the simulator's particles if it is a step_interval-th one. Dead
+    /// particles, which the OpenCL simulator keeps as NaN positions, are left out
+    void record_step(ParticleSimulator &simulator, float dt_seconds);
+
+    /// Writes the frames still waiting and the index, and closes the file. Returns false if anything of the
+    /// recording could not be written
+    bool close();
+
+    inline bool is_open() const {
+        return recording;
+    }
+
+    /// Of the recording so far, still valid after close
+    inline unsigned long long get_frame_count() const {
+        return frame_count;
+    }
+
+    /// The size the recorded particles would have as floats
+    inline unsigned long long get_raw_bytes() const {
+        return raw_bytes;
+    }
+
+    /// The size of the file, only valid after close
+    inline unsigned long long get_file_bytes() const {
+        return file_bytes;
+    }
+
+private:
+    TrajectoryRecorder(const TrajectoryRecorder &) = delete;
+    TrajectoryRecorder &operator=(const TrajectoryRecorder &) = delete;
+
+    struct Frame {
+        uint64_t step;
+        double time;
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> velocities;
+    };
+
+    /// The background thread: codes and writes the queued frames until closed
+    void write_frames();
+
+    // Only the thread writes to the file while recording
+    std::ofstream file;
+    std::unique_ptr<TrajectoryFrameCodec> codec;
+    bool recording = false;
+    unsigned int step_interval = 1;
+
+    uint64_t step = 0;
+    double time = 0.0;
+    unsigned long long frame_count = 0;
+    unsigned long long raw_bytes = 0;
+
+    std::thread thread;
+
+    // Guard everything below, the thread waits on frame_queued and record_step on frame_written
+    std::mutex mutex;
+    std::condition_variable frame_queued;
+    std::condition_variable frame_written;
+    std::deque<std::unique_ptr<Frame>> queued_frames;
+    std::vector<std::unique_ptr<Frame>> free_frames;
+    bool closing = false;
+
+    // Written by the thread only, read once it has been joined
+    std::vector<TrajectoryIndexEntry> index;
+    uint64_t file_bytes = 0;
+    bool write_failed = false;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ParticleSimulator.hpp"
+#include "common/PhaseTimings.hpp"
+
+class MetricsServer;
+
+/// @brief The counters of a long simulation run, for dashboards and soak tests
+/// After each update the program hands the simulator, the update's wall-clock time and its phase and kernel timings
+/// to record_step. From these Metrics keeps running totals: the steps and a histogram of their durations, the
+/// simulator's SimulationCounters, the time of each phase and kernel, and the process' memory. The totals go out in
+/// two ways, both optional:
+///  - open_log writes a JSON line every log_interval steps, with what happened in those steps, so that a file of a
+///    long run can be plotted without replaying it
+///  - serve puts the totals on http://127.0.0.1:<port>/metrics in the Prometheus text format, for scraping
+/// record_step is meant for the simulation thread; the page is built on the server's thread under a mutex.
+class Metrics {
+public:
+    Metrics();
+
+    ~Metrics();
+
+    /// Starts writing a line every log_interval steps to the file. Returns false if it could not be opened
+    bool open_log(const std::string &file_name, unsigned int log_interval);
+
+    /// Starts serving the totals on the port of the loopback interface. Returns false if the port is taken
+    bool serve(unsigned short port);
+
+    /// Adds an update of the simulator that took step_seconds. phases and kernels are timings the simulator adds
+    /// to and the caller never clears, see ParticleSimulator::setPhaseTimings, or nullptr if not timed
+    void record_step(ParticleSimulator &simulator, double step_seconds, const PhaseTimings *phases,
+                     const PhaseTimings *kernels);
+
+    /// The totals in the Prometheus text exposition format
+    std::string get_prometheus_text();
+
+private:
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    struct Totals {
+        unsigned long long steps;
+        double step_seconds;
+        SimulationCounters counters;
+
+        // The phases and kernels by name, in the order they first showed up (s)
+        std::vector<std::pair<std::string, double>> phase_seconds;
+        std::vector<std::pair<std::string, double>> kernel_seconds;
+    };
+
+    /// Writes the steps since the last line, the difference between the totals and the ones at the last line
+    void write_log_line();
+
+    // Upper bounds of the step duration histogram's buckets (s), the last bucket (+Inf) is implied
+    static const double step_buckets[];
+    static const size_t step_bucket_count;
+
+    std::mutex mutex;
+
+    Totals totals;
+    std::vector<unsigned long long> step_bucket_counts;
+
+    // Gauges, of the last step
+    double last_step_seconds = 0.0;
+    unsigned int particles = 0;
+    unsigned int solver_iterations = 0;
+
+    std::ofstream log;
+    unsigned int log_interval = 1;
+    Totals logged_totals;
+
+    // The slowest step since the last line (s)
+    double log_max_step_seconds = 0.0;
+
+    std::unique_ptr<MetricsServer> server;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+/// @brief A minimal HTTP server on the loopback interface that answers every request with the page its callback
+/// builds, enough for a Prometheus scraper or curl. Requests are handled one at a time on the server's own thread,
+/// which checks a few times a second whether it should stop.
+class MetricsServer {
+public:
+    typedef std::function<std::string()> PageCallback;
+
+    explicit MetricsServer(const PageCallback &page);
+
+    /// Stops the server, waiting for the request being handled
+    ~MetricsServer();
+
+    /// Starts listening on 127.0.0.1:port. Returns false if the socket could not be bound, e.g. the port is taken
+    bool start(unsigned short port);
+
+private:
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    void run();
+
+    PageCallback page;
+
+    // A SOCKET on Windows, a file descriptor elsewhere, negative if not listening
+    long long listen_socket = -1;
+
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// @brief A low-overhead hierarchical profiler of named zones, see PROFILE_ZONE
+/// While it is enabled, every zone that ends is added to a ring buffer of its thread, which keeps the last
+/// ring_capacity zones and overwrites older ones. Disabled, a zone costs a relaxed atomic load, so the zones stay
+/// in the simulators' hot paths. Zones nest: the ones opened inside another zone's scope show up under it in the
+/// exported trace. Building with SPH_NO_PROFILER compiles the zones out altogether.
+///
+/// The zones are exported as Chrome trace_event JSON, for chrome://tracing or https://ui.perfetto.dev, or summed up
+/// per zone name. Both may run while other threads record, but the zones still open are not included.
+class Profiler {
+public:
+    struct Event {
+        // A string that outlives the profiler, usually a literal
+        const char *name;
+
+        // Since the first use of the profiler (ns)
+        int64_t start_ns;
+        int64_t end_ns;
+    };
+
+    struct ZoneStatistics {
+        std::string name;
+        size_t count;
+        double total_ms;
+        double min_ms;
+        double mean_ms;
+        double p99_ms;
+        double max_ms;
+    };
+
+    // How many zones each thread keeps
+    static const size_t ring_capacity = 1 << 16;
+
+    static inline bool is_enabled() {
+#ifdef SPH_NO_PROFILER
+        return false;
+#else
+        return enabled.load(std::memory_order_relaxed);
+#endif
+    }
+
+    /// Starts or stops recording zones, keeping the ones already recorded
+    static void set_enabled(bool enable);
+
+    /// Forgets the recorded zones of all threads
+    static void clear();
+
+    /// The time on the profiler's clock (ns)
+    static int64_t now_ns();
+
+    /// Adds a zone that ran from start_ns to end_ns to the calling thread's buffer
+    static void record(const char *name, int64_t start_ns, int64_t end_ns);
+
+    /// The recorded zones of each thread that has recorded any, oldest first
+    static std::vector<std::vector<Event>> get_events();
+
+    /// The recorded zones grouped by name, the most time first
+    static std::vector<ZoneStatistics> get_zone_statistics();
+
+    /// Writes the recorded zones as Chrome trace_event JSON. Returns false if the file could not be written
+    static bool write_chrome_trace(const std::string &file_name);
+
+    /// Prints a table of get_zone_statistics
+    static void print_zone_statistics(std::ostream &out);
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+/// @brief Times its own lifetime as a zone of the profiler. Use it through PROFILE_ZONE
+class ProfileZone {
+public:
+    explicit ProfileZone(const char *name) : name(Profiler::is_enabled() ? name : nullptr), start_ns(0) {
+        if (this->name) {
+            start_ns = Profiler::now_ns();
+        }
+    }
+
+    ~ProfileZone() {
+        if (name) {
+            Profiler::record(name, start_ns, Profiler::now_ns());
+        }
+    }
+
+    ProfileZone(const ProfileZone &) = delete;
+
+    ProfileZone &operator=(const ProfileZone &) = delete;
+
+private:
+    // nullptr if the profiler was disabled when the zone began
+    const char *name;
+    int64_t start_ns;
+};
+
+#define PROFILE_ZONE_CONCATENATE_(a, b) a##b
+#define PROFILE_ZONE_CONCATENATE(a, b) PROFILE_ZONE_CONCATENATE_(a, b)
+
+/// Times the rest of the enclosing scope as a zone of the given name, which must be a string literal
+#ifdef SPH_NO_PROFILER
+#define PROFILE_ZONE(name) ((void) 0)
+#else
+#define PROFILE_ZONE(name) ProfileZone PROFILE_ZONE_CONCATENATE(profile_zone_, __LINE__)(name)
+#endif
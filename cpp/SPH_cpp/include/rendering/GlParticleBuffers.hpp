@@ -0,0 +1,68 @@
+#pragma once
+
+#ifdef _WIN32
+#include "GL/glew.h"
+#endif
+
+#include "GLFW/glfw3.h"
+
+#include "glm/glm.hpp"
+
+#include "ParticleSimulator.hpp"
+#include "OpenCL/OpenClBufferSharing.hpp"
+
+/// @brief The OpenGL side of the particles: position and velocity VBOs with room for the whole particle pool
+/// The simulators know nothing of OpenGL. get_upload_callback() is given to the C++ ones as their particle state
+/// callback, and OpenClParticleSimulator is given the buffers as its OpenClBufferSharing, which shares the VBOs with
+/// OpenCL so that it updates them in place. That needs the OpenCL context to be created while the OpenGL one is
+/// current.
+class GlParticleBuffers : public OpenClBufferSharing {
+public:
+    /// Creates the buffers, which needs a current OpenGL context
+    explicit GlParticleBuffers(unsigned int max_particles);
+
+    ~GlParticleBuffers();
+
+    /// Uploads the particles to the start of the buffers, at most max_particles of them
+    void upload(Span<const glm::vec3> positions, Span<const glm::vec3> velocities);
+
+    /// A particle state callback uploading the particles, valid as long as the buffers
+    ParticleStateCallback get_upload_callback();
+
+    /// Draws the first count particles as points with the currently bound shader program, position at location 0
+    /// and velocity at 1
+    void draw(unsigned int count) const;
+
+    inline GLuint get_positions() const {
+        return vbo_positions;
+    }
+
+    inline GLuint get_velocities() const {
+        return vbo_velocities;
+    }
+
+    const char *get_sharing_extension() const;
+
+    void add_context_properties(cl_platform_id platform, std::vector<cl_context_properties> &properties);
+
+    /// The OpenCL buffers are created from the VBOs
+    void create_buffers(cl_context context, cl_mem &positions, cl_mem &velocities);
+
+    /// Flushes the OpenGL commands, so that they have run before OpenCL uses the VBOs
+    void acquire_buffers(cl_command_queue queue);
+
+    void release_buffers(cl_command_queue queue);
+
+private:
+    GlParticleBuffers(const GlParticleBuffers &) = delete;
+    GlParticleBuffers &operator=(const GlParticleBuffers &) = delete;
+
+    unsigned int capacity;
+
+    GLuint vao = 0;
+    GLuint vbo_positions = 0;
+    GLuint vbo_velocities = 0;
+
+    // The VBOs as OpenCL buffers, once created
+    std::vector<cl_mem> shared_buffers;
+};
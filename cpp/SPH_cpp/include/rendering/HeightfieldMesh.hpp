@@ -0,0 +1,40 @@
+#pragma once
+
+#ifdef _WIN32
+#include "GL/glew.h"
+#endif
+
+#include "GLFW/glfw3.h"
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "ShallowWater.hpp"
+
+/// @brief A triangle mesh of a ShallowWater's surface, one vertex per column
+/// The columns above the active region are left out where the particles are drawn instead, and so are the
+/// columns outside the container
+class HeightfieldMesh {
+public:
+    /// Creates the buffers for the heightfield's columns, which needs a current OpenGL context
+    HeightfieldMesh(const ShallowWater &shallow_water);
+
+    ~HeightfieldMesh();
+
+    /// Uploads the current surface heights and normals
+    void update(const ShallowWater &shallow_water);
+
+    /// Draws the surface with the currently bound shader program, position at location 0 and normal at 1
+    void draw() const;
+
+private:
+    GLuint vao = 0;
+    GLuint vbo_positions = 0;
+    GLuint vbo_normals = 0;
+    GLuint ebo = 0;
+    GLsizei index_count = 0;
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nanogui/nanogui.h"
+
+#include "ParticleSimulator.hpp"
+#include "common/PhaseTimings.hpp"
+
+/// @brief A nanogui window showing where the time of the last frames went, for tuning the parameters interactively
+/// Rolling graphs split each frame into simulate / upload / render / GUI, and a few times a second the window shows
+/// the particle-updates per second, the process' memory, how full the simulator's neighbour grid is and, for the
+/// OpenCL simulator, the device time of the slowest kernels.
+/// The simulator's phases and kernels are only timed while the window is shown, since that makes OpenCL wait after
+/// each phase and create an event for each kernel.
+/// Pausing stops the simulation and the graphs, and a slider then picks the frame whose breakdown is shown.
+class PerformanceHud {
+public:
+    /// The wall-clock time of each part of a frame (s). The upload is split off the simulate time by the HUD, from
+    /// the simulator's "upload" phase
+    struct FrameTimes {
+        double simulate;
+        double render;
+        double gui;
+
+        // The particles the simulation updated, zero while paused
+        unsigned int particle_updates;
+    };
+
+    /// Creates the window, hidden, on the screen
+    PerformanceHud(nanogui::Screen *screen, ParticleSimulator *simulator);
+
+    ~PerformanceHud();
+
+    /// Adds a frame to the graphs, unless paused. Call once per frame, after the GUI is drawn
+    void add_frame(const FrameTimes &frame_times);
+
+    /// Shows or hides the window, timing the simulator's phases and kernels while it is shown
+    void set_visible(bool visible);
+
+    inline bool is_visible() const {
+        return visible;
+    }
+
+    /// The simulation should not be stepped while paused
+    inline bool is_paused() const {
+        return paused;
+    }
+
+private:
+    PerformanceHud(const PerformanceHud &) = delete;
+    PerformanceHud &operator=(const PerformanceHud &) = delete;
+
+    struct Frame {
+        // (s)
+        double simulate;
+        double upload;
+        double render;
+        double gui;
+        unsigned int particle_updates;
+
+        // The simulator's phases in this frame (s)
+        std::vector<std::pair<std::string, double>> phases;
+    };
+
+    /// Sets the graphs to the frames, each scaled to the slowest of its frames
+    void update_graphs();
+
+    /// Refreshes the throughput, memory, grid and kernel labels from the frames since the last refresh
+    void update_statistics();
+
+    /// Shows the breakdown of the frame the inspect slider points at
+    void update_inspected_frame();
+
+    ParticleSimulator *simulator;
+
+    PhaseTimings phase_timings;
+    PhaseTimings kernel_timings;
+
+    bool visible = false;
+    bool paused = false;
+
+    // The last history_length frames, oldest first
+    static const size_t history_length = 240;
+    std::deque<Frame> frames;
+
+    // Since the statistics were last refreshed
+    double refresh_seconds = 0.0;
+    double refresh_updates = 0.0;
+    unsigned int refresh_frames = 0;
+
+    // The frames of this refresh that the kernels were timed in
+    unsigned int kernel_frames = 0;
+
+    // Owned by the screen
+    nanogui::Window *window;
+    nanogui::Graph *frame_graph;
+    nanogui::Graph *simulate_graph;
+    nanogui::Graph *upload_graph;
+    nanogui::Graph *render_graph;
+    nanogui::Graph *gui_graph;
+    nanogui::Label *throughput_label;
+    nanogui::Label *memory_label;
+    nanogui::Label *grid_label;
+    nanogui::Label *grid_cells_label;
+    std::vector<nanogui::Label *> kernel_labels;
+    nanogui::Slider *inspect_slider;
+    std::vector<nanogui::Label *> inspect_labels;
+};
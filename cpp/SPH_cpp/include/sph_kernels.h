@@ -24,4 +24,23 @@ glm::vec3 gradWspiky(glm::vec3 r, float h);
 // Used for Viscosity force
 float laplacianWviscosity(glm::vec3 r, float h);
 
+// Wpoly6 of count offsets at once, w[i] = Wpoly6(r[i], h)
+// The normalisation is found once for the whole batch rather than for every pair
+void Wpoly6(const glm::vec3 *r, float *w, size_t count, float h);
+
+// Gradient of Wspiky of count offsets at once, gradients[i] = gradWspiky(r[i], h)
+void gradWspiky(const glm::vec3 *r, glm::vec3 *gradients, size_t count, float h);
+
+// Density of a particle with a full neighbourhood: a cubic lattice with a spacing of half the kernel size
+// Used as the rest density by the incompressible pressure solvers
+float latticeDensity(float mass, float h);
+
+// Pressure per unit of predicted density error for a particle with a full neighbourhood
+// Used by PCISPH to correct the pressures (Solenthaler & Pajarola 2009, eq. 8)
+float pcisphDelta(float mass, float restDensity, float h, float dt);
+
+// Sum of the squared mass-weighted Wspiky gradients for a particle with a full neighbourhood
+// Used by DFSPH to keep the stiffness of particles with very few neighbours bounded
+float latticeGradientSquaredSum(float mass, float h);
+
 #endif
@@ -23,16 +23,25 @@ typedef struct /*__attribute__ ((packed))*/ def_VoxelGridInfo {
 	float3 grid_origin;
 
 	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
 } VoxelGridInfo;
 
 // Calculate the voxel cell indices (x/y/z) representing the cell that contains the supplied position
 int3 calculate_voxel_cell_indices(const float3 position, const VoxelGridInfo grid_info) {
 	// todo investigate if ceil, floor or round should be used
 	//return convert_int3(ceil((position - grid_info.grid_origin) / grid_info.grid_cell_size));
-	return clamp(convert_int3(floor((position - grid_info.grid_origin) / grid_info.grid_cell_size)), 
-		(int3)(0, 0, 0), // Minimum indices
-		(int3)(convert_int3(grid_info.grid_dimensions) - (int3)(1, 1, 1)) // Maximum indices
-	);
+	const int3 indices = convert_int3(floor((position - grid_info.grid_origin) / grid_info.grid_cell_size));
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+
+	// Clamped into the edge cells, except on the periodic axes, where the positions are wrapped into the grid by
+	// integrate_particle_states and only rounding can leave them a cell outside
+	return select(clamp(indices,
+						(int3)(0, 0, 0), // Minimum indices
+						dimensions - (int3)(1, 1, 1)), // Maximum indices
+				  (indices % dimensions + dimensions) % dimensions,
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
 }
 
 // Calculate the 1D-mapped voxel cell index for the given 3D voxel cell indices (x/y/z)
@@ -43,11 +52,16 @@ uint calculate_voxel_cell_index(const uint3 voxel_cell_indices, const VoxelGridI
 __kernel void calculate_voxel_grid(__global const float *positions, // The position of each particle
 								   __global volatile uint *indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
 								   __global volatile uint *cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
-								   const VoxelGridInfo grid_info
+								   const VoxelGridInfo grid_info,
+								   __global const uint *alive // Non-zero for each alive particle, dead particles are left out of the grid
 ){ 
 	const uint particle_id = get_global_id(0);
 	const uint particle_positions_id = 3 * particle_id;
 
+	if (!alive[particle_id]) {
+		return;
+	}
+
 	const float3 position = (float3)(positions[particle_positions_id], 
 									 positions[particle_positions_id + 1], 
 									 positions[particle_positions_id + 2]);
@@ -0,0 +1,645 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+
+#define zero3 (float3)(0.0f, 0.0f, 0.0f);
+
+__constant float PI = 3.1415926535f;
+__constant float EPSILON = 1e-5;
+
+__constant float DENSITY_MIN = 5000.0f;
+__constant float DENSITY_MAX = 100000.0f;
+
+typedef struct def_VoxelGridInfo {
+	// How many grid cells there are in each dimension (i.e. [x=8 y=8 z=10])
+	uint3 grid_dimensions;
+
+	// How many grid cells there are in total
+	uint total_grid_cells;
+
+	// The size (x/y/z) of each cell
+	float grid_cell_size;
+
+	// The bottom-most corner of the grid, where the grid cell [0 0 0] starts
+	float3 grid_origin;
+
+	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
+} VoxelGridInfo;
+
+typedef struct def_FluidInfo {
+	// The mass of each fluid particle
+	float mass;
+
+	float k_gas;
+	float k_viscosity;
+	float rest_density;
+	float sigma;
+	float k_threshold;
+
+	// Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+	uint surface_neighbour_count;
+
+	float k_wall_damper;
+	float k_wall_friction;
+
+	float3 gravity;
+} FluidInfo;
+
+typedef struct def_SleepInfo {
+	// Counts the simulation steps, compared against each cell's last active step
+	uint step;
+
+	// How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+	uint sleep_step_count;
+
+	// A cell is active while any of its particles is faster than this...
+	float velocity_threshold;
+
+	// ...or while its mean density changes more than this fraction per step
+	float density_threshold;
+} SleepInfo;
+
+// Calculates the euclidean length of the vector r
+float euclidean_distance(const float3 r);
+
+// Calculates the squared euclidean length of the vector r (x^2 + y^2 + z^2)
+float euclidean_distance2(const float3 r);
+
+// The SPH kernel "poly6": used for density- and "color field" calc
+float W_poly6(const float3 r, const float h);
+
+// Gradient of the SPH-kernel "poly6": used for "color field" gradient calc
+float3 gradW_poly6(const float3 r, const float h);
+
+// Laplacian of the SPH-kernel "poly6": used for "color field" laplacian calc
+float laplacianW_poly6(const float3 r, const float h);
+
+// Gradient of the SPH-kernel "spiky": used for pressure force calc
+float3 gradW_spiky(const float3 r, const float h);
+
+// Laplacian of the SPH-kernel "viscosity": used for viscosity force calc
+float laplacianW_viscosity(const float3 r, const float h);
+
+// Map a particle index inside a voxel cell to its global buffer index
+uint get_particle_buffer_index(const uint voxel_cell_index, 
+							   const uint voxel_particle_index, 
+					 		   const uint max_cell_particle_count,
+					 		   __global const uint* restrict indices);
+
+// Get the position of a particle based on its cell index and particle index inside the given cell
+float3 get_particle_position(const uint voxel_cell_index, 
+							 const uint voxel_particle_index, 
+					 		 const uint max_cell_particle_count,
+					 		 __global const uint* restrict indices, 
+					 		 __global const float* restrict positions);
+
+float3 get_particle_velocity(const uint voxel_cell_index, 
+							 const uint voxel_particle_index, 
+					 		 const uint max_cell_particle_count,
+					 		 __global const uint* restrict indices, 
+					 		 __global const float* restrict velocities);
+
+// Calculate the 1D-mapped voxel cell index for the given 3D voxel cell indices (x/y/z)
+uint calculate_voxel_cell_index(const uint3 voxel_cell_indices, const VoxelGridInfo grid_info);
+
+// Calculate the 1D-mapped index of a cell the neighbour search reaches, which may be one outside the grid on the periodic
+// axes. Those cells wrap around to the opposite side, and image_offset moves their particles next to the processed cell
+uint calculate_neighbour_voxel_cell_index(const int3 neighbour_cell_indices,
+										  const VoxelGridInfo grid_info,
+										  float3* image_offset);
+
+// Find the voxel cell processed by this work item: the one at its 3D global id, or with multi-rate timestepping the
+// active_cells entry at its 1D global id. Returns false for the work items past the end of the list
+bool get_processed_voxel_cell(__global const uint* restrict active_cells,
+							  __global const uint* restrict active_cell_count,
+							  const uint use_active_cells,
+							  const VoxelGridInfo grid_info,
+							  uint3* voxel_cell_indices);
+
+// Check if neither the voxel cell nor its neighbours have been active for the last sleep_step_count steps
+bool is_voxel_cell_asleep(const uint voxel_cell_index,
+						  __global const uint* restrict cell_last_active,
+						  const SleepInfo sleep_info);
+
+__kernel void calculate_forces(__global const float* restrict positions, // The position of each particle
+							   __global const float* restrict velocities, // The position of each particle
+							   __global float3* restrict forces, 		 // The force on each particle
+							   __global const float* restrict densities, // The density of each particle. Is [max_cell_particle_count * total_grid_cells] long, since
+																	   // it does NOT need to match up with the particle's global positions/velocities buffers 
+						   	   __global const uint* restrict indices,   // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+						   	   __global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+						   	   const VoxelGridInfo grid_info,
+						   	   const FluidInfo fluid_info,
+						   	   __global const float4* restrict boundary_particles, // Position (xyz) and volume weight (w) of each boundary particle, ordered by voxel cell
+						   	   __global const uint* restrict boundary_cell_start, // Where each voxel cell's boundary particles start. Is [total_grid_cells + 1] long
+						   	   const uint use_boundary_particles,
+						   	   __global const uint* restrict cell_last_active, // The last step each voxel cell or one of its neighbours was active. Is [total_grid_cells] long
+						   	   const SleepInfo sleep_info,
+						   	   __global const uint* restrict neighbour_counts, // How many neighbours each particle has. Is [max_cell_particle_count * total_grid_cells] long, like the densities
+						   	   __global const uint* restrict active_cells, // The voxel cells whose particles take a step this sub-step, with multi-rate timestepping
+						   	   __global const uint* restrict active_cell_count,
+						   	   const uint use_active_cells) {
+	
+	// The particles of the other cells keep the forces of their last step
+	uint3 voxel_cell_indices;
+	if (!get_processed_voxel_cell(active_cells, active_cell_count, use_active_cells, grid_info, &voxel_cell_indices)) {
+		return;
+	}
+
+	const uint voxel_cell_index = calculate_voxel_cell_index(voxel_cell_indices, grid_info);
+	const uint particle_count = cell_particle_count[voxel_cell_index];
+
+	// Sleeping particles are not integrated, so their forces are not needed
+	if (is_voxel_cell_asleep(voxel_cell_index, cell_last_active, sleep_info)) {
+		return;
+	}
+
+	// Store the cumulative forces locally (in private kernel memory) during calc
+	float3 processed_particle_forces[@VOXEL_CELL_PARTICLE_COUNT@];
+	
+	// Store the cumulative colorfield gradient and laplacian locally during calc
+	float3 processed_particle_colorfield_grad[@VOXEL_CELL_PARTICLE_COUNT@];
+	float processed_particle_colorfield_laplacian[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	// Interior particles have a (close to) zero colorfield gradient and get no tension force anyway,
+	// so the colorfield is only evaluated for particles with a partial neighbourhood
+	bool processed_particle_is_surface[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	// Pre-calculate the processed particle's pressure
+	float processed_particle_pressure[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	// Pre-calculate the pressure the boundary particles push back with, p / density (clamped to only push)
+	float processed_particle_boundary_pressure[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	float3 processed_particle_positions[@VOXEL_CELL_PARTICLE_COUNT@];
+	float3 processed_particle_velocities[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	for (uint idp = 0; idp < particle_count; ++idp) {
+		// Pre-store the position of the particle being processed locally (in private memory)
+		processed_particle_positions[idp] = get_particle_position(voxel_cell_index, 
+																  idp, 
+																  grid_info.max_cell_particle_count,
+																  indices,
+																  positions);
+		processed_particle_velocities[idp] = get_particle_velocity(voxel_cell_index, 
+																   idp, 
+																   grid_info.max_cell_particle_count,
+																   indices,
+																   velocities);
+
+		// Pre-calculate the pressure
+		const float processed_particle_density = densities[voxel_cell_index * grid_info.max_cell_particle_count + idp];
+		processed_particle_pressure[idp] = (processed_particle_density - fluid_info.rest_density) * fluid_info.k_gas;
+		processed_particle_boundary_pressure[idp] = fmax(processed_particle_pressure[idp], 0.0f) / fmax(processed_particle_density, EPSILON);
+
+		// Initialize the force sum and all colorfield sums to zeroes
+		processed_particle_forces[idp] = (float3)(0.0f, 0.0f, 0.0f);
+
+		processed_particle_colorfield_grad[idp] = (float3)(0.0f, 0.0f, 0.0f);
+		processed_particle_colorfield_laplacian[idp] = 0.0f;
+
+		processed_particle_is_surface[idp] = 
+			neighbour_counts[voxel_cell_index * grid_info.max_cell_particle_count + idp] < fluid_info.surface_neighbour_count;
+	}
+
+	// Pre-define this before x*y*z loop
+	const int3 max_cell_indices = convert_int3(grid_info.grid_dimensions) - (int3)(1, 1, 1);
+
+	// Pre-declare memory for relative position, for speeeeeeeeeeeed
+	float3 relative_position = (float3)(0.0f, 0.0f, 0.0f);
+
+	// Loop through all voxel cells around the currently processed voxel cell
+	// todo optimize these for-loops and voxel cell index generation
+	for (int d_idx = -1; d_idx <= 1; ++d_idx) {
+		
+		// Check if the x-index lies outside the voxel grid, the periodic axes wrap around instead
+		const int idx = convert_int(voxel_cell_indices.x) + d_idx;
+		if (grid_info.periodic_axes.x || idx == clamp(idx, 0, max_cell_indices.x)) {
+			for (int d_idy = -1; d_idy <= 1; ++d_idy) {
+
+				// Check if the x-index lies outside the voxel grid
+				const int idy = convert_int(voxel_cell_indices.y) + d_idy;
+				if (grid_info.periodic_axes.y || idy == clamp(idy, 0, max_cell_indices.y)) {
+					for (int d_idz = -1; d_idz <= 1; ++d_idz) {
+
+						// Check if the x-index lies outside the voxel grid
+						const int idz = convert_int(voxel_cell_indices.z) + d_idz;
+						if (grid_info.periodic_axes.z || idz == clamp(idz, 0, max_cell_indices.z)) {
+							float3 image_offset;
+							const uint current_voxel_cell_index = calculate_neighbour_voxel_cell_index((int3)(idx, idy, idz), grid_info, &image_offset);
+							const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+							// Iterate through this cell's particles
+							for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+								// LOOK HERE:
+								// The below line is the reason the nested loops are the way they are:
+								//
+								// Since the position of a particle is NOT located within the grid cell, each time we want to use the position
+								// of a particle we have to calculate its global buffer index and retrieve it that way. This is a slow operation.
+								// So instead of having the outer-most loop be over each particle in the current voxel we loop through the voxels
+								// This way we only need to fetch the position of each particle in the neighbouring cells ONCE. :D
+								const float3 position = get_particle_position(current_voxel_cell_index, 
+																			  idp,
+																			  grid_info.max_cell_particle_count,
+																			  indices,
+																			  positions) + image_offset;
+								const float3 velocity = get_particle_velocity(current_voxel_cell_index, 
+																			  idp,
+																			  grid_info.max_cell_particle_count,
+																			  indices,
+																			  velocities);
+
+								const float density = clamp(densities[voxel_cell_index * grid_info.max_cell_particle_count + idp], DENSITY_MIN, DENSITY_MAX);
+								//const float density = 6000.0f;
+								const float pressure = (density - fluid_info.rest_density) * fluid_info.k_gas;
+
+								// Pre-calc colorfield constant used in all three colorfield calculations
+								const float c_colorfield = fluid_info.mass / density;
+
+								for (uint processed_particle_id = 0; processed_particle_id < particle_count; ++processed_particle_id) {
+									/** Calculate the current particle's force contributions to the processed particle based on the 'idp' **/
+									// todo investigate if any values can be pre-calculated outside this loop
+									relative_position = processed_particle_positions[processed_particle_id] - position;
+
+									/* Pressure force */
+									processed_particle_forces[processed_particle_id] = processed_particle_forces[processed_particle_id] -
+										fluid_info.mass * ( (pressure + processed_particle_pressure[processed_particle_id]) / (2 * density) ) * gradW_spiky(relative_position, grid_info.grid_cell_size);
+
+									/* Viscosity force */
+									processed_particle_forces[processed_particle_id] = processed_particle_forces[processed_particle_id] + 
+									fluid_info.k_viscosity * fluid_info.mass * ( 1 / density ) * laplacianW_viscosity(relative_position, grid_info.grid_cell_size) * (velocity - processed_particle_velocities[processed_particle_id]);
+
+									/* Color field contribution */
+									if (processed_particle_is_surface[processed_particle_id]) {
+										processed_particle_colorfield_grad[processed_particle_id] = processed_particle_colorfield_grad[processed_particle_id] + 
+											c_colorfield * gradW_poly6(relative_position, grid_info.grid_cell_size);
+										
+										processed_particle_colorfield_laplacian[processed_particle_id] = processed_particle_colorfield_laplacian[processed_particle_id] + 
+											c_colorfield * laplacianW_poly6(relative_position, grid_info.grid_cell_size);
+									}
+								}
+							}
+
+							// Static boundary particles push back with the processed particle's own pressure (Akinci et al. 2012)
+							if (use_boundary_particles) {
+								const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+								for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+									const float4 boundary_particle = boundary_particles[idb];
+
+									for (uint processed_particle_id = 0; processed_particle_id < particle_count; ++processed_particle_id) {
+										relative_position = processed_particle_positions[processed_particle_id] - (boundary_particle.xyz + image_offset);
+
+										processed_particle_forces[processed_particle_id] = processed_particle_forces[processed_particle_id] -
+											boundary_particle.w * processed_particle_boundary_pressure[processed_particle_id] * gradW_spiky(relative_position, grid_info.grid_cell_size);
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Final calculation and storage of each processed particle
+	for (uint idp = 0; idp < particle_count; ++idp) {
+		/* See if tension force should be applied for each particle */
+		const float colorfield_grad_length = euclidean_distance2(processed_particle_colorfield_grad[idp]);
+		if (colorfield_grad_length >= pow(fluid_info.k_threshold, 2)) {
+			processed_particle_forces[idp] = processed_particle_forces[idp] - 
+				fluid_info.sigma * processed_particle_colorfield_laplacian[idp] * processed_particle_colorfield_grad[idp] / colorfield_grad_length;
+		}
+	    
+	    processed_particle_forces[idp] = processed_particle_forces[idp];
+
+		// The global force buffer array is simply linear with the particles in no particular order
+		// To retrieve the correct index for a particle in a particular voxel cell we have to call our special function :)
+		const uint particle_force_index = get_particle_buffer_index(voxel_cell_index,
+																		idp,
+																		grid_info.max_cell_particle_count,
+																		indices);
+		
+		forces[particle_force_index].x = processed_particle_forces[idp].x;
+		forces[particle_force_index].y = processed_particle_forces[idp].y;
+		forces[particle_force_index].z = processed_particle_forces[idp].z;
+	}
+}
+
+__kernel void calculate_particle_densities(__global const float* restrict positions, // The position of each particle
+											     __global float* restrict out_densities,   // The density of each particle. Is [max_cell_particle_count * total_grid_cells] long, since
+											 											   // it does NOT need to match up with the particle's global positions/velocities buffers 
+										   	     __global const uint* restrict indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+										   	     __global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+										   	     const VoxelGridInfo grid_info,
+										   	     const FluidInfo fluid_info,
+										   	     __global const float4* restrict boundary_particles, // Position (xyz) and volume weight (w) of each boundary particle, ordered by voxel cell
+										   	     __global const uint* restrict boundary_cell_start, // Where each voxel cell's boundary particles start. Is [total_grid_cells + 1] long
+										   	     const uint use_boundary_particles,
+										   	     __global const uint* restrict cell_last_active, // The last step each voxel cell or one of its neighbours was active. Is [total_grid_cells] long
+										   	     const SleepInfo sleep_info,
+										   	     __global float* restrict particle_densities, // The density of each particle, in global particle order. Is [max_particles] long
+										   	     __global float* restrict cell_mean_densities, // The mean density of each voxel cell's particles. Is [total_grid_cells] long
+										   	     __global float* restrict cell_density_changes, // How much each voxel cell's mean density changed. Is [total_grid_cells] long
+										   	     __global uint* restrict out_neighbour_counts, // How many neighbours each particle has. Is [max_cell_particle_count * total_grid_cells] long, like the densities
+										   	     __global const uint* restrict active_cells, // The voxel cells whose particles take a step this sub-step, with multi-rate timestepping
+										   	     __global const uint* restrict active_cell_count,
+										   	     const uint use_active_cells) {
+	// Only the force pass of the same cell reads these densities, and it skips the same cells
+	uint3 voxel_cell_indices;
+	if (!get_processed_voxel_cell(active_cells, active_cell_count, use_active_cells, grid_info, &voxel_cell_indices)) {
+		return;
+	}
+
+	const uint voxel_cell_index = calculate_voxel_cell_index(voxel_cell_indices, grid_info);
+	const uint particle_count = cell_particle_count[voxel_cell_index];
+
+	// Sleeping particles keep their last density, but the grid rebuild may have shuffled them within the cell
+	if (is_voxel_cell_asleep(voxel_cell_index, cell_last_active, sleep_info)) {
+		for (uint idp = 0; idp < particle_count; ++idp) {
+			out_densities[voxel_cell_index * grid_info.max_cell_particle_count + idp] = 
+				particle_densities[get_particle_buffer_index(voxel_cell_index, idp, grid_info.max_cell_particle_count, indices)];
+		}
+
+		cell_density_changes[voxel_cell_index] = 0.0f;
+		return;
+	}
+
+	// Store the densities locally (in private kernel memory) during calculation
+	float processed_particle_densities[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	// Counting the neighbours is a cheap way to find the particles near the surface
+	uint processed_particle_neighbour_counts[@VOXEL_CELL_PARTICLE_COUNT@];
+
+	// Pre-store the positions of the particles being processed locally (in private memory)
+	float3 processed_particle_positions[@VOXEL_CELL_PARTICLE_COUNT@];
+	for (uint idp = 0; idp < particle_count; ++idp) {
+		processed_particle_positions[idp] = get_particle_position(voxel_cell_index, 
+																  idp, 
+																  grid_info.max_cell_particle_count,
+																  indices,
+																  positions);
+		processed_particle_densities[idp] = 0.0f;
+		processed_particle_neighbour_counts[idp] = 0;
+	}
+
+	const float kernel_size2 = grid_info.grid_cell_size * grid_info.grid_cell_size;
+
+	// Pre-define this before x*y*z loop
+	const int3 max_cell_indices = convert_int3(grid_info.grid_dimensions) - (int3)(1, 1, 1);
+
+	// Loop through all voxel cells around the currently processed voxel cell
+	// todo optimize these for-loops and voxel cell index generation
+	for (int d_idx = -1; d_idx <= 1; ++d_idx) {
+
+		// Check if the x-index lies outside the voxel grid, the periodic axes wrap around instead
+		const int idx = convert_int(voxel_cell_indices.x) + d_idx;
+		if (grid_info.periodic_axes.x || idx == clamp(idx, 0, max_cell_indices.x)) {
+			for (int d_idy = -1; d_idy <= 1; ++d_idy) {
+
+				// Check if the x-index lies outside the voxel grid
+				const int idy = convert_int(voxel_cell_indices.y) + d_idy;
+				if (grid_info.periodic_axes.y || idy == clamp(idy, 0, max_cell_indices.y)) {
+					for (int d_idz = -1; d_idz <= 1; ++d_idz) {
+
+						// Check if the x-index lies outside the voxel grid
+						const int idz = convert_int(voxel_cell_indices.z) + d_idz;
+						if (grid_info.periodic_axes.z || idz == clamp(idz, 0, max_cell_indices.z)) {
+							float3 image_offset;
+							const uint current_voxel_cell_index = calculate_neighbour_voxel_cell_index((int3)(idx, idy, idz), grid_info, &image_offset);
+							const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+							// Iterate through this cell's particles
+							for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+								// LOOK HERE:
+								// The below line is the reason the nested loops are the way they are:
+								//
+								// Since the position of a particle is NOT located within the grid cell, each time we want to use the position
+								// of a particle we have to calculate its global buffer index and retrieve it that way. This is a slow operation.
+								// So instead of having the outer-most loop be over each particle in the current voxel we loop through the voxels
+								// This way we only need to fetch the position of each particle in the neighbouring cells ONCE. :D
+								const float3 position = get_particle_position(current_voxel_cell_index, 
+																			  idp,
+																			  grid_info.max_cell_particle_count,
+																			  indices,
+																			  positions) + image_offset;
+
+								for (uint processed_particle_id = 0; processed_particle_id < particle_count; ++processed_particle_id) {
+									const float3 relative_position = processed_particle_positions[processed_particle_id] - position;
+
+									// Calculate and apply the processed particle's density based on the 'idp'
+									processed_particle_densities[processed_particle_id] = processed_particle_densities[processed_particle_id] 
+										+ fluid_info.mass * W_poly6(relative_position, grid_info.grid_cell_size);
+
+									if (euclidean_distance2(relative_position) < kernel_size2) {
+										++processed_particle_neighbour_counts[processed_particle_id];
+									}
+								}
+							}
+
+							// Static boundary particles contribute with their volume weight instead of a mass
+							if (use_boundary_particles) {
+								const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+								for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+									const float4 boundary_particle = boundary_particles[idb];
+
+									for (uint processed_particle_id = 0; processed_particle_id < particle_count; ++processed_particle_id) {
+										const float3 relative_position = processed_particle_positions[processed_particle_id] - (boundary_particle.xyz + image_offset);
+
+										processed_particle_densities[processed_particle_id] = processed_particle_densities[processed_particle_id]
+											+ boundary_particle.w * W_poly6(relative_position, grid_info.grid_cell_size);
+
+										// The walls fill up the neighbourhood as well, they are not a free surface
+										if (euclidean_distance2(relative_position) < kernel_size2) {
+											++processed_particle_neighbour_counts[processed_particle_id];
+										}
+									}
+								}
+							}
+						}	
+					}
+				}
+			}
+		}
+	}
+
+	// Move the privately stored densities to global memory
+	float density_sum = 0.0f;
+	for (uint idp = 0; idp < particle_count; ++idp) {
+		// The global density buffer array is simply linear with the particles in no particular order
+		// To retrieve the correct index for a particle in a particular voxel cell we have to call our special function :)
+
+		out_densities[voxel_cell_index * grid_info.max_cell_particle_count + idp] = processed_particle_densities[idp];
+		out_neighbour_counts[voxel_cell_index * grid_info.max_cell_particle_count + idp] = processed_particle_neighbour_counts[idp];
+
+		//out_densities[voxel_cell_index * grid_info.max_cell_particle_count + idp]
+		//	= clamp(processed_particle_densities[idp], DENSITY_MIN, DENSITY_MAX);
+
+		density_sum += processed_particle_densities[idp];
+	}
+
+	// Keep what sleeping needs: the densities in particle order, and how much the cell's mean density changed
+	if (sleep_info.sleep_step_count > 0 && particle_count > 0) {
+		for (uint idp = 0; idp < particle_count; ++idp) {
+			particle_densities[get_particle_buffer_index(voxel_cell_index, idp, grid_info.max_cell_particle_count, indices)] = 
+				processed_particle_densities[idp];
+		}
+
+		const float mean_density = density_sum / particle_count;
+		cell_density_changes[voxel_cell_index] = fabs(mean_density - cell_mean_densities[voxel_cell_index]) / 
+			fmax(mean_density, fluid_info.rest_density);
+		cell_mean_densities[voxel_cell_index] = mean_density;
+	}
+}
+
+float euclidean_distance2(const float3 r) {
+	return r.x * r.x + r.y * r.y + r.z * r.z;
+}
+
+float euclidean_distance(const float3 r) {
+	return sqrt(r.x * r.x + r.y * r.y + r.z * r.z);
+}
+
+float W_poly6(const float3 r, const float h) {
+	const float tmp = h * h - euclidean_distance2(r);
+	if (tmp < EPSILON) {
+		return 0.0f;
+	}
+
+	return ( 315.0f / (64.0f * PI * pow(h,9)) ) * pow((tmp), 3);
+}
+
+float3 gradW_poly6(const float3 r, const float h) {
+	const float radius2 = euclidean_distance2(r);
+	if (radius2 >= h * h) {
+		return zero3;
+	}
+	if (radius2 <= EPSILON) {
+		return zero3;
+	}
+
+	const float kernel_constant = - (315 /(64 * PI * pow(h, 9))) * 6 * pow((h * h - euclidean_distance2(r)), 2);
+	return (float3)(kernel_constant * r.x,
+					kernel_constant * r.y,
+					kernel_constant * r.z);
+}
+
+float laplacianW_poly6(const float3 r, const float h) {
+	const float radius2 = euclidean_distance2(r);
+	if (radius2 >= h*h) {
+		return 0.0f;
+	}
+
+	// todo maybe pre-calculate h^2 - radius2 since it is used 2 times? then again, maybe not...
+	return (315 / (64 * PI * pow(h, 9))) * (24 * radius2 * (pow(h, 2) - radius2) - 6 * pow((pow(h, 2) - radius2), 2));
+}
+
+float3 gradW_spiky(const float3 r, const float h) {
+	const float radius2 = euclidean_distance2(r);
+	if (radius2 >= h * h) {
+		return zero3;
+	}
+	if (radius2 <= EPSILON) {
+		return zero3;
+	}
+
+	const float radius = sqrt(radius2);
+	const float kernel_constant = - (15 / (PI * pow(h, 6))) * 3 * pow(h - radius, 2) / radius;
+
+	return (float3)(kernel_constant * r.x, 
+				   	kernel_constant * r.y, 
+				   	kernel_constant * r.z);
+}
+
+float laplacianW_viscosity(const float3 r, const float h) {
+	const float tmp = h - euclidean_distance(r);
+	if (tmp <= 0.0f) {
+		return 0.0f;
+	}
+
+	return (45 / (PI * pow(h, 6))) * (h - euclidean_distance(r));
+}
+
+uint calculate_voxel_cell_index(const uint3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	return voxel_cell_indices.x + grid_info.grid_dimensions.x * (voxel_cell_indices.y + grid_info.grid_dimensions.y * voxel_cell_indices.z);
+}
+
+uint calculate_neighbour_voxel_cell_index(const int3 neighbour_cell_indices,
+										  const VoxelGridInfo grid_info,
+										  float3* image_offset) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const int3 wrapped_indices = (neighbour_cell_indices + dimensions) % dimensions;
+
+	// The particles are wrapped into the grid, so shifting them by the cells skipped across the edge is the
+	// minimum image, and saves doing it per particle pair
+	*image_offset = convert_float3(neighbour_cell_indices - wrapped_indices) * grid_info.grid_cell_size;
+
+	return calculate_voxel_cell_index(convert_uint3(wrapped_indices), grid_info);
+}
+
+bool get_processed_voxel_cell(__global const uint* restrict active_cells,
+							  __global const uint* restrict active_cell_count,
+							  const uint use_active_cells,
+							  const VoxelGridInfo grid_info,
+							  uint3* voxel_cell_indices) {
+	if (!use_active_cells) {
+		*voxel_cell_indices = (uint3)(get_global_id(0), get_global_id(1), get_global_id(2));
+		return true;
+	}
+
+	if (get_global_id(0) >= active_cell_count[0]) {
+		return false;
+	}
+
+	const uint voxel_cell_index = active_cells[get_global_id(0)];
+	const uint cells_per_layer = grid_info.grid_dimensions.x * grid_info.grid_dimensions.y;
+
+	*voxel_cell_indices = (uint3)(voxel_cell_index % grid_info.grid_dimensions.x,
+								  (voxel_cell_index % cells_per_layer) / grid_info.grid_dimensions.x,
+								  voxel_cell_index / cells_per_layer);
+	return true;
+}
+
+bool is_voxel_cell_asleep(const uint voxel_cell_index,
+						  __global const uint* restrict cell_last_active,
+						  const SleepInfo sleep_info) {
+	return sleep_info.sleep_step_count > 0 && 
+		sleep_info.step - cell_last_active[voxel_cell_index] >= sleep_info.sleep_step_count;
+}
+
+uint get_particle_buffer_index(const uint voxel_cell_index, 
+							   const uint voxel_particle_index, 
+					 		   const uint max_cell_particle_count,
+					 		   __global const uint* restrict indices) {
+	return indices[voxel_cell_index * max_cell_particle_count + voxel_particle_index];
+}
+
+float3 get_particle_position(const uint voxel_cell_index, 
+							 const uint voxel_particle_index, 
+					 		 const uint max_cell_particle_count,
+					 		 __global const uint* restrict indices, 
+					 		 __global const float* restrict positions) {
+	const uint particle_position_index = 3 * get_particle_buffer_index(voxel_cell_index, 
+																  voxel_particle_index, 
+																  max_cell_particle_count, 
+																  indices);
+
+	return (float3)(positions[particle_position_index], 
+					positions[particle_position_index + 1], 
+					positions[particle_position_index + 2]);
+}
+
+float3 get_particle_velocity(const uint voxel_cell_index, 
+							 const uint voxel_particle_index, 
+					 		 const uint max_cell_particle_count,
+					 		 __global const uint* restrict indices, 
+					 		 __global const float* restrict velocities) {
+	const uint particle_position_index = 3 * get_particle_buffer_index(voxel_cell_index, 
+																	   voxel_particle_index, 
+																	   max_cell_particle_count, 
+																	   indices);
+
+	return (float3)(velocities[particle_position_index], 
+					velocities[particle_position_index + 1], 
+					velocities[particle_position_index + 2]);
+}
\ No newline at end of file
@@ -0,0 +1,440 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+
+#define zero3 (float3)(0.0f, 0.0f, 0.0f);
+
+__constant float EPSILON = 1e-5;
+__constant float PI = 3.1415926535f;
+#define MAX_VEL 5.0f
+__constant float3 VELOCITY_CLAMP = (float3)(MAX_VEL, MAX_VEL, MAX_VEL);
+
+// Which constraint calculate_dfsph_stiffness corrects
+#define SOLVE_DIVERGENCE 0
+#define SOLVE_DENSITY 1
+
+typedef struct def_FluidInfo {
+	// The mass of each fluid particle
+	float mass;
+
+	float k_gas;
+	float k_viscosity;
+	float rest_density;
+	float sigma;
+	float k_threshold;
+
+	// Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+	uint surface_neighbour_count;
+
+	float k_wall_damper;
+	float k_wall_friction;
+
+	float3 gravity;
+} FluidInfo;
+
+typedef struct def_VoxelGridInfo {
+	// How many grid cells there are in each dimension (i.e. [x=8 y=8 z=10])
+	uint3 grid_dimensions;
+
+	// How many grid cells there are in total
+	uint total_grid_cells;
+
+	// The size (x/y/z) of each cell
+	float grid_cell_size;
+
+	// The bottom-most corner of the grid, where the grid cell [0 0 0] starts
+	float3 grid_origin;
+
+	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
+} VoxelGridInfo;
+
+typedef struct def_SleepInfo {
+	// Counts the simulation steps, compared against each cell's last active step
+	uint step;
+
+	// How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+	uint sleep_step_count;
+
+	// A cell is active while any of its particles is faster than this...
+	float velocity_threshold;
+
+	// ...or while its mean density changes more than this fraction per step
+	float density_threshold;
+} SleepInfo;
+
+typedef struct def_SolverInfo {
+	// The density the incompressible solvers keep, that of a particle with a full neighbourhood
+	float rest_density;
+
+	// Scales the boundary particle volume weights, which are for FluidInfo::rest_density
+	float boundary_scale;
+
+	// The smallest DFSPH factor denominator, so that nearly overlapping particles get a bounded stiffness
+	float min_denominator;
+
+	float dt;
+
+	// The largest velocity change a single pressure correction may give a particle
+	float max_velocity_change;
+
+	// The density errors are summed as fixed point numbers with this many steps per unit
+	float error_scale;
+} SolverInfo;
+
+float euclidean_distance2(const float3 r) {
+	return r.x * r.x + r.y * r.y + r.z * r.z;
+}
+
+float euclidean_distance(const float3 r) {
+	return sqrt(r.x * r.x + r.y * r.y + r.z * r.z);
+}
+
+float W_poly6(const float3 r, const float h) {
+	const float tmp = h * h - euclidean_distance2(r);
+	if (tmp < EPSILON) {
+		return 0.0f;
+	}
+
+	return ( 315.0f / (64.0f * PI * pow(h,9)) ) * pow((tmp), 3);
+}
+
+float3 gradW_spiky(const float3 r, const float h) {
+	const float radius2 = euclidean_distance2(r);
+	if (radius2 >= h * h) {
+		return zero3;
+	}
+	if (radius2 <= EPSILON) {
+		return zero3;
+	}
+
+	const float radius = sqrt(radius2);
+	const float kernel_constant = - (15 / (PI * pow(h, 6))) * 3 * pow(h - radius, 2) / radius;
+
+	return (float3)(kernel_constant * r.x,
+				   	kernel_constant * r.y,
+				   	kernel_constant * r.z);
+}
+
+// The 3D indices of the voxel cell containing the position, the same way calculate_voxel_grid finds them
+int3 calculate_voxel_cell_indices(const float3 position, const VoxelGridInfo grid_info) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const int3 indices = convert_int3(floor((position - grid_info.grid_origin) / grid_info.grid_cell_size));
+
+	return select(clamp(indices, (int3)(0, 0, 0), dimensions - (int3)(1, 1, 1)),
+				  (indices % dimensions + dimensions) % dimensions,
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+// Cells one outside the grid, which the neighbour searches reach on the periodic axes, wrap around to the opposite side
+uint calculate_voxel_cell_index(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const uint3 wrapped_indices = convert_uint3((voxel_cell_indices + dimensions) % dimensions);
+
+	return wrapped_indices.x + grid_info.grid_dimensions.x * (wrapped_indices.y + grid_info.grid_dimensions.y * wrapped_indices.z);
+}
+
+// The first and last cells of the neighbour search around the given one, which go past the edges on the periodic axes
+int3 calculate_min_neighbour_cell_indices(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 min_indices = voxel_cell_indices - (int3)(1, 1, 1);
+	return select(max(min_indices, (int3)(0, 0, 0)), min_indices, grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+int3 calculate_max_neighbour_cell_indices(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 max_indices = voxel_cell_indices + (int3)(1, 1, 1);
+	return select(min(max_indices, convert_int3(grid_info.grid_dimensions) - (int3)(1, 1, 1)), max_indices,
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+// The vector from b to a, through the periodic boundaries when that is shorter (the minimum image)
+float3 calculate_relative_position(const float3 a, const float3 b, const VoxelGridInfo grid_info) {
+	const float3 relative_position = a - b;
+	const float3 period = convert_float3(grid_info.grid_dimensions) * grid_info.grid_cell_size;
+
+	return select(relative_position, relative_position - period * rint(relative_position / period),
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+bool is_voxel_cell_asleep(const uint voxel_cell_index,
+						  __global const uint* restrict cell_last_active,
+						  const SleepInfo sleep_info) {
+	return sleep_info.sleep_step_count > 0 &&
+		sleep_info.step - cell_last_active[voxel_cell_index] >= sleep_info.sleep_step_count;
+}
+
+float3 read_float3(__global const float* restrict buffer, const uint particle_id) {
+	return (float3)(buffer[3 * particle_id], buffer[3 * particle_id + 1], buffer[3 * particle_id + 2]);
+}
+
+// Finds each particle's density and the factor turning a density error into a stiffness (Bender & Koschier 2015)
+// Runs per particle, unlike calculate_particle_densities, since the solver works in particle order
+__kernel void calculate_dfsph_factors(__global const float* restrict positions,
+									  __global const uint* restrict alive,
+									  __global const uint* restrict indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+									  __global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+									  const VoxelGridInfo grid_info,
+									  const FluidInfo fluid_info,
+									  __global const float4* restrict boundary_particles, // Position (xyz) and volume weight (w) of each boundary particle, ordered by voxel cell
+									  __global const uint* restrict boundary_cell_start, // Where each voxel cell's boundary particles start. Is [total_grid_cells + 1] long
+									  const uint use_boundary_particles,
+									  __global const uint* restrict cell_last_active, // The last step each voxel cell or one of its neighbours was active. Is [total_grid_cells] long
+									  const SleepInfo sleep_info,
+									  const SolverInfo solver_info,
+									  __global float* restrict solver_densities, // The density of each particle. Is [max_particles] long
+									  __global float* restrict solver_factors) { // The DFSPH factor of each particle, zero for the ones left alone. Is [max_particles] long
+	const uint particle_id = get_global_id(0);
+
+	if (!alive[particle_id]) {
+		solver_factors[particle_id] = 0.0f;
+		return;
+	}
+
+	const float3 position = read_float3(positions, particle_id);
+	const int3 voxel_cell_indices = calculate_voxel_cell_indices(position, grid_info);
+
+	// Sleeping particles are at rest, and still divide their zero stiffness by a density when their awake neighbours
+	// are corrected
+	if (is_voxel_cell_asleep(calculate_voxel_cell_index(voxel_cell_indices, grid_info), cell_last_active, sleep_info)) {
+		solver_densities[particle_id] = solver_info.rest_density;
+		solver_factors[particle_id] = 0.0f;
+		return;
+	}
+
+	const float h = grid_info.grid_cell_size;
+	float density = 0.0f;
+	float3 gradient_sum = (float3)(0.0f, 0.0f, 0.0f);
+	float gradient_squared_sum = 0.0f;
+
+	const int3 min_cell_indices = calculate_min_neighbour_cell_indices(voxel_cell_indices, grid_info);
+	const int3 max_cell_indices = calculate_max_neighbour_cell_indices(voxel_cell_indices, grid_info);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint current_voxel_cell_index = calculate_voxel_cell_index((int3)(idx, idy, idz), grid_info);
+				const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+				for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+					const uint neighbour_id = indices[current_voxel_cell_index * grid_info.max_cell_particle_count + idp];
+					const float3 relative_position = calculate_relative_position(position, read_float3(positions, neighbour_id), grid_info);
+					const float3 gradient = fluid_info.mass * gradW_spiky(relative_position, h);
+
+					density += fluid_info.mass * W_poly6(relative_position, h);
+					gradient_sum += gradient;
+					gradient_squared_sum += dot(gradient, gradient);
+				}
+
+				// The boundary particles only take part in the sum, since they do not move
+				if (use_boundary_particles) {
+					const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+					for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+						const float4 boundary_particle = boundary_particles[idb];
+						const float3 relative_position = calculate_relative_position(position, boundary_particle.xyz, grid_info);
+						const float volume = solver_info.boundary_scale * boundary_particle.w;
+
+						density += volume * W_poly6(relative_position, h);
+						gradient_sum += volume * gradW_spiky(relative_position, h);
+					}
+				}
+			}
+		}
+	}
+
+	const float denominator = dot(gradient_sum, gradient_sum) + gradient_squared_sum;
+
+	solver_densities[particle_id] = density;
+	solver_factors[particle_id] = density / fmax(denominator, solver_info.min_denominator);
+}
+
+// Calculates each particle's stiffness increment from how much the current velocities compress the fluid,
+// either from the density change (SOLVE_DIVERGENCE) or the predicted density (SOLVE_DENSITY)
+// Only compression is corrected, so that the free surface does not pull the fluid together
+__kernel void calculate_dfsph_stiffness(__global const float* restrict positions,
+										__global const float* restrict velocities,
+										__global const uint* restrict alive,
+										__global const uint* restrict indices,
+										__global const uint* restrict cell_particle_count,
+										const VoxelGridInfo grid_info,
+										const FluidInfo fluid_info,
+										__global const float4* restrict boundary_particles,
+										__global const uint* restrict boundary_cell_start,
+										const uint use_boundary_particles,
+										const SolverInfo solver_info,
+										__global const float* restrict solver_densities,
+										__global const float* restrict solver_factors,
+										__global float* restrict stiffness_increments, // This iteration's stiffness of each particle. Is [max_particles] long
+										__global float* restrict stiffness,            // The summed stiffness of each particle, kept for the warm start. Is [max_particles] long
+										__global volatile uint* solver_error,          // The summed density error of this iteration, in fixed point
+										const uint solve_mode) {
+	const uint particle_id = get_global_id(0);
+	const float factor = solver_factors[particle_id];
+
+	// Dead and sleeping particles have a zero factor
+	if (factor == 0.0f) {
+		stiffness_increments[particle_id] = 0.0f;
+		return;
+	}
+
+	const float3 position = read_float3(positions, particle_id);
+	const float3 velocity = read_float3(velocities, particle_id);
+	const int3 voxel_cell_indices = calculate_voxel_cell_indices(position, grid_info);
+	const float h = grid_info.grid_cell_size;
+
+	float density_change = 0.0f;
+
+	const int3 min_cell_indices = calculate_min_neighbour_cell_indices(voxel_cell_indices, grid_info);
+	const int3 max_cell_indices = calculate_max_neighbour_cell_indices(voxel_cell_indices, grid_info);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint current_voxel_cell_index = calculate_voxel_cell_index((int3)(idx, idy, idz), grid_info);
+				const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+				for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+					const uint neighbour_id = indices[current_voxel_cell_index * grid_info.max_cell_particle_count + idp];
+
+					density_change += fluid_info.mass * dot(velocity - read_float3(velocities, neighbour_id),
+						gradW_spiky(calculate_relative_position(position, read_float3(positions, neighbour_id), grid_info), h));
+				}
+
+				if (use_boundary_particles) {
+					const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+					for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+						const float4 boundary_particle = boundary_particles[idb];
+
+						density_change += solver_info.boundary_scale * boundary_particle.w *
+							dot(velocity, gradW_spiky(calculate_relative_position(position, boundary_particle.xyz, grid_info), h));
+					}
+				}
+			}
+		}
+	}
+
+	float density_error;
+	float stiffness_increment;
+
+	if (solve_mode == SOLVE_DIVERGENCE) {
+		const float compression = fmax(density_change, 0.0f);
+		density_error = compression * solver_info.dt;
+		stiffness_increment = compression / solver_info.dt * factor;
+	} else {
+		// The density the particle would get by moving with its current velocity
+		const float predicted_density = solver_densities[particle_id] + solver_info.dt * density_change;
+		density_error = fmax(predicted_density - solver_info.rest_density, 0.0f);
+		stiffness_increment = density_error / (solver_info.dt * solver_info.dt) * factor;
+	}
+
+	stiffness_increments[particle_id] = stiffness_increment;
+	stiffness[particle_id] += stiffness_increment;
+
+	// There are no atomic float additions, so the relative errors are summed in fixed point
+	atomic_add(solver_error, convert_uint_sat(density_error / solver_info.rest_density * solver_info.error_scale));
+}
+
+// Changes the velocities by the pressure accelerations of the given stiffnesses
+// The changes only depend on the positions, so every particle can be updated in place
+__kernel void apply_dfsph_stiffness(__global const float* restrict positions,
+									__global float* restrict velocities,
+									__global const uint* restrict indices,
+									__global const uint* restrict cell_particle_count,
+									const VoxelGridInfo grid_info,
+									const FluidInfo fluid_info,
+									__global const float4* restrict boundary_particles,
+									__global const uint* restrict boundary_cell_start,
+									const uint use_boundary_particles,
+									const SolverInfo solver_info,
+									__global const float* restrict solver_densities,
+									__global const float* restrict solver_factors,
+									__global const float* restrict stiffness,
+									__global uint* restrict limited_particles) {
+	const uint particle_id = get_global_id(0);
+
+	// Dead and sleeping particles have a zero factor
+	if (solver_factors[particle_id] == 0.0f) {
+		return;
+	}
+
+	const float3 position = read_float3(positions, particle_id);
+	const int3 voxel_cell_indices = calculate_voxel_cell_indices(position, grid_info);
+	const float h = grid_info.grid_cell_size;
+	const float particle_stiffness = stiffness[particle_id] / solver_densities[particle_id];
+
+	float3 velocity_change = (float3)(0.0f, 0.0f, 0.0f);
+
+	const int3 min_cell_indices = calculate_min_neighbour_cell_indices(voxel_cell_indices, grid_info);
+	const int3 max_cell_indices = calculate_max_neighbour_cell_indices(voxel_cell_indices, grid_info);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint current_voxel_cell_index = calculate_voxel_cell_index((int3)(idx, idy, idz), grid_info);
+				const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+				for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+					const uint neighbour_id = indices[current_voxel_cell_index * grid_info.max_cell_particle_count + idp];
+					const float neighbour_stiffness = stiffness[neighbour_id] / solver_densities[neighbour_id];
+
+					velocity_change -= solver_info.dt * fluid_info.mass * (particle_stiffness + neighbour_stiffness) *
+						gradW_spiky(calculate_relative_position(position, read_float3(positions, neighbour_id), grid_info), h);
+				}
+
+				if (use_boundary_particles) {
+					const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+					for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+						const float4 boundary_particle = boundary_particles[idb];
+
+						velocity_change -= solver_info.dt * solver_info.boundary_scale * boundary_particle.w * particle_stiffness *
+							gradW_spiky(calculate_relative_position(position, boundary_particle.xyz, grid_info), h);
+					}
+				}
+			}
+		}
+	}
+
+	// Overlapping particles are separated by at most a tenth of a kernel size per correction
+	const float velocity_change_length = euclidean_distance(velocity_change);
+	if (velocity_change_length > solver_info.max_velocity_change) {
+		velocity_change = velocity_change * (solver_info.max_velocity_change / velocity_change_length);
+		atomic_inc(limited_particles);
+	}
+
+	velocities[3 * particle_id] += velocity_change.x;
+	velocities[3 * particle_id + 1] += velocity_change.y;
+	velocities[3 * particle_id + 2] += velocity_change.z;
+}
+
+// Scales last step's summed stiffness for the warm start, and makes it the start of this step's sum
+// Dead and sleeping particles, with a zero factor, start over
+__kernel void warm_start_dfsph_stiffness(__global float* restrict stiffness_increments,
+										 __global float* restrict stiffness,
+										 __global const float* restrict solver_factors,
+										 const float scale) {
+	const uint particle_id = get_global_id(0);
+	const float warm_stiffness = solver_factors[particle_id] != 0.0f ? scale * stiffness[particle_id] : 0.0f;
+
+	stiffness_increments[particle_id] = warm_stiffness;
+	stiffness[particle_id] = warm_stiffness;
+}
+
+// Adds the non-pressure forces and gravity to the velocities, which the density solve then corrects
+__kernel void predict_dfsph_velocities(__global float* restrict velocities,
+									   __global const float3* restrict forces,
+									   __global const float* restrict solver_factors,
+									   const FluidInfo fluid_info,
+									   const float dt) {
+	const uint particle_id = get_global_id(0);
+
+	// Dead and sleeping particles have a zero factor
+	if (solver_factors[particle_id] == 0.0f) {
+		return;
+	}
+
+	// Acceleration according to Newton's law: a = F / m, like in integrate_particle_states
+	const float3 acceleration = forces[particle_id] / fluid_info.mass + fluid_info.gravity;
+	const float3 velocity = clamp(read_float3(velocities, particle_id) + acceleration * dt, -VELOCITY_CLAMP, VELOCITY_CLAMP);
+
+	velocities[3 * particle_id] = velocity.x;
+	velocities[3 * particle_id + 1] = velocity.y;
+	velocities[3 * particle_id + 2] = velocity.z;
+}
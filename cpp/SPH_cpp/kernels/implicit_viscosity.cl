@@ -0,0 +1,313 @@
+__constant float EPSILON = 1e-5;
+__constant float PI = 3.1415926535f;
+
+// The same clamp calculate_forces applies to the densities
+__constant float DENSITY_MIN = 5000.0f;
+__constant float DENSITY_MAX = 100000.0f;
+
+typedef struct def_FluidInfo {
+	// The mass of each fluid particle
+	float mass;
+
+	float k_gas;
+	float k_viscosity;
+	float rest_density;
+	float sigma;
+	float k_threshold;
+
+	// Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+	uint surface_neighbour_count;
+
+	float k_wall_damper;
+	float k_wall_friction;
+
+	float3 gravity;
+} FluidInfo;
+
+typedef struct def_VoxelGridInfo {
+	// How many grid cells there are in each dimension (i.e. [x=8 y=8 z=10])
+	uint3 grid_dimensions;
+
+	// How many grid cells there are in total
+	uint total_grid_cells;
+
+	// The size (x/y/z) of each cell
+	float grid_cell_size;
+
+	// The bottom-most corner of the grid, where the grid cell [0 0 0] starts
+	float3 grid_origin;
+
+	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
+} VoxelGridInfo;
+
+typedef struct def_SleepInfo {
+	// Counts the simulation steps, compared against each cell's last active step
+	uint step;
+
+	// How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+	uint sleep_step_count;
+
+	// A cell is active while any of its particles is faster than this...
+	float velocity_threshold;
+
+	// ...or while its mean density changes more than this fraction per step
+	float density_threshold;
+} SleepInfo;
+
+float euclidean_distance2(const float3 r) {
+	return r.x * r.x + r.y * r.y + r.z * r.z;
+}
+
+float euclidean_distance(const float3 r) {
+	return sqrt(r.x * r.x + r.y * r.y + r.z * r.z);
+}
+
+float W_poly6(const float3 r, const float h) {
+	const float tmp = h * h - euclidean_distance2(r);
+	if (tmp < EPSILON) {
+		return 0.0f;
+	}
+
+	return ( 315.0f / (64.0f * PI * pow(h,9)) ) * pow((tmp), 3);
+}
+
+float laplacianW_viscosity(const float3 r, const float h) {
+	const float tmp = h - euclidean_distance(r);
+	if (tmp <= 0.0f) {
+		return 0.0f;
+	}
+
+	return (45 / (PI * pow(h, 6))) * (h - euclidean_distance(r));
+}
+
+// The 3D indices of the voxel cell containing the position, the same way calculate_voxel_grid finds them
+int3 calculate_voxel_cell_indices(const float3 position, const VoxelGridInfo grid_info) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const int3 indices = convert_int3(floor((position - grid_info.grid_origin) / grid_info.grid_cell_size));
+
+	return select(clamp(indices, (int3)(0, 0, 0), dimensions - (int3)(1, 1, 1)),
+				  (indices % dimensions + dimensions) % dimensions,
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+// Cells one outside the grid, which the neighbour searches reach on the periodic axes, wrap around to the opposite side
+uint calculate_voxel_cell_index(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const uint3 wrapped_indices = convert_uint3((voxel_cell_indices + dimensions) % dimensions);
+
+	return wrapped_indices.x + grid_info.grid_dimensions.x * (wrapped_indices.y + grid_info.grid_dimensions.y * wrapped_indices.z);
+}
+
+// The first and last cells of the neighbour search around the given one, which go past the edges on the periodic axes
+int3 calculate_min_neighbour_cell_indices(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 min_indices = voxel_cell_indices - (int3)(1, 1, 1);
+	return select(max(min_indices, (int3)(0, 0, 0)), min_indices, grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+int3 calculate_max_neighbour_cell_indices(const int3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	const int3 max_indices = voxel_cell_indices + (int3)(1, 1, 1);
+	return select(min(max_indices, convert_int3(grid_info.grid_dimensions) - (int3)(1, 1, 1)), max_indices,
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+// The vector from b to a, through the periodic boundaries when that is shorter (the minimum image)
+float3 calculate_relative_position(const float3 a, const float3 b, const VoxelGridInfo grid_info) {
+	const float3 relative_position = a - b;
+	const float3 period = convert_float3(grid_info.grid_dimensions) * grid_info.grid_cell_size;
+
+	return select(relative_position, relative_position - period * rint(relative_position / period),
+				  grid_info.periodic_axes != (uint3)(0, 0, 0));
+}
+
+bool is_voxel_cell_asleep(const uint voxel_cell_index,
+						  __global const uint* restrict cell_last_active,
+						  const SleepInfo sleep_info) {
+	return sleep_info.sleep_step_count > 0 &&
+		sleep_info.step - cell_last_active[voxel_cell_index] >= sleep_info.sleep_step_count;
+}
+
+float3 read_float3(__global const float* restrict buffer, const uint particle_id) {
+	return (float3)(buffer[3 * particle_id], buffer[3 * particle_id + 1], buffer[3 * particle_id + 2]);
+}
+
+void write_float3(__global float* restrict buffer, const uint particle_id, const float3 value) {
+	buffer[3 * particle_id] = value.x;
+	buffer[3 * particle_id + 1] = value.y;
+	buffer[3 * particle_id + 2] = value.z;
+}
+
+// Finds each particle's density in particle order, which the viscosity weights need for both particles of a pair
+__kernel void calculate_viscosity_densities(__global const float* restrict positions,
+											__global const uint* restrict alive,
+											__global const uint* restrict indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+											__global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+											const VoxelGridInfo grid_info,
+											const FluidInfo fluid_info,
+											__global const float4* restrict boundary_particles, // Position (xyz) and volume weight (w) of each boundary particle, ordered by voxel cell
+											__global const uint* restrict boundary_cell_start, // Where each voxel cell's boundary particles start. Is [total_grid_cells + 1] long
+											const uint use_boundary_particles,
+											__global float* restrict viscosity_densities) { // Is [max_particles] long
+	const uint particle_id = get_global_id(0);
+
+	if (!alive[particle_id]) {
+		return;
+	}
+
+	const float3 position = read_float3(positions, particle_id);
+	const int3 voxel_cell_indices = calculate_voxel_cell_indices(position, grid_info);
+	const float h = grid_info.grid_cell_size;
+	float density = 0.0f;
+
+	const int3 min_cell_indices = calculate_min_neighbour_cell_indices(voxel_cell_indices, grid_info);
+	const int3 max_cell_indices = calculate_max_neighbour_cell_indices(voxel_cell_indices, grid_info);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint current_voxel_cell_index = calculate_voxel_cell_index((int3)(idx, idy, idz), grid_info);
+				const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+
+				for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+					const uint neighbour_id = indices[current_voxel_cell_index * grid_info.max_cell_particle_count + idp];
+					density += fluid_info.mass * W_poly6(calculate_relative_position(position, read_float3(positions, neighbour_id), grid_info), h);
+				}
+
+				if (use_boundary_particles) {
+					const uint boundary_end = boundary_cell_start[current_voxel_cell_index + 1];
+					for (uint idb = boundary_cell_start[current_voxel_cell_index]; idb < boundary_end; ++idb) {
+						const float4 boundary_particle = boundary_particles[idb];
+						density += boundary_particle.w * W_poly6(calculate_relative_position(position, boundary_particle.xyz, grid_info), h);
+					}
+				}
+			}
+		}
+	}
+
+	viscosity_densities[particle_id] = clamp(density, DENSITY_MIN, DENSITY_MAX);
+}
+
+// product = (I - dt * viscosity) x for the awake particles and product = x for the others, see CppParticleSimulator
+// The pair weights use the mean density of the pair instead of calculate_forces' neighbour density, which keeps
+// the operator symmetric as conjugate gradients needs. The sleeping neighbours' velocities are fixed, so they only
+// pull on the diagonal. With residual_mode set, x is the velocities and product is the first residual instead:
+// the explicit viscosity's velocity change
+__kernel void apply_viscosity_operator(__global const float* restrict positions,
+									   __global const float* restrict x,
+									   __global const uint* restrict alive,
+									   __global const uint* restrict indices,
+									   __global const uint* restrict cell_particle_count,
+									   const VoxelGridInfo grid_info,
+									   const FluidInfo fluid_info,
+									   __global const float* restrict viscosity_densities,
+									   __global const uint* restrict cell_last_active, // The last step each voxel cell or one of its neighbours was active. Is [total_grid_cells] long
+									   const SleepInfo sleep_info,
+									   const float dt,
+									   __global float* restrict product,
+									   const uint residual_mode) {
+	const uint particle_id = get_global_id(0);
+
+	if (!alive[particle_id]) {
+		write_float3(product, particle_id, (float3)(0.0f, 0.0f, 0.0f));
+		return;
+	}
+
+	const float3 position = read_float3(positions, particle_id);
+	const float3 x_i = read_float3(x, particle_id);
+	const int3 voxel_cell_indices = calculate_voxel_cell_indices(position, grid_info);
+
+	if (is_voxel_cell_asleep(calculate_voxel_cell_index(voxel_cell_indices, grid_info), cell_last_active, sleep_info)) {
+		write_float3(product, particle_id, residual_mode ? (float3)(0.0f, 0.0f, 0.0f) : x_i);
+		return;
+	}
+
+	const float h = grid_info.grid_cell_size;
+	const float density = viscosity_densities[particle_id];
+	float3 sum = (float3)(0.0f, 0.0f, 0.0f);
+
+	const int3 min_cell_indices = calculate_min_neighbour_cell_indices(voxel_cell_indices, grid_info);
+	const int3 max_cell_indices = calculate_max_neighbour_cell_indices(voxel_cell_indices, grid_info);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint current_voxel_cell_index = calculate_voxel_cell_index((int3)(idx, idy, idz), grid_info);
+				const uint current_voxel_particle_count = cell_particle_count[current_voxel_cell_index];
+				const bool neighbour_asleep = is_voxel_cell_asleep(current_voxel_cell_index, cell_last_active, sleep_info);
+
+				for (uint idp = 0; idp < current_voxel_particle_count; ++idp) {
+					const uint neighbour_id = indices[current_voxel_cell_index * grid_info.max_cell_particle_count + idp];
+					const float weight = dt * fluid_info.k_viscosity * 2.0f / (density + viscosity_densities[neighbour_id]) *
+						laplacianW_viscosity(calculate_relative_position(position, read_float3(positions, neighbour_id), grid_info), h);
+					const float3 x_j = read_float3(x, neighbour_id);
+
+					if (residual_mode) {
+						sum += weight * (x_j - x_i);
+					} else {
+						sum += weight * (neighbour_asleep ? x_i : x_i - x_j);
+					}
+				}
+			}
+		}
+	}
+
+	write_float3(product, particle_id, residual_mode ? sum : x_i + sum);
+}
+
+// x += alpha * direction, residual -= alpha * product, per float
+__kernel void update_viscosity_solution(__global float* restrict x,
+										__global float* restrict residual,
+										__global const float* restrict direction,
+										__global const float* restrict product,
+										const float alpha,
+										const uint count) {
+	const uint id = get_global_id(0);
+
+	if (id >= count) {
+		return;
+	}
+
+	x[id] += alpha * direction[id];
+	residual[id] -= alpha * product[id];
+}
+
+// direction = residual + beta * direction, per float
+__kernel void update_viscosity_direction(__global float* restrict direction,
+										 __global const float* restrict residual,
+										 const float beta,
+										 const uint count) {
+	const uint id = get_global_id(0);
+
+	if (id >= count) {
+		return;
+	}
+
+	direction[id] = residual[id] + beta * direction[id];
+}
+
+// Sums a[i] * b[i] of the alive particles' floats within each work group, the host adds up the partial sums
+__kernel void sum_viscosity_products(__global const float* restrict a,
+									 __global const float* restrict b,
+									 __global const uint* restrict alive,
+									 const uint count,
+									 __local float* scratch, // Is [local size] long
+									 __global float* restrict partial_sums) { // Is [number of work groups] long
+	const uint id = get_global_id(0);
+	const uint local_id = get_local_id(0);
+
+	scratch[local_id] = id < count && alive[id / 3] ? a[id] * b[id] : 0.0f;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+		if (local_id < stride) {
+			scratch[local_id] += scratch[local_id + stride];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (local_id == 0) {
+		partial_sums[get_group_id(0)] = scratch[0];
+	}
+}
@@ -7,6 +7,11 @@ __constant float PI = 3.1415926535f;
 #define MAX_VEL 5.0f
 __constant float3 VELOCITY_CLAMP = (float3)(MAX_VEL, MAX_VEL, MAX_VEL);
 
+// The same order as the TimeIntegrator enum in Parameters.hpp
+#define INTEGRATOR_SEMI_IMPLICIT_EULER 0
+#define INTEGRATOR_LEAPFROG 1
+#define INTEGRATOR_VELOCITY_VERLET 2
+
 typedef struct def_FluidInfo {
 	// The mass of each fluid particle
 	float mass;
@@ -16,6 +21,10 @@ typedef struct def_FluidInfo {
 	float rest_density;
 	float sigma;
 	float k_threshold;
+
+	// Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+	uint surface_neighbour_count;
+
 	float k_wall_damper;
 	float k_wall_friction;
 
@@ -36,8 +45,42 @@ typedef struct def_VoxelGridInfo {
 	float3 grid_origin;
 
 	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
 } VoxelGridInfo;
 
+typedef struct def_BoundaryInfo {
+	// How many nodes the signed distance field has in each dimension
+	uint3 sdf_dimensions;
+
+	// The position of node [0 0 0]
+	float3 sdf_origin;
+
+	// The distance between two neighbouring nodes
+	float sdf_cell_size;
+
+	// The distance from the boundary at which the wall starts pushing particles
+	float force_range;
+
+	// Non-zero if the wall force should be applied, zero if boundary particles keep the fluid in
+	uint use_penalty_force;
+} BoundaryInfo;
+
+typedef struct def_SleepInfo {
+	// Counts the simulation steps, compared against each cell's last active step
+	uint step;
+
+	// How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+	uint sleep_step_count;
+
+	// A cell is active while any of its particles is faster than this...
+	float velocity_threshold;
+
+	// ...or while its mean density changes more than this fraction per step
+	float density_threshold;
+} SleepInfo;
+
 float euclidean_distance2(const float3 r) {
 	return r.x * r.x + r.y * r.y + r.z * r.z;
 }
@@ -63,16 +106,84 @@ float3 gradW_spiky(const float3 r, const float h) {
 				   	kernel_constant * r.z);
 }
 
+// Calculate the 1D-mapped index of the voxel cell containing the position, the same way calculate_voxel_grid does
+uint calculate_voxel_cell_index(const float3 position, const VoxelGridInfo grid_info) {
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const int3 indices = convert_int3(floor((position - grid_info.grid_origin) / grid_info.grid_cell_size));
+	const uint3 voxel_cell_indices = convert_uint3(select(clamp(indices, (int3)(0, 0, 0), dimensions - (int3)(1, 1, 1)),
+														  (indices % dimensions + dimensions) % dimensions,
+														  grid_info.periodic_axes != (uint3)(0, 0, 0)));
+
+	return voxel_cell_indices.x + grid_info.grid_dimensions.x * (voxel_cell_indices.y + grid_info.grid_dimensions.y * voxel_cell_indices.z);
+}
+
+uint sdf_node_index(const uint3 node, const BoundaryInfo boundary_info) {
+	return node.x + boundary_info.sdf_dimensions.x * (node.y + boundary_info.sdf_dimensions.y * node.z);
+}
+
+// Trilinearly interpolates the container's signed distance field
+// Returns (normal.xyz, distance), where the distance is positive inside the container and the normal points into it
+float4 sample_boundary_sdf(const float3 position,
+						   __global const float4* restrict sdf,
+						   const BoundaryInfo boundary_info) {
+	const float3 max_coordinates = convert_float3(boundary_info.sdf_dimensions) - (float3)(1.0f, 1.0f, 1.0f);
+	const float3 coordinates = clamp((position - boundary_info.sdf_origin) / boundary_info.sdf_cell_size,
+									 (float3)(0.0f, 0.0f, 0.0f), max_coordinates);
+
+	// The lower corner node of the cell containing the position, kept one node away from the upper border
+	const uint3 i0 = min(convert_uint3(coordinates), boundary_info.sdf_dimensions - (uint3)(2, 2, 2));
+	const float3 t = coordinates - convert_float3(i0);
+
+	const float4 c00 = mix(sdf[sdf_node_index(i0, boundary_info)],
+						   sdf[sdf_node_index(i0 + (uint3)(1, 0, 0), boundary_info)], t.x);
+	const float4 c10 = mix(sdf[sdf_node_index(i0 + (uint3)(0, 1, 0), boundary_info)],
+						   sdf[sdf_node_index(i0 + (uint3)(1, 1, 0), boundary_info)], t.x);
+	const float4 c01 = mix(sdf[sdf_node_index(i0 + (uint3)(0, 0, 1), boundary_info)],
+						   sdf[sdf_node_index(i0 + (uint3)(1, 0, 1), boundary_info)], t.x);
+	const float4 c11 = mix(sdf[sdf_node_index(i0 + (uint3)(0, 1, 1), boundary_info)],
+						   sdf[sdf_node_index(i0 + (uint3)(1, 1, 1), boundary_info)], t.x);
+
+	const float4 value = mix(mix(c00, c10, t.y), mix(c01, c11, t.y), t.z);
+
+	const float normal_length = euclidean_distance(value.xyz);
+	const float3 normal = normal_length > EPSILON ? value.xyz / normal_length : zero3;
+
+	return (float4)(normal, value.w);
+}
+
+// Reflects the velocity component going into the wall, damped by k_wall_damper
+float3 reflect_wall_velocity(const float3 velocity, const float3 boundary_normal, const float k_wall_damper) {
+	const float normal_velocity = dot(velocity, boundary_normal);
+	if (normal_velocity < 0.0f) {
+		return velocity - (1.0f + k_wall_damper) * normal_velocity * boundary_normal;
+	}
+
+	return velocity;
+}
+
 __kernel void integrate_particle_states(__global float* restrict positions,
 										__global float* restrict velocities,
 										__global const float3* restrict forces,
 										const VoxelGridInfo grid_info,
 										const FluidInfo fluid_info,
-										const float dt) {
+										__global const float4* restrict boundary_sdf,
+										const BoundaryInfo boundary_info,
+										const float dt,
+										__global const uint* restrict alive,
+										__global const uint* restrict cell_last_active, // The last step each voxel cell or one of its neighbours was active
+										const SleepInfo sleep_info,
+										const uint velocities_predicted, // Non-zero when a pressure solver already added the forces to the velocities
+										const uint integrator, // One of the INTEGRATOR_ defines, always semi-implicit Euler when velocities_predicted is set
+										__global float* restrict half_step_velocities, // Leapfrog's velocities half a step ahead of the positions
+										__global float* restrict previous_accelerations) { // Velocity Verlet's accelerations of the last step
 	const uint particle_id = get_global_id(0);
 	const uint particle_position_id = 3 * particle_id;
 
-	float3 force = forces[particle_id];
+	if (!alive[particle_id]) {
+		return;
+	}
+
+	float3 force = velocities_predicted ? (float3)(0.0f, 0.0f, 0.0f) : forces[particle_id];
 
 	float3 position = (float3)(positions[particle_position_id],
 									 positions[particle_position_id + 1],
@@ -81,42 +192,84 @@ __kernel void integrate_particle_states(__global float* restrict positions,
 									 velocities[particle_position_id + 1],
 									 velocities[particle_position_id + 2]);
 
-	// Apply forces from the walls
-	float3 boundary_force = zero3;
-	float diff = 0.0f;
-	float hardness = 1000.0f;
+	// Particles in sleeping cells stay where they are
+	if (sleep_info.sleep_step_count > 0 &&
+		sleep_info.step - cell_last_active[calculate_voxel_cell_index(position, grid_info)] >= sleep_info.sleep_step_count) {
+		return;
+	}
 
-	// Bottom bound
-	float3 r = (float3)(0.0f, fabs(position.y - grid_info.grid_origin.y), 0.0f);
-	boundary_force = boundary_force - fluid_info.mass * 10.0f * hardness * gradW_spiky(r, 5.0f * grid_info.grid_cell_size);
+	// A single lookup gives both the distance to and the direction away from the closest wall
+	const float4 boundary = sample_boundary_sdf(position, boundary_sdf, boundary_info);
+	const float3 boundary_normal = boundary.xyz;
+	const float boundary_distance = boundary.w;
 
-	float distance = sqrt(pow(position.x, 2) + pow(position.z, 2));
-	// Using 1/2 of grid_origin.x as radius of cylinder
-	diff = 0.5f * grid_info.grid_dimensions.x * grid_info.grid_cell_size - distance;
-	r = - (float3)(position / distance) * diff;
-	boundary_force = boundary_force - fluid_info.mass * hardness * gradW_spiky(r, 5.0f * grid_info.grid_cell_size);
+	// Apply forces from the walls, unless boundary particles already took care of them in calculate_forces
+	if (boundary_info.use_penalty_force) {
+		const float hardness = 1000.0f;
+		// Particles that already penetrated the wall are pushed back in as well
+		const float3 r = boundary_normal * fabs(boundary_distance);
+		const float3 boundary_force = - fluid_info.mass * hardness * gradW_spiky(r, boundary_info.force_range);
 
-    // Apply external forces
-    force = force + boundary_force;
+	    // Apply external forces
+	    force = force + boundary_force;
+	}
 
 	// Acceleration according to Newton's law: a = F / m
-	const float3 acceleration = force / fluid_info.mass + fluid_info.gravity;
+	const float3 acceleration = force / fluid_info.mass + (velocities_predicted ? (float3)(0.0f, 0.0f, 0.0f) : fluid_info.gravity);
+
+	float3 drift_velocity;
+	float3 half_step_velocity;
 
-	// Integrate to new state using simple Euler integration
-	// Todo investigate other methods such as velocity verlet or leap-frog
-	//velocity = velocity + acceleration * dt;
-	velocity = clamp(velocity + acceleration * dt, -VELOCITY_CLAMP, VELOCITY_CLAMP);
+	if (integrator == INTEGRATOR_LEAPFROG) {
+		// Kick the half-step velocity a whole step and drift with it. The forces of the next step are
+		// calculated with the full-step velocity, extrapolated half a step with this acceleration
+		half_step_velocity = (float3)(half_step_velocities[particle_position_id],
+									  half_step_velocities[particle_position_id + 1],
+									  half_step_velocities[particle_position_id + 2]);
+		half_step_velocity = clamp(half_step_velocity + acceleration * dt, -VELOCITY_CLAMP, VELOCITY_CLAMP);
+		drift_velocity = half_step_velocity;
+		velocity = clamp(half_step_velocity + acceleration * (0.5f * dt), -VELOCITY_CLAMP, VELOCITY_CLAMP);
+	} else if (integrator == INTEGRATOR_VELOCITY_VERLET) {
+		// The last step predicted the velocity with its own acceleration, correct it with the average of
+		// that and the new one: v(t) = v(t - dt) + (a(t - dt) + a(t)) * dt / 2
+		const float3 previous_acceleration = (float3)(previous_accelerations[particle_position_id],
+													  previous_accelerations[particle_position_id + 1],
+													  previous_accelerations[particle_position_id + 2]);
+		velocity = clamp(velocity + (acceleration - previous_acceleration) * (0.5f * dt), -VELOCITY_CLAMP, VELOCITY_CLAMP);
+		drift_velocity = velocity + acceleration * (0.5f * dt);
+		velocity = clamp(velocity + acceleration * dt, -VELOCITY_CLAMP, VELOCITY_CLAMP);
 
-	if (position.y - grid_info.grid_origin.y < grid_info.grid_cell_size || euclidean_distance2(r) < grid_info.grid_cell_size) {
-		//velocity = (1 - dt) * fluid_info.k_wall_friction * velocity;
+		previous_accelerations[particle_position_id] = acceleration.x;
+		previous_accelerations[particle_position_id + 1] = acceleration.y;
+		previous_accelerations[particle_position_id + 2] = acceleration.z;
+	} else {
+		// Integrate to new state using simple Euler integration
+		velocity = clamp(velocity + acceleration * dt, -VELOCITY_CLAMP, VELOCITY_CLAMP);
+		drift_velocity = velocity;
 	}
-	/*
-	if (euclidean_distance2(r) < grid_info.grid_cell_size) {
-		velocity = dt * fluid_info.k_wall_friction * velocity;
+
+	// The pressure solvers predict the densities from moving the whole step with the corrected velocities
+	float3 position_delta = (velocities_predicted ? 1.0f : 0.5f) * drift_velocity * dt;
+
+	// Estimate the distance after the move from the same lookup, and push the particle back if it would leave the container
+	const float predicted_distance = boundary_distance + dot(boundary_normal, position_delta);
+	if (predicted_distance < 0.0f) {
+		position_delta = position_delta - predicted_distance * boundary_normal;
+
+		velocity = reflect_wall_velocity(velocity, boundary_normal, fluid_info.k_wall_damper);
+
+		// Leapfrog would otherwise keep moving the particle into the wall with its half-step velocity
+		if (integrator == INTEGRATOR_LEAPFROG) {
+			half_step_velocity = reflect_wall_velocity(half_step_velocity, boundary_normal, fluid_info.k_wall_damper);
+		}
 	}
-*/
 
-	position = position + 0.5f * velocity * dt;
+	position = position + position_delta;
+
+	// Particles leaving through a periodic side come back in through the opposite one
+	const float3 period = convert_float3(grid_info.grid_dimensions) * grid_info.grid_cell_size;
+	position = select(position, position - period * floor((position - grid_info.grid_origin) / period),
+					  grid_info.periodic_axes != (uint3)(0, 0, 0));
 
 	// Write new position and velocity
 	positions[particle_position_id] = position.x;
@@ -125,4 +278,10 @@ __kernel void integrate_particle_states(__global float* restrict positions,
 	velocities[particle_position_id] = velocity.x;
 	velocities[particle_position_id + 1] = velocity.y;
 	velocities[particle_position_id + 2] = velocity.z;
+
+	if (integrator == INTEGRATOR_LEAPFROG) {
+		half_step_velocities[particle_position_id] = half_step_velocity.x;
+		half_step_velocities[particle_position_id + 1] = half_step_velocity.y;
+		half_step_velocities[particle_position_id + 2] = half_step_velocity.z;
+	}
 }
\ No newline at end of file
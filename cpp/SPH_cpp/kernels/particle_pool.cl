@@ -0,0 +1,94 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable
+
+// Indices into the pool counters buffer
+#define FREE_COUNT 0 // How many particle slots there are in the free list
+#define HIGH_WATER 1 // One past the highest particle slot that has ever been alive
+
+// Integer hash (Thomas Wang), used to get uncorrelated random numbers for each spawned particle
+uint wang_hash(uint seed) {
+	seed = (seed ^ 61) ^ (seed >> 16);
+	seed *= 9;
+	seed = seed ^ (seed >> 4);
+	seed *= 0x27d4eb2d;
+	seed = seed ^ (seed >> 15);
+	return seed;
+}
+
+// A random float in [0, 1), advancing the state
+float random_float(uint *state) {
+	*state = wang_hash(*state);
+	return (*state & 0x00FFFFFF) / 16777216.0f;
+}
+
+// Removes every alive particle inside the sink box, pushing its slot onto the free list
+__kernel void despawn_particles(__global float* restrict positions,
+								__global uint* restrict alive,         // Non-zero for each alive particle
+								__global uint* restrict free_list,     // Stack of dead particle slots. Is [max_particles] long
+								__global volatile uint* counters,      // Pool counters, see FREE_COUNT and HIGH_WATER
+								const float3 sink_origin,
+								const float3 sink_size) {
+	const uint particle_id = get_global_id(0);
+	const uint particle_position_id = 3 * particle_id;
+
+	if (!alive[particle_id]) {
+		return;
+	}
+
+	const float3 position = (float3)(positions[particle_position_id],
+									 positions[particle_position_id + 1],
+									 positions[particle_position_id + 2]);
+
+	if (all(position >= sink_origin) && all(position < sink_origin + sink_size)) {
+		alive[particle_id] = 0;
+
+		// Dead particles are NaN so that the geometry shader skips them
+		positions[particle_position_id] = NAN;
+		positions[particle_position_id + 1] = NAN;
+		positions[particle_position_id + 2] = NAN;
+
+		const uint free_index = atomic_inc(&counters[FREE_COUNT]);
+		free_list[free_index] = particle_id;
+	}
+}
+
+// Spawns one particle per work item inside the emitter box, popping its slot from the free list
+// The host makes sure that no more work items are enqueued than there are free slots
+__kernel void spawn_particles(__global float* restrict positions,
+							  __global float* restrict velocities,
+							  __global uint* restrict alive,
+							  __global const uint* restrict free_list,
+							  __global volatile uint* counters,
+							  const float3 emitter_origin,
+							  const float3 emitter_size,
+							  const float3 emitter_velocity,
+							  const uint seed,
+							  __global float* restrict half_step_velocities,
+							  __global float* restrict previous_accelerations) {
+	const uint free_index = atomic_dec(&counters[FREE_COUNT]) - 1;
+	const uint particle_id = free_list[free_index];
+	const uint particle_position_id = 3 * particle_id;
+
+	uint state = seed ^ wang_hash(get_global_id(0) + 1);
+	const float3 offset = (float3)(random_float(&state), random_float(&state), random_float(&state));
+	const float3 position = emitter_origin + offset * emitter_size;
+
+	positions[particle_position_id] = position.x;
+	positions[particle_position_id + 1] = position.y;
+	positions[particle_position_id + 2] = position.z;
+	velocities[particle_position_id] = emitter_velocity.x;
+	velocities[particle_position_id + 1] = emitter_velocity.y;
+	velocities[particle_position_id + 2] = emitter_velocity.z;
+
+	// Start the integrator state as if the particle had not been accelerated before
+	half_step_velocities[particle_position_id] = emitter_velocity.x;
+	half_step_velocities[particle_position_id + 1] = emitter_velocity.y;
+	half_step_velocities[particle_position_id + 2] = emitter_velocity.z;
+	previous_accelerations[particle_position_id] = 0.0f;
+	previous_accelerations[particle_position_id + 1] = 0.0f;
+	previous_accelerations[particle_position_id + 2] = 0.0f;
+
+	alive[particle_id] = 1;
+
+	atomic_max(&counters[HIGH_WATER], particle_id + 1);
+}
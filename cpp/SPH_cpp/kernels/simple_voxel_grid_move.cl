@@ -23,6 +23,9 @@ typedef struct def_VoxelGridInfo {
 	float3 grid_origin;
 
 	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
 } VoxelGridInfo;
 
 // Map a particle index inside a voxel cell to its global buffer index
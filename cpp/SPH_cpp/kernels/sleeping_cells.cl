@@ -0,0 +1,89 @@
+typedef struct def_VoxelGridInfo {
+	// How many grid cells there are in each dimension (i.e. [x=8 y=8 z=10])
+	uint3 grid_dimensions;
+
+	// How many grid cells there are in total
+	uint total_grid_cells;
+
+	// The size (x/y/z) of each cell
+	float grid_cell_size;
+
+	// The bottom-most corner of the grid, where the grid cell [0 0 0] starts
+	float3 grid_origin;
+
+	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
+} VoxelGridInfo;
+
+typedef struct def_SleepInfo {
+	// Counts the simulation steps, compared against each cell's last active step
+	uint step;
+
+	// How many quiet steps it takes for a cell to fall asleep. Zero turns sleeping off
+	uint sleep_step_count;
+
+	// A cell is active while any of its particles is faster than this...
+	float velocity_threshold;
+
+	// ...or while its mean density changes more than this fraction per step
+	float density_threshold;
+} SleepInfo;
+
+// Calculate the 1D-mapped voxel cell index for the given 3D voxel cell indices (x/y/z)
+uint calculate_voxel_cell_index(const uint3 voxel_cell_indices, const VoxelGridInfo grid_info) {
+	return voxel_cell_indices.x + grid_info.grid_dimensions.x * (voxel_cell_indices.y + grid_info.grid_dimensions.y * voxel_cell_indices.z);
+}
+
+// Marks every cell with a fast particle or a changing density, and its neighbours, as active this step
+// Cells that have not been marked for sleep_step_count steps are asleep, see SleepingCells for the C++ version
+__kernel void update_sleeping_cells(__global const float* restrict velocities,
+									__global const uint* restrict indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+									__global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+									__global const float* restrict cell_density_changes, // How much each cell's mean density changed last step. Is [total_grid_cells] long
+									__global uint* cell_last_active, // The last step each cell or one of its neighbours was active. Is [total_grid_cells] long
+									const VoxelGridInfo grid_info,
+									const SleepInfo sleep_info) {
+	const uint3 voxel_cell_indices = (uint3)(get_global_id(0), get_global_id(1), get_global_id(2));
+	const uint voxel_cell_index = calculate_voxel_cell_index(voxel_cell_indices, grid_info);
+	const uint particle_count = cell_particle_count[voxel_cell_index];
+
+	if (particle_count == 0) {
+		return;
+	}
+
+	bool active = cell_density_changes[voxel_cell_index] > sleep_info.density_threshold;
+
+	const float velocity_threshold2 = sleep_info.velocity_threshold * sleep_info.velocity_threshold;
+	for (uint idp = 0; idp < particle_count && !active; ++idp) {
+		const uint particle_velocity_index = 3 * indices[voxel_cell_index * grid_info.max_cell_particle_count + idp];
+		const float3 velocity = (float3)(velocities[particle_velocity_index],
+										 velocities[particle_velocity_index + 1],
+										 velocities[particle_velocity_index + 2]);
+
+		active = dot(velocity, velocity) > velocity_threshold2;
+	}
+
+	if (!active) {
+		return;
+	}
+
+	// Keep the neighbours awake too. Every work item writes the same step, so the races are harmless
+	// On the periodic axes the neighbours past the edges are the cells on the opposite side
+	const int3 dimensions = convert_int3(grid_info.grid_dimensions);
+	const int3 periodic = grid_info.periodic_axes != (uint3)(0, 0, 0);
+	const int3 min_cell_indices = select(max(convert_int3(voxel_cell_indices) - (int3)(1, 1, 1), (int3)(0, 0, 0)),
+										 convert_int3(voxel_cell_indices) - (int3)(1, 1, 1), periodic);
+	const int3 max_cell_indices = select(min(convert_int3(voxel_cell_indices) + (int3)(1, 1, 1), dimensions - (int3)(1, 1, 1)),
+										 convert_int3(voxel_cell_indices) + (int3)(1, 1, 1), periodic);
+
+	for (int idz = min_cell_indices.z; idz <= max_cell_indices.z; ++idz) {
+		for (int idy = min_cell_indices.y; idy <= max_cell_indices.y; ++idy) {
+			for (int idx = min_cell_indices.x; idx <= max_cell_indices.x; ++idx) {
+				const uint3 neighbour_indices = convert_uint3(((int3)(idx, idy, idz) + dimensions) % dimensions);
+				cell_last_active[calculate_voxel_cell_index(neighbour_indices, grid_info)] = sleep_info.step;
+			}
+		}
+	}
+}
@@ -0,0 +1,128 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable
+
+typedef struct def_VoxelGridInfo {
+	// How many grid cells there are in each dimension (i.e. [x=8 y=8 z=10])
+	uint3 grid_dimensions;
+
+	// How many grid cells there are in total
+	uint total_grid_cells;
+
+	// The size (x/y/z) of each cell
+	float grid_cell_size;
+
+	// The bottom-most corner of the grid, where the grid cell [0 0 0] starts
+	float3 grid_origin;
+
+	uint max_cell_particle_count;
+
+	// Non-zero on the axes that wrap around, with a period of the grid's extent along them
+	uint3 periodic_axes;
+} VoxelGridInfo;
+
+typedef struct def_FluidInfo {
+	// The mass of each fluid particle
+	float mass;
+
+	float k_gas;
+	float k_viscosity;
+	float rest_density;
+	float sigma;
+	float k_threshold;
+
+	// Particles with fewer neighbours than this are near the surface and get the color field tension evaluated
+	uint surface_neighbour_count;
+
+	float k_wall_damper;
+	float k_wall_friction;
+
+	float3 gravity;
+} FluidInfo;
+
+typedef struct def_TimestepInfo {
+	// The length of the whole frame, the step of timestep level 0
+	float frame_dt;
+
+	// The fraction of its smoothing length a particle may move in one of its steps
+	float courant_number;
+
+	// The finest level a particle may be given. Zero turns multi-rate timestepping off
+	uint max_timestep_level;
+
+	// The finest level of any particle this frame, which splits it into 2^finest_level sub-steps...
+	uint finest_level;
+
+	// ...and the one being simulated
+	uint substep;
+} TimestepInfo;
+
+// Gives each particle the coarsest level whose step keeps it within the Courant number of the kernel size, with
+// both its velocity and last acceleration. The finest level of the frame is gathered in finest_level
+// See CppParticleSimulator::assignTimestepLevels for the C++ version
+__kernel void assign_timestep_levels(__global const float* restrict velocities,
+									 __global const float3* restrict forces, // The force on each particle of its last step
+									 __global const uint* restrict alive,
+									 __global uint* restrict timestep_levels, // The level of each particle. Is [max_particles] long
+									 __global uint* restrict finest_level,
+									 const VoxelGridInfo grid_info,
+									 const FluidInfo fluid_info,
+									 const TimestepInfo timestep_info) {
+	const uint particle_id = get_global_id(0);
+	const uint particle_velocity_id = 3 * particle_id;
+
+	if (!alive[particle_id]) {
+		return;
+	}
+
+	const float3 velocity = (float3)(velocities[particle_velocity_id],
+									 velocities[particle_velocity_id + 1],
+									 velocities[particle_velocity_id + 2]);
+	const float speed = length(velocity);
+	const float acceleration = length(forces[particle_id] / fluid_info.mass + fluid_info.gravity);
+
+	const float distance = timestep_info.courant_number * grid_info.grid_cell_size;
+
+	uint level = 0;
+	float step = timestep_info.frame_dt;
+	while (level < timestep_info.max_timestep_level &&
+		   (speed * step > distance || 0.5f * acceleration * step * step > distance)) {
+		++level;
+		step *= 0.5f;
+	}
+
+	timestep_levels[particle_id] = level;
+	atomic_max(finest_level, level);
+}
+
+// Appends every voxel cell with a particle whose level has a step starting at this sub-step to active_cells. The
+// density and force passes only process the listed cells, the rest keep the forces of their last step
+__kernel void build_active_cell_list(__global const uint* restrict indices, // Indices from each voxel cell to each particle. Is [max_cell_particle_count * total_grid_cells] long
+									 __global const uint* restrict cell_particle_count, // Particle counter for each voxel cell. Is [total_grid_cells] long
+									 __global const uint* restrict timestep_levels, // The level of each particle. Is [max_particles] long
+									 __global uint* restrict active_cells, // The active voxel cells in no particular order. Is [total_grid_cells] long
+									 __global uint* restrict active_cell_count,
+									 const VoxelGridInfo grid_info,
+									 const TimestepInfo timestep_info) {
+	const uint3 voxel_cell_indices = (uint3)(get_global_id(0), get_global_id(1), get_global_id(2));
+	const uint voxel_cell_index = voxel_cell_indices.x + grid_info.grid_dimensions.x *
+		(voxel_cell_indices.y + grid_info.grid_dimensions.y * voxel_cell_indices.z);
+	const uint particle_count = cell_particle_count[voxel_cell_index];
+
+	if (particle_count == 0) {
+		return;
+	}
+
+	// The cell takes the steps of its finest particle
+	uint cell_level = 0;
+	for (uint idp = 0; idp < particle_count; ++idp) {
+		cell_level = max(cell_level, timestep_levels[indices[voxel_cell_index * grid_info.max_cell_particle_count + idp]]);
+	}
+
+	// A level L particle takes a step every 2^(finest_level - L) sub-steps
+	const uint period_mask = (1u << (timestep_info.finest_level - cell_level)) - 1;
+	if ((timestep_info.substep & period_mask) != 0) {
+		return;
+	}
+
+	active_cells[atomic_inc(active_cell_count)] = voxel_cell_index;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <chrono>
 #include <iomanip>
@@ -12,6 +13,9 @@
 #include "GLFW/glfw3.h"
 
 #include "rendering/ShaderProgram.hpp"
+#include "rendering/HeightfieldMesh.hpp"
+#include "rendering/GlParticleBuffers.hpp"
+#include "rendering/PerformanceHud.hpp"
 #include "math/randomized.hpp"
 #include "common/Rotator.hpp"
 #include "constants.hpp"
@@ -19,6 +23,14 @@
 #include "ParticleSimulator.hpp"
 #include "OpenCL/OpenClParticleSimulator.hpp"
 #include "CppParticleSimulator.hpp"
+#include "PbfParticleSimulator.hpp"
+#include "FlipParticleSimulator.hpp"
+#include "ShallowWater.hpp"
+#include "io/Checkpoint.hpp"
+#include "io/TrajectoryPlayer.hpp"
+#include "io/TrajectoryRecorder.hpp"
+#include "metrics/Metrics.hpp"
+#include "profiling/Profiler.hpp"
 
 #include "nanogui/nanogui.h"
 
@@ -27,7 +39,8 @@ nanogui::Screen *screen;
 using std::cout;
 using std::endl;
 
-ParticleSimulator *createSimulator(std::vector<glm::vec3> &positions, std::vector<glm::vec3> &velocities, Parameters &params);
+ParticleSimulator *createSimulator(std::vector<glm::vec3> &positions, std::vector<glm::vec3> &velocities, Parameters &params,
+                                   GlParticleBuffers &particleBuffers);
 
 void setWindowFPS(GLFWwindow *window, float fps);
 
@@ -47,15 +60,50 @@ void scrollCallback(GLFWwindow *window, double x, double y);
 
 void framebufferSizeCallback(GLFWwindow *window, int width, int height);
 
-void createGUI(nanogui::Screen *screen, Parameters &params);
+void createGUI(nanogui::Screen *screen, Parameters &params, const ParticleSimulator &simulator);
+
+void createReplayGUI(nanogui::Screen *screen);
+
+void updateReplayGUI();
+
+double lapSeconds(std::chrono::high_resolution_clock::time_point &tp_lap);
 
 std::chrono::duration<double> second_accumulator;
 unsigned int frames_last_second;
 nanogui::TextBox *fpsBox;
-
-int main() {
+nanogui::TextBox *iterationsBox;
+PerformanceHud *performanceHud;
+
+// While "Serve metrics" is checked, nullptr otherwise. Written to metricsLogFile and served on metricsPort
+Metrics *metrics = nullptr;
+const char *const metricsLogFile = "metrics.jsonl";
+const unsigned short metricsPort = 9188;
+const unsigned int metricsLogInterval = 60;
+
+// Set by "Save checkpoint", the checkpoint is taken between two frames. Restart from it with the file as argument
+bool checkpointRequested = false;
+const char *const checkpointFile = "checkpoint.sphc";
+
+// While "Record trajectory" is checked, nullptr otherwise. Records every frame to trajectoryFile
+TrajectoryRecorder *recorder = nullptr;
+const char *const trajectoryFile = "trajectory.sphtraj";
+
+// With --replay, nullptr otherwise. Plays the trajectory in place of a simulator, scrubbed with replaySlider
+TrajectoryPlayer *player = nullptr;
+nanogui::Slider *replaySlider;
+nanogui::TextBox *replayTimeBox;
+
+/// Usage: SPH [checkpoint file | --replay <trajectory file>]
+/// Without a checkpoint asks for the number of particles and starts from the default parameters. --replay plays a
+/// trajectory recorded with "Record trajectory" or SPH_batch --record back instead of simulating
+int main(int argc, char **argv) {
     using namespace nanogui;
 
+#ifdef MY_DEBUG
+    // Profile from the start, setup included. Unchecking "Record profile" writes it out
+    Profiler::set_enabled(true);
+#endif
+
     GLFWwindow *window;
 
     if (!glfwInit()) {
@@ -101,46 +149,95 @@ int main() {
         return -1;
     }
 #endif
-    cout << "How many particles? ";
-    int n_particles;
-    std::cin >> n_particles;
+    // Kept open for the simulators' setup, which reads the particles straight from the mapped file
+    Checkpoint checkpoint;
+    Parameters params(0);
+    if (argc > 2 && std::string(argv[1]) == "--replay") {
+        std::string error;
+        player = new TrajectoryPlayer;
+        if (!player->open(argv[2], error)) {
+            cout << argv[2] << ": " << error << endl;
+            exit(EXIT_FAILURE);
+        }
 
-    Parameters params(n_particles);
-    Parameters::set_default_parameters(params);
+        // Only the container is recorded, the camera and the buffers need no more
+        const TrajectoryReader &reader = player->get_reader();
+        params = Parameters(std::max(reader.get_frame(0).particle_count, 1u));
+        Parameters::set_default_parameters(params);
+        params.max_particles = std::max(reader.get_header().max_particles, 1u);
+
+        const glm::vec3 origin = reader.get_origin();
+        const glm::vec3 opposite_corner = origin + reader.get_size();
+        params.left_bound = origin.x;
+        params.right_bound = opposite_corner.x;
+        params.bottom_bound = origin.y;
+        params.top_bound = opposite_corner.y;
+        params.near_bound = origin.z;
+        params.far_bound = opposite_corner.z;
+    } else if (argc > 1) {
+        std::string error;
+        if (!checkpoint.open(argv[1], error)) {
+            cout << argv[1] << ": " << error << endl;
+            exit(EXIT_FAILURE);
+        }
+        params = checkpoint.get_parameters();
+    } else {
+        cout << "How many particles? ";
+        int n_particles;
+        std::cin >> n_particles;
+
+        params = Parameters(n_particles);
+        Parameters::set_default_parameters(params);
+
+        // Leave room in the particle pool for the emitters
+        params.max_particles = 2 * n_particles;
+    }
+
+    // The particles are drawn from these, the simulators either upload to them or share them
+    GlParticleBuffers particleBuffers(params.max_particles);
 
     std::vector<glm::vec3> positions, velocities;
-    ParticleSimulator *simulator = createSimulator(positions, velocities, params);
+    ParticleSimulator *simulator;
+    if (player) {
+        simulator = player;
+        simulator->setParticleStateCallback(particleBuffers.get_upload_callback());
+    } else {
+        simulator = createSimulator(positions, velocities, params, particleBuffers);
+    }
 
     screen = new Screen;
     screen->initialize(window, true);
     setNanoScreenCallbacksGLFW(window, screen);
-    createGUI(screen, params);
-
-    //Generate VBOs
-    GLuint pos_vbo = 0;
-    glGenBuffers(1, &pos_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, pos_vbo);
-    glBufferData(GL_ARRAY_BUFFER, n_particles * 3 * sizeof(float), positions.data(), GL_DYNAMIC_DRAW);
+    performanceHud = new PerformanceHud(screen, simulator);
+    createGUI(screen, params, *simulator);
+    if (player) {
+        createReplayGUI(screen);
+    }
 
-    GLuint vel_vbo = 0;
-    glGenBuffers(1, &vel_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vel_vbo);
-    glBufferData(GL_ARRAY_BUFFER, n_particles * 3 * sizeof(float), velocities.data(), GL_DYNAMIC_DRAW);
+    {
+        PROFILE_ZONE("setup");
+        std::string error;
+        bool setUp;
+        if (checkpoint.get_positions().size() > 0) {
+            particleBuffers.upload(checkpoint.get_positions(), checkpoint.get_velocities());
+            setUp = simulator->setupSimulation(params, checkpoint.get_positions(), checkpoint.get_velocities(), error);
+        } else {
+            particleBuffers.upload(positions, velocities);
+            setUp = simulator->setupSimulation(params, positions, velocities, error);
+        }
 
-    simulator->setupSimulation(params, positions, velocities, pos_vbo, vel_vbo);
+        if (!setUp) {
+            cout << error << endl;
+            exit(EXIT_FAILURE);
+        }
 
-    // Generate VAO with all VBOs
-    GLuint vao = 0;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, pos_vbo);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL); //position
-    glBindBuffer(GL_ARRAY_BUFFER, vel_vbo);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL); //velocity
+        if (checkpoint.get_positions().size() > 0) {
+            simulator->setSolverState(checkpoint.get_solver_state());
+        }
+    }
 
-    //How many attributes do we have? Enable them!
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+    // Writes while the simulation goes on
+    CheckpointWriter checkpointWriter;
 
 
     // Declare which shader to use and bind it
@@ -159,6 +256,14 @@ int main() {
     P_Loc = glGetUniformLocation(particlesShader, "P");
     lDir_Loc = glGetUniformLocation(particlesShader, "lDir");
     radius_Loc = glGetUniformLocation(particlesShader, "radius");
+
+    // The shallow water surface, created once the simulator has a heightfield
+    ShaderProgram heightfieldShader("../shaders/heightfield.vert", "", "", "", "../shaders/heightfield.frag");
+    GLint heightfield_MV_Loc = glGetUniformLocation(heightfieldShader, "MV");
+    GLint heightfield_P_Loc = glGetUniformLocation(heightfieldShader, "P");
+    GLint heightfield_lDir_Loc = glGetUniformLocation(heightfieldShader, "lDir");
+    HeightfieldMesh *heightfieldMesh = nullptr;
+
     glm::mat4 MV, P;
     glm::vec3 lDir;
     glm::mat4 M = glm::mat4(1.0f);
@@ -182,6 +287,8 @@ int main() {
     screen->setVisible(true);
 
     while (!glfwWindowShouldClose(window)) {
+        PROFILE_ZONE("frame");
+
         std::chrono::high_resolution_clock::time_point tp_now = std::chrono::high_resolution_clock::now();
         std::chrono::high_resolution_clock::duration delta_time = tp_now - tp_last;
         tp_last = tp_now;
@@ -198,7 +305,36 @@ int main() {
         glfwGetFramebufferSize(window, &width, &height);
         glViewport(0, 0, width, height);
 
-        simulator->updateSimulation(params, dt_s);
+        // The parts of the frame for the performance HUD
+        PerformanceHud::FrameTimes frameTimes = {0.0, 0.0, 0.0, 0};
+        std::chrono::high_resolution_clock::time_point tp_part = std::chrono::high_resolution_clock::now();
+
+        if (!performanceHud->is_paused()) {
+            PROFILE_ZONE("simulation");
+            frameTimes.particle_updates = simulator->getParticleDrawCount();
+            simulator->updateSimulation(params, dt_s);
+        }
+        frameTimes.simulate = lapSeconds(tp_part);
+
+        // The HUD owns the phase and kernel timings and clears them every frame, so only the steps are counted
+        if (metrics && !performanceHud->is_paused()) {
+            metrics->record_step(*simulator, frameTimes.simulate, nullptr, nullptr);
+        }
+
+        if (player) {
+            updateReplayGUI();
+        }
+
+        if (recorder && !performanceHud->is_paused()) {
+            recorder->record_step(*simulator, dt_s);
+        }
+
+        if (checkpointRequested) {
+            checkpointRequested = false;
+            checkpointWriter.write_async(checkpointFile, params, *simulator);
+        }
+
+        PROFILE_ZONE("rendering");
 
         // Get mouse and key input
         rotator.poll(window);
@@ -238,13 +374,37 @@ int main() {
                      1.0f);
 
         //Send VAO to the GPU
-        glBindVertexArray(vao);
-        glDrawArrays(GL_POINTS, 0, n_particles); //GeomShader
+        particleBuffers.draw(simulator->getParticleDrawCount()); //GeomShader
         //glDrawArrays(GL_PATCHES, 0, n_particles); //TessShader
 
-        screen->drawWidgets();
+        const ShallowWater *shallowWater = simulator->getShallowWater();
+        if (shallowWater) {
+            if (!heightfieldMesh) {
+                heightfieldMesh = new HeightfieldMesh(*shallowWater);
+            }
+            heightfieldMesh->update(*shallowWater);
+
+            heightfieldShader();
+            glUniformMatrix4fv(heightfield_MV_Loc, 1, GL_FALSE, &MV[0][0]);
+            glUniformMatrix4fv(heightfield_P_Loc, 1, GL_FALSE, &P[0][0]);
+            glUniform3fv(heightfield_lDir_Loc, 1, &lDir[0]);
+            heightfieldMesh->draw();
+        }
+
+        frameTimes.render = lapSeconds(tp_part);
+
+        {
+            PROFILE_ZONE("gui");
+            screen->drawWidgets();
+        }
+        frameTimes.gui = lapSeconds(tp_part);
 
-        glfwSwapBuffers(window);
+        {
+            PROFILE_ZONE("swap buffers");
+            glfwSwapBuffers(window);
+        }
+        frameTimes.render += lapSeconds(tp_part);
+        performanceHud->add_frame(frameTimes);
         ++frames_last_second;
         glfwPollEvents();
 
@@ -261,16 +421,32 @@ int main() {
             std::stringstream fpsString;
             fpsString << std::fixed << std::setprecision(0) << newFPS;
             fpsBox->setValue(fpsString.str());
+            iterationsBox->setValue(std::to_string(simulator->getSolverIterations()));
             frames_last_second = 0;
             second_accumulator = std::chrono::duration<double>(0);
         }
     }
 
+    // exit skips the destructors
+    checkpointWriter.wait();
+    delete heightfieldMesh;
+    delete metrics;
+    delete recorder;
+    delete player;
+
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
+double lapSeconds(std::chrono::high_resolution_clock::time_point &tp_lap) {
+    const std::chrono::high_resolution_clock::time_point tp_now = std::chrono::high_resolution_clock::now();
+    const double seconds = std::chrono::duration<double>(tp_now - tp_lap).count();
+    tp_lap = tp_now;
+
+    return seconds;
+}
+
 void setWindowFPS(GLFWwindow *window, float fps) {
     std::stringstream ss;
     ss << "FPS: " << fps;
@@ -322,7 +498,7 @@ void framebufferSizeCallback(GLFWwindow *window, int width, int height) {
     screen->resizeCallbackEvent(width, height);
 }
 
-void createGUI(nanogui::Screen *screen, Parameters &params) {
+void createGUI(nanogui::Screen *screen, Parameters &params, const ParticleSimulator &simulator) {
     using namespace nanogui;
     Parameters *p = &params;
 
@@ -424,6 +600,181 @@ void createGUI(nanogui::Screen *screen, Parameters &params) {
     cb->setFontSize(16);
     cb->setChecked(true);
 
+    cb = new CheckBox(window, "Faucet and drain",
+        [=](bool state) {
+            p->emitters.clear();
+            p->sinks.clear();
+
+            if (state) {
+                // A stream falling in near the middle of the glass, drained at the bottom next to the wall
+                ParticleEmitter faucet;
+                faucet.origin = glm::vec3(-0.5f, 0.8f * p->top_bound, -0.5f);
+                faucet.size = glm::vec3(1.0f, 0.2f, 1.0f);
+                faucet.velocity = glm::vec3(0.0f, -2.0f, 0.0f);
+                faucet.rate = 0.1f * p->max_particles;
+                p->emitters.push_back(faucet);
+
+                ParticleSink drain;
+                drain.origin = glm::vec3(0.5f * p->right_bound, p->bottom_bound, -1.0f);
+                drain.size = glm::vec3(2.0f, 0.5f, 2.0f);
+                p->sinks.push_back(drain);
+            }
+        }
+    );
+    cb->setFontSize(16);
+
+    cb = new CheckBox(window, "Sleeping regions",
+        [=](bool state) {
+            p->allow_sleeping = state;
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(p->allow_sleeping);
+
+    cb = new CheckBox(window, "Shallow water far field",
+        [=](bool state) {
+            p->shallow_water = state;
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(p->shallow_water);
+
+    cb = new CheckBox(window, "Implicit viscosity",
+        [=](bool state) {
+            p->implicit_viscosity = state;
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(p->implicit_viscosity);
+
+    cb = new CheckBox(window, "Adaptive resolution",
+        [=](bool state) {
+            p->adaptive_resolution = state;
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(p->adaptive_resolution);
+
+    cb = new CheckBox(window, "Multi-rate timestepping",
+        [=](bool state) {
+            p->multi_rate_timestepping = state;
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(p->multi_rate_timestepping);
+
+    // Where the frames' time goes, see PerformanceHud
+    cb = new CheckBox(window, "Performance HUD",
+        [=](bool state) {
+            performanceHud->set_visible(state);
+        }
+    );
+    cb->setFontSize(16);
+
+    // For dashboards of long runs, see Metrics
+    cb = new CheckBox(window, "Serve metrics",
+        [=](bool state) {
+            delete metrics;
+            metrics = nullptr;
+
+            if (state) {
+                metrics = new Metrics;
+                if (!metrics->open_log(metricsLogFile, metricsLogInterval)) {
+                    cout << "Could not write " << metricsLogFile << endl;
+                }
+                if (metrics->serve(metricsPort)) {
+                    cout << "Metrics on http://127.0.0.1:" << metricsPort << "/metrics" << endl;
+                } else {
+                    cout << "Could not serve the metrics on port " << metricsPort << endl;
+                }
+            }
+        }
+    );
+    cb->setFontSize(16);
+
+    // Records the zones while checked, and writes them out when unchecked
+    cb = new CheckBox(window, "Record profile",
+        [=](bool state) {
+            if (state) {
+                Profiler::clear();
+                Profiler::set_enabled(true);
+            } else {
+                Profiler::set_enabled(false);
+                Profiler::print_zone_statistics(cout);
+                if (Profiler::write_chrome_trace("profile.json")) {
+                    cout << "Wrote the profile to profile.json, open it in chrome://tracing" << endl;
+                }
+            }
+        }
+    );
+    cb->setFontSize(16);
+    cb->setChecked(Profiler::is_enabled());
+
+    // For rendering offline or reviewing the run, see TrajectoryRecorder
+    cb = new CheckBox(window, "Record trajectory",
+        [=](bool state) {
+            if (recorder) {
+                if (recorder->close()) {
+                    cout << "Recorded " << recorder->get_frame_count() << " frames to " << trajectoryFile << endl;
+                } else {
+                    cout << "Could not write the trajectory " << trajectoryFile << endl;
+                }
+                delete recorder;
+                recorder = nullptr;
+            }
+
+            if (state) {
+                std::string error;
+                recorder = new TrajectoryRecorder;
+                if (!recorder->open(trajectoryFile, *p, 1, error)) {
+                    cout << error << endl;
+                    delete recorder;
+                    recorder = nullptr;
+                }
+            }
+        }
+    );
+    cb->setFontSize(16);
+
+    Button *checkpointButton = new Button(window, "Save checkpoint");
+    checkpointButton->setFontSize(16);
+    checkpointButton->setCallback([]() {
+        checkpointRequested = true;
+    });
+
+    // Only the solvers the simulator has are offered
+    const std::vector<std::pair<PressureSolver, std::string>> allSolvers = {
+            {PressureSolver::StateEquation, "State equation"},
+            {PressureSolver::PCISPH,        "PCISPH"},
+            {PressureSolver::DFSPH,         "DFSPH"}};
+    std::vector<PressureSolver> solvers;
+    std::vector<std::string> solverNames;
+    for (const std::pair<PressureSolver, std::string> &solver : allSolvers) {
+        if (simulator.supportsPressureSolver(solver.first)) {
+            solvers.push_back(solver.first);
+            solverNames.push_back(solver.second);
+        }
+    }
+
+    new Label(window, "Pressure solver", "sans-bold");
+    ComboBox *solverBox = new ComboBox(window, solverNames);
+    solverBox->setFontSize(16);
+    const std::vector<PressureSolver>::const_iterator selectedSolver =
+            std::find(solvers.begin(), solvers.end(), p->pressure_solver);
+    solverBox->setSelectedIndex(
+            selectedSolver == solvers.end() ? 0 : static_cast<int>(selectedSolver - solvers.begin()));
+    solverBox->setCallback([=](int index) {
+        p->pressure_solver = solvers[index];
+    });
+
+    new Label(window, "Integrator", "sans-bold");
+    ComboBox *integratorBox = new ComboBox(window, {"Semi-implicit Euler", "Leapfrog", "Velocity Verlet"});
+    integratorBox->setFontSize(16);
+    integratorBox->setSelectedIndex(static_cast<int>(p->time_integrator));
+    integratorBox->setCallback([=](int index) {
+        p->time_integrator = static_cast<TimeIntegrator>(index);
+    });
+
     Widget *panel_fps = new Widget(window);
     panel_fps->setLayout(new BoxLayout(Orientation::Horizontal,
                                        Alignment::Maximum, 5, 10));
@@ -434,20 +785,77 @@ void createGUI(nanogui::Screen *screen, Parameters &params) {
     fpsBox->setFontSize(16);
     fpsBox->setFormat("[-]?[0-9]*\\.?[0-9]+");
 
+    // The pressure solver's iterations in the last step
+    Widget *panel_iterations = new Widget(window);
+    panel_iterations->setLayout(new BoxLayout(Orientation::Horizontal,
+                                              Alignment::Maximum, 5, 10));
+    new Label(panel_iterations, "Iterations: ", "sans-bold");
+    iterationsBox = new TextBox(panel_iterations);
+    iterationsBox->setFixedSize(Vector2i(100, 20));
+    iterationsBox->setDefaultValue("0");
+    iterationsBox->setFontSize(16);
+
+    screen->performLayout();
+}
+
+void createReplayGUI(nanogui::Screen *screen) {
+    using namespace nanogui;
+
+    Window *window = new Window(screen, "Replay");
+    window->setPosition(Vector2i(250, 400));
+    window->setLayout(new GroupLayout());
+
+    // From the first frame (0) to the last (1). Pause in the performance HUD to hold the frame
+    new Label(window, "Time", "sans-bold");
+    replaySlider = new Slider(window);
+    replaySlider->setFixedWidth(300);
+    replaySlider->setCallback([](float value) {
+        player->seek(value * player->get_duration());
+    });
+
+    replayTimeBox = new TextBox(window);
+    replayTimeBox->setFixedSize(Vector2i(300, 20));
+    replayTimeBox->setFontSize(16);
+
     screen->performLayout();
 }
 
+void updateReplayGUI() {
+    // Shows a frame decoded since the last update, i.e. after seeking while paused
+    player->show_playhead_frame();
+
+    const double duration = player->get_duration();
+    replaySlider->setValue(duration > 0.0 ? static_cast<float>(player->get_time() / duration) : 0.0f);
+
+    const TrajectoryIndexEntry &frame = player->get_reader().get_frame(player->get_shown_frame());
+    std::stringstream timeString;
+    timeString << std::fixed << std::setprecision(2) << player->get_time() << " / " << duration << " s, step "
+               << frame.step;
+    replayTimeBox->setValue(timeString.str());
+}
+
 ParticleSimulator *createSimulator(std::vector<glm::vec3> &positions, std::vector<glm::vec3> &velocities,
-                                   Parameters &params) {
-    cout << "Use C++ [0] or OpenCL [1] for fluid simulation? ";
+                                   Parameters &params, GlParticleBuffers &particleBuffers) {
+    cout << "Use C++ [0], OpenCL [1], C++ position based fluids [2] or C++ FLIP [3] for fluid simulation? ";
     int choice = -1;
     std::cin >> choice;
 
-    if (choice == 0) {
+    if (choice == 0 || choice == 2 || choice == 3) {
         positions = generate_uniform_vec3s(params.n_particles, -1, -0.2, 0, 1, -1, 1);
         velocities = generate_uniform_vec3s(params.n_particles, 0, 0, 0, 0, 0, 0);
 
-        return new CppParticleSimulator;
+        ParticleSimulator *simulator;
+        if (choice == 2) {
+            simulator = new PbfParticleSimulator;
+        } else if (choice == 3) {
+            simulator = new FlipParticleSimulator;
+        } else {
+            simulator = new CppParticleSimulator;
+        }
+
+        // The C++ simulators keep the particles in host memory, and hand them over for drawing after each update
+        simulator->setParticleStateCallback(particleBuffers.get_upload_callback());
+        return simulator;
     } else if (choice == 1) {
         // Cylinder generation
         const float cylinder_radius = params.left_bound / 2;
@@ -460,7 +868,21 @@ ParticleSimulator *createSimulator(std::vector<glm::vec3> &positions, std::vecto
                                            origin.z, origin.z + size.z);
         velocities = generate_uniform_vec3s(params.n_particles, 0, 0, 0, 0, 0, 0);
 
-        return new OpenClParticleSimulator;
+        // The simulator runs on the first device unless told otherwise, asking for one is up to the application
+        const std::vector<std::string> deviceNames = OpenClParticleSimulator::getDeviceNames();
+        int deviceId = 1;
+        if (deviceNames.size() > 1) {
+            for (unsigned int i = 0; i < deviceNames.size(); ++i) {
+                cout << "\t (" << (i + 1) << ") : " << deviceNames[i] << endl;
+            }
+            cout << "Choose a device id from the devices above: ";
+            std::cin >> deviceId;
+        }
+
+        // The OpenCL simulator works on the VBOs directly, shared through the buffers
+        OpenClParticleSimulator *simulator = new OpenClParticleSimulator(&particleBuffers);
+        simulator->setDeviceId(deviceId);
+        return simulator;
     }
 
     std::exit(EXIT_FAILURE);
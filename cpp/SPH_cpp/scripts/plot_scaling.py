@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Plots the CSV of scripts/scaling.py: throughput, cost per particle-step, peak memory and the phase breakdown.
+
+    python3 scripts/plot_scaling.py scaling.csv [--output scaling.png]
+
+Each backend, OpenCL device and pressure solver is one line. The phase breakdown has a panel per line, with the
+phases' share of the step at each particle count.
+"""
+
+import argparse
+import csv
+import math
+from collections import OrderedDict
+
+import matplotlib
+
+matplotlib.use("Agg")
+import matplotlib.pyplot as plt
+
+
+def read_runs(file_name):
+    """The successful runs, grouped by backend, device and solver in the order they were run"""
+    series = OrderedDict()
+    with open(file_name) as scaling_csv:
+        for row in csv.DictReader(scaling_csv):
+            if row.get("status", "ok") != "ok":
+                continue
+
+            label = row["backend"]
+            if row["backend"] == "opencl":
+                label += " device " + row["opencl_device"]
+            label += " " + row["pressure_solver"]
+            series.setdefault(label, []).append(row)
+
+    for rows in series.values():
+        rows.sort(key=lambda row: int(row["particles"]))
+    return series
+
+
+def column(rows, name):
+    return [float(row[name]) if row.get(name) else math.nan for row in rows]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("csv", help="the output of scripts/scaling.py")
+    parser.add_argument("--output", default="scaling.png")
+    args = parser.parse_args()
+
+    series = read_runs(args.csv)
+    if not series:
+        raise SystemExit("No successful runs in " + args.csv)
+
+    figure = plt.figure(figsize=(15, 5 + 3.5 * math.ceil(len(series) / 3.0)))
+    grid = figure.add_gridspec(1 + math.ceil(len(series) / 3.0), 3)
+
+    panels = [
+        ("steps_per_s", "steps/s", True),
+        ("ns_per_particle_step", "ns / particle-step", True),
+        ("peak_memory_mib", "peak memory (MiB)", True),
+    ]
+    for index, (name, label, log_y) in enumerate(panels):
+        axes = figure.add_subplot(grid[0, index])
+        for series_label, rows in series.items():
+            axes.plot(column(rows, "particles"), column(rows, name), marker="o", label=series_label)
+        axes.set_xscale("log")
+        if log_y:
+            axes.set_yscale("log")
+        axes.set_xlabel("particles")
+        axes.set_ylabel(label)
+        axes.grid(True, which="both", alpha=0.3)
+    figure.axes[0].legend(fontsize="small")
+
+    # Every phase any run had gets the same color in all panels
+    phases = []
+    for rows in series.values():
+        for row in rows:
+            phases += [name for name in row if name.startswith("phase_") and name not in phases]
+    colors = plt.get_cmap("tab20")
+
+    for index, (series_label, rows) in enumerate(series.items()):
+        axes = figure.add_subplot(grid[1 + index // 3, index % 3])
+        positions = range(len(rows))
+
+        # The phases as a share of their sum, the steps' time that the simulator did not time is left out
+        totals = [sum(float(row[name]) for name in phases if row.get(name)) for row in rows]
+        bottoms = [0.0] * len(rows)
+        for phase_index, name in enumerate(phases):
+            shares = [float(row[name]) / total if row.get(name) and total > 0 else 0.0
+                      for row, total in zip(rows, totals)]
+            if not any(shares):
+                continue
+
+            axes.bar(positions, shares, bottom=bottoms, color=colors(phase_index % 20),
+                     label=name[len("phase_"):-len("_ms")].replace("_", " "))
+            bottoms = [bottom + share for bottom, share in zip(bottoms, shares)]
+
+        axes.set_xticks(list(positions))
+        axes.set_xticklabels([row["particles"] for row in rows], rotation=45, fontsize="small")
+        axes.set_ylim(0, 1)
+        axes.set_title(series_label, fontsize="medium")
+        axes.set_ylabel("share of the step")
+        axes.legend(fontsize="x-small", loc="upper left", bbox_to_anchor=(1.0, 1.0))
+
+    figure.tight_layout()
+    figure.savefig(args.output, dpi=120)
+    print("Wrote " + args.output)
+
+
+if __name__ == "__main__":
+    main()
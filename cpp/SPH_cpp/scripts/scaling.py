@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""Sweeps SPH_batch over particle counts, backends, OpenCL devices and pressure solvers, one process per run.
+
+Every run is a separate SPH_batch process, so its peak memory is its own. The rows SPH_batch writes with --csv are
+collected into one CSV, with a column per phase of the simulators (ms/step), for scripts/plot_scaling.py:
+
+    python3 scripts/scaling.py --batch build/SPH_batch --output scaling.csv
+    python3 scripts/plot_scaling.py scaling.csv
+
+Unless --keep-domain is given, each run gets a cube of fluid in a box sized for its particle count, keeping the
+mass of a particle and the lattice spacing of the scenario. The work per particle then stays the same and
+ns/particle-step shows where a backend stops scaling: flat while it does, rising once it runs out of cache, memory
+bandwidth or device memory.
+"""
+
+import argparse
+import csv
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_PARTICLES = [1000, 4000, 16000, 64000, 256000, 1048576, 4194304]
+
+
+def parse_list(text, convert=str):
+    return [convert(item) for item in text.split(",") if item.strip()]
+
+
+def read_scenario(file_name):
+    """The "key = value" lines of a scenario file, later lines winning like in Scenario::load"""
+    values = {}
+    with open(file_name) as scenario:
+        for line in scenario:
+            line = line.split("#", 1)[0]
+            if "=" in line:
+                key, value = line.split("=", 1)
+                values[key.strip()] = value.strip()
+    return values
+
+
+def domain_overrides(scenario, particles):
+    """A box twice as wide as a cube of the particles on the scenario's lattice, with the cube against its left wall"""
+    kernel_size = float(scenario.get("kernel_size", 0.2))
+    spacing = float(scenario.get("layout_spacing", 0)) or kernel_size / 2
+
+    base_particles = int(scenario.get("particles", particles))
+    particle_mass = float(scenario.get("total_mass", 1000000.0)) / base_particles
+
+    # The lattice is filled from the bottom up, a partial top layer is fine
+    side_count = math.ceil(round(particles ** (1.0 / 3.0), 6))
+    side = side_count * spacing
+
+    # A quarter spacing of slack keeps the lattice's column count from being rounded down
+    return [
+        "particles=%d" % particles,
+        "total_mass=%g" % (particle_mass * particles),
+        "container=box",
+        "layout=lattice",
+        "layout_spacing=%g" % spacing,
+        "layout_min=%g %g %g" % (-side + spacing / 2, spacing / 2, -side / 2 + spacing / 2),
+        "layout_max=%g %g %g" % (-spacing / 4, side, side / 2 - spacing / 4),
+        "left_bound=%g" % -side,
+        "right_bound=%g" % side,
+        "bottom_bound=0",
+        "top_bound=%g" % (1.5 * side),
+        "near_bound=%g" % (-side / 2),
+        "far_bound=%g" % (side / 2),
+    ]
+
+
+def run(args, overrides):
+    """Runs SPH_batch once. Returns its CSV row, or None and the reason it failed"""
+    handle, csv_file_name = tempfile.mkstemp(suffix=".csv")
+    os.close(handle)
+
+    command = [args.batch, args.scenario] + overrides + ["--csv", csv_file_name]
+    try:
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                universal_newlines=True, timeout=args.timeout)
+        if result.returncode != 0:
+            lines = result.stdout.strip().splitlines()
+            return None, "failed (%d): %s" % (result.returncode, lines[-1] if lines else "no output")
+
+        with open(csv_file_name) as run_csv:
+            rows = list(csv.DictReader(run_csv))
+        if not rows:
+            return None, "no results"
+        return rows[0], None
+    except subprocess.TimeoutExpired:
+        return None, "timed out after %g s" % args.timeout
+    finally:
+        os.remove(csv_file_name)
+
+
+def write_rows(file_name, rows):
+    # The phases differ between the backends, so the columns are the union of all rows', in the order first seen
+    columns = []
+    for row in rows:
+        columns += [column for column in row if column not in columns]
+
+    with open(file_name, "w", newline="") as output:
+        writer = csv.DictWriter(output, fieldnames=columns, restval="")
+        writer.writeheader()
+        writer.writerows(rows)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--batch", default=os.path.join("build", "SPH_batch"), help="the SPH_batch executable")
+    parser.add_argument("--scenario", default=os.path.join("scenarios", "scaling.scenario"),
+                        help="the scenario every run starts from")
+    parser.add_argument("--output", default="scaling.csv")
+    parser.add_argument("--particles", type=lambda text: parse_list(text, int), default=DEFAULT_PARTICLES,
+                        help="comma separated particle counts")
+    parser.add_argument("--backends", type=parse_list, default=["cpp", "opencl"],
+                        help="comma separated backends: cpp, opencl, pbf, flip")
+    parser.add_argument("--opencl-devices", type=lambda text: parse_list(text, int), default=[1],
+                        help="comma separated OpenCL devices, counted from 1")
+    parser.add_argument("--solvers", type=parse_list, default=["state_equation", "pcisph", "dfsph"],
+                        help="comma separated pressure solvers, only the C++ and OpenCL simulators have them")
+    parser.add_argument("--steps", type=int, help="timed steps of each run, the scenario's by default")
+    parser.add_argument("--warmup-steps", type=int, help="untimed steps before them, the scenario's by default")
+    parser.add_argument("--set", action="append", default=[], metavar="KEY=VALUE",
+                        help="any other scenario key for all runs, may be repeated")
+    parser.add_argument("--timeout", type=float, default=3600.0, help="seconds before a run is given up")
+    parser.add_argument("--keep-domain", action="store_true",
+                        help="keep the scenario's container and layout instead of sizing them for each run")
+    parser.add_argument("--stop-after-failure", action="store_true",
+                        help="skip the larger particle counts of a configuration once one of its runs fails")
+    args = parser.parse_args()
+
+    scenario = read_scenario(args.scenario)
+
+    common = list(args.set)
+    if args.steps is not None:
+        common.append("steps=%d" % args.steps)
+    if args.warmup_steps is not None:
+        common.append("warmup_steps=%d" % args.warmup_steps)
+
+    configurations = []
+    for backend in args.backends:
+        devices = args.opencl_devices if backend == "opencl" else [0]
+        solvers = args.solvers if backend in ("cpp", "opencl") else [scenario.get("pressure_solver", "state_equation")]
+        for device in devices:
+            for solver in solvers:
+                configurations.append((backend, device, solver))
+
+    rows = []
+    for backend, device, solver in configurations:
+        for particles in sorted(args.particles):
+            overrides = ["backend=%s" % backend, "pressure_solver=%s" % solver]
+            if backend == "opencl":
+                overrides.append("opencl_device=%d" % device)
+            if args.keep_domain:
+                overrides.append("particles=%d" % particles)
+            else:
+                overrides += domain_overrides(scenario, particles)
+            overrides += common
+
+            label = "%s%s %s %d particles" % (backend, " device %d" % device if backend == "opencl" else "",
+                                               solver, particles)
+            print("%-50s" % label, end="", flush=True)
+
+            start = time.time()
+            row, failure = run(args, overrides)
+            if row is None:
+                print(failure)
+                rows.append({"backend": backend, "opencl_device": device, "pressure_solver": solver,
+                             "particles": particles, "status": failure})
+            else:
+                print("%10.2f steps/s %10.1f ns/particle-step %10.1f MiB  (%.0f s)" % (
+                    float(row["steps_per_s"]), float(row["ns_per_particle_step"]), float(row["peak_memory_mib"]),
+                    time.time() - start))
+                row["status"] = "ok"
+                rows.append(row)
+
+            # Written after every run, so a sweep that is stopped still leaves its results
+            write_rows(args.output, rows)
+
+            if row is None and args.stop_after_failure:
+                break
+
+    print("Wrote %d runs to %s" % (len(rows), args.output))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,14 @@
+#version 330 core
+
+in vec3 view_normal;
+
+out vec4 color;
+
+uniform vec3 lDir;
+
+const vec3 WATER = vec3(0.1, 0.3, 0.6);
+
+void main() {
+    float diffuse = max(dot(normalize(view_normal), normalize(lDir)), 0.0);
+    color = vec4(WATER * (0.4 + 0.6 * diffuse), 1.0);
+}
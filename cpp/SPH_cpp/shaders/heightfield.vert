@@ -0,0 +1,15 @@
+#version 330 core
+
+layout (location = 0) in vec3 position;
+layout (location = 1) in vec3 normal;
+
+out vec3 view_normal;
+
+uniform mat4 MV;
+uniform mat4 P;
+
+void main() {
+    // The heightfield is never scaled, so the normals only need rotating
+    view_normal = mat3(MV) * normal;
+    gl_Position = P * MV * vec4(position, 1.0);
+}
@@ -2,72 +2,242 @@
 
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <algorithm>
+#include <functional>
 #include "sph_kernels.h"
+#include "common/parallel_chunks.hpp"
 #include "Parameters.hpp"
 
-void CppParticleSimulator::setupSimulation(const Parameters &parameters,
-                                           const std::vector<glm::vec3> &particle_positions,
-                                           const std::vector<glm::vec3> &particle_velocities,
-                                           const GLuint &vbo_positions,
-                                           const GLuint &vbo_velocities) {
-    positions = particle_positions;
-    velocities = particle_velocities;
+bool CppParticleSimulator::setupSimulation(const Parameters &parameters,
+                                           Span<const glm::vec3> particle_positions,
+                                           Span<const glm::vec3> particle_velocities,
+                                           std::string &error) {
+    PROFILE_ZONE("CppParticleSimulator::setupSimulation");
 
-    vbo_pos = vbo_positions;
-    vbo_vel = vbo_velocities;
+    positions.assign(particle_positions.begin(), particle_positions.end());
+    velocities.assign(particle_velocities.begin(), particle_velocities.end());
+
+    // Reserve room for the whole particle pool up front so that spawning never reallocates
+    positions.reserve(parameters.max_particles);
+    velocities.reserve(parameters.max_particles);
+    forces.reserve(parameters.max_particles);
+    densities.reserve(parameters.max_particles);
+    neighbourCounts.reserve(parameters.max_particles);
+    halfStepVelocities.reserve(parameters.max_particles);
+    previousAccelerations.reserve(parameters.max_particles);
+    accelerations.reserve(parameters.max_particles);
+    splitLevels.reserve(parameters.max_particles);
 
     forces.resize(positions.size());
     velocities.resize(positions.size());
     densities.resize(positions.size());
+    neighbourCounts.resize(positions.size());
+    divergenceStiffness.assign(positions.size(), 0.0f);
+    densityStiffness.assign(positions.size(), 0.0f);
+    halfStepVelocities.assign(velocities.begin(), velocities.end());
+    previousAccelerations.assign(positions.size(), glm::vec3(0, 0, 0));
+    accelerations.assign(positions.size(), glm::vec3(0, 0, 0));
+    splitLevels.assign(positions.size(), 0);
+    updateParticleSizes(parameters);
+
+    boundary_sdf = SignedDistanceField::create_from_parameters(parameters);
+    boundary_particles.sample(boundary_sdf, parameters);
+
+    return true;
 }
 
 void CppParticleSimulator::updateSimulation(const Parameters &params, float dt_seconds) {
+    PROFILE_ZONE("CppParticleSimulator::updateSimulation");
+
+    PhaseClock clock(phase_timings);
+
+    updateParticlePool(params, dt_seconds);
+    ++counters.steps;
+    counters.particle_steps += positions.size();
+
+    // A changed integrator starts over from the current velocities, as if the fluid had not been accelerated before
+    if (params.get_active_integrator() != activeIntegrator) {
+        activeIntegrator = params.get_active_integrator();
+        halfStepVelocities.assign(velocities.begin(), velocities.end());
+        previousAccelerations.assign(positions.size(), glm::vec3(0, 0, 0));
+    }
+
+    // Without multi-rate timestepping every particle is on level 0, and the frame is a single step
+    const unsigned int substepCount = assignTimestepLevels(params, dt_seconds);
+    clock.lap("particle pool");
+
+    // The sub-steps time their own phases, and add their solver iterations to the frame's
+    solverIterations = 0;
+    for (timestep_info.substep = 0; timestep_info.substep < substepCount; ++timestep_info.substep) {
+        stepSimulation(params, dt_seconds / substepCount);
+    }
+    clock.restart();
+
+    // The split particles may start outside the container, so the boundaries are checked again
+    if (params.adaptive_resolution) {
+        adaptResolution(params);
+        checkBoundaries(params);
+        clock.lap("adaptive resolution");
+    }
+
+    // Only the alive range is handed out, i.e. for uploading to the renderer's VBOs
+    if (publishParticleState()) {
+        clock.lap("upload");
+    }
+}
+
+void CppParticleSimulator::stepSimulation(const Parameters &params, float dt_seconds) {
+    PROFILE_ZONE("CppParticleSimulator::stepSimulation");
+
+    const bool use_boundary_particles = params.boundary_handling == BoundaryHandling::Particles;
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+    const float kernelSize2 = params.kernel_size * params.kernel_size;
+    const float inverseBaseMass = 1 / params.get_particle_mass();
+
+    PhaseClock clock(phase_timings);
+
+    // Bucket the particles so that only the neighbouring cells have to be searched
+    clVoxelGridInfo grid_info;
+    params.set_voxel_grid_info(grid_info);
+    grid.build(grid_info, positions);
+
+    // Particles in sleeping cells keep their density and neither move nor get forces calculated
+    sleeping_cells.update(params, grid, velocities);
+    clock.lap("grid");
 
     // Set forces to 0 and calculate densities
+    unsigned long long neighbourPairs = 0;
     for (int i = 0; i < positions.size(); ++i) {
+        // Between their steps the particles keep the density and forces of the last one
+        if (!isTimestepActive(i)) {
+            continue;
+        }
+
         forces[i] = {0, 0, 0};
+
+        if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            continue;
+        }
+
         float density = 0;
+        float neighbourCount = 0;
+
+        grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+            glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+            density += masses[j] * Wpoly6(relativePos, pairKernelSize(i, j));
+
+            // Counting the neighbours is a cheap way to find the particles with a partial neighbourhood
+            // Split particles count by their mass, so that they don't make the surface look deeper
+            const bool isNeighbour = glm::dot(relativePos, relativePos) < kernelSize2;
+            neighbourCount += isNeighbour * masses[j] * inverseBaseMass;
+            neighbourPairs += isNeighbour;
+        });
+
+        // Boundary particles contribute with their volume weight instead of a mass
+        if (use_boundary_particles) {
+            boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                glm::vec3 relativePos = grid.get_relative_position(positions[i], boundaryPositions[b]);
+                density += boundaryVolumes[b] * Wpoly6(relativePos, smoothingLengths[i]);
 
-        for (int j = 0; j < positions.size(); ++j) {
-            glm::vec3 relativePos = positions[i] - positions[j];
-            density += params.get_particle_mass() * Wpoly6(relativePos, params.kernel_size);
+                // The walls fill up the neighbourhood as well, they are not a free surface
+                const bool isNeighbour = glm::dot(relativePos, relativePos) < kernelSize2;
+                neighbourCount += isNeighbour;
+                neighbourPairs += isNeighbour;
+            });
         }
 
         densities[i] = density;
+        neighbourCounts[i] = static_cast<unsigned int>(neighbourCount + 0.5f);
+    }
+    counters.neighbour_pairs += neighbourPairs;
+
+    sleeping_cells.update_densities(params, grid, densities);
+    clock.lap("densities");
+
+    // DFSPH makes the velocities divergence-free before the forces are calculated from them
+    if (params.pressure_solver == PressureSolver::DFSPH) {
+        params.set_solver_info(solver_info, dt_seconds);
+        calculateFactorsDFSPH(params);
+        solverIterations += solveDivergenceDFSPH(params, dt_seconds);
     }
 
+    // The implicit viscosity changes the velocities directly, so the forces leave it out
+    if (params.implicit_viscosity) {
+        solveViscosityImplicit(params, dt_seconds);
+    }
+
+    if (params.pressure_solver == PressureSolver::DFSPH || params.implicit_viscosity) {
+        clock.lap("velocity solves");
+    }
+
+    // The state equation's pressure is part of the forces, the incompressible solvers find it separately
+    const bool useStateEquation = params.pressure_solver == PressureSolver::StateEquation;
+
     // Calculate forces
     for (int i = 0; i < positions.size(); ++i) {
+        if (!isTimestepActive(i) || sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            continue;
+        }
+
         float iPressure = (densities[i] - params.rest_density) * params.k_gas;
-        float cs = 0;
         glm::vec3 n = {0, 0, 0};
         float laplacianCs = 0;
 
+        // Interior particles have a (close to) zero color field gradient and get no tension force anyway,
+        // so the color field is only evaluated for particles near the surface
+        const bool isSurface = neighbourCounts[i] < params.surface_neighbour_count;
+
         glm::vec3 pressureForce = {0, 0, 0};
         glm::vec3 viscosityForce = {0, 0, 0};
+        glm::vec3 vorticity = {0, 0, 0};
 
-        for (int j = 0; j < positions.size(); ++j) {
-            glm::vec3 relativePos = positions[i] - positions[j];
+        grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+            glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+            const float h = pairKernelSize(i, j);
 
             // Particle j's pressure force on i
-            float jPressure = (densities[j] - params.rest_density) * params.k_gas;
-            pressureForce = pressureForce - params.get_particle_mass() *
-                ((iPressure + jPressure) / (2 * densities[j])) *
-                gradWspiky(relativePos, params.kernel_size);
+            if (useStateEquation) {
+                float jPressure = (densities[j] - params.rest_density) * params.k_gas;
+                pressureForce = pressureForce - masses[j] *
+                    ((iPressure + jPressure) / (2 * densities[j])) *
+                    gradWspiky(relativePos, h);
+            }
 
             // Particle j's viscosity force in i
-            viscosityForce += params.k_viscosity *
-                params.get_particle_mass() * ((velocities[j] - velocities[i]) / densities[j]) *
-                laplacianWviscosity(relativePos, params.kernel_size);
+            if (!params.implicit_viscosity) {
+                viscosityForce += params.k_viscosity *
+                    masses[j] * ((velocities[j] - velocities[i]) / densities[j]) *
+                    laplacianWviscosity(relativePos, h);
+            }
 
-            // cs for particle j
-            cs += params.get_particle_mass() * (1 / densities[j]) * Wpoly6(relativePos, params.kernel_size);
+            if (isSurface) {
+                // Gradient of cs for particle j
+                n += masses[j] * (1 / densities[j]) * gradWpoly6(relativePos, h);
 
-            // Gradient of cs for particle j
-            n += params.get_particle_mass() * (1 / densities[j]) * gradWpoly6(relativePos, params.kernel_size);
+                // Laplacian of cs for particle j
+                laplacianCs += masses[j] * (1 /densities[j]) * laplacianWpoly6(relativePos, h);
+            }
 
-            // Laplacian of cs for particle j
-            laplacianCs += params.get_particle_mass() * (1 /densities[j]) * laplacianWpoly6(relativePos, params.kernel_size);
+            // The curl of the velocity, which decides where the adaptive resolution splits particles
+            if (params.adaptive_resolution) {
+                vorticity += masses[j] / densities[j] * glm::cross(velocities[j] - velocities[i],
+                                                                   gradWspiky(relativePos, h));
+            }
+        });
+
+        vorticities[i] = glm::length(vorticity);
+
+        // Boundary particles push back with the particle's own pressure (Akinci et al. 2012)
+        // Negative pressures are ignored so that the fluid does not stick to the walls
+        if (use_boundary_particles && useStateEquation) {
+            const float boundaryPressure = std::max(iPressure, 0.0f) / densities[i];
+
+            boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                pressureForce -= boundaryVolumes[b] * boundaryPressure *
+                    gradWspiky(grid.get_relative_position(positions[i], boundaryPositions[b]), smoothingLengths[i]);
+            });
         }
 
         glm::vec3 tensionForce;
@@ -80,165 +250,858 @@ void CppParticleSimulator::updateSimulation(const Parameters &params, float dt_s
 
         //glm::vec3 n = {0, 0, 0};
         glm::vec3 boundaryForce = {0, 0, 0};
-        boundaryForce = calculateBoundaryForceGlass(params, i);
+        if (!use_boundary_particles) {
+            boundaryForce = calculateBoundaryForce(params, i);
+        }
 
         // Add external forces on i
-        forces[i] = pressureForce + viscosityForce + tensionForce + params.gravity + boundaryForce;
+        forces[i] = pressureForce + viscosityForce + tensionForce + boundaryForce;
+    }
+    clock.lap("forces");
 
-        // Euler time step
-        velocities[i] += (forces[i] / densities[i]) * dt_seconds;
-        positions[i] += velocities[i] * dt_seconds;
+    // The incompressible solvers move the particles at the end of their solve, which is timed as a whole
+    if (params.pressure_solver == PressureSolver::PCISPH) {
+        solvePressurePCISPH(params, dt_seconds);
+        clock.lap("pressure solve");
+    } else if (params.pressure_solver == PressureSolver::DFSPH) {
+        solverIterations += solveDensityDFSPH(params, dt_seconds);
+        clock.lap("pressure solve");
+    } else {
+        integrate(params, dt_seconds);
+    }
 
+    checkBoundaries(params);
+    clock.lap("integration");
+}
+
+unsigned int CppParticleSimulator::assignTimestepLevels(const Parameters &params, float dt_seconds) {
+    params.set_timestep_info(timestep_info, dt_seconds);
+    timestepLevels.resize(positions.size());
+
+    // The incompressible solvers correct all particles together, so they all take the finest step
+    const bool perParticle = params.pressure_solver == PressureSolver::StateEquation;
+
+    unsigned int finestLevel = 0;
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        // The last step's acceleration, spawned particles only go by their speed
+        const float speed = glm::length(velocities[i]);
+        const float acceleration = glm::length(accelerations[i]);
+
+        // Moving at most the Courant number of the smoothing length, also from the acceleration alone
+        const float distance = params.courant_number * smoothingLengths[i];
+
+        unsigned int level = 0;
+        float step = dt_seconds;
+        while (level < timestep_info.max_timestep_level &&
+               (speed * step > distance || 0.5f * acceleration * step * step > distance)) {
+            ++level;
+            step *= 0.5f;
+        }
+
+        timestepLevels[i] = static_cast<unsigned char>(level);
+        finestLevel = std::max(finestLevel, level);
     }
 
-    checkBoundariesGlass(params);
+    if (!perParticle) {
+        std::fill(timestepLevels.begin(), timestepLevels.end(), static_cast<unsigned char>(finestLevel));
+    }
 
-    glBindBuffer (GL_ARRAY_BUFFER, vbo_pos);
-    glBufferData (GL_ARRAY_BUFFER, positions.size() * 3 * sizeof (float), positions.data(), GL_STATIC_DRAW);
+    timestep_info.finest_level = finestLevel;
+    return 1u << finestLevel;
 }
 
+unsigned int CppParticleSimulator::solveViscosityImplicit(const Parameters &params, float dt_seconds) {
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+
+    viscosityResidual.resize(n);
+    viscosityDirection.resize(n);
+    viscosityProduct.resize(n);
+
+    // With the current velocities as the first guess the residual is the explicit viscosity's velocity change.
+    // The weights m / (density_i * density_j) make the operator symmetric, which conjugate gradients needs. With
+    // split particles the mass is the pair's mean, for the same reason. The loops are split over a few threads, see
+    // parallel_chunks, the velocity and residual sums go together
+    const glm::vec2 sums = parallel_sum<glm::vec2>(n, [&](unsigned int begin, unsigned int end) {
+        glm::vec2 chunkSums = {0, 0};
+
+        for (unsigned int i = begin; i < end; ++i) {
+            glm::vec3 residual = {0, 0, 0};
+
+            if (!sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+                    const float mass = 0.5f * (masses[i] + masses[j]);
+                    residual += dt_seconds * params.k_viscosity * mass / (densities[i] * densities[j]) *
+                        laplacianWviscosity(grid.get_relative_position(positions[i], positions[j]),
+                                            pairKernelSize(i, j)) *
+                        (velocities[j] - velocities[i]);
+                });
+            }
+
+            viscosityResidual[i] = residual;
+            viscosityDirection[i] = residual;
+            chunkSums += glm::vec2(glm::dot(velocities[i], velocities[i]), glm::dot(residual, residual));
+        }
 
-glm::vec3 CppParticleSimulator::calculateBoundaryForce(const Parameters &params, int i){
+        return chunkSums;
+    });
 
-    glm::vec3 boundaryForce = {0, 0, 0};
-    glm::vec3 r = {0, 0, 0};
-    float radius = 0;
-    float hardness = 10.0f;
+    const float velocitySum = sums.x;
+    float residualSum = sums.y;
 
+    const float tolerance2 = params.viscosity_error_tolerance * params.viscosity_error_tolerance * velocitySum;
 
-    // Future solution
-    //glm::vec3 n = {0, 1, 0};
-    //float d = positions[i].y - Params::bottomBound;
-    //glm::vec3 r = n*d;
+    unsigned int iterations = 0;
+    while (residualSum > tolerance2 && iterations < params.max_viscosity_iterations) {
+        applyViscosityOperator(params, dt_seconds, viscosityDirection, viscosityProduct);
 
-    // BOTTOM BOUND
-    r = {0, positions[i].y - params.bottom_bound, 0};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
+        const float directionProduct = parallel_sum<float>(n, [&](unsigned int begin, unsigned int end) {
+            float chunkSum = 0;
+            for (unsigned int i = begin; i < end; ++i) {
+                chunkSum += glm::dot(viscosityDirection[i], viscosityProduct[i]);
+            }
+            return chunkSum;
+        });
+
+        const float alpha = residualSum / directionProduct;
+
+        const float nextResidualSum = parallel_sum<float>(n, [&](unsigned int begin, unsigned int end) {
+            float chunkSum = 0;
+            for (unsigned int i = begin; i < end; ++i) {
+                velocities[i] += alpha * viscosityDirection[i];
+                viscosityResidual[i] -= alpha * viscosityProduct[i];
+                chunkSum += glm::dot(viscosityResidual[i], viscosityResidual[i]);
+            }
+            return chunkSum;
+        });
+
+        const float beta = nextResidualSum / residualSum;
+        parallel_chunks(n, [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+            for (unsigned int i = begin; i < end; ++i) {
+                viscosityDirection[i] = viscosityResidual[i] + beta * viscosityDirection[i];
+            }
+        });
+
+        residualSum = nextResidualSum;
+        ++iterations;
+    }
+
+    return iterations;
+}
+
+void CppParticleSimulator::applyViscosityOperator(const Parameters &params, float dt_seconds,
+                                                  const std::vector<glm::vec3> &x,
+                                                  std::vector<glm::vec3> &product) {
+    // Each particle only writes its own product, so the particles are split over a few threads
+    parallel_chunks(static_cast<unsigned int>(positions.size()),
+                    [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; ++i) {
+            product[i] = x[i];
+
+            if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                continue;
+            }
+
+            // The sleeping neighbours' velocities are fixed, so they only pull on the diagonal
+            grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+                const float mass = 0.5f * (masses[i] + masses[j]);
+                const float weight = dt_seconds * params.k_viscosity * mass / (densities[i] * densities[j]) *
+                    laplacianWviscosity(grid.get_relative_position(positions[i], positions[j]), pairKernelSize(i, j));
+
+                product[i] += weight * x[i];
+                if (!sleeping_cells.is_asleep(grid.get_particle_cell(j))) {
+                    product[i] -= weight * x[j];
+                }
+            });
+        }
+    });
+}
+
+void CppParticleSimulator::integrate(const Parameters &params, float dt_seconds) {
+    for (int i = 0; i < positions.size(); ++i) {
+        if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            accelerations[i] = {0, 0, 0};
+            continue;
+        }
+
+        // The forces are per volume, gravity is an acceleration, like in the solvers and the OpenCL kernels
+        const glm::vec3 acceleration = forces[i] / densities[i] + params.gravity;
+        accelerations[i] = acceleration;
+
+        if (activeIntegrator == TimeIntegrator::Leapfrog) {
+            // Kick the half-step velocity a whole step and drift with it. The forces of the next step are
+            // calculated with the full-step velocity, extrapolated half a step with this acceleration
+            halfStepVelocities[i] += acceleration * dt_seconds;
+            positions[i] += halfStepVelocities[i] * dt_seconds;
+            velocities[i] = halfStepVelocities[i] + acceleration * (dt_seconds / 2);
+        } else if (activeIntegrator == TimeIntegrator::VelocityVerlet) {
+            // The last step predicted the velocity with its own acceleration, correct it with the average of
+            // that and the new one: v(t) = v(t - dt) + (a(t - dt) + a(t)) * dt / 2
+            velocities[i] += (acceleration - previousAccelerations[i]) * (dt_seconds / 2);
+            positions[i] += (velocities[i] + acceleration * (dt_seconds / 2)) * dt_seconds;
+            velocities[i] += acceleration * dt_seconds;
+            previousAccelerations[i] = acceleration;
+        } else {
+            // Euler time step
+            velocities[i] += acceleration * dt_seconds;
+            positions[i] += velocities[i] * dt_seconds;
+        }
+    }
+}
+
+void CppParticleSimulator::solvePressurePCISPH(const Parameters &params, float dt_seconds) {
+    const bool use_boundary_particles = params.boundary_handling == BoundaryHandling::Particles;
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+
+    const float mass = params.get_particle_mass();
+    const float h = params.kernel_size;
+
+    // PCISPH keeps the particles at a spacing of half a kernel size, see latticeDensity. Split particles have the
+    // same rest density, so the unsplit particles' constants are used for all of them
+    const float restDensity = latticeDensity(mass, h);
+    const float restDensity2 = restDensity * restDensity;
+    const float delta = pcisphDelta(mass, restDensity, h, dt_seconds);
+
+    // The boundary particle weights are for Parameters::rest_density
+    const float boundaryScale = restDensity / params.rest_density;
+
+    // The safety limit on the pressure acceleration, a tenth of a kernel size of movement per step
+    const float maxAcceleration = 0.1f * h / (dt_seconds * dt_seconds);
+    unsigned int limitedParticles = 0;
+
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+    predictedPositions.resize(n);
+    pressures.assign(n, 0.0f);
+    pressureAccelerations.assign(n, glm::vec3(0, 0, 0));
+
+    // The non-pressure accelerations stay the same during the iterations
+    for (unsigned int i = 0; i < n; ++i) {
+        forces[i] = forces[i] / densities[i] + params.gravity;
+    }
+
+    unsigned int iterations = 0;
+    while (iterations < params.max_solver_iterations) {
+        // Predict where the particles end up with the current pressures
+        for (unsigned int i = 0; i < n; ++i) {
+            if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                predictedPositions[i] = positions[i];
+            } else {
+                const glm::vec3 velocity = velocities[i] + (forces[i] + pressureAccelerations[i]) * dt_seconds;
+                predictedPositions[i] = positions[i] + velocity * dt_seconds;
+            }
+        }
+
+        // Correct each particle's pressure by the density error at its predicted position
+        // Only compression is corrected, so that the free surface does not pull the fluid together
+        float densityErrorSum = 0;
+
+        for (unsigned int i = 0; i < n; ++i) {
+            if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                continue;
+            }
+
+            float predictedDensity = 0;
+
+            grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+                const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i], predictedPositions[j]);
+                predictedDensity += masses[j] * Wpoly6(relativePos, pairKernelSize(i, j));
+            });
+
+            if (use_boundary_particles) {
+                boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                    const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i],
+                                                                             boundaryPositions[b]);
+                    predictedDensity += boundaryScale * boundaryVolumes[b] * Wpoly6(relativePos, smoothingLengths[i]);
+                });
+            }
+
+            const float densityError = std::max(predictedDensity - restDensity, 0.0f);
+            densityErrorSum += densityError;
+
+            pressures[i] += delta * densityError;
+        }
+
+        // The pressure accelerations from the corrected pressures
+        limitedParticles = 0;
+        for (unsigned int i = 0; i < n; ++i) {
+            if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                continue;
+            }
+
+            glm::vec3 acceleration = {0, 0, 0};
+
+            grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+                const glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+                acceleration -= masses[j] * ((pressures[i] + pressures[j]) / restDensity2) *
+                                gradWspiky(relativePos, pairKernelSize(i, j));
+            });
+
+            // Boundary particles push back with the particle's own pressure (Akinci et al. 2012)
+            if (use_boundary_particles) {
+                boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                    const glm::vec3 relativePos = grid.get_relative_position(positions[i], boundaryPositions[b]);
+                    acceleration -= boundaryScale * boundaryVolumes[b] * (pressures[i] / restDensity2) *
+                                    gradWspiky(relativePos, smoothingLengths[i]);
+                });
+            }
+
+            const float accelerationLength = glm::length(acceleration);
+            if (accelerationLength > maxAcceleration) {
+                acceleration *= maxAcceleration / accelerationLength;
+                ++limitedParticles;
+            }
+
+            pressureAccelerations[i] = acceleration;
+        }
+
+        ++iterations;
+
+        const float averageDensityError = n > 0 ? densityErrorSum / n / restDensity : 0.0f;
+        if (iterations >= params.min_solver_iterations && averageDensityError < params.density_error_tolerance) {
+            break;
+        }
     }
 
-    // RIGHT BOUND
-    r = {positions[i].x - params.right_bound, 0, 0};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = boundaryForce -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
+    // Only the particles the final pressures leave held back
+    solverIterations += iterations;
+    counters.limited_pressure_particles += limitedParticles;
+
+    for (unsigned int i = 0; i < n; ++i) {
+        if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            accelerations[i] = {0, 0, 0};
+            continue;
+        }
+
+        // Semi-implicit Euler time step with the corrected pressures
+        accelerations[i] = forces[i] + pressureAccelerations[i];
+        velocities[i] += accelerations[i] * dt_seconds;
+        positions[i] += velocities[i] * dt_seconds;
     }
+}
+
+void CppParticleSimulator::calculateFactorsDFSPH(const Parameters &params) {
+    const bool use_boundary_particles = params.boundary_handling == BoundaryHandling::Particles;
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+    solverDensities.resize(n);
+    solverFactors.resize(n);
+    stiffnessIncrements.resize(n);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        // Sleeping particles are at rest, and still divide their zero stiffness by a density when their awake
+        // neighbours are corrected
+        if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            solverDensities[i] = solver_info.rest_density;
+            solverFactors[i] = 0;
+            continue;
+        }
+
+        float density = 0;
+        glm::vec3 gradientSum = {0, 0, 0};
+        float gradientSquaredSum = 0;
+
+        grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+            const glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+            const float h = pairKernelSize(i, j);
+            const glm::vec3 gradient = masses[j] * gradWspiky(relativePos, h);
+
+            density += masses[j] * Wpoly6(relativePos, h);
+            gradientSum += gradient;
+            gradientSquaredSum += glm::dot(gradient, gradient);
+        });
+
+        // The boundary particles only take part in the sum, since they do not move
+        if (use_boundary_particles) {
+            boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                const glm::vec3 relativePos = grid.get_relative_position(positions[i], boundaryPositions[b]);
+                const float volume = solver_info.boundary_scale * boundaryVolumes[b];
 
-    // LEFT BOUND
-    r = {positions[i].x - params.left_bound, 0, 0};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = boundaryForce -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
+                density += volume * Wpoly6(relativePos, smoothingLengths[i]);
+                gradientSum += volume * gradWspiky(relativePos, smoothingLengths[i]);
+            });
+        }
+
+        const float denominator = glm::dot(gradientSum, gradientSum) + gradientSquaredSum;
+
+        solverDensities[i] = density;
+        // A pair of nearly overlapping particles has almost no gradient, which would give them an enormous stiffness
+        solverFactors[i] = density / std::max(denominator, solver_info.min_denominator);
     }
+}
 
-    // FAR BOUND
-    r = {0, 0, positions[i].z - params.far_bound};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = boundaryForce -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
+float CppParticleSimulator::densityChangeDFSPH(const Parameters &params, unsigned int i) {
+    float densityChange = 0;
+
+    grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+        const glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+        densityChange += masses[j] * glm::dot(velocities[i] - velocities[j],
+                                              gradWspiky(relativePos, pairKernelSize(i, j)));
+    });
+
+    if (params.boundary_handling == BoundaryHandling::Particles) {
+        const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+        const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+        boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+            const glm::vec3 relativePos = grid.get_relative_position(positions[i], boundaryPositions[b]);
+            densityChange += solver_info.boundary_scale * boundaryVolumes[b] *
+                             glm::dot(velocities[i], gradWspiky(relativePos, smoothingLengths[i]));
+        });
     }
 
-    // NEAR BOUND
-    r = {0, 0, positions[i].z - params.near_bound};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = boundaryForce -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
+    return densityChange;
+}
+
+unsigned int CppParticleSimulator::applyStiffnessDFSPH(const Parameters &params, const std::vector<float> &stiffness,
+                                                       float dt_seconds) {
+    const bool use_boundary_particles = params.boundary_handling == BoundaryHandling::Particles;
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+
+    // Like in PCISPH, overlapping particles are separated by at most a tenth of a kernel size per correction
+    const float maxVelocityChange = solver_info.max_velocity_change;
+    unsigned int limitedParticles = 0;
+
+    // The velocity changes only depend on the positions, so they can be applied right away
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        if (sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            continue;
+        }
+
+        glm::vec3 velocityChange = {0, 0, 0};
+        const float iStiffness = stiffness[i] / solverDensities[i];
+
+        grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+            velocityChange -= dt_seconds * masses[j] * (iStiffness + stiffness[j] / solverDensities[j]) *
+                              gradWspiky(grid.get_relative_position(positions[i], positions[j]), pairKernelSize(i, j));
+        });
+
+        if (use_boundary_particles) {
+            boundary_particles.get_grid().for_each_neighbour(positions[i], [&](unsigned int b) {
+                const glm::vec3 relativePos = grid.get_relative_position(positions[i], boundaryPositions[b]);
+                velocityChange -= dt_seconds * solver_info.boundary_scale * boundaryVolumes[b] * iStiffness *
+                                  gradWspiky(relativePos, smoothingLengths[i]);
+            });
+        }
+
+        const float velocityChangeLength = glm::length(velocityChange);
+        if (velocityChangeLength > maxVelocityChange) {
+            velocityChange *= maxVelocityChange / velocityChangeLength;
+            ++limitedParticles;
+        }
+
+        velocities[i] += velocityChange;
     }
 
-    return boundaryForce;
+    return limitedParticles;
 }
 
+unsigned int CppParticleSimulator::solveDivergenceDFSPH(const Parameters &params, float dt_seconds) {
+    const float restDensity = solver_info.rest_density;
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+
+    // Warm start with half of last step's stiffness, which is stored without the time step since it varies
+    // Sleeping particles, with a zero factor, start over
+    for (unsigned int i = 0; i < n; ++i) {
+        divergenceStiffness[i] = solverFactors[i] != 0 ? 0.5f * divergenceStiffness[i] / dt_seconds : 0.0f;
+    }
+    unsigned int limitedParticles = applyStiffnessDFSPH(params, divergenceStiffness, dt_seconds);
 
-glm::vec3 CppParticleSimulator::calculateBoundaryForceGlass(const Parameters &params, int i){
+    unsigned int iterations = 0;
+    for (; iterations < params.max_solver_iterations; ++iterations) {
+        // Only compression is corrected, so that the free surface does not pull the fluid together
+        float errorSum = 0;
 
-    glm::vec3 boundaryForce = {0, 0, 0};
-    glm::vec3 r = {0, 0, 0};
-    float distance = 0.0f;
-    float diff = 0.0f;
-    float radius = 0;
-    float hardness = 10.0f;
+        for (unsigned int i = 0; i < n; ++i) {
+            stiffnessIncrements[i] = 0;
 
+            if (solverFactors[i] == 0 || sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                continue;
+            }
 
-    // BOTTOM BOUND
-    r = {0, positions[i].y - params.bottom_bound, 0};
-    radius = sqrt(pow(r.x,2.0f) + pow(r.y,2.0f) + pow(r.z,2.0f));
-    if(radius < params.kernel_size){
-        boundaryForce = -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
-        velocities[i] *= params.k_wall_friction;
+            const float densityChange = std::max(densityChangeDFSPH(params, i), 0.0f);
+            errorSum += densityChange * dt_seconds;
+
+            stiffnessIncrements[i] = densityChange / dt_seconds * solverFactors[i];
+            divergenceStiffness[i] += stiffnessIncrements[i];
+        }
+
+        const float averageError = n > 0 ? errorSum / n / restDensity : 0.0f;
+        if (iterations >= params.min_solver_iterations && averageError < params.divergence_error_tolerance) {
+            break;
+        }
+
+        limitedParticles = applyStiffnessDFSPH(params, stiffnessIncrements, dt_seconds);
     }
 
-    //WALLS BOUND
-    distance = sqrt(pow(positions[i].x,2.0f) + pow(positions[i].z,2.0f));
-    diff = params.top_bound - distance;
-    r = -positions[i]*diff/distance;
+    // Only the particles the last correction left held back
+    counters.limited_pressure_particles += limitedParticles;
 
-    if(diff < params.kernel_size){
-        boundaryForce += -params.get_particle_mass() * hardness * gradWspiky(r, params.kernel_size);
-        velocities[i] *= params.k_wall_friction;
+    for (unsigned int i = 0; i < n; ++i) {
+        divergenceStiffness[i] *= dt_seconds;
     }
 
-    return boundaryForce;
+    return iterations;
 }
 
-void CppParticleSimulator::checkBoundaries(const Parameters &params) {
-    for (int i = 0; i < positions.size(); ++i) {
+unsigned int CppParticleSimulator::solveDensityDFSPH(const Parameters &params, float dt_seconds) {
+    const float restDensity = solver_info.rest_density;
+    const unsigned int n = static_cast<unsigned int>(positions.size());
 
+    // The velocities with the non-pressure forces, which the density solve then corrects. The velocities before
+    // are kept in the accelerations, which become the whole step's velocity change once the pressure is found
+    for (unsigned int i = 0; i < n; ++i) {
+        accelerations[i] = velocities[i];
 
-        if (positions[i].y < params.bottom_bound || positions[i].y > params.top_bound) {
-            positions[i].y = fmax(fmin(positions[i].y, params.top_bound), params.bottom_bound);
-            velocities[i].y = params.k_wall_damper * (- velocities[i].y);
+        if (!sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            velocities[i] += (forces[i] / densities[i] + params.gravity) * dt_seconds;
         }
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        densityStiffness[i] = solverFactors[i] != 0 ? 0.5f * densityStiffness[i] / (dt_seconds * dt_seconds) : 0.0f;
+    }
+    unsigned int limitedParticles = applyStiffnessDFSPH(params, densityStiffness, dt_seconds);
+
+    unsigned int iterations = 0;
+    for (; iterations < params.max_solver_iterations; ++iterations) {
+        float errorSum = 0;
 
-        if (positions[i].x < params.left_bound || positions[i].x > params.right_bound) {
-            positions[i].x = fmax(fmin(positions[i].x, params.right_bound), params.left_bound);
-            velocities[i].x = params.k_wall_damper * (- velocities[i].x);
+        for (unsigned int i = 0; i < n; ++i) {
+            stiffnessIncrements[i] = 0;
+
+            if (solverFactors[i] == 0 || sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+                continue;
+            }
+
+            // The density the particle would get by moving with its current velocity
+            const float predictedDensity = solverDensities[i] + dt_seconds * densityChangeDFSPH(params, i);
+            const float densityError = std::max(predictedDensity - restDensity, 0.0f);
+            errorSum += densityError;
+
+            stiffnessIncrements[i] = densityError / (dt_seconds * dt_seconds) * solverFactors[i];
+            densityStiffness[i] += stiffnessIncrements[i];
         }
 
-        if (positions[i].z < params.near_bound || positions[i].z > params.far_bound) {
-            positions[i].z = fmax(fmin(positions[i].z, params.far_bound), params.near_bound);
-            velocities[i].z = params.k_wall_damper * (- velocities[i].z);
+        const float averageError = n > 0 ? errorSum / n / restDensity : 0.0f;
+        if (iterations >= params.min_solver_iterations && averageError < params.density_error_tolerance) {
+            break;
         }
+
+        limitedParticles = applyStiffnessDFSPH(params, stiffnessIncrements, dt_seconds);
     }
+
+    // Only the particles the last correction left held back
+    counters.limited_pressure_particles += limitedParticles;
+
+    for (unsigned int i = 0; i < n; ++i) {
+        densityStiffness[i] *= dt_seconds * dt_seconds;
+        accelerations[i] = (velocities[i] - accelerations[i]) / dt_seconds;
+
+        if (!sleeping_cells.is_asleep(grid.get_particle_cell(i))) {
+            positions[i] += velocities[i] * dt_seconds;
+        }
+    }
+
+    return iterations;
 }
 
-void CppParticleSimulator::checkBoundariesGlass(const Parameters &params) {
-    for (int i = 0; i < positions.size(); ++i) {
+unsigned int CppParticleSimulator::getParticleDrawCount() {
+    return static_cast<unsigned int>(positions.size());
+}
+
+void CppParticleSimulator::readParticleState(const ParticleStateCallback &callback) {
+    callback(positions, velocities);
+}
+
+const ShallowWater *CppParticleSimulator::getShallowWater() {
+    return shallow_water_enabled ? &shallow_water : nullptr;
+}
+
+unsigned int CppParticleSimulator::getSolverIterations() {
+    return solverIterations;
+}
 
-        float dp = 0.01f;
-        float radius = sqrt(pow(positions[i].x,2.0f) + pow(positions[i].z,2.0f));
+bool CppParticleSimulator::getGridOccupancy(GridOccupancy &occupancy) {
+    occupancy = grid.get_occupancy();
+    return true;
+}
 
-        if (radius > params.right_bound && positions[i].x > 0 && positions[i].z > 0) {
-            positions[i].x -= dp;
-            positions[i].z -= dp;
-            velocities[i].x = params.k_wall_damper * (- velocities[i].x);
-            velocities[i].z = params.k_wall_damper * (- velocities[i].x);
+void CppParticleSimulator::getSolverState(SolverState &state) {
+    state.add_value("active_integrator", activeIntegrator);
+    state.add("half_step_velocities", halfStepVelocities);
+    state.add("previous_accelerations", previousAccelerations);
+    state.add("accelerations", accelerations);
+    state.add("split_levels", splitLevels);
+    state.add("divergence_stiffness", divergenceStiffness);
+    state.add("density_stiffness", densityStiffness);
+    particle_flow.get_state(state);
+    state.add_text("random_generator", random_generator);
+}
+
+void CppParticleSimulator::setSolverState(const SolverState &state) {
+    const size_t n = positions.size();
+
+    // Without the integrator the next step would take its state for a stale one and start it over
+    state.get_value("active_integrator", activeIntegrator);
+    state.get("half_step_velocities", halfStepVelocities, n);
+    state.get("previous_accelerations", previousAccelerations, n);
+    state.get("accelerations", accelerations, n);
+    state.get("divergence_stiffness", divergenceStiffness, n);
+    state.get("density_stiffness", densityStiffness, n);
+    particle_flow.set_state(state);
+    state.get_text("random_generator", random_generator);
+
+    // The masses and smoothing lengths follow from the split levels at the start of each step
+    state.get("split_levels", splitLevels, n);
+}
+
+void CppParticleSimulator::updateParticlePool(const Parameters &params, float dt_seconds) {
+    // The heightfield starts over from still water whenever it is turned on
+    if (params.shallow_water && !shallow_water_enabled) {
+        shallow_water.build(params, boundary_sdf);
+    }
+    shallow_water_enabled = params.shallow_water;
+
+    const float particleVolume = params.get_particle_rest_volume();
+
+    // Particles leaving the active region become part of the heightfield
+    ParticleFlow::RemoveTest absorb;
+    if (shallow_water_enabled) {
+        absorb = [&](unsigned int i) {
+            if (shallow_water.is_active(positions[i])) {
+                return false;
+            }
+
+            shallow_water.absorb(positions[i], velocities[i], particleVolume / (1u << splitLevels[i]));
+            return true;
+        };
+    }
+
+    particle_flow.drain(params, positions, [&](unsigned int i) { removeParticle(i); }, counters, absorb);
+
+    particle_flow.emit(params, dt_seconds, static_cast<unsigned int>(positions.size()), random_generator,
+                       [&](const glm::vec3 &position, const glm::vec3 &velocity) {
+        addParticle(position, velocity, 0);
+    }, counters);
+
+    // The heightfield flows around the active region, and whatever flows into it is spawned as particles
+    if (shallow_water_enabled) {
+        shallow_water.set_active_depths(positions, particleVolume);
+        shallow_water.update(params, dt_seconds);
+
+        shallow_water.for_each_inflow_particle(particleVolume, random_generator,
+                                               [&](const glm::vec3 &position, const glm::vec3 &velocity) {
+            if (positions.size() >= params.max_particles) {
+                ++counters.dropped_particles;
+                return false;
+            }
+
+            addParticle(position, velocity, 0);
+            ++counters.spawned_particles;
+            return true;
+        });
+    }
+
+    forces.resize(positions.size());
+    densities.resize(positions.size());
+    neighbourCounts.resize(positions.size());
+
+    // Spawned particles start without a warm start, and as if they had not been accelerated before
+    divergenceStiffness.resize(positions.size(), 0.0f);
+    densityStiffness.resize(positions.size(), 0.0f);
+    previousAccelerations.resize(positions.size(), glm::vec3(0, 0, 0));
+    accelerations.resize(positions.size(), glm::vec3(0, 0, 0));
+
+    updateParticleSizes(params);
+}
+
+void CppParticleSimulator::updateParticleSizes(const Parameters &params) {
+    masses.resize(positions.size());
+    smoothingLengths.resize(positions.size());
+    vorticities.resize(positions.size(), 0.0f);
+
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        masses[i] = params.get_particle_mass() / (1u << splitLevels[i]);
+        smoothingLengths[i] = params.kernel_size / std::cbrt(static_cast<float>(1u << splitLevels[i]));
+    }
+}
+
+void CppParticleSimulator::removeParticle(unsigned int i) {
+    positions[i] = positions.back();
+    velocities[i] = velocities.back();
+    forces[i] = forces.back();
+    densities[i] = densities.back();
+    neighbourCounts[i] = neighbourCounts.back();
+    divergenceStiffness[i] = divergenceStiffness.back();
+    densityStiffness[i] = densityStiffness.back();
+    halfStepVelocities[i] = halfStepVelocities.back();
+    previousAccelerations[i] = previousAccelerations.back();
+    accelerations[i] = accelerations.back();
+    splitLevels[i] = splitLevels.back();
+    masses[i] = masses.back();
+    smoothingLengths[i] = smoothingLengths.back();
+    vorticities[i] = vorticities.back();
+    positions.pop_back();
+    velocities.pop_back();
+    forces.pop_back();
+    densities.pop_back();
+    neighbourCounts.pop_back();
+    divergenceStiffness.pop_back();
+    densityStiffness.pop_back();
+    halfStepVelocities.pop_back();
+    previousAccelerations.pop_back();
+    accelerations.pop_back();
+    splitLevels.pop_back();
+    masses.pop_back();
+    smoothingLengths.pop_back();
+    vorticities.pop_back();
+}
+
+void CppParticleSimulator::addParticle(const glm::vec3 &position, const glm::vec3 &velocity,
+                                       unsigned char splitLevel) {
+    positions.push_back(position);
+    velocities.push_back(velocity);
+    halfStepVelocities.push_back(velocity);
+    splitLevels.push_back(splitLevel);
+}
+
+void CppParticleSimulator::adaptResolution(const Parameters &params) {
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+
+    // Merging pairs up the particles first, so that the split ones don't get merged right away
+    std::vector<bool> merged(n, false);
+    std::vector<unsigned int> removed;
+
+    auto canMerge = [&](unsigned int i) {
+        return splitLevels[i] > 0 && !merged[i] &&
+               neighbourCounts[i] >= params.merge_neighbour_count &&
+               vorticities[i] < 0.5f * params.split_vorticity;
+    };
+
+    for (unsigned int i = 0; i < n; ++i) {
+        if (!canMerge(i)) {
+            continue;
+        }
+
+        // The closest particle of the same level that is calm enough as well
+        unsigned int partner = i;
+        float closestDistance2 = smoothingLengths[i] * smoothingLengths[i];
+
+        grid.for_each_neighbour(positions[i], [&](unsigned int j) {
+            const glm::vec3 relativePos = grid.get_relative_position(positions[i], positions[j]);
+            const float distance2 = glm::dot(relativePos, relativePos);
+
+            if (j != i && splitLevels[j] == splitLevels[i] && distance2 < closestDistance2 && canMerge(j)) {
+                partner = j;
+                closestDistance2 = distance2;
+            }
+        });
+
+        if (partner == i) {
+            continue;
         }
 
-        if (radius > params.right_bound && positions[i].x < 0 && positions[i].z > 0) {
-            positions[i].x += dp;
-            positions[i].z -= dp;
-            velocities[i].x = params.k_wall_damper * (- velocities[i].x);
-            velocities[i].z = params.k_wall_damper * (- velocities[i].x);
+        // Both have the same mass, so the merged particle sits in the middle and keeps the momentum
+        positions[i] -= 0.5f * grid.get_relative_position(positions[i], positions[partner]);
+        velocities[i] = 0.5f * (velocities[i] + velocities[partner]);
+        halfStepVelocities[i] = 0.5f * (halfStepVelocities[i] + halfStepVelocities[partner]);
+        --splitLevels[i];
+
+        merged[i] = merged[partner] = true;
+        removed.push_back(partner);
+    }
+
+    // Splitting the particles with a partial neighbourhood or in swirling flow
+    for (unsigned int i = 0; i < n; ++i) {
+        if (merged[i] || splitLevels[i] >= params.max_split_level || positions.size() >= params.max_particles) {
+            continue;
         }
-        if (radius > params.right_bound && positions[i].x > 0 && positions[i].z < 0) {
-            positions[i].x -= dp;
-            positions[i].z += dp;
-            velocities[i].x = params.k_wall_damper * (- velocities[i].x);
-            velocities[i].z = params.k_wall_damper * (- velocities[i].x);
+
+        const bool isSurface = neighbourCounts[i] < params.surface_neighbour_count;
+        if (!isSurface && vorticities[i] <= params.split_vorticity) {
+            continue;
         }
 
-        if (radius > params.right_bound && positions[i].x < 0 && positions[i].z < 0) {
-            positions[i].x += dp;
-            positions[i].z += dp;
-            velocities[i].x = params.k_wall_damper * (- velocities[i].x);
-            velocities[i].z = params.k_wall_damper * (- velocities[i].x);
+        // The children sit a quarter of their smoothing length either side of the parent, in a random direction
+        glm::vec3 direction(distribution(random_generator), distribution(random_generator),
+                            distribution(random_generator));
+        if (glm::dot(direction, direction) < 1e-6f) {
+            direction = glm::vec3(0, 1, 0);
         }
 
-        if (positions[i].y < params.bottom_bound || positions[i].y > params.top_bound) {
-            positions[i].y = fmax(fmin(positions[i].y, params.top_bound), params.bottom_bound);
-            velocities[i].y = params.k_wall_damper * (- velocities[i].y);
+        const glm::vec3 offset = 0.25f * smoothingLengths[i] / std::cbrt(2.0f) * glm::normalize(direction);
+
+        ++splitLevels[i];
+        addParticle(positions[i] + offset, velocities[i], splitLevels[i]);
+        halfStepVelocities.back() = halfStepVelocities[i];
+        positions[i] -= offset;
+    }
+
+    // The new particles start like spawned ones, the next step calculates the rest of their state
+    forces.resize(positions.size());
+    densities.resize(positions.size(), params.rest_density);
+    neighbourCounts.resize(positions.size(), 0);
+    divergenceStiffness.resize(positions.size(), 0.0f);
+    densityStiffness.resize(positions.size(), 0.0f);
+    previousAccelerations.resize(positions.size(), glm::vec3(0, 0, 0));
+    accelerations.resize(positions.size(), glm::vec3(0, 0, 0));
+    updateParticleSizes(params);
+
+    // Removing from the back first, so that the swapped in particles are never ones that still have to go
+    std::sort(removed.begin(), removed.end(), std::greater<unsigned int>());
+    for (unsigned int i : removed) {
+        removeParticle(i);
+    }
+}
+
+
+glm::vec3 CppParticleSimulator::calculateBoundaryForce(const Parameters &params, int i) {
+    const float hardness = 10.0f;
+
+    // xyz is the normal pointing into the container, w the distance to the closest wall
+    const glm::vec4 boundary = boundary_sdf.sample(positions[i]);
+    const float distance = boundary.w;
+
+    if (distance >= smoothingLengths[i]) {
+        return {0, 0, 0};
+    }
+
+    velocities[i] *= params.k_wall_friction;
+
+    // r points from the closest wall point towards the inside, also for particles that penetrated the wall
+    const glm::vec3 r = glm::vec3(boundary) * std::abs(distance);
+    return -masses[i] * hardness * gradWspiky(r, smoothingLengths[i]);
+}
+
+void CppParticleSimulator::checkBoundaries(const Parameters &params) {
+    for (int i = 0; i < positions.size(); ++i) {
+        const glm::vec4 boundary = boundary_sdf.sample(positions[i]);
+        const float distance = boundary.w;
+
+        if (distance < 0) {
+            const glm::vec3 normal(boundary);
+
+            // Project the particle back onto the wall and reflect the velocity component going into it
+            positions[i] -= distance * normal;
+
+            const float normal_velocity = glm::dot(velocities[i], normal);
+            if (normal_velocity < 0) {
+                velocities[i] -= (1 + params.k_wall_damper) * normal_velocity * normal;
+            }
+
+            // Leapfrog would otherwise keep moving the particle into the wall with its half-step velocity
+            if (activeIntegrator == TimeIntegrator::Leapfrog) {
+                const float half_step_normal_velocity = glm::dot(halfStepVelocities[i], normal);
+                if (half_step_normal_velocity < 0) {
+                    halfStepVelocities[i] -= (1 + params.k_wall_damper) * half_step_normal_velocity * normal;
+                }
+            }
         }
 
+        // Particles leaving through a periodic side come back in through the opposite one
+        positions[i] = grid.wrap_position(positions[i]);
     }
-}
\ No newline at end of file
+}
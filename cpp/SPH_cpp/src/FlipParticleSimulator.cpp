@@ -0,0 +1,152 @@
+#include "FlipParticleSimulator.hpp"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+bool FlipParticleSimulator::setupSimulation(const Parameters &parameters,
+                                            Span<const glm::vec3> particle_positions,
+                                            Span<const glm::vec3> particle_velocities,
+                                            std::string &error) {
+    PROFILE_ZONE("FlipParticleSimulator::setupSimulation");
+
+    positions.assign(particle_positions.begin(), particle_positions.end());
+    velocities.assign(particle_velocities.begin(), particle_velocities.end());
+
+    // Reserve room for the whole particle pool up front so that spawning never reallocates
+    positions.reserve(parameters.max_particles);
+    velocities.reserve(parameters.max_particles);
+
+    velocities.resize(positions.size());
+
+    boundary_sdf = SignedDistanceField::create_from_parameters(parameters);
+
+    // The container never changes, so neither do the solid cells
+    clVoxelGridInfo grid_info;
+    parameters.set_voxel_grid_info(grid_info);
+    grid.build(grid_info, boundary_sdf);
+
+    return true;
+}
+
+void FlipParticleSimulator::updateSimulation(const Parameters &params, float dt_seconds) {
+    PROFILE_ZONE("FlipParticleSimulator::updateSimulation");
+
+    PhaseClock clock(phase_timings);
+
+    updateParticlePool(params, dt_seconds);
+    ++counters.steps;
+    counters.particle_steps += positions.size();
+    clock.lap("particle pool");
+
+    grid.mark_fluid_cells(positions);
+    grid.particles_to_grid(positions, velocities);
+    grid.save_velocities();
+
+    grid.add_acceleration(params.gravity, dt_seconds);
+    grid.enforce_solid_walls();
+    clock.lap("particles to grid");
+
+    projectPressure(params);
+    clock.lap("pressure");
+
+    gridToParticles(params);
+    clock.lap("grid to particles");
+
+    advectParticles(dt_seconds);
+    checkBoundaries();
+    clock.lap("advection");
+
+    // Only the alive range is handed out, i.e. for uploading to the renderer's VBOs
+    if (publishParticleState()) {
+        clock.lap("upload");
+    }
+}
+
+void FlipParticleSimulator::projectPressure(const Parameters &params) {
+    grid.calculate_divergence(divergence);
+
+    // The fluid cells change every step, so the hierarchy does too. It is cheap next to the solve
+    pressure_solver.build(grid.get_dimensions(), grid.get_cells());
+    solverIterations = pressure_solver.solve(divergence, pressure, params.flip_pressure_tolerance,
+                                             params.max_solver_iterations);
+
+    grid.subtract_pressure_gradient(pressure);
+}
+
+void FlipParticleSimulator::gridToParticles(const Parameters &params) {
+    const float flipRatio = params.flip_ratio;
+
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        const glm::vec3 flipVelocity = velocities[i] + grid.sample_velocity_change(positions[i]);
+        const glm::vec3 picVelocity = grid.sample_velocity(positions[i]);
+
+        velocities[i] = flipRatio * flipVelocity + (1 - flipRatio) * picVelocity;
+    }
+}
+
+void FlipParticleSimulator::advectParticles(float dt_seconds) {
+    // The particle velocities are noisy with FLIP, the grid's divergence free field moves them more evenly
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        const glm::vec3 midpoint = positions[i] + 0.5f * dt_seconds * grid.sample_velocity(positions[i]);
+        positions[i] += dt_seconds * grid.sample_velocity(midpoint);
+    }
+}
+
+void FlipParticleSimulator::checkBoundaries() {
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        const glm::vec4 boundary = boundary_sdf.sample(positions[i]);
+        const glm::vec3 normal(boundary);
+        const float distance = boundary.w;
+
+        if (distance < 0) {
+            positions[i] -= distance * normal;
+
+            // Keep the tangential velocity, the grid already handles the friction
+            const float normalVelocity = glm::dot(velocities[i], normal);
+            if (normalVelocity < 0) {
+                velocities[i] -= normalVelocity * normal;
+            }
+        }
+    }
+}
+
+unsigned int FlipParticleSimulator::getParticleDrawCount() {
+    return static_cast<unsigned int>(positions.size());
+}
+
+void FlipParticleSimulator::readParticleState(const ParticleStateCallback &callback) {
+    callback(positions, velocities);
+}
+
+unsigned int FlipParticleSimulator::getSolverIterations() {
+    return solverIterations;
+}
+
+void FlipParticleSimulator::getSolverState(SolverState &state) {
+    state.add("pressure", pressure);
+    particle_flow.get_state(state);
+    state.add_text("random_generator", random_generator);
+}
+
+void FlipParticleSimulator::setSolverState(const SolverState &state) {
+    // One pressure per cell of the grid the setup built, which only fits if the bounds did not change
+    state.get("pressure", pressure, grid.get_cells().size());
+    particle_flow.set_state(state);
+    state.get_text("random_generator", random_generator);
+}
+
+void FlipParticleSimulator::updateParticlePool(const Parameters &params, float dt_seconds) {
+    particle_flow.drain(params, positions, [&](unsigned int i) {
+        positions[i] = positions.back();
+        velocities[i] = velocities.back();
+        positions.pop_back();
+        velocities.pop_back();
+    }, counters);
+
+    particle_flow.emit(params, dt_seconds, static_cast<unsigned int>(positions.size()), random_generator,
+                       [&](const glm::vec3 &position, const glm::vec3 &velocity) {
+        positions.push_back(position);
+        velocities.push_back(velocity);
+    }, counters);
+}
@@ -1,21 +1,30 @@
 #include "OpenCL/OpenClParticleSimulator.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 #include "OpenCL/opencl_context_info.hpp"
 
 #include "common/FileReader.hpp"
+#include "VoxelGrid.hpp"
+
+namespace {
+    // Written to the counters before the kernels add to them, enqueued without waiting so it has to outlive the call
+    const cl_uint zero_count = 0;
+}
 
-#include "common/tic_toc.hpp"
+OpenClParticleSimulator::OpenClParticleSimulator() {
+}
 
-void Exit() {
-    std::exit(1);
+OpenClParticleSimulator::OpenClParticleSimulator(OpenClBufferSharing *sharing) : buffer_sharing(sharing) {
 }
 
 OpenClParticleSimulator::~OpenClParticleSimulator() {
     // TODO clean up allocated space on the GPU (clRelease[...] ?)
 }
 
-void OpenClParticleSimulator::createAndBuildKernel(cl_kernel &kernel_out, std::string kernel_name,
-                                                   std::string kernel_file_name) {
+bool OpenClParticleSimulator::createAndBuildKernel(cl_kernel &kernel_out, std::string kernel_name,
+                                                   std::string kernel_file_name, std::string &error_message) {
     //std::cout << "Creating kernel \"" << kernel_name << "\" from file kernels/" << kernel_file_name << ".\n\n";
     const auto kernel_str = FileReader::ReadFromFile("../kernels/" + kernel_file_name);
 
@@ -27,45 +36,80 @@ void OpenClParticleSimulator::createAndBuildKernel(cl_kernel &kernel_out, std::s
 
     cl_program program = clCreateProgramWithSource(context, 1, &kernel_cstr,
                                                    (const size_t *) &kernel_str_size, &error);
+    if (error != CL_SUCCESS) {
+        error_message = kernel_file_name + ": " + GetErrorString(error);
+        return false;
+    }
 
-    CheckError(error);
     error = clBuildProgram(program, 1, &deviceIds[chosen_device_id - 1], NULL, NULL, NULL);
     if (error == CL_BUILD_PROGRAM_FAILURE) {
         // Determine the size of the log
         size_t log_size;
         clGetProgramBuildInfo(program, deviceIds[chosen_device_id - 1], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
 
-        // Allocate memory for the log
-        char *log = (char *) malloc(log_size);
+        // Get the log, which ends with a null character
+        std::string log(log_size, '\0');
+        clGetProgramBuildInfo(program, deviceIds[chosen_device_id - 1], CL_PROGRAM_BUILD_LOG, log_size, &log[0], NULL);
 
-        // Get the log
-        clGetProgramBuildInfo(program, deviceIds[chosen_device_id - 1], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-
-        // Print the log
-        std::cout << log << "\n";
+        error_message = kernel_file_name + " failed to build:\n" + log.c_str();
+        return false;
+    } else if (error != CL_SUCCESS) {
+        error_message = kernel_file_name + ": " + GetErrorString(error);
+        return false;
     }
 
-    CheckError(error);
-
     kernel_out = clCreateKernel(program, kernel_name.c_str(), &error);
-    CheckError(error);
+    if (error != CL_SUCCESS) {
+        error_message = kernel_file_name + ", " + kernel_name + ": " + GetErrorString(error);
+        return false;
+    }
+
+    return true;
 }
 
-void OpenClParticleSimulator::setupSharedBuffers(const GLuint &vbo_positions, const GLuint &vbo_velocities) {
-    cl_int error;
+void OpenClParticleSimulator::createParticleBuffers(Span<const glm::vec3> particle_positions,
+                                                    Span<const glm::vec3> particle_velocities) {
+    cl_int error = CL_SUCCESS;
 
     // R/W buffers
-    cl_positions = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, vbo_positions, &error);
-    CheckError(error);
-    error = clRetainMemObject(cl_positions);
-    CheckError(error);
-    cl_velocities = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, vbo_velocities, &error);
-    CheckError(error);
-    error = clRetainMemObject(cl_velocities);
-    CheckError(error);
+    if (buffer_sharing) {
+        buffer_sharing->create_buffers(context, cl_positions, cl_velocities);
+    } else {
+        cl_positions = clCreateBuffer(context, CL_MEM_READ_WRITE, 3 * max_particles * sizeof(cl_float), NULL, &error);
+        CheckError(error);
+        cl_velocities = clCreateBuffer(context, CL_MEM_READ_WRITE, 3 * max_particles * sizeof(cl_float), NULL,
+                                       &error);
+        CheckError(error);
+    }
+
+    /* The initial particles, the pool's dead ones are filled in by allocateParticlePoolBuffers */
+    acquireParticleBuffers();
+    if (!particle_positions.empty()) {
+        error = clEnqueueWriteBuffer(command_queue, cl_positions, CL_TRUE, 0,
+                                     3 * n_particles * sizeof(cl_float),
+                                     (const void *) particle_positions.data(), NULL, NULL, NULL);
+        CheckError(error);
+    }
+    if (!particle_velocities.empty()) {
+        error = clEnqueueWriteBuffer(command_queue, cl_velocities, CL_TRUE, 0,
+                                     3 * std::min(particle_velocities.size(), n_particles) * sizeof(cl_float),
+                                     (const void *) particle_velocities.data(), NULL, NULL, NULL);
+        CheckError(error);
+    }
+    releaseParticleBuffers();
+    clFinish(command_queue);
+}
 
-    cgl_objects.push_back(cl_positions);
-    cgl_objects.push_back(cl_velocities);
+void OpenClParticleSimulator::acquireParticleBuffers() {
+    if (buffer_sharing) {
+        buffer_sharing->acquire_buffers(command_queue);
+    }
+}
+
+void OpenClParticleSimulator::releaseParticleBuffers() {
+    if (buffer_sharing) {
+        buffer_sharing->release_buffers(command_queue);
+    }
 }
 
 void OpenClParticleSimulator::allocateVoxelGridBuffer(const Parameters &params) {
@@ -127,8 +171,21 @@ void OpenClParticleSimulator::allocateVoxelGridBuffer(const Parameters &params)
     error = clRetainMemObject(cl_densities);
     CheckError(error);
 
+    /* Setup neighbour count buffer, laid out like the densities */
+    cl_neighbour_counts = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                         voxel_cell_particle_indices_zeroes.size() * sizeof(cl_uint),
+                                         NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_neighbour_counts, CL_TRUE, 0,
+                                 voxel_cell_particle_indices_zeroes.size() * sizeof(cl_uint),
+                                 (const void *) voxel_cell_particle_indices_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_neighbour_counts);
+    CheckError(error);
+
     /* Setup force calculation buffer */
-    std::vector<cl_float3> particle_forces_zeroes(n_particles);
+    std::vector<cl_float3> particle_forces_zeroes(max_particles);
 
     cl_forces = clCreateBuffer(context, CL_MEM_READ_WRITE,
                                particle_forces_zeroes.size() * sizeof(cl_float3),
@@ -143,491 +200,1779 @@ void OpenClParticleSimulator::allocateVoxelGridBuffer(const Parameters &params)
     CheckError(error);
 }
 
-void OpenClParticleSimulator::setupSimulation(const Parameters &params,
-                                              const std::vector<glm::vec3> &particle_positions,
-                                              const std::vector<glm::vec3> &particle_velocities,
-                                              const GLuint &vbo_positions,
-                                              const GLuint &vbo_velocities) {
-    positions = particle_positions;
-
-    initOpenCL();
-    std::cout << "\nOpenCL ready to use: context created.\n\n";
-
-    n_particles = particle_positions.size();
+void OpenClParticleSimulator::allocateBoundaryBuffer(const Parameters &params) {
+    cl_int error = CL_SUCCESS;
 
+    boundary_sdf = SignedDistanceField::create_from_parameters(params);
+    boundary_sdf.set_boundary_info(boundary_info, params);
 
-    // Here we can use OpenCL functionality
-    // cl_int error = CL_SUCCESS;
+    const std::vector<glm::vec4> &sdf_data = boundary_sdf.get_data();
 
-    setupSharedBuffers(vbo_positions, vbo_velocities);
-    allocateVoxelGridBuffer(params);
+    cl_boundary_sdf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                     sdf_data.size() * sizeof(cl_float4),
+                                     NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_boundary_sdf, CL_TRUE, 0,
+                                 sdf_data.size() * sizeof(cl_float4),
+                                 (const void *) sdf_data.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_boundary_sdf);
+    CheckError(error);
 
-    createAndBuildKernel(simple_integration, "taskParallelIntegrateVelocity", "update_particle_positions.cl");
-    createAndBuildKernel(calculate_voxel_grid, "calculate_voxel_grid", "calculate_voxel_grid.cl");
-    createAndBuildKernel(reset_voxel_grid, "reset_voxel_grid", "calculate_voxel_grid.cl");
-    createAndBuildKernel(simple_voxel_grid_move, "simple_voxel_grid_move", "simple_voxel_grid_move.cl");
-    createAndBuildKernel(calculate_particle_densities, "calculate_particle_densities", "simulate_fluid_particles.cl");
-    createAndBuildKernel(calculate_particle_forces, "calculate_forces", "simulate_fluid_particles.cl");
-    createAndBuildKernel(integrate_particle_states, "integrate_particle_states", "integrate_particle_states.cl");
-}
+    /* Setup boundary particles, stored in the order of the voxel grid cells */
+    boundary_particles.sample(boundary_sdf, params);
 
-void OpenClParticleSimulator::updateSimulation(const Parameters &parameters, float dt_seconds) {
-    parameters.set_voxel_grid_info(grid_info);
-    parameters.set_fluid_info(fluid_info, parameters.n_particles);
-    n_particles = parameters.n_particles;
+    const std::vector<glm::vec3> &boundary_positions = boundary_particles.get_positions();
+    const std::vector<float> &boundary_volumes = boundary_particles.get_volumes();
+    const std::vector<unsigned int> &sorted_indices = boundary_particles.get_grid().get_sorted_indices();
 
-    // Make sure all OpenGL commands will run before enqueueing OpenCL kernels
-    glFlush();
+    // Always allocate at least one element, since zero-sized buffers are not allowed
+    std::vector<cl_float4> boundary_particle_data(std::max(boundary_particles.size(), 1u));
+    for (unsigned int i = 0; i < sorted_indices.size(); ++i) {
+        const unsigned int b = sorted_indices[i];
 
-    //std::vector<cl_event> events;
-    cl_event event;
-    cl_int error;
+        boundary_particle_data[i].s[0] = boundary_positions[b].x;
+        boundary_particle_data[i].s[1] = boundary_positions[b].y;
+        boundary_particle_data[i].s[2] = boundary_positions[b].z;
+        boundary_particle_data[i].s[3] = boundary_volumes[b];
+    }
 
-#ifdef MY_DEBUG
-    tic();
-#endif
-    error = clEnqueueAcquireGLObjects(command_queue, cgl_objects.size(), (const cl_mem *) cgl_objects.data(),
-                                      0, NULL, NULL);
+    cl_boundary_particles = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                           boundary_particle_data.size() * sizeof(cl_float4),
+                                           NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_boundary_particles, CL_TRUE, 0,
+                                 boundary_particle_data.size() * sizeof(cl_float4),
+                                 (const void *) boundary_particle_data.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_boundary_particles);
     CheckError(error);
 
-    runCalculateVoxelGridKernel(dt_seconds);
-    runCalculateParticleDensitiesKernel(dt_seconds);
-    runCalculateParticleForcesKernel();
-    runResetVoxelGridKernel();
-    runIntegrateParticleStatesKernel(dt_seconds);
+    const std::vector<unsigned int> &boundary_cell_start = boundary_particles.get_grid().get_cell_start();
 
-    error = clEnqueueReleaseGLObjects(command_queue, (cl_uint) cgl_objects.size(), (const cl_mem *) cgl_objects.data(),
-                                      0, NULL, &event);
+    cl_boundary_cell_start = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                            boundary_cell_start.size() * sizeof(cl_uint),
+                                            NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_boundary_cell_start, CL_TRUE, 0,
+                                 boundary_cell_start.size() * sizeof(cl_uint),
+                                 (const void *) boundary_cell_start.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_boundary_cell_start);
     CheckError(error);
-
-    //clWaitForEvents(1, &event);
-    clFinish(command_queue);
-#ifdef MY_DEBUG
-    toc();
-#endif
 }
 
-void OpenClParticleSimulator::initOpenCL() {
-    cl_uint platformIdCount = 0;
-    clGetPlatformIDs(0, NULL, &platformIdCount);
+void OpenClParticleSimulator::allocateParticlePoolBuffers(const Parameters &params) {
+    cl_int error = CL_SUCCESS;
 
+    const size_t initial_particles = positions.size();
 
-    if (platformIdCount == 0) {
-        std::cerr << "No OpenCL platform found" << std::endl;
-        Exit();
-    } else {
-        std::cout << "Found " << platformIdCount << " platform(s)" << std::endl;
-    }
+    /* Mark the initial particles as alive and the rest of the pool as dead */
+    std::vector<cl_uint> alive(max_particles, 0);
+    std::fill(alive.begin(), alive.begin() + initial_particles, 1);
 
-    // Resize vector to actual amount of platform ids and get the ids
-    platformIds.resize(platformIdCount);
-    clGetPlatformIDs(platformIdCount, platformIds.data(), NULL);
+    cl_alive = clCreateBuffer(context, CL_MEM_READ_WRITE, max_particles * sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_alive, CL_TRUE, 0,
+                                 max_particles * sizeof(cl_uint),
+                                 (const void *) alive.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_alive);
+    CheckError(error);
 
-    for (cl_uint i = 0; i < platformIdCount; ++i) {
-        std::cout << "\t (" << (i + 1) << ") : " << GetPlatformName(platformIds[i]) << std::endl;
+    /* The free list is a stack with the lowest free slot on top, so the alive range grows from the start */
+    std::vector<cl_uint> free_list(max_particles, 0);
+    for (size_t i = 0; i < max_particles - initial_particles; ++i) {
+        free_list[i] = static_cast<cl_uint>(max_particles - 1 - i);
     }
 
-    cl_uint deviceIdCount = 0;
-    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, 0, NULL,
-                   &deviceIdCount);
+    cl_free_list = clCreateBuffer(context, CL_MEM_READ_WRITE, max_particles * sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_free_list, CL_TRUE, 0,
+                                 max_particles * sizeof(cl_uint),
+                                 (const void *) free_list.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_free_list);
+    CheckError(error);
 
-    if (deviceIdCount == 0) {
-        std::cerr << "No OpenCL devices found" << std::endl;
-        Exit();
-    } else {
-        std::cout << "Found " << deviceIdCount << " device(s)" << std::endl;
-    }
+    pool_counters[0] = static_cast<cl_uint>(max_particles - initial_particles);
+    pool_counters[1] = static_cast<cl_uint>(initial_particles);
 
-    deviceIds.resize(deviceIdCount);
-    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, deviceIdCount,
-                   deviceIds.data(), NULL);
+    cl_pool_counters = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(pool_counters), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_pool_counters, CL_TRUE, 0,
+                                 sizeof(pool_counters),
+                                 (const void *) pool_counters,
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_pool_counters);
+    CheckError(error);
 
-    for (cl_uint i = 0; i < deviceIdCount; ++i) {
-        std::cout << "\t (" << (i + 1) << ") : " << GetDeviceName(deviceIds[i]) << std::endl;
+    /* Dead particles are NaN so that the geometry shader skips them */
+    if (max_particles > initial_particles) {
+        const std::vector<cl_float> dead_positions(3 * (max_particles - initial_particles), NAN);
+
+        acquireParticleBuffers();
+        error = clEnqueueWriteBuffer(command_queue, cl_positions, CL_TRUE,
+                                     3 * initial_particles * sizeof(cl_float),
+                                     dead_positions.size() * sizeof(cl_float),
+                                     (const void *) dead_positions.data(),
+                                     NULL, NULL, NULL);
+        CheckError(error);
+        releaseParticleBuffers();
+        clFinish(command_queue);
     }
 
+    n_particles = initial_particles;
+    spawn_seed = 0;
+}
+
+void OpenClParticleSimulator::allocateSleepingCellBuffers(const Parameters &params) {
     cl_int error = CL_SUCCESS;
 
-#ifdef __linux__
-#define GL_SHARING_EXTENSION "cl_khr_gl_sharing"
-    cl_context_properties properties[] = {
-        //CL_GL_CONTEXT_KHR, (cl_context_properties) glXGetCurrentContext(),
-        //CL_GLX_DISPLAY_KHR, (cl_context_properties) glXGetCurrentDisplay(),
-        //CL_CONTEXT_PLATFORM, (cl_context_properties) platform,
-        0
-    };
-#elif defined _WIN32
-#define GL_SHARING_EXTENSION "cl_khr_gl_sharing"
-    cl_context_properties properties[] = {
-            CL_GL_CONTEXT_KHR, (cl_context_properties) wglGetCurrentContext(),
-            CL_WGL_HDC_KHR, (cl_context_properties) wglGetCurrentDC(),
-            CL_CONTEXT_PLATFORM, (cl_context_properties) platformIds[0],
-            0
-    };
-#elif defined TARGET_OS_MAC
-#define GL_SHARING_EXTENSION "cl_APPLE_gl_sharing"
-
-    CGLContextObj glContext = CGLGetCurrentContext();
-    CGLShareGroupObj shareGroup = CGLGetShareGroup(glContext);
-    cl_context_properties properties[] = {
-            CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
-            (cl_context_properties) shareGroup,
-            0};
-
-    gcl_gl_set_sharegroup(shareGroup);
-#endif
+    clVoxelGridInfo grid_info;
+    params.set_voxel_grid_info(grid_info);
 
-    context = clCreateContext(properties, deviceIdCount,
-                              deviceIds.data(), NULL, NULL, &error);
-    CheckError(error);
+    // The float and uint zero bit patterns are the same
+    const std::vector<cl_uint> cell_zeroes(grid_info.total_grid_cells, 0);
 
-    std::cout << "Context created" << std::endl;
+    cl_cell_last_active = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                         grid_info.total_grid_cells * sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_cell_last_active, CL_TRUE, 0,
+                                 grid_info.total_grid_cells * sizeof(cl_uint),
+                                 (const void *) cell_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_cell_last_active);
+    CheckError(error);
 
-    std::cout << "Choose a device id from the devices above: ";
+    cl_cell_mean_densities = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                            grid_info.total_grid_cells * sizeof(cl_float), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_cell_mean_densities, CL_TRUE, 0,
+                                 grid_info.total_grid_cells * sizeof(cl_float),
+                                 (const void *) cell_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_cell_mean_densities);
+    CheckError(error);
 
-    std::cin >> chosen_device_id;
+    cl_cell_density_changes = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                             grid_info.total_grid_cells * sizeof(cl_float), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_cell_density_changes, CL_TRUE, 0,
+                                 grid_info.total_grid_cells * sizeof(cl_float),
+                                 (const void *) cell_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_cell_density_changes);
+    CheckError(error);
 
-    command_queue = clCreateCommandQueue(context, deviceIds[chosen_device_id - 1],
-                                         0, &error);
+    const std::vector<cl_float> particle_zeroes(max_particles, 0.0f);
 
+    cl_particle_densities = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                           max_particles * sizeof(cl_float), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_particle_densities, CL_TRUE, 0,
+                                 max_particles * sizeof(cl_float),
+                                 (const void *) particle_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_particle_densities);
     CheckError(error);
+}
 
-    // Check that context sharing is supported
-    bool cgl_context_sharing_supported = false;
+void OpenClParticleSimulator::allocateSolverBuffers(const Parameters &params) {
+    cl_int error = CL_SUCCESS;
 
-    size_t extensionSize;
-    error = clGetDeviceInfo(deviceIds[chosen_device_id - 1], CL_DEVICE_EXTENSIONS, 0, NULL, &extensionSize);
+    const std::vector<cl_float> particle_zeroes(max_particles, 0.0f);
 
-    CheckError(error);
+    // The per-particle DFSPH state, all [max_particles] long
+    cl_mem *particle_buffers[] = {&cl_solver_densities, &cl_solver_factors, &cl_stiffness_increments,
+                                  &cl_divergence_stiffness, &cl_density_stiffness};
 
-    if (extensionSize > 0) {
-        char *extensions = (char *) malloc(extensionSize);
-        error = clGetDeviceInfo(deviceIds[chosen_device_id - 1], CL_DEVICE_EXTENSIONS, extensionSize, extensions,
-                                &extensionSize);
+    for (cl_mem *buffer : particle_buffers) {
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, max_particles * sizeof(cl_float), NULL, &error);
+        CheckError(error);
+        error = clEnqueueWriteBuffer(command_queue, *buffer, CL_TRUE, 0,
+                                     max_particles * sizeof(cl_float),
+                                     (const void *) particle_zeroes.data(),
+                                     NULL, NULL, NULL);
         CheckError(error);
+        error = clRetainMemObject(*buffer);
+        CheckError(error);
+    }
 
-        std::string stdDevString(extensions);
-        free(extensions);
+    const cl_uint solver_error = 0;
 
-        size_t szOldPos = 0;
-        size_t szSpacePos = stdDevString.find(' ', szOldPos); // extensions string is space delimited
-        while (szSpacePos != stdDevString.npos) {
-            if (strcmp(GL_SHARING_EXTENSION, stdDevString.substr(szOldPos, szSpacePos - szOldPos).c_str()) == 0) {
-                // Device supports context sharing with OpenGL
-                cgl_context_sharing_supported = true;
-                break;
-            }
-            do {
-                szOldPos = szSpacePos + 1;
-                szSpacePos = stdDevString.find(' ', szOldPos);
-            }
-            while (szSpacePos == szOldPos);
-        }
-    }
+    cl_solver_error = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clEnqueueWriteBuffer(command_queue, cl_solver_error, CL_TRUE, 0,
+                                 sizeof(cl_uint), (const void *) &solver_error,
+                                 NULL, NULL, NULL);
+    CheckError(error);
+    error = clRetainMemObject(cl_solver_error);
+    CheckError(error);
 
-    std::cout << (cgl_context_sharing_supported ? "CL-GL sharing supported" : "CL-GL sharing NOT supported") << "\n";
+    cl_limited_particles = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clRetainMemObject(cl_limited_particles);
+    CheckError(error);
 }
 
-/* Processing steps */
+void OpenClParticleSimulator::allocateIntegratorBuffers(const Parameters &params) {
+    cl_int error = CL_SUCCESS;
 
-void OpenClParticleSimulator::runCalculateVoxelGridKernel(float dt_seconds) {
-#ifdef MY_DEBUG
-    std::cout << ">> calculate_voxel_grid\n";
-    std::cout << "  " << print_clVoxelGridInfo(grid_info) << "\n";
-#endif
+    const std::vector<cl_float> particle_zeroes(3 * max_particles, 0.0f);
+
+    // Laid out like the velocities, [3 * max_particles] long each
+    cl_mem *particle_buffers[] = {&cl_half_step_velocities, &cl_previous_accelerations};
+
+    for (cl_mem *buffer : particle_buffers) {
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, 3 * max_particles * sizeof(cl_float), NULL, &error);
+        CheckError(error);
+        error = clEnqueueWriteBuffer(command_queue, *buffer, CL_TRUE, 0,
+                                     3 * max_particles * sizeof(cl_float),
+                                     (const void *) particle_zeroes.data(),
+                                     NULL, NULL, NULL);
+        CheckError(error);
+        error = clRetainMemObject(*buffer);
+        CheckError(error);
+    }
+}
 
+void OpenClParticleSimulator::allocateViscosityBuffers(const Parameters &params) {
     cl_int error = CL_SUCCESS;
 
+    const std::vector<cl_float> particle_zeroes(3 * max_particles, 0.0f);
 
-    error = clSetKernelArg(calculate_voxel_grid, 0, sizeof(cl_mem), (void *) &cl_positions);
-    CheckError(error);
-    error = clSetKernelArg(calculate_voxel_grid, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
-    CheckError(error);
-    error = clSetKernelArg(calculate_voxel_grid, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    cl_viscosity_densities = clCreateBuffer(context, CL_MEM_READ_WRITE, max_particles * sizeof(cl_float), NULL, &error);
     CheckError(error);
-    error = clSetKernelArg(calculate_voxel_grid, 3, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clEnqueueWriteBuffer(command_queue, cl_viscosity_densities, CL_TRUE, 0,
+                                 max_particles * sizeof(cl_float),
+                                 (const void *) particle_zeroes.data(),
+                                 NULL, NULL, NULL);
     CheckError(error);
-
-    error = clEnqueueNDRangeKernel(command_queue, calculate_voxel_grid, 1, NULL, (const size_t *) &n_particles, NULL,
-                                   NULL, NULL, NULL);
+    error = clRetainMemObject(cl_viscosity_densities);
     CheckError(error);
 
-    /*
-     * Read back data and check for correctness
-     */
-
-#ifdef MY_DEBUG
-    cl_uint voxel_cell_particle_count[grid_info.total_grid_cells];
-    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_count, CL_TRUE, 0,
-                                grid_info.total_grid_cells * sizeof(cl_uint), (void *) &voxel_cell_particle_count[0],
-                                0, NULL, NULL);
+    // Laid out like the velocities, [3 * max_particles] long each
+    cl_mem *particle_buffers[] = {&cl_viscosity_residual, &cl_viscosity_direction, &cl_viscosity_product};
 
-    unsigned int total = 0;
-    for (unsigned int i = 0; i < grid_info.total_grid_cells; ++i) {
-        total += voxel_cell_particle_count[i];
+    for (cl_mem *buffer : particle_buffers) {
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, 3 * max_particles * sizeof(cl_float), NULL, &error);
+        CheckError(error);
+        error = clEnqueueWriteBuffer(command_queue, *buffer, CL_TRUE, 0,
+                                     3 * max_particles * sizeof(cl_float),
+                                     (const void *) particle_zeroes.data(),
+                                     NULL, NULL, NULL);
+        CheckError(error);
+        error = clRetainMemObject(*buffer);
+        CheckError(error);
     }
-    std::cout << "  voxel_cell_particle_count (count) = " << total << "\n    ";
 
-    const unsigned int PARTICLE_INDICES_COUNT = grid_info.total_grid_cells * grid_info.max_cell_particle_count;
-    cl_uint voxel_cell_particle_indices[PARTICLE_INDICES_COUNT];
-    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_indices, CL_TRUE, 0,
-                                grid_info.total_grid_cells * grid_info.max_cell_particle_count * sizeof(cl_uint),
-                                (void *) &voxel_cell_particle_indices[0],
-                                0, NULL, NULL);
-    total = 0;
-    for (unsigned int i = 0; i < PARTICLE_INDICES_COUNT; ++i) {
-        if (voxel_cell_particle_indices[i] != 0) {
-            total++;
-        }
-    }
-    std::cout << "  voxel_cell_particle_indices (count) = " << total + 1 << "\n    ";
-#endif
-}
+    // One partial sum per work group of sum_viscosity_products
+    viscosity_partial_sums.resize((3 * max_particles + VISCOSITY_WORK_GROUP_SIZE - 1) / VISCOSITY_WORK_GROUP_SIZE);
 
-void OpenClParticleSimulator::runResetVoxelGridKernel() {
-#ifdef MY_DEBUG
-    std::cout << ">> reset_voxel_grid\n";
-#endif
+    cl_viscosity_partial_sums = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                               viscosity_partial_sums.size() * sizeof(cl_float), NULL, &error);
+    CheckError(error);
+    error = clRetainMemObject(cl_viscosity_partial_sums);
+    CheckError(error);
+}
 
+void OpenClParticleSimulator::allocateTimestepBuffers(const Parameters &params) {
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(reset_voxel_grid, 0, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    clVoxelGridInfo grid_info;
+    params.set_voxel_grid_info(grid_info);
+
+    // Every particle starts on level 0, so the first frame is a single step
+    const std::vector<cl_uint> particle_zeroes(max_particles, 0);
+
+    cl_timestep_levels = clCreateBuffer(context, CL_MEM_READ_WRITE, max_particles * sizeof(cl_uint), NULL, &error);
     CheckError(error);
-    error = clSetKernelArg(reset_voxel_grid, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    error = clEnqueueWriteBuffer(command_queue, cl_timestep_levels, CL_TRUE, 0,
+                                 max_particles * sizeof(cl_uint),
+                                 (const void *) particle_zeroes.data(),
+                                 NULL, NULL, NULL);
     CheckError(error);
-    error = clSetKernelArg(reset_voxel_grid, 2, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clRetainMemObject(cl_timestep_levels);
     CheckError(error);
 
-    const size_t total_grid_cells = static_cast<size_t>(grid_info.total_grid_cells);
-    error = clEnqueueNDRangeKernel(command_queue, reset_voxel_grid, 1, NULL,
-                                   (const size_t *) &total_grid_cells, NULL,
-                                   NULL, NULL, NULL);
+    cl_active_cells = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                     grid_info.total_grid_cells * sizeof(cl_uint), NULL, &error);
+    CheckError(error);
+    error = clRetainMemObject(cl_active_cells);
     CheckError(error);
 
-    /* Read back data and check for correctness */
-
-#ifdef MY_DEBUG
-    const unsigned int PARTICLE_COUNT = grid_info.total_grid_cells;
-    cl_uint voxel_cell_particle_count[PARTICLE_COUNT];
-    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_count, CL_TRUE, 0,
-                                grid_info.total_grid_cells * sizeof(cl_uint), (void *) &voxel_cell_particle_count[0],
-                                0, NULL, NULL);
+    // Both counters are reset before they are used
+    cl_mem *counters[] = {&cl_finest_timestep_level, &cl_active_cell_count};
 
-    unsigned int total = 0;
-    for (unsigned int i = 0; i < PARTICLE_COUNT; ++i) {
-        total += voxel_cell_particle_count[i];
+    for (cl_mem *buffer : counters) {
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &error);
+        CheckError(error);
+        error = clRetainMemObject(*buffer);
+        CheckError(error);
     }
-    std::cout << "  [post-reset] voxel_cell_particle_count (count) = " << total << "\n    ";
+}
 
-    const unsigned int PARTICLE_INDICES_COUNT = grid_info.total_grid_cells * grid_info.max_cell_particle_count;
-    cl_uint voxel_cell_particle_indices[PARTICLE_INDICES_COUNT];
-    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_indices, CL_TRUE, 0,
-                                grid_info.total_grid_cells * grid_info.max_cell_particle_count * sizeof(cl_uint),
-                                (void *) &voxel_cell_particle_indices[0],
+void OpenClParticleSimulator::resetIntegratorState() {
+    cl_int error = CL_SUCCESS;
+
+    // As if the fluid had not been accelerated before: the half-step velocities are the current ones
+    error = clEnqueueCopyBuffer(command_queue, cl_velocities, cl_half_step_velocities, 0, 0,
+                                3 * max_particles * sizeof(cl_float), 0, NULL, NULL);
+    CheckError(error);
+
+    const std::vector<cl_float> particle_zeroes(3 * max_particles, 0.0f);
+
+    error = clEnqueueWriteBuffer(command_queue, cl_previous_accelerations, CL_TRUE, 0,
+                                 3 * max_particles * sizeof(cl_float),
+                                 (const void *) particle_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+}
+
+void OpenClParticleSimulator::resetSleepingCells() {
+    cl_int error = CL_SUCCESS;
+
+    // Every cell was last active at step 0, so nothing can sleep until sleep_step_count steps have passed
+    const std::vector<cl_uint> cell_zeroes(grid_info.total_grid_cells, 0);
+
+    error = clEnqueueWriteBuffer(command_queue, cl_cell_last_active, CL_TRUE, 0,
+                                 grid_info.total_grid_cells * sizeof(cl_uint),
+                                 (const void *) cell_zeroes.data(),
+                                 NULL, NULL, NULL);
+    CheckError(error);
+
+    sleep_info.step = 0;
+}
+
+bool OpenClParticleSimulator::setupSimulation(const Parameters &params,
+                                              Span<const glm::vec3> particle_positions,
+                                              Span<const glm::vec3> particle_velocities,
+                                              std::string &error) {
+    PROFILE_ZONE("OpenClParticleSimulator::setupSimulation");
+
+    positions.assign(particle_positions.begin(), particle_positions.end());
+
+    if (!initOpenCL(error)) {
+        return false;
+    }
+    std::cout << "\nOpenCL ready to use: context created.\n\n";
+
+    n_particles = particle_positions.size();
+    max_particles = std::max(static_cast<size_t>(params.max_particles), n_particles);
+
+
+    // Here we can use OpenCL functionality
+    // cl_int error = CL_SUCCESS;
+
+    createParticleBuffers(particle_positions, particle_velocities);
+    allocateVoxelGridBuffer(params);
+    allocateBoundaryBuffer(params);
+    allocateParticlePoolBuffers(params);
+    allocateSleepingCellBuffers(params);
+    allocateSolverBuffers(params);
+    allocateIntegratorBuffers(params);
+    allocateViscosityBuffers(params);
+    allocateTimestepBuffers(params);
+
+    // Each failed build names its kernel file in the error, with the build log
+    return
+        createAndBuildKernel(simple_integration, "taskParallelIntegrateVelocity", "update_particle_positions.cl",
+                             error) &&
+        createAndBuildKernel(calculate_voxel_grid, "calculate_voxel_grid", "calculate_voxel_grid.cl", error) &&
+        createAndBuildKernel(reset_voxel_grid, "reset_voxel_grid", "calculate_voxel_grid.cl", error) &&
+        createAndBuildKernel(simple_voxel_grid_move, "simple_voxel_grid_move", "simple_voxel_grid_move.cl", error) &&
+        createAndBuildKernel(update_sleeping_cells, "update_sleeping_cells", "sleeping_cells.cl", error) &&
+        createAndBuildKernel(calculate_particle_densities, "calculate_particle_densities", "simulate_fluid_particles.cl",
+                             error) &&
+        createAndBuildKernel(calculate_particle_forces, "calculate_forces", "simulate_fluid_particles.cl", error) &&
+        createAndBuildKernel(integrate_particle_states, "integrate_particle_states", "integrate_particle_states.cl",
+                             error) &&
+        createAndBuildKernel(despawn_particles, "despawn_particles", "particle_pool.cl", error) &&
+        createAndBuildKernel(spawn_particles, "spawn_particles", "particle_pool.cl", error) &&
+        createAndBuildKernel(calculate_dfsph_factors, "calculate_dfsph_factors", "dfsph.cl", error) &&
+        createAndBuildKernel(calculate_dfsph_stiffness, "calculate_dfsph_stiffness", "dfsph.cl", error) &&
+        createAndBuildKernel(apply_dfsph_stiffness, "apply_dfsph_stiffness", "dfsph.cl", error) &&
+        createAndBuildKernel(warm_start_dfsph_stiffness, "warm_start_dfsph_stiffness", "dfsph.cl", error) &&
+        createAndBuildKernel(predict_dfsph_velocities, "predict_dfsph_velocities", "dfsph.cl", error) &&
+        createAndBuildKernel(calculate_viscosity_densities, "calculate_viscosity_densities", "implicit_viscosity.cl",
+                             error) &&
+        createAndBuildKernel(apply_viscosity_operator, "apply_viscosity_operator", "implicit_viscosity.cl", error) &&
+        createAndBuildKernel(update_viscosity_solution, "update_viscosity_solution", "implicit_viscosity.cl", error) &&
+        createAndBuildKernel(update_viscosity_direction, "update_viscosity_direction", "implicit_viscosity.cl",
+                             error) &&
+        createAndBuildKernel(sum_viscosity_products, "sum_viscosity_products", "implicit_viscosity.cl", error) &&
+        createAndBuildKernel(assign_timestep_levels, "assign_timestep_levels", "timestep_levels.cl", error) &&
+        createAndBuildKernel(build_active_cell_list, "build_active_cell_list", "timestep_levels.cl", error);
+}
+
+unsigned int OpenClParticleSimulator::getParticleDrawCount() {
+    return static_cast<unsigned int>(n_particles);
+}
+
+unsigned int OpenClParticleSimulator::getSolverIterations() {
+    return solver_iterations;
+}
+
+bool OpenClParticleSimulator::supportsPressureSolver(PressureSolver solver) const {
+    return solver != PressureSolver::PCISPH;
+}
+
+bool OpenClParticleSimulator::getGridOccupancy(GridOccupancy &occupancy) {
+    grid_occupancy_requested = true;
+    if (grid_cell_particle_counts.empty()) {
+        return false;
+    }
+
+    occupancy = {static_cast<unsigned int>(grid_cell_particle_counts.size()), 0, 0, 0,
+                 grid_info.max_cell_particle_count, 0};
+    for (cl_uint count : grid_cell_particle_counts) {
+        occupancy.occupied_cells += count > 0;
+        occupancy.particles += count;
+        occupancy.max_cell_particles = std::max(occupancy.max_cell_particles, count);
+        occupancy.full_cells += count >= grid_info.max_cell_particle_count;
+    }
+
+    return true;
+}
+
+void OpenClParticleSimulator::readParticleState(const ParticleStateCallback &callback) {
+    positions.resize(n_particles);
+    velocities.resize(n_particles);
+
+    acquireParticleBuffers();
+
+    cl_int error = clEnqueueReadBuffer(command_queue, cl_positions, CL_FALSE, 0, 3 * n_particles * sizeof(cl_float),
+                                positions.data(), 0, NULL, NULL);
+    CheckError(error);
+    error = clEnqueueReadBuffer(command_queue, cl_velocities, CL_FALSE, 0, 3 * n_particles * sizeof(cl_float),
+                                velocities.data(), 0, NULL, NULL);
+    CheckError(error);
+
+    releaseParticleBuffers();
+    clFinish(command_queue);
+
+    callback(positions, velocities);
+}
+
+void OpenClParticleSimulator::updateSimulation(const Parameters &parameters, float dt_seconds) {
+    PROFILE_ZONE("OpenClParticleSimulator::updateSimulation");
+
+    parameters.set_voxel_grid_info(grid_info);
+    parameters.set_fluid_info(fluid_info, parameters.n_particles);
+    boundary_info.force_range = parameters.kernel_size;
+    boundary_info.use_penalty_force = parameters.boundary_handling == BoundaryHandling::Penalty;
+    use_boundary_particles = parameters.boundary_handling == BoundaryHandling::Particles;
+    parameters.set_sleep_info(sleep_info);
+
+    if (!supportsPressureSolver(parameters.pressure_solver)) {
+        if (!pressure_solver_fallback_reported) {
+            std::cerr << "The OpenCL simulator has no PCISPH, it uses the state equation instead" << std::endl;
+            pressure_solver_fallback_reported = true;
+        }
+    } else {
+        pressure_solver_fallback_reported = false;
+    }
+
+    // DFSPH finds the pressure itself, so the state equation's is turned off in calculate_forces
+    const bool use_dfsph = parameters.pressure_solver == PressureSolver::DFSPH;
+    if (use_dfsph) {
+        fluid_info.k_gas = 0.0f;
+    }
+
+    PhaseClock clock(phase_timings);
+
+    acquireParticleBuffers();
+
+    // A changed integrator starts over from the current velocities
+    if (parameters.get_active_integrator() != active_integrator) {
+        active_integrator = parameters.get_active_integrator();
+        resetIntegratorState();
+    }
+
+    runParticlePoolKernels(parameters, dt_seconds);
+
+    // The dead particles below the high-water mark are stepped as well, the kernels skip over them
+    ++counters.steps;
+    counters.particle_steps += n_particles;
+
+    // Without multi-rate timestepping every particle is on level 0, and the frame is a single step
+    parameters.set_timestep_info(timestep_info, dt_seconds);
+    timestep_info.finest_level = runAssignTimestepLevelsKernel();
+    const unsigned int substep_count = 1u << timestep_info.finest_level;
+    clock.lap("particle pool");
+
+    // DFSPH corrects all particles together, so every cell takes every sub-step
+    use_active_cells = timestep_info.finest_level > 0 && !use_dfsph;
+
+    solver_iterations = 0;
+    // The sub-steps time their own phases
+    for (timestep_info.substep = 0; timestep_info.substep < substep_count; ++timestep_info.substep) {
+        stepSimulation(parameters, dt_seconds / substep_count, use_dfsph);
+    }
+    clock.restart();
+
+    releaseParticleBuffers();
+    clFinish(command_queue);
+    clock.lap("release");
+
+    if (kernel_timings) {
+        collectKernelTimings();
+    }
+
+    // Drawing uses the VBOs directly, the particles are only read back for a callback
+    if (publishParticleState()) {
+        clock.lap("read back");
+    }
+}
+
+void OpenClParticleSimulator::stepSimulation(const Parameters &parameters, float dt_seconds, bool use_dfsph) {
+    // Only the enqueueing of the kernels, unless the phase timings wait for them
+    PROFILE_ZONE("OpenClParticleSimulator::stepSimulation");
+
+    parameters.set_solver_info(solver_info, dt_seconds);
+
+    PhaseClock clock(phase_timings);
+
+    runCalculateVoxelGridKernel(dt_seconds);
+    runUpdateSleepingCellsKernel();
+
+    if (use_active_cells) {
+        runBuildActiveCellListKernel();
+    }
+    clock.lap("grid");
+
+    runCalculateParticleDensitiesKernel(dt_seconds);
+    clock.lap("densities");
+
+    // DFSPH makes the velocities divergence-free before the forces are calculated from them,
+    // then corrects the velocities with the forces until they keep the rest density
+    // The stiffnesses scale with the time step, which varies between frames
+    const float dt_ratio = previous_dt > 0.0f ? previous_dt / dt_seconds : 0.0f;
+
+    if (use_dfsph) {
+        runCalculateDFSPHFactorsKernel();
+        solver_iterations += runDFSPHSolve(parameters, DFSPH_SOLVE_DIVERGENCE, cl_divergence_stiffness,
+                                           0.5f * dt_ratio);
+    }
+
+    // The implicit viscosity changes the velocities directly, so calculate_forces leaves it out
+    if (parameters.implicit_viscosity) {
+        runImplicitViscositySolve(parameters, dt_seconds);
+    }
+
+    if (use_dfsph || parameters.implicit_viscosity) {
+        clock.lap("velocity solves");
+    }
+
+    runCalculateParticleForcesKernel(!parameters.implicit_viscosity);
+    clock.lap("forces");
+
+    if (use_dfsph) {
+        runPredictDFSPHVelocitiesKernel(dt_seconds);
+        solver_iterations += runDFSPHSolve(parameters, DFSPH_SOLVE_DENSITY, cl_density_stiffness,
+                                           0.5f * dt_ratio * dt_ratio);
+        previous_dt = dt_seconds;
+        clock.lap("pressure solve");
+    } else {
+        previous_dt = 0.0f;
+    }
+
+    // updateSimulation waits for the queue before it returns, the counts are there by then
+    if (grid_occupancy_requested) {
+        grid_cell_particle_counts.resize(grid_info.total_grid_cells);
+        cl_int error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_count, CL_FALSE, 0,
+                                           grid_cell_particle_counts.size() * sizeof(cl_uint),
+                                           grid_cell_particle_counts.data(), 0, NULL, NULL);
+        CheckError(error);
+        grid_occupancy_requested = false;
+    }
+
+    runResetVoxelGridKernel();
+    runIntegrateParticleStatesKernel(dt_seconds, use_dfsph);
+    clock.lap("integration");
+}
+
+void OpenClParticleSimulator::setPhaseTimings(PhaseTimings *timings) {
+    ParticleSimulator::setPhaseTimings(timings);
+
+    if (timings) {
+        timings->synchronize = [this]() {
+            clFinish(command_queue);
+        };
+    }
+}
+
+void OpenClParticleSimulator::setDeviceId(int device_id) {
+    chosen_device_id = device_id;
+}
+
+void OpenClParticleSimulator::setKernelTimings(PhaseTimings *timings) {
+    const bool profiling_changed = (timings != nullptr) != (kernel_timings != nullptr);
+    kernel_timings = timings;
+
+    // Profiling is set when the queue is created. The kernels and buffers belong to the context and are kept
+    if (command_queue && profiling_changed) {
+        clFinish(command_queue);
+        for (const std::pair<cl_kernel, cl_event> &kernel_event : kernel_events) {
+            clReleaseEvent(kernel_event.second);
+        }
+        kernel_events.clear();
+
+        clReleaseCommandQueue(command_queue);
+        CheckError(createCommandQueue());
+    }
+}
+
+cl_int OpenClParticleSimulator::enqueueKernel(cl_kernel kernel, cl_uint work_dim, const size_t *global_work_size,
+                                              const size_t *local_work_size) {
+    cl_event event = NULL;
+    const cl_int error = clEnqueueNDRangeKernel(command_queue, kernel, work_dim, NULL, global_work_size,
+                                                local_work_size, 0, NULL, kernel_timings ? &event : NULL);
+
+    if (kernel_timings && error == CL_SUCCESS) {
+        kernel_events.push_back(std::make_pair(kernel, event));
+    }
+
+    return error;
+}
+
+void OpenClParticleSimulator::collectKernelTimings() {
+    char name[128];
+
+    for (const std::pair<cl_kernel, cl_event> &kernel_event : kernel_events) {
+        cl_ulong start = 0;
+        cl_ulong end = 0;
+
+        cl_int error = clGetEventProfilingInfo(kernel_event.second, CL_PROFILING_COMMAND_START, sizeof(cl_ulong),
+                                               &start, NULL);
+        CheckError(error);
+        error = clGetEventProfilingInfo(kernel_event.second, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        CheckError(error);
+        error = clGetKernelInfo(kernel_event.first, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+        CheckError(error);
+
+        // The profiling counters are in nanoseconds
+        kernel_timings->add(name, 1e-9 * (end - start));
+
+        clReleaseEvent(kernel_event.second);
+    }
+
+    kernel_events.clear();
+}
+
+cl_int OpenClParticleSimulator::createCommandQueue() {
+    cl_int error = CL_SUCCESS;
+    command_queue = clCreateCommandQueue(context, deviceIds[chosen_device_id - 1],
+                                         kernel_timings ? CL_QUEUE_PROFILING_ENABLE : 0, &error);
+
+    return error;
+}
+
+std::vector<std::string> OpenClParticleSimulator::getDeviceNames() {
+    std::vector<std::string> names;
+
+    cl_uint platformIdCount = 0;
+    clGetPlatformIDs(0, NULL, &platformIdCount);
+    if (platformIdCount == 0) {
+        return names;
+    }
+
+    // Like the simulator, only the first platform is looked at
+    std::vector<cl_platform_id> platformIds(platformIdCount);
+    clGetPlatformIDs(platformIdCount, platformIds.data(), NULL);
+
+    cl_uint deviceIdCount = 0;
+    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceIdCount);
+
+    std::vector<cl_device_id> deviceIds(deviceIdCount);
+    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, deviceIdCount, deviceIds.data(), NULL);
+
+    for (cl_device_id deviceId : deviceIds) {
+        names.push_back(GetDeviceName(deviceId));
+    }
+
+    return names;
+}
+
+bool OpenClParticleSimulator::initOpenCL(std::string &error_message) {
+    PROFILE_ZONE("OpenClParticleSimulator::initOpenCL");
+
+    cl_uint platformIdCount = 0;
+    clGetPlatformIDs(0, NULL, &platformIdCount);
+
+
+    if (platformIdCount == 0) {
+        error_message = "No OpenCL platform found";
+        return false;
+    } else {
+        std::cout << "Found " << platformIdCount << " platform(s)" << std::endl;
+    }
+
+    // Resize vector to actual amount of platform ids and get the ids
+    platformIds.resize(platformIdCount);
+    clGetPlatformIDs(platformIdCount, platformIds.data(), NULL);
+
+    for (cl_uint i = 0; i < platformIdCount; ++i) {
+        std::cout << "\t (" << (i + 1) << ") : " << GetPlatformName(platformIds[i]) << std::endl;
+    }
+
+    cl_uint deviceIdCount = 0;
+    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, 0, NULL,
+                   &deviceIdCount);
+
+    if (deviceIdCount == 0) {
+        error_message = "No OpenCL devices found";
+        return false;
+    } else {
+        std::cout << "Found " << deviceIdCount << " device(s)" << std::endl;
+    }
+
+    deviceIds.resize(deviceIdCount);
+    clGetDeviceIDs(platformIds[0], CL_DEVICE_TYPE_ALL, deviceIdCount,
+                   deviceIds.data(), NULL);
+
+    for (cl_uint i = 0; i < deviceIdCount; ++i) {
+        std::cout << "\t (" << (i + 1) << ") : " << GetDeviceName(deviceIds[i]) << std::endl;
+    }
+
+    cl_int error = CL_SUCCESS;
+
+    // Sharing the particle buffers takes the sharing's properties, plain buffers only need the platform
+    std::vector<cl_context_properties> properties;
+    if (buffer_sharing) {
+        buffer_sharing->add_context_properties(platformIds[0], properties);
+    } else {
+        properties.push_back(CL_CONTEXT_PLATFORM);
+        properties.push_back((cl_context_properties) platformIds[0]);
+    }
+    properties.push_back(0);
+
+    context = clCreateContext(properties.data(), deviceIdCount,
+                              deviceIds.data(), NULL, NULL, &error);
+    if (error != CL_SUCCESS) {
+        error_message = "Could not create the OpenCL context: " + GetErrorString(error);
+        return false;
+    }
+
+    std::cout << "Context created" << std::endl;
+
+    // The device is an index into deviceIds, so a wrong one would read past them
+    if (chosen_device_id < 1 || chosen_device_id > static_cast<int>(deviceIdCount)) {
+        error_message = "There is no OpenCL device " + std::to_string(chosen_device_id) + ", there are " +
+                        std::to_string(deviceIdCount);
+        return false;
+    }
+
+    std::cout << "Using device " << chosen_device_id << std::endl;
+
+    error = createCommandQueue();
+    if (error != CL_SUCCESS) {
+        error_message = "Could not create the OpenCL command queue: " + GetErrorString(error);
+        return false;
+    }
+
+    if (!buffer_sharing) {
+        return true;
+    }
+
+    // Check that context sharing is supported
+    const char *sharing_extension = buffer_sharing->get_sharing_extension();
+    bool cgl_context_sharing_supported = false;
+
+    size_t extensionSize = 0;
+    clGetDeviceInfo(deviceIds[chosen_device_id - 1], CL_DEVICE_EXTENSIONS, 0, NULL, &extensionSize);
+
+    if (extensionSize > 0) {
+        char *extensions = (char *) malloc(extensionSize);
+        clGetDeviceInfo(deviceIds[chosen_device_id - 1], CL_DEVICE_EXTENSIONS, extensionSize, extensions,
+                        &extensionSize);
+
+        std::string stdDevString(extensions);
+        free(extensions);
+
+        size_t szOldPos = 0;
+        size_t szSpacePos = stdDevString.find(' ', szOldPos); // extensions string is space delimited
+        while (szSpacePos != stdDevString.npos) {
+            if (strcmp(sharing_extension, stdDevString.substr(szOldPos, szSpacePos - szOldPos).c_str()) == 0) {
+                // Device supports context sharing with OpenGL
+                cgl_context_sharing_supported = true;
+                break;
+            }
+            do {
+                szOldPos = szSpacePos + 1;
+                szSpacePos = stdDevString.find(' ', szOldPos);
+            }
+            while (szSpacePos == szOldPos);
+        }
+    }
+
+    std::cout << sharing_extension << (cgl_context_sharing_supported ? " supported" : " NOT supported") << "\n";
+    return true;
+}
+
+/* Processing steps */
+
+void OpenClParticleSimulator::runCalculateVoxelGridKernel(float dt_seconds) {
+#ifdef MY_DEBUG
+    std::cout << ">> calculate_voxel_grid\n";
+    std::cout << "  " << print_clVoxelGridInfo(grid_info) << "\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+
+    error = clSetKernelArg(calculate_voxel_grid, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(calculate_voxel_grid, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(calculate_voxel_grid, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_voxel_grid, 3, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_voxel_grid, 4, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+
+    error = enqueueKernel(calculate_voxel_grid, 1, &n_particles, NULL);
+    CheckError(error);
+
+    /*
+     * Read back data and check for correctness
+     */
+
+#ifdef MY_DEBUG
+    cl_uint voxel_cell_particle_count[grid_info.total_grid_cells];
+    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_count, CL_TRUE, 0,
+                                grid_info.total_grid_cells * sizeof(cl_uint), (void *) &voxel_cell_particle_count[0],
+                                0, NULL, NULL);
+
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < grid_info.total_grid_cells; ++i) {
+        total += voxel_cell_particle_count[i];
+    }
+    std::cout << "  voxel_cell_particle_count (count) = " << total << "\n    ";
+
+    const unsigned int PARTICLE_INDICES_COUNT = grid_info.total_grid_cells * grid_info.max_cell_particle_count;
+    cl_uint voxel_cell_particle_indices[PARTICLE_INDICES_COUNT];
+    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_indices, CL_TRUE, 0,
+                                grid_info.total_grid_cells * grid_info.max_cell_particle_count * sizeof(cl_uint),
+                                (void *) &voxel_cell_particle_indices[0],
+                                0, NULL, NULL);
+    total = 0;
+    for (unsigned int i = 0; i < PARTICLE_INDICES_COUNT; ++i) {
+        if (voxel_cell_particle_indices[i] != 0) {
+            total++;
+        }
+    }
+    std::cout << "  voxel_cell_particle_indices (count) = " << total + 1 << "\n    ";
+#endif
+}
+
+void OpenClParticleSimulator::runResetVoxelGridKernel() {
+#ifdef MY_DEBUG
+    std::cout << ">> reset_voxel_grid\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(reset_voxel_grid, 0, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(reset_voxel_grid, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(reset_voxel_grid, 2, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+
+    const size_t total_grid_cells = static_cast<size_t>(grid_info.total_grid_cells);
+    error = enqueueKernel(reset_voxel_grid, 1, (const size_t *) &total_grid_cells, NULL);
+    CheckError(error);
+
+    /* Read back data and check for correctness */
+
+#ifdef MY_DEBUG
+    const unsigned int PARTICLE_COUNT = grid_info.total_grid_cells;
+    cl_uint voxel_cell_particle_count[PARTICLE_COUNT];
+    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_count, CL_TRUE, 0,
+                                grid_info.total_grid_cells * sizeof(cl_uint), (void *) &voxel_cell_particle_count[0],
+                                0, NULL, NULL);
+
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < PARTICLE_COUNT; ++i) {
+        total += voxel_cell_particle_count[i];
+    }
+    std::cout << "  [post-reset] voxel_cell_particle_count (count) = " << total << "\n    ";
+
+    const unsigned int PARTICLE_INDICES_COUNT = grid_info.total_grid_cells * grid_info.max_cell_particle_count;
+    cl_uint voxel_cell_particle_indices[PARTICLE_INDICES_COUNT];
+    error = clEnqueueReadBuffer(command_queue, cl_voxel_cell_particle_indices, CL_TRUE, 0,
+                                grid_info.total_grid_cells * grid_info.max_cell_particle_count * sizeof(cl_uint),
+                                (void *) &voxel_cell_particle_indices[0],
+                                0, NULL, NULL);
+    total = 0;
+    for (unsigned int i = 0; i < PARTICLE_INDICES_COUNT; ++i) {
+        if (voxel_cell_particle_indices[i] != 0) {
+            total++;
+        }
+    }
+
+    std::cout << "  [post-reset] voxel_cell_particle_indices (count) = " << total << "\n    ";
+#endif
+}
+
+void OpenClParticleSimulator::runSimpleVoxelGridMoveKernel(float dt_seconds) {
+#ifdef MY_DEBUG
+    std::cout << ">> simple_voxel_grid_move\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(simple_voxel_grid_move, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(simple_voxel_grid_move, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(simple_voxel_grid_move, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(simple_voxel_grid_move, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(simple_voxel_grid_move, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    const cl_float cl_dt = dt_seconds;
+    error = clSetKernelArg(simple_voxel_grid_move, 5, sizeof(cl_float), (void *) &cl_dt);
+    CheckError(error);
+
+    error = enqueueKernel(simple_voxel_grid_move, 1, (const size_t *) &grid_info.total_grid_cells, NULL);
+    CheckError(error);
+}
+
+void OpenClParticleSimulator::runUpdateSleepingCellsKernel() {
+    if (sleep_info.sleep_step_count == 0) {
+        sleeping_enabled = false;
+        return;
+    }
+
+#ifdef MY_DEBUG
+    std::cout << ">> update_sleeping_cells\n";
+#endif
+
+    // The per-particle densities are not kept while sleeping is off, so nothing may sleep until they are
+    if (!sleeping_enabled) {
+        resetSleepingCells();
+        sleeping_enabled = true;
+    }
+
+    ++sleep_info.step;
+
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(update_sleeping_cells, 0, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 3, sizeof(cl_mem), (void *) &cl_cell_density_changes);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 4, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 5, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(update_sleeping_cells, 6, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+
+    error = enqueueKernel(update_sleeping_cells, 3, (const size_t *) grid_cells_count, NULL);
+    CheckError(error);
+}
+
+void OpenClParticleSimulator::runCalculateParticleDensitiesKernel(float dt_seconds) {
+#ifdef MY_DEBUG
+    std::cout << ">> calculate_particle_densities\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(calculate_particle_densities, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 1, sizeof(cl_mem), (void *) &cl_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 5, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 6, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 7, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 8, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 9, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 10, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 11, sizeof(cl_mem), (void *) &cl_particle_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 12, sizeof(cl_mem), (void *) &cl_cell_mean_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 13, sizeof(cl_mem), (void *) &cl_cell_density_changes);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 14, sizeof(cl_mem), (void *) &cl_neighbour_counts);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 15, sizeof(cl_mem), (void *) &cl_active_cells);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 16, sizeof(cl_mem), (void *) &cl_active_cell_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_densities, 17, sizeof(cl_uint), (void *) &use_active_cells);
+    CheckError(error);
+
+    // The active cell list is never longer than the grid, the work items past its end return right away
+    const size_t total_grid_cells = grid_info.total_grid_cells;
+
+    if (use_active_cells) {
+        error = enqueueKernel(calculate_particle_densities, 1, &total_grid_cells, NULL);
+    } else {
+        error = enqueueKernel(calculate_particle_densities, 3, (const size_t *) grid_cells_count, NULL);
+    }
+    CheckError(error);
+
+#ifdef MY_DEBUG
+    const unsigned int PARTICLE_DENSITIES_COUNT = grid_info.max_cell_particle_count * grid_info.total_grid_cells;
+    cl_float particle_densities[PARTICLE_DENSITIES_COUNT];
+    error = clEnqueueReadBuffer(command_queue, cl_densities, CL_TRUE, 0,
+                                PARTICLE_DENSITIES_COUNT * sizeof(cl_float),
+                                (void *) &particle_densities[0],
                                 0, NULL, NULL);
-    total = 0;
-    for (unsigned int i = 0; i < PARTICLE_INDICES_COUNT; ++i) {
-        if (voxel_cell_particle_indices[i] != 0) {
-            total++;
+    CheckError(error);
+    clFinish(command_queue);
+
+    unsigned int zero_counter = 0;
+    unsigned int NaN_counter = 0;
+
+    std::cout << "Densities: \n";
+    for (unsigned int i = 0; i < PARTICLE_DENSITIES_COUNT; ++i) {
+        auto density = particle_densities[i];
+
+        if (density < 0.0001f) {
+            ++zero_counter;
+        }
+        if (isnan(density)) {
+            ++NaN_counter;
+        }
+        if (density > 0.0001f && !isnan(density)) {
+            std::cout << density << ", ";
+        }
+    }
+    std::cout << "\nNaN-count = " << NaN_counter << ", zero-count = " << zero_counter << "\n";
+
+    std::cout << "\n";
+#endif
+}
+
+void OpenClParticleSimulator::runCalculateParticleForcesKernel(bool explicit_viscosity) {
+#ifdef MY_DEBUG
+    std::cout << ">> calculate_particle_forces\n";
+#endif
+
+    // A copy, the other kernels of the step still need the viscosity
+    clFluidInfo forces_fluid_info = fluid_info;
+    if (!explicit_viscosity) {
+        forces_fluid_info.k_viscosity = 0.0f;
+    }
+
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(calculate_particle_forces, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 2, sizeof(cl_mem), (void *) &cl_forces);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 3, sizeof(cl_mem), (void *) &cl_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 4, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 5, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 6, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 7, sizeof(clFluidInfo), (void *) &forces_fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 8, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 9, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 10, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 11, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 12, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 13, sizeof(cl_mem), (void *) &cl_neighbour_counts);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 14, sizeof(cl_mem), (void *) &cl_active_cells);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 15, sizeof(cl_mem), (void *) &cl_active_cell_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_particle_forces, 16, sizeof(cl_uint), (void *) &use_active_cells);
+    CheckError(error);
+
+    error = clFinish(command_queue);
+    CheckError(error);
+
+    const size_t total_grid_cells = grid_info.total_grid_cells;
+
+    if (use_active_cells) {
+        error = enqueueKernel(calculate_particle_forces, 1, &total_grid_cells, NULL);
+    } else {
+        error = enqueueKernel(calculate_particle_forces, 3, (const size_t *) grid_cells_count, NULL);
+    }
+    CheckError(error);
+
+#ifdef MY_DEBUG
+    const unsigned int PARTICLE_FORCES_COUNT = n_particles;
+    cl_float3 particle_forces[PARTICLE_FORCES_COUNT];
+    error = clEnqueueReadBuffer(command_queue, cl_forces, CL_TRUE, 0,
+                                PARTICLE_FORCES_COUNT * sizeof(cl_float3),
+                                (void *) &particle_forces[0],
+                                0, NULL, NULL);
+    CheckError(error);
+
+    unsigned int counter = 0;
+    for (unsigned int i = 0; i < PARTICLE_FORCES_COUNT; ++i) {
+        auto force = particle_forces[i];
+
+        if (isnan(force.s[0]) || isnan(force.s[1]) || isnan(force.s[2])) {
+            ++counter;
+        }
+        //if (density > 0.0f) {
+        std::cout << "[" << force.s[0] << " " << force.s[1] << " " << force.s[2] << "], ";
+        //}
+    }
+
+    std::cout << "\n";
+    std::cout << "NaN-count = " << counter << "\n";
+#endif
+}
+
+/* Simple integrate positions kernel */
+void OpenClParticleSimulator::runSimpleIntegratePositionsKernel(float dt_seconds) {
+#ifdef MY_DEBUG
+    std::cout << ">> taskParallelIntegrateVelocity\n";
+#endif
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(simple_integration, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(simple_integration, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(simple_integration, 2, sizeof(float), (void *) &dt_seconds);
+    CheckError(error);
+
+#ifdef MY_DEBUG
+    std::cout << "  global_work_size = " << (const size_t) n_particles << "\n";
+#endif
+
+    error = enqueueKernel(simple_integration, 1, &n_particles, NULL);
+    CheckError(error);
+}
+
+void OpenClParticleSimulator::runIntegrateParticleStatesKernel(float dt_seconds, bool velocities_predicted) {
+#ifdef MY_DEBUG
+    std::cout << ">> integrate_particle_states\n";
+#endif
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(integrate_particle_states, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 2, sizeof(cl_mem), (void *) &cl_forces);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 3, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 4, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 5, sizeof(cl_mem), (void *) &cl_boundary_sdf);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 6, sizeof(clBoundaryInfo), (void *) &boundary_info);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 7, sizeof(float), (void *) &dt_seconds);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 8, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 9, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 10, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+    const cl_uint cl_velocities_predicted = velocities_predicted ? 1 : 0;
+    error = clSetKernelArg(integrate_particle_states, 11, sizeof(cl_uint), (void *) &cl_velocities_predicted);
+    CheckError(error);
+    const cl_uint integrator = static_cast<cl_uint>(active_integrator);
+    error = clSetKernelArg(integrate_particle_states, 12, sizeof(cl_uint), (void *) &integrator);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 13, sizeof(cl_mem), (void *) &cl_half_step_velocities);
+    CheckError(error);
+    error = clSetKernelArg(integrate_particle_states, 14, sizeof(cl_mem), (void *) &cl_previous_accelerations);
+    CheckError(error);
+
+#ifdef MY_DEBUG
+    std::cout << "  global_work_size = " << (const size_t) n_particles << "\n";
+#endif
+
+    error = enqueueKernel(integrate_particle_states, 1, &n_particles, NULL);
+    CheckError(error);
+}
+
+void OpenClParticleSimulator::runParticlePoolKernels(const Parameters &params, float dt_seconds) {
+    if (params.emitters.empty() && params.sinks.empty()) {
+        return;
+    }
+
+#ifdef MY_DEBUG
+    std::cout << ">> despawn_particles / spawn_particles\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+    for (const ParticleSink &sink : params.sinks) {
+        const cl_float3 sink_origin = {{sink.origin.x, sink.origin.y, sink.origin.z}};
+        const cl_float3 sink_size = {{sink.size.x, sink.size.y, sink.size.z}};
+
+        error = clSetKernelArg(despawn_particles, 0, sizeof(cl_mem), (void *) &cl_positions);
+        CheckError(error);
+        error = clSetKernelArg(despawn_particles, 1, sizeof(cl_mem), (void *) &cl_alive);
+        CheckError(error);
+        error = clSetKernelArg(despawn_particles, 2, sizeof(cl_mem), (void *) &cl_free_list);
+        CheckError(error);
+        error = clSetKernelArg(despawn_particles, 3, sizeof(cl_mem), (void *) &cl_pool_counters);
+        CheckError(error);
+        error = clSetKernelArg(despawn_particles, 4, sizeof(cl_float3), (void *) &sink_origin);
+        CheckError(error);
+        error = clSetKernelArg(despawn_particles, 5, sizeof(cl_float3), (void *) &sink_size);
+        CheckError(error);
+
+        error = enqueueKernel(despawn_particles, 1, &n_particles, NULL);
+        CheckError(error);
+    }
+
+    // The free count known on the host is from the last read back, and despawning only ever adds to it,
+    // so it is a safe upper bound on how many particles can be spawned
+    const cl_uint start_free_count = pool_counters[0];
+    cl_uint free_count = start_free_count;
+    size_t spawned_count = 0;
+
+    emitter_accumulators.resize(params.emitters.size(), 0.0f);
+    for (unsigned int e = 0; e < params.emitters.size(); ++e) {
+        const ParticleEmitter &emitter = params.emitters[e];
+        emitter_accumulators[e] += emitter.rate * dt_seconds;
+
+        const size_t spawn_count = std::min(static_cast<size_t>(emitter_accumulators[e]),
+                                            static_cast<size_t>(free_count));
+        emitter_accumulators[e] -= spawn_count;
+
+        // Don't let a full pool build up a burst of particles to spawn later
+        if (emitter_accumulators[e] >= 1.0f) {
+            counters.dropped_particles += static_cast<unsigned long long>(emitter_accumulators[e] - 1.0f);
+            emitter_accumulators[e] = 1.0f;
+        }
+
+        if (spawn_count == 0) {
+            continue;
         }
+        free_count -= spawn_count;
+        spawned_count += spawn_count;
+
+        const cl_float3 emitter_origin = {{emitter.origin.x, emitter.origin.y, emitter.origin.z}};
+        const cl_float3 emitter_size = {{emitter.size.x, emitter.size.y, emitter.size.z}};
+        const cl_float3 emitter_velocity = {{emitter.velocity.x, emitter.velocity.y, emitter.velocity.z}};
+        ++spawn_seed;
+
+        error = clSetKernelArg(spawn_particles, 0, sizeof(cl_mem), (void *) &cl_positions);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 1, sizeof(cl_mem), (void *) &cl_velocities);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 2, sizeof(cl_mem), (void *) &cl_alive);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 3, sizeof(cl_mem), (void *) &cl_free_list);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 4, sizeof(cl_mem), (void *) &cl_pool_counters);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 5, sizeof(cl_float3), (void *) &emitter_origin);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 6, sizeof(cl_float3), (void *) &emitter_size);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 7, sizeof(cl_float3), (void *) &emitter_velocity);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 8, sizeof(cl_uint), (void *) &spawn_seed);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 9, sizeof(cl_mem), (void *) &cl_half_step_velocities);
+        CheckError(error);
+        error = clSetKernelArg(spawn_particles, 10, sizeof(cl_mem), (void *) &cl_previous_accelerations);
+        CheckError(error);
+
+        error = enqueueKernel(spawn_particles, 1, &spawn_count, NULL);
+        CheckError(error);
     }
 
-    std::cout << "  [post-reset] voxel_cell_particle_indices (count) = " << total << "\n    ";
-#endif
+    // The high-water mark decides the work size of the following kernels and the draw count
+    error = clEnqueueReadBuffer(command_queue, cl_pool_counters, CL_TRUE, 0,
+                                sizeof(pool_counters), (void *) pool_counters,
+                                0, NULL, NULL);
+    CheckError(error);
+
+    n_particles = pool_counters[1];
+
+    // The free list grew by the despawned particles and shrank by the spawned ones
+    counters.spawned_particles += spawned_count;
+    counters.removed_particles += pool_counters[0] + spawned_count - start_free_count;
 }
 
-void OpenClParticleSimulator::runSimpleVoxelGridMoveKernel(float dt_seconds) {
+void OpenClParticleSimulator::runCalculateDFSPHFactorsKernel() {
 #ifdef MY_DEBUG
-    std::cout << ">> simple_voxel_grid_move\n";
+    std::cout << ">> calculate_dfsph_factors\n";
 #endif
 
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(simple_voxel_grid_move, 0, sizeof(cl_mem), (void *) &cl_positions);
+    error = clSetKernelArg(calculate_dfsph_factors, 0, sizeof(cl_mem), (void *) &cl_positions);
     CheckError(error);
-    error = clSetKernelArg(simple_voxel_grid_move, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    error = clSetKernelArg(calculate_dfsph_factors, 1, sizeof(cl_mem), (void *) &cl_alive);
     CheckError(error);
-    error = clSetKernelArg(simple_voxel_grid_move, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    error = clSetKernelArg(calculate_dfsph_factors, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
     CheckError(error);
-    error = clSetKernelArg(simple_voxel_grid_move, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    error = clSetKernelArg(calculate_dfsph_factors, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
     CheckError(error);
-    error = clSetKernelArg(simple_voxel_grid_move, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clSetKernelArg(calculate_dfsph_factors, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
     CheckError(error);
-    const cl_float cl_dt = dt_seconds;
-    error = clSetKernelArg(simple_voxel_grid_move, 5, sizeof(cl_float), (void *) &cl_dt);
+    error = clSetKernelArg(calculate_dfsph_factors, 5, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 6, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 7, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 8, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 9, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 10, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 11, sizeof(clSolverInfo), (void *) &solver_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 12, sizeof(cl_mem), (void *) &cl_solver_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_factors, 13, sizeof(cl_mem), (void *) &cl_solver_factors);
     CheckError(error);
 
-    error = clEnqueueNDRangeKernel(command_queue, simple_voxel_grid_move, 1, NULL,
-                                   (const size_t *) &grid_info.total_grid_cells, NULL,
-                                   NULL, NULL, NULL);
+    error = enqueueKernel(calculate_dfsph_factors, 1, &n_particles, NULL);
     CheckError(error);
 }
 
-void OpenClParticleSimulator::runCalculateParticleDensitiesKernel(float dt_seconds) {
-#ifdef MY_DEBUG
-    std::cout << ">> calculate_particle_densities\n";
-#endif
-
+void OpenClParticleSimulator::runApplyDFSPHStiffnessKernel(cl_mem &stiffness) {
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(calculate_particle_densities, 0, sizeof(cl_mem), (void *) &cl_positions);
+    error = clSetKernelArg(apply_dfsph_stiffness, 0, sizeof(cl_mem), (void *) &cl_positions);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_densities, 1, sizeof(cl_mem), (void *) &cl_densities);
+    error = clSetKernelArg(apply_dfsph_stiffness, 1, sizeof(cl_mem), (void *) &cl_velocities);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_densities, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    error = clSetKernelArg(apply_dfsph_stiffness, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_densities, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    error = clSetKernelArg(apply_dfsph_stiffness, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_densities, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clSetKernelArg(apply_dfsph_stiffness, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_densities, 5, sizeof(clFluidInfo), (void *) &fluid_info);
+    error = clSetKernelArg(apply_dfsph_stiffness, 5, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 6, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 7, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 8, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 9, sizeof(clSolverInfo), (void *) &solver_info);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 10, sizeof(cl_mem), (void *) &cl_solver_densities);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 11, sizeof(cl_mem), (void *) &cl_solver_factors);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 12, sizeof(cl_mem), (void *) &stiffness);
+    CheckError(error);
+    error = clSetKernelArg(apply_dfsph_stiffness, 13, sizeof(cl_mem), (void *) &cl_limited_particles);
     CheckError(error);
 
-    error = clEnqueueNDRangeKernel(command_queue, calculate_particle_densities, 3, NULL,
-                                   (const size_t *) grid_cells_count, NULL,
-                                   NULL, NULL, NULL);
+    error = clEnqueueWriteBuffer(command_queue, cl_limited_particles, CL_FALSE, 0, sizeof(cl_uint),
+                                 (const void *) &zero_count, 0, NULL, NULL);
+    CheckError(error);
+    error = enqueueKernel(apply_dfsph_stiffness, 1, &n_particles, NULL);
     CheckError(error);
+}
 
+unsigned int OpenClParticleSimulator::runDFSPHSolve(const Parameters &params, cl_uint solve_mode,
+                                                    cl_mem &stiffness, float warm_start_scale) {
 #ifdef MY_DEBUG
-    const unsigned int PARTICLE_DENSITIES_COUNT = grid_info.max_cell_particle_count * grid_info.total_grid_cells;
-    cl_float particle_densities[PARTICLE_DENSITIES_COUNT];
-    error = clEnqueueReadBuffer(command_queue, cl_densities, CL_TRUE, 0,
-                                PARTICLE_DENSITIES_COUNT * sizeof(cl_float),
-                                (void *) &particle_densities[0],
-                                0, NULL, NULL);
+    std::cout << ">> calculate_dfsph_stiffness / apply_dfsph_stiffness (" <<
+            (solve_mode == DFSPH_SOLVE_DENSITY ? "density" : "divergence") << ")\n";
+#endif
+
+    cl_int error = CL_SUCCESS;
+
+    // Warm start with last step's stiffness
+    error = clSetKernelArg(warm_start_dfsph_stiffness, 0, sizeof(cl_mem), (void *) &cl_stiffness_increments);
+    CheckError(error);
+    error = clSetKernelArg(warm_start_dfsph_stiffness, 1, sizeof(cl_mem), (void *) &stiffness);
+    CheckError(error);
+    error = clSetKernelArg(warm_start_dfsph_stiffness, 2, sizeof(cl_mem), (void *) &cl_solver_factors);
+    CheckError(error);
+    error = clSetKernelArg(warm_start_dfsph_stiffness, 3, sizeof(cl_float), (void *) &warm_start_scale);
+    CheckError(error);
+    error = enqueueKernel(warm_start_dfsph_stiffness, 1, &n_particles, NULL);
     CheckError(error);
-    clFinish(command_queue);
 
-    unsigned int zero_counter = 0;
-    unsigned int NaN_counter = 0;
+    runApplyDFSPHStiffnessKernel(cl_stiffness_increments);
 
-    std::cout << "Densities: \n";
-    for (unsigned int i = 0; i < PARTICLE_DENSITIES_COUNT; ++i) {
-        auto density = particle_densities[i];
+    const float tolerance = solve_mode == DFSPH_SOLVE_DENSITY ? params.density_error_tolerance
+                                                               : params.divergence_error_tolerance;
+    const size_t alive_particles = max_particles - pool_counters[0];
 
-        if (density < 0.0001f) {
-            ++zero_counter;
-        }
-        if (isnan(density)) {
-            ++NaN_counter;
-        }
-        if (density > 0.0001f && !isnan(density)) {
-            std::cout << density << ", ";
+    error = clSetKernelArg(calculate_dfsph_stiffness, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 2, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 4, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 5, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 6, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 7, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 8, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 9, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 10, sizeof(clSolverInfo), (void *) &solver_info);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 11, sizeof(cl_mem), (void *) &cl_solver_densities);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 12, sizeof(cl_mem), (void *) &cl_solver_factors);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 13, sizeof(cl_mem), (void *) &cl_stiffness_increments);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 14, sizeof(cl_mem), (void *) &stiffness);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 15, sizeof(cl_mem), (void *) &cl_solver_error);
+    CheckError(error);
+    error = clSetKernelArg(calculate_dfsph_stiffness, 16, sizeof(cl_uint), (void *) &solve_mode);
+    CheckError(error);
+
+    unsigned int iterations = 0;
+    for (; iterations < params.max_solver_iterations; ++iterations) {
+        cl_uint solver_error = 0;
+
+        error = clEnqueueWriteBuffer(command_queue, cl_solver_error, CL_FALSE, 0,
+                                     sizeof(cl_uint), (const void *) &solver_error,
+                                     0, NULL, NULL);
+        CheckError(error);
+        error = enqueueKernel(calculate_dfsph_stiffness, 1, &n_particles, NULL);
+        CheckError(error);
+
+        // The only read back per iteration, deciding whether to go on
+        error = clEnqueueReadBuffer(command_queue, cl_solver_error, CL_TRUE, 0,
+                                    sizeof(cl_uint), (void *) &solver_error,
+                                    0, NULL, NULL);
+        CheckError(error);
+
+        const float average_error = alive_particles > 0 ?
+                                    solver_error / solver_info.error_scale / alive_particles : 0.0f;
+
+        if (iterations >= params.min_solver_iterations && average_error < tolerance) {
+            break;
         }
+
+        runApplyDFSPHStiffnessKernel(cl_stiffness_increments);
     }
-    std::cout << "\nNaN-count = " << NaN_counter << ", zero-count = " << zero_counter << "\n";
 
-    std::cout << "\n";
-#endif
+    // Only the particles the last correction left held back
+    cl_uint limited_particles = 0;
+    error = clEnqueueReadBuffer(command_queue, cl_limited_particles, CL_TRUE, 0, sizeof(cl_uint),
+                                (void *) &limited_particles, 0, NULL, NULL);
+    CheckError(error);
+    counters.limited_pressure_particles += limited_particles;
+
+    return iterations;
+}
+
+void OpenClParticleSimulator::runPredictDFSPHVelocitiesKernel(float dt_seconds) {
+    cl_int error = CL_SUCCESS;
+
+    error = clSetKernelArg(predict_dfsph_velocities, 0, sizeof(cl_mem), (void *) &cl_velocities);
+    CheckError(error);
+    error = clSetKernelArg(predict_dfsph_velocities, 1, sizeof(cl_mem), (void *) &cl_forces);
+    CheckError(error);
+    error = clSetKernelArg(predict_dfsph_velocities, 2, sizeof(cl_mem), (void *) &cl_solver_factors);
+    CheckError(error);
+    error = clSetKernelArg(predict_dfsph_velocities, 3, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(predict_dfsph_velocities, 4, sizeof(cl_float), (void *) &dt_seconds);
+    CheckError(error);
+
+    error = enqueueKernel(predict_dfsph_velocities, 1, &n_particles, NULL);
+    CheckError(error);
 }
 
-void OpenClParticleSimulator::runCalculateParticleForcesKernel() {
+unsigned int OpenClParticleSimulator::runImplicitViscositySolve(const Parameters &params, float dt_seconds) {
 #ifdef MY_DEBUG
-    std::cout << ">> calculate_particle_forces\n";
+    std::cout << ">> apply_viscosity_operator / update_viscosity_solution / update_viscosity_direction\n";
 #endif
 
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(calculate_particle_forces, 0, sizeof(cl_mem), (void *) &cl_positions);
+    error = clSetKernelArg(calculate_viscosity_densities, 0, sizeof(cl_mem), (void *) &cl_positions);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 1, sizeof(cl_mem), (void *) &cl_velocities);
+    error = clSetKernelArg(calculate_viscosity_densities, 1, sizeof(cl_mem), (void *) &cl_alive);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 2, sizeof(cl_mem), (void *) &cl_forces);
+    error = clSetKernelArg(calculate_viscosity_densities, 2, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 3, sizeof(cl_mem), (void *) &cl_densities);
+    error = clSetKernelArg(calculate_viscosity_densities, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 4, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    error = clSetKernelArg(calculate_viscosity_densities, 4, sizeof(clVoxelGridInfo), (void *) &grid_info);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 5, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    error = clSetKernelArg(calculate_viscosity_densities, 5, sizeof(clFluidInfo), (void *) &fluid_info);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 6, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clSetKernelArg(calculate_viscosity_densities, 6, sizeof(cl_mem), (void *) &cl_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_viscosity_densities, 7, sizeof(cl_mem), (void *) &cl_boundary_cell_start);
+    CheckError(error);
+    error = clSetKernelArg(calculate_viscosity_densities, 8, sizeof(cl_uint), (void *) &use_boundary_particles);
+    CheckError(error);
+    error = clSetKernelArg(calculate_viscosity_densities, 9, sizeof(cl_mem), (void *) &cl_viscosity_densities);
     CheckError(error);
-    error = clSetKernelArg(calculate_particle_forces, 7, sizeof(clFluidInfo), (void *) &fluid_info);
+    error = enqueueKernel(calculate_viscosity_densities, 1, &n_particles, NULL);
     CheckError(error);
 
-    error = clFinish(command_queue);
+    // With the current velocities as the first guess, the first residual is the explicit viscosity's velocity change
+    runApplyViscosityOperatorKernel(dt_seconds, cl_velocities, cl_viscosity_residual, true);
+
+    error = clEnqueueCopyBuffer(command_queue, cl_viscosity_residual, cl_viscosity_direction, 0, 0,
+                                3 * n_particles * sizeof(cl_float), 0, NULL, NULL);
     CheckError(error);
 
-    error = clEnqueueNDRangeKernel(command_queue, calculate_particle_forces, 3, NULL,
-                                   (const size_t *) grid_cells_count, NULL,
-                                   NULL, NULL, NULL);
+    const float velocity_sum = runSumViscosityProductsKernel(cl_velocities, cl_velocities);
+    const float tolerance2 = params.viscosity_error_tolerance * params.viscosity_error_tolerance * velocity_sum;
+    float residual_sum = runSumViscosityProductsKernel(cl_viscosity_residual, cl_viscosity_residual);
+
+    // The vector updates run per float
+    const cl_uint count = static_cast<cl_uint>(3 * n_particles);
+    const size_t global_work_size = viscosityGlobalWorkSize();
+
+    unsigned int iterations = 0;
+    while (residual_sum > tolerance2 && iterations < params.max_viscosity_iterations) {
+        runApplyViscosityOperatorKernel(dt_seconds, cl_viscosity_direction, cl_viscosity_product, false);
+
+        const float alpha = residual_sum / runSumViscosityProductsKernel(cl_viscosity_direction, cl_viscosity_product);
+
+        error = clSetKernelArg(update_viscosity_solution, 0, sizeof(cl_mem), (void *) &cl_velocities);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_solution, 1, sizeof(cl_mem), (void *) &cl_viscosity_residual);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_solution, 2, sizeof(cl_mem), (void *) &cl_viscosity_direction);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_solution, 3, sizeof(cl_mem), (void *) &cl_viscosity_product);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_solution, 4, sizeof(cl_float), (void *) &alpha);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_solution, 5, sizeof(cl_uint), (void *) &count);
+        CheckError(error);
+        error = enqueueKernel(update_viscosity_solution, 1, &global_work_size, NULL);
+        CheckError(error);
+
+        const float next_residual_sum = runSumViscosityProductsKernel(cl_viscosity_residual, cl_viscosity_residual);
+        const float beta = next_residual_sum / residual_sum;
+
+        error = clSetKernelArg(update_viscosity_direction, 0, sizeof(cl_mem), (void *) &cl_viscosity_direction);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_direction, 1, sizeof(cl_mem), (void *) &cl_viscosity_residual);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_direction, 2, sizeof(cl_float), (void *) &beta);
+        CheckError(error);
+        error = clSetKernelArg(update_viscosity_direction, 3, sizeof(cl_uint), (void *) &count);
+        CheckError(error);
+        error = enqueueKernel(update_viscosity_direction, 1, &global_work_size, NULL);
+        CheckError(error);
+
+        residual_sum = next_residual_sum;
+        ++iterations;
+    }
+
+    return iterations;
+}
+
+void OpenClParticleSimulator::runApplyViscosityOperatorKernel(float dt_seconds, cl_mem &x, cl_mem &product,
+                                                              bool residual_mode) {
+    cl_int error = CL_SUCCESS;
+
+    const cl_uint cl_residual_mode = residual_mode ? 1 : 0;
+
+    error = clSetKernelArg(apply_viscosity_operator, 0, sizeof(cl_mem), (void *) &cl_positions);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 1, sizeof(cl_mem), (void *) &x);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 2, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 3, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 4, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 5, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 6, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 7, sizeof(cl_mem), (void *) &cl_viscosity_densities);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 8, sizeof(cl_mem), (void *) &cl_cell_last_active);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 9, sizeof(clSleepInfo), (void *) &sleep_info);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 10, sizeof(cl_float), (void *) &dt_seconds);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 11, sizeof(cl_mem), (void *) &product);
+    CheckError(error);
+    error = clSetKernelArg(apply_viscosity_operator, 12, sizeof(cl_uint), (void *) &cl_residual_mode);
     CheckError(error);
 
-#ifdef MY_DEBUG
-    const unsigned int PARTICLE_FORCES_COUNT = n_particles;
-    cl_float3 particle_forces[PARTICLE_FORCES_COUNT];
-    error = clEnqueueReadBuffer(command_queue, cl_forces, CL_TRUE, 0,
-                                PARTICLE_FORCES_COUNT * sizeof(cl_float3),
-                                (void *) &particle_forces[0],
-                                0, NULL, NULL);
+    error = enqueueKernel(apply_viscosity_operator, 1, &n_particles, NULL);
+    CheckError(error);
+}
+
+float OpenClParticleSimulator::runSumViscosityProductsKernel(cl_mem &a, cl_mem &b) {
+    cl_int error = CL_SUCCESS;
+
+    const cl_uint count = static_cast<cl_uint>(3 * n_particles);
+    const size_t global_work_size = viscosityGlobalWorkSize();
+    const size_t local_work_size = VISCOSITY_WORK_GROUP_SIZE;
+    const size_t group_count = global_work_size / local_work_size;
+
+    error = clSetKernelArg(sum_viscosity_products, 0, sizeof(cl_mem), (void *) &a);
+    CheckError(error);
+    error = clSetKernelArg(sum_viscosity_products, 1, sizeof(cl_mem), (void *) &b);
+    CheckError(error);
+    error = clSetKernelArg(sum_viscosity_products, 2, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+    error = clSetKernelArg(sum_viscosity_products, 3, sizeof(cl_uint), (void *) &count);
+    CheckError(error);
+    error = clSetKernelArg(sum_viscosity_products, 4, local_work_size * sizeof(cl_float), NULL);
+    CheckError(error);
+    error = clSetKernelArg(sum_viscosity_products, 5, sizeof(cl_mem), (void *) &cl_viscosity_partial_sums);
+    CheckError(error);
+    error = enqueueKernel(sum_viscosity_products, 1, &global_work_size, &local_work_size);
     CheckError(error);
 
-    unsigned int counter = 0;
-    for (unsigned int i = 0; i < PARTICLE_FORCES_COUNT; ++i) {
-        auto force = particle_forces[i];
+    // The conjugate gradient step sizes are needed on the host, the partial sums are few enough to add up here
+    error = clEnqueueReadBuffer(command_queue, cl_viscosity_partial_sums, CL_TRUE, 0,
+                                group_count * sizeof(cl_float), (void *) viscosity_partial_sums.data(),
+                                0, NULL, NULL);
+    CheckError(error);
 
-        if (isnan(force.s[0]) || isnan(force.s[1]) || isnan(force.s[2])) {
-            ++counter;
-        }
-        //if (density > 0.0f) {
-        std::cout << "[" << force.s[0] << " " << force.s[1] << " " << force.s[2] << "], ";
-        //}
+    float sum = 0.0f;
+    for (size_t i = 0; i < group_count; ++i) {
+        sum += viscosity_partial_sums[i];
     }
 
-    std::cout << "\n";
-    std::cout << "NaN-count = " << counter << "\n";
-#endif
+    return sum;
 }
 
-/* Simple integrate positions kernel */
-void OpenClParticleSimulator::runSimpleIntegratePositionsKernel(float dt_seconds) {
+size_t OpenClParticleSimulator::viscosityGlobalWorkSize() const {
+    return (3 * n_particles + VISCOSITY_WORK_GROUP_SIZE - 1) / VISCOSITY_WORK_GROUP_SIZE * VISCOSITY_WORK_GROUP_SIZE;
+}
+
+unsigned int OpenClParticleSimulator::runAssignTimestepLevelsKernel() {
+    if (timestep_info.max_timestep_level == 0) {
+        return 0;
+    }
+
 #ifdef MY_DEBUG
-    std::cout << ">> taskParallelIntegrateVelocity\n";
+    std::cout << ">> assign_timestep_levels\n";
 #endif
+
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(simple_integration, 0, sizeof(cl_mem), (void *) &cl_positions);
+    cl_uint finest_level = 0;
+    error = clEnqueueWriteBuffer(command_queue, cl_finest_timestep_level, CL_FALSE, 0,
+                                 sizeof(cl_uint), (const void *) &finest_level,
+                                 0, NULL, NULL);
     CheckError(error);
-    error = clSetKernelArg(simple_integration, 1, sizeof(cl_mem), (void *) &cl_velocities);
+
+    error = clSetKernelArg(assign_timestep_levels, 0, sizeof(cl_mem), (void *) &cl_velocities);
     CheckError(error);
-    error = clSetKernelArg(simple_integration, 2, sizeof(float), (void *) &dt_seconds);
+    error = clSetKernelArg(assign_timestep_levels, 1, sizeof(cl_mem), (void *) &cl_forces);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 2, sizeof(cl_mem), (void *) &cl_alive);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 3, sizeof(cl_mem), (void *) &cl_timestep_levels);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 4, sizeof(cl_mem), (void *) &cl_finest_timestep_level);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 5, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 6, sizeof(clFluidInfo), (void *) &fluid_info);
+    CheckError(error);
+    error = clSetKernelArg(assign_timestep_levels, 7, sizeof(clTimestepInfo), (void *) &timestep_info);
     CheckError(error);
 
-#ifdef MY_DEBUG
-    std::cout << "  global_work_size = " << (const size_t) n_particles << "\n";
-#endif
+    error = enqueueKernel(assign_timestep_levels, 1, &n_particles, NULL);
+    CheckError(error);
 
-    error = clEnqueueNDRangeKernel(command_queue, simple_integration, 1, NULL, (const size_t *) &n_particles,
-                                   NULL, 0,
-                                   NULL, NULL);
+    // The host needs the sub-step count to enqueue the frame
+    error = clEnqueueReadBuffer(command_queue, cl_finest_timestep_level, CL_TRUE, 0,
+                                sizeof(cl_uint), (void *) &finest_level,
+                                0, NULL, NULL);
     CheckError(error);
+
+    return finest_level;
 }
 
-void OpenClParticleSimulator::runIntegrateParticleStatesKernel(float dt_seconds) {
+void OpenClParticleSimulator::runBuildActiveCellListKernel() {
 #ifdef MY_DEBUG
-    std::cout << ">> integrate_particle_states\n";
+    std::cout << ">> build_active_cell_list\n";
 #endif
+
     cl_int error = CL_SUCCESS;
 
-    error = clSetKernelArg(integrate_particle_states, 0, sizeof(cl_mem), (void *) &cl_positions);
+    const cl_uint active_cell_count = 0;
+    error = clEnqueueWriteBuffer(command_queue, cl_active_cell_count, CL_FALSE, 0,
+                                 sizeof(cl_uint), (const void *) &active_cell_count,
+                                 0, NULL, NULL);
     CheckError(error);
-    error = clSetKernelArg(integrate_particle_states, 1, sizeof(cl_mem), (void *) &cl_velocities);
+
+    error = clSetKernelArg(build_active_cell_list, 0, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_indices);
     CheckError(error);
-    error = clSetKernelArg(integrate_particle_states, 2, sizeof(cl_mem), (void *) &cl_forces);
+    error = clSetKernelArg(build_active_cell_list, 1, sizeof(cl_mem), (void *) &cl_voxel_cell_particle_count);
     CheckError(error);
-    error = clSetKernelArg(integrate_particle_states, 3, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    error = clSetKernelArg(build_active_cell_list, 2, sizeof(cl_mem), (void *) &cl_timestep_levels);
     CheckError(error);
-    error = clSetKernelArg(integrate_particle_states, 4, sizeof(clFluidInfo), (void *) &fluid_info);
+    error = clSetKernelArg(build_active_cell_list, 3, sizeof(cl_mem), (void *) &cl_active_cells);
     CheckError(error);
-    error = clSetKernelArg(integrate_particle_states, 5, sizeof(float), (void *) &dt_seconds);
+    error = clSetKernelArg(build_active_cell_list, 4, sizeof(cl_mem), (void *) &cl_active_cell_count);
+    CheckError(error);
+    error = clSetKernelArg(build_active_cell_list, 5, sizeof(clVoxelGridInfo), (void *) &grid_info);
+    CheckError(error);
+    error = clSetKernelArg(build_active_cell_list, 6, sizeof(clTimestepInfo), (void *) &timestep_info);
     CheckError(error);
 
-#ifdef MY_DEBUG
-    std::cout << "  global_work_size = " << (const size_t) n_particles << "\n";
-#endif
-
-    error = clEnqueueNDRangeKernel(command_queue, integrate_particle_states, 1, NULL, (const size_t *) &n_particles,
-                                   NULL, 0,
-                                   NULL, NULL);
+    error = enqueueKernel(build_active_cell_list, 3, (const size_t *) grid_cells_count, NULL);
     CheckError(error);
-}
\ No newline at end of file
+}
@@ -0,0 +1,62 @@
+#include "ParticleFlow.hpp"
+
+void ParticleFlow::drain(const Parameters &params, const std::vector<glm::vec3> &positions,
+                         const RemoveCallback &remove, SimulationCounters &counters, const RemoveTest &also_remove) {
+    for (unsigned int i = 0; i < positions.size();) {
+        bool removed = false;
+        for (const ParticleSink &sink : params.sinks) {
+            if (sink.contains(positions[i])) {
+                removed = true;
+                break;
+            }
+        }
+
+        if (!removed && also_remove) {
+            removed = also_remove(i);
+        }
+
+        // The last particle takes the removed one's place, so the same index is looked at again
+        if (removed) {
+            remove(i);
+            ++counters.removed_particles;
+        } else {
+            ++i;
+        }
+    }
+}
+
+void ParticleFlow::emit(const Parameters &params, float dt_seconds, unsigned int particle_count,
+                        std::mt19937 &random_generator, const SpawnCallback &spawn, SimulationCounters &counters) {
+    emitter_accumulators.resize(params.emitters.size(), 0.0f);
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+
+    for (unsigned int e = 0; e < params.emitters.size(); ++e) {
+        const ParticleEmitter &emitter = params.emitters[e];
+        emitter_accumulators[e] += emitter.rate * dt_seconds;
+
+        while (emitter_accumulators[e] >= 1.0f && particle_count < params.max_particles) {
+            const glm::vec3 offset(distribution(random_generator),
+                                   distribution(random_generator),
+                                   distribution(random_generator));
+
+            spawn(emitter.origin + offset * emitter.size, emitter.velocity);
+            ++particle_count;
+            emitter_accumulators[e] -= 1.0f;
+            ++counters.spawned_particles;
+        }
+
+        // Don't let a full pool build up a burst of particles to spawn later
+        if (emitter_accumulators[e] >= 1.0f) {
+            counters.dropped_particles += static_cast<unsigned long long>(emitter_accumulators[e] - 1.0f);
+            emitter_accumulators[e] = 1.0f;
+        }
+    }
+}
+
+void ParticleFlow::get_state(SolverState &state) const {
+    state.add("emitter_accumulators", emitter_accumulators);
+}
+
+void ParticleFlow::set_state(const SolverState &state) {
+    state.get("emitter_accumulators", emitter_accumulators);
+}
@@ -0,0 +1,306 @@
+#include "PbfParticleSimulator.hpp"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "sph_kernels.h"
+
+bool PbfParticleSimulator::setupSimulation(const Parameters &parameters,
+                                           Span<const glm::vec3> particle_positions,
+                                           Span<const glm::vec3> particle_velocities,
+                                           std::string &error) {
+    PROFILE_ZONE("PbfParticleSimulator::setupSimulation");
+
+    positions.assign(particle_positions.begin(), particle_positions.end());
+    velocities.assign(particle_velocities.begin(), particle_velocities.end());
+
+    // Reserve room for the whole particle pool up front so that spawning never reallocates
+    positions.reserve(parameters.max_particles);
+    velocities.reserve(parameters.max_particles);
+
+    // The positions and velocities are swapped with these each step, so they need the same room
+    predictedPositions.reserve(parameters.max_particles);
+    smoothedVelocities.reserve(parameters.max_particles);
+
+    velocities.resize(positions.size());
+
+    boundary_sdf = SignedDistanceField::create_from_parameters(parameters);
+    boundary_particles.sample(boundary_sdf, parameters);
+
+    return true;
+}
+
+void PbfParticleSimulator::updateSimulation(const Parameters &params, float dt_seconds) {
+    PROFILE_ZONE("PbfParticleSimulator::updateSimulation");
+
+    PhaseClock clock(phase_timings);
+
+    updateParticlePool(params, dt_seconds);
+    ++counters.steps;
+    counters.particle_steps += positions.size();
+    clock.lap("particle pool");
+
+    const unsigned int n = static_cast<unsigned int>(positions.size());
+    predictedPositions.resize(n);
+    positionCorrections.resize(n);
+    smoothedVelocities.resize(n);
+    lambdas.resize(n);
+
+    params.set_solver_info(solver_info, dt_seconds);
+
+    // Apply the external forces and predict where the particles end up without the constraints
+    for (unsigned int i = 0; i < n; ++i) {
+        velocities[i] += params.gravity * dt_seconds;
+        predictedPositions[i] = positions[i] + velocities[i] * dt_seconds;
+    }
+
+    projectBoundaries(params);
+    clock.lap("prediction");
+
+    findNeighbours(params);
+    clock.lap("neighbours");
+
+    // Each iteration may move a particle up to a tenth of a kernel size, so the neighbours are found again once a
+    // particle has moved that far, instead of missing the ones that came closer. A calm fluid keeps its lists
+    const float maxNeighbourDrift = 0.1f * params.kernel_size;
+    for (solverIterations = 0; solverIterations < params.pbf_iterations; ++solverIterations) {
+        if (solverIterations > 0 && getNeighbourDrift() > maxNeighbourDrift) {
+            findNeighbours(params);
+        }
+
+        solveDensityConstraints(params);
+        projectBoundaries(params);
+    }
+    clock.lap("constraints");
+
+    // The velocity is whatever moved the particle to its corrected position
+    for (unsigned int i = 0; i < n; ++i) {
+        velocities[i] = (predictedPositions[i] - positions[i]) / dt_seconds;
+    }
+
+    applyXSPHViscosity(params);
+    clock.lap("viscosity");
+
+    positions.swap(predictedPositions);
+
+    // Particles leaving through a periodic side come back in through the opposite one
+    for (glm::vec3 &position : positions) {
+        position = grid.wrap_position(position);
+    }
+
+    // Only the alive range is handed out, i.e. for uploading to the renderer's VBOs
+    if (publishParticleState()) {
+        clock.lap("upload");
+    }
+}
+
+void PbfParticleSimulator::findNeighbours(const Parameters &params) {
+    const bool use_boundary_particles = params.boundary_handling == BoundaryHandling::Particles;
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const float kernelSize2 = params.kernel_size * params.kernel_size;
+    const unsigned int n = static_cast<unsigned int>(predictedPositions.size());
+
+    clVoxelGridInfo grid_info;
+    params.set_voxel_grid_info(grid_info);
+    grid.build(grid_info, predictedPositions);
+
+    neighbourStart.resize(n + 1);
+    boundaryNeighbourStart.resize(n + 1);
+    neighbours.clear();
+    boundaryNeighbours.clear();
+
+    // Only the particles within one kernel size are kept, the 3x3x3 cells hold about five times as many
+    for (unsigned int i = 0; i < n; ++i) {
+        neighbourStart[i] = static_cast<unsigned int>(neighbours.size());
+        boundaryNeighbourStart[i] = static_cast<unsigned int>(boundaryNeighbours.size());
+
+        grid.for_each_neighbour(predictedPositions[i], [&](unsigned int j) {
+            const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i], predictedPositions[j]);
+            if (glm::dot(relativePos, relativePos) < kernelSize2) {
+                neighbours.push_back(j);
+            }
+        });
+
+        if (use_boundary_particles) {
+            boundary_particles.get_grid().for_each_neighbour(predictedPositions[i], [&](unsigned int b) {
+                const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i], boundaryPositions[b]);
+                if (glm::dot(relativePos, relativePos) < kernelSize2) {
+                    boundaryNeighbours.push_back(b);
+                }
+            });
+        }
+    }
+
+    neighbourStart[n] = static_cast<unsigned int>(neighbours.size());
+    boundaryNeighbourStart[n] = static_cast<unsigned int>(boundaryNeighbours.size());
+    counters.neighbour_pairs += neighbours.size() + boundaryNeighbours.size();
+
+    neighbourPositions.assign(predictedPositions.begin(), predictedPositions.end());
+}
+
+float PbfParticleSimulator::getNeighbourDrift() const {
+    float maxDrift2 = 0;
+    for (unsigned int i = 0; i < predictedPositions.size(); ++i) {
+        const glm::vec3 drift = grid.get_relative_position(predictedPositions[i], neighbourPositions[i]);
+        maxDrift2 = std::max(maxDrift2, glm::dot(drift, drift));
+    }
+    return std::sqrt(maxDrift2);
+}
+
+void PbfParticleSimulator::solveDensityConstraints(const Parameters &params) {
+    const std::vector<glm::vec3> &boundaryPositions = boundary_particles.get_positions();
+    const std::vector<float> &boundaryVolumes = boundary_particles.get_volumes();
+    const unsigned int n = static_cast<unsigned int>(predictedPositions.size());
+    const float mass = params.get_particle_mass();
+    const float h = params.kernel_size;
+    const float restDensity = solver_info.rest_density;
+    const float maxCorrection = solver_info.max_velocity_change * solver_info.dt;
+
+    // The constraint C_i = density_i / rest_density - 1 gets a scaling factor lambda_i (eq. 11), with the
+    // constraint gradients mass-weighted and multiplied by rest_density^2 to keep the sums in the units of the
+    // DFSPH factors. The minimum denominator takes the place of the paper's relaxation epsilon
+    for (unsigned int i = 0; i < n; ++i) {
+        float density = 0;
+        glm::vec3 gradientSum = {0, 0, 0};
+        float gradientDotSum = 0;
+
+        for (unsigned int k = neighbourStart[i]; k < neighbourStart[i + 1]; ++k) {
+            const unsigned int j = neighbours[k];
+            const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i], predictedPositions[j]);
+            density += mass * Wpoly6(relativePos, h);
+
+            const glm::vec3 gradient = mass * gradWspiky(relativePos, h);
+            gradientSum += gradient;
+            gradientDotSum += glm::dot(gradient, gradient);
+        }
+
+        // Boundary particles never move, so they only add to particle i's own gradient
+        for (unsigned int k = boundaryNeighbourStart[i]; k < boundaryNeighbourStart[i + 1]; ++k) {
+            const unsigned int b = boundaryNeighbours[k];
+            const glm::vec3 relativePos = grid.get_relative_position(predictedPositions[i], boundaryPositions[b]);
+            const float boundaryMass = solver_info.boundary_scale * boundaryVolumes[b];
+            density += boundaryMass * Wpoly6(relativePos, h);
+            gradientSum += boundaryMass * gradWspiky(relativePos, h);
+        }
+
+        // Only compression is corrected, so that the surface does not clump together
+        const float constraint = std::max(density / restDensity - 1, 0.0f);
+        const float denominator = std::max(glm::dot(gradientSum, gradientSum) + gradientDotSum,
+                                           solver_info.min_denominator);
+
+        lambdas[i] = -constraint * restDensity * restDensity / denominator;
+    }
+
+    // The position corrections (eq. 12) are computed for all particles before any of them moves (Jacobi)
+    for (unsigned int i = 0; i < n; ++i) {
+        glm::vec3 correction = {0, 0, 0};
+
+        for (unsigned int k = neighbourStart[i]; k < neighbourStart[i + 1]; ++k) {
+            const unsigned int j = neighbours[k];
+            correction += mass * (lambdas[i] + lambdas[j]) *
+                gradWspiky(grid.get_relative_position(predictedPositions[i], predictedPositions[j]), h);
+        }
+
+        for (unsigned int k = boundaryNeighbourStart[i]; k < boundaryNeighbourStart[i + 1]; ++k) {
+            const unsigned int b = boundaryNeighbours[k];
+            correction += solver_info.boundary_scale * boundaryVolumes[b] * lambdas[i] *
+                gradWspiky(grid.get_relative_position(predictedPositions[i], boundaryPositions[b]), h);
+        }
+
+        correction /= restDensity;
+
+        // Overlapping particles, e.g. from a random initial state, would get flung apart at the speed of their
+        // overlap. Limiting the correction lets them separate calmly, like the other solvers do
+        const float length = glm::length(correction);
+        if (length > maxCorrection) {
+            correction *= maxCorrection / length;
+        }
+
+        positionCorrections[i] = correction;
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        predictedPositions[i] += positionCorrections[i];
+    }
+}
+
+void PbfParticleSimulator::projectBoundaries(const Parameters &params) {
+    // A particle on the wall would sit on top of the boundary particles, where the constraint gradients point in
+    // arbitrary directions and keep kicking it along the wall. Half a particle spacing away it is pushed off evenly
+    const float margin = params.boundary_handling == BoundaryHandling::Particles ? params.kernel_size / 4 : 0.0f;
+
+    for (unsigned int i = 0; i < predictedPositions.size(); ++i) {
+        const glm::vec4 boundary = boundary_sdf.sample(predictedPositions[i]);
+        const float distance = boundary.w;
+
+        // The velocity follows from the corrected position, so there is nothing to reflect
+        if (distance < margin) {
+            predictedPositions[i] -= (distance - margin) * glm::vec3(boundary);
+        }
+    }
+}
+
+void PbfParticleSimulator::applyXSPHViscosity(const Parameters &params) {
+    const unsigned int n = static_cast<unsigned int>(velocities.size());
+    const float mass = params.get_particle_mass();
+    const float h = params.kernel_size;
+
+    // The kernel is weighted by the rest volume so that the coefficient is independent of the particle count
+    const float weight = params.xsph_viscosity * mass / solver_info.rest_density;
+
+    for (unsigned int i = 0; i < n; ++i) {
+        glm::vec3 velocity = velocities[i];
+
+        for (unsigned int k = neighbourStart[i]; k < neighbourStart[i + 1]; ++k) {
+            const unsigned int j = neighbours[k];
+            velocity += weight * (velocities[j] - velocities[i]) *
+                Wpoly6(grid.get_relative_position(predictedPositions[i], predictedPositions[j]), h);
+        }
+
+        smoothedVelocities[i] = velocity;
+    }
+
+    velocities.swap(smoothedVelocities);
+}
+
+unsigned int PbfParticleSimulator::getParticleDrawCount() {
+    return static_cast<unsigned int>(positions.size());
+}
+
+void PbfParticleSimulator::readParticleState(const ParticleStateCallback &callback) {
+    callback(positions, velocities);
+}
+
+unsigned int PbfParticleSimulator::getSolverIterations() {
+    return solverIterations;
+}
+
+bool PbfParticleSimulator::getGridOccupancy(GridOccupancy &occupancy) {
+    occupancy = grid.get_occupancy();
+    return true;
+}
+
+void PbfParticleSimulator::getSolverState(SolverState &state) {
+    particle_flow.get_state(state);
+    state.add_text("random_generator", random_generator);
+}
+
+void PbfParticleSimulator::setSolverState(const SolverState &state) {
+    particle_flow.set_state(state);
+    state.get_text("random_generator", random_generator);
+}
+
+void PbfParticleSimulator::updateParticlePool(const Parameters &params, float dt_seconds) {
+    particle_flow.drain(params, positions, [&](unsigned int i) {
+        positions[i] = positions.back();
+        velocities[i] = velocities.back();
+        positions.pop_back();
+        velocities.pop_back();
+    }, counters);
+
+    particle_flow.emit(params, dt_seconds, static_cast<unsigned int>(positions.size()), random_generator,
+                       [&](const glm::vec3 &position, const glm::vec3 &velocity) {
+        positions.push_back(position);
+        velocities.push_back(velocity);
+    }, counters);
+}
@@ -0,0 +1,207 @@
+#include "ShallowWater.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// The fraction of a column a wave may cross per sub-step
+static const float COURANT_NUMBER = 0.25f;
+
+// How quickly the far field calms down, per second. The linearized equations have no other losses
+static const float VELOCITY_DAMPING = 0.2f;
+
+// Columns shallower than this count as dry, there is nothing to move
+static const float DRY_DEPTH = 1e-4f;
+
+void ShallowWater::build(const Parameters &params, const SignedDistanceField &sdf) {
+    cell_size = params.shallow_water_cell_size;
+    origin = glm::vec2(params.left_bound, params.near_bound);
+    floor_height = params.bottom_bound;
+
+    dimensions.x = static_cast<int>(ceilf(params.get_volume_size_x() / cell_size));
+    dimensions.y = static_cast<int>(ceilf(params.get_volume_size_z() / cell_size));
+
+    const unsigned int column_count = dimensions.x * dimensions.y;
+    column_types.assign(column_count, ColumnType::Water);
+    depths.assign(column_count, 0.0f);
+
+    const glm::vec2 active_min = params.active_region_origin;
+    const glm::vec2 active_max = params.active_region_origin + params.active_region_size;
+
+    for (int z = 0; z < dimensions.y; ++z) {
+        for (int x = 0; x < dimensions.x; ++x) {
+            const unsigned int c = get_column_index(glm::ivec2(x, z));
+            const glm::vec2 centre = origin + (glm::vec2(x, z) + 0.5f) * cell_size;
+
+            // Half a column above the floor, so that only the walls decide
+            if (sdf.sample(glm::vec3(centre.x, floor_height + 0.5f * cell_size, centre.y)).w < 0.0f) {
+                column_types[c] = ColumnType::Land;
+            } else if (glm::all(glm::greaterThanEqual(centre, active_min)) &&
+                       glm::all(glm::lessThan(centre, active_max))) {
+                column_types[c] = ColumnType::Active;
+            } else {
+                depths[c] = params.shallow_water_depth;
+            }
+        }
+    }
+
+    x_velocities.assign((dimensions.x + 1) * dimensions.y, 0.0f);
+    z_velocities.assign(dimensions.x * (dimensions.y + 1), 0.0f);
+    outflows.assign(column_count, 0.0f);
+    depth_changes.assign(column_count, 0.0f);
+
+    inflow_volumes.assign(column_count, 0.0f);
+    inflow_momenta.assign(column_count, glm::vec2(0.0f));
+}
+
+glm::ivec2 ShallowWater::get_column(const glm::vec3 &position) const {
+    const glm::vec2 grid_position = (glm::vec2(position.x, position.z) - origin) / cell_size;
+
+    return glm::clamp(glm::ivec2(glm::floor(grid_position)), glm::ivec2(0), dimensions - glm::ivec2(1));
+}
+
+bool ShallowWater::is_active(const glm::vec3 &position) const {
+    return column_types[get_column_index(get_column(position))] == ColumnType::Active;
+}
+
+void ShallowWater::absorb(const glm::vec3 &position, const glm::vec3 &velocity, float volume) {
+    const glm::ivec2 column = get_column(position);
+    const unsigned int c = get_column_index(column);
+
+    // A particle that flew over the wall has nowhere to go
+    if (column_types[c] != ColumnType::Water) {
+        return;
+    }
+
+    // The column's faces take on the particle's momentum in proportion to the volume it adds
+    const float area = cell_size * cell_size;
+    const float weight = volume / (volume + depths[c] * area);
+
+    float &left = x_velocities[column.x + (dimensions.x + 1) * column.y];
+    float &right = x_velocities[column.x + 1 + (dimensions.x + 1) * column.y];
+    float &front = z_velocities[column.x + dimensions.x * column.y];
+    float &back = z_velocities[column.x + dimensions.x * (column.y + 1)];
+
+    left += weight * (velocity.x - left);
+    right += weight * (velocity.x - right);
+    front += weight * (velocity.z - front);
+    back += weight * (velocity.z - back);
+
+    depths[c] += volume / area;
+}
+
+void ShallowWater::set_active_depths(const std::vector<glm::vec3> &positions, float particle_volume) {
+    for (unsigned int c = 0; c < depths.size(); ++c) {
+        if (column_types[c] == ColumnType::Active) {
+            depths[c] = 0.0f;
+        }
+    }
+
+    const float particle_depth = particle_volume / (cell_size * cell_size);
+
+    for (const glm::vec3 &position : positions) {
+        const unsigned int c = get_column_index(get_column(position));
+
+        if (column_types[c] == ColumnType::Active) {
+            depths[c] += particle_depth;
+        }
+    }
+}
+
+void ShallowWater::update(const Parameters &params, float dt_seconds) {
+    const float gravity = std::abs(params.gravity.y);
+
+    float max_depth = 0.0f;
+    for (float depth : depths) {
+        max_depth = std::max(max_depth, depth);
+    }
+
+    float max_speed = 0.0f;
+    for (float velocity : x_velocities) {
+        max_speed = std::max(max_speed, std::abs(velocity));
+    }
+    for (float velocity : z_velocities) {
+        max_speed = std::max(max_speed, std::abs(velocity));
+    }
+
+    // Waves travel at sqrt(g * depth) on top of the flow
+    const float speed = std::sqrt(gravity * max_depth) + max_speed;
+    const unsigned int substeps = std::max(1u, static_cast<unsigned int>(
+        ceilf(dt_seconds * speed / (COURANT_NUMBER * cell_size))));
+    const float substep_seconds = dt_seconds / substeps;
+
+    for (unsigned int step = 0; step < substeps; ++step) {
+        update_velocities(gravity, substep_seconds);
+        transport(substep_seconds);
+    }
+}
+
+void ShallowWater::update_velocities(float gravity, float dt_seconds) {
+    const float damping = std::max(1.0f - VELOCITY_DAMPING * dt_seconds, 0.0f);
+
+    for_each_inner_face([&](float &velocity, unsigned int lower, unsigned int upper, const glm::vec2 &axis) {
+        // The particles move the water between active columns, and nothing flows through land
+        const bool blocked = column_types[lower] == ColumnType::Land || column_types[upper] == ColumnType::Land ||
+                             (column_types[lower] == ColumnType::Active && column_types[upper] == ColumnType::Active);
+
+        if (blocked || (depths[lower] < DRY_DEPTH && depths[upper] < DRY_DEPTH)) {
+            velocity = 0.0f;
+            return;
+        }
+
+        // The floor is flat, so the surface slope is the depth difference
+        velocity -= gravity * dt_seconds * (depths[upper] - depths[lower]) / cell_size;
+        velocity *= damping;
+    });
+}
+
+void ShallowWater::transport(float dt_seconds) {
+    std::fill(outflows.begin(), outflows.end(), 0.0f);
+    std::fill(depth_changes.begin(), depth_changes.end(), 0.0f);
+
+    // Water only leaves the active columns as particles, so the faces pushing out of them are closed
+    for_each_inner_face([&](float &velocity, unsigned int lower, unsigned int upper, const glm::vec2 &axis) {
+        const unsigned int from = velocity > 0 ? lower : upper;
+
+        if (column_types[from] == ColumnType::Active) {
+            velocity = 0.0f;
+            return;
+        }
+
+        outflows[from] += std::abs(velocity) * dt_seconds * cell_size * depths[from];
+    });
+
+    const float area = cell_size * cell_size;
+
+    // Upwind fluxes, scaled down where a column would give away more than it holds
+    for_each_inner_face([&](float &velocity, unsigned int lower, unsigned int upper, const glm::vec2 &axis) {
+        if (velocity == 0.0f) {
+            return;
+        }
+
+        const unsigned int from = velocity > 0 ? lower : upper;
+        const unsigned int to = velocity > 0 ? upper : lower;
+
+        float volume = std::abs(velocity) * dt_seconds * cell_size * depths[from];
+        if (outflows[from] > depths[from] * area) {
+            volume *= depths[from] * area / outflows[from];
+        }
+
+        // Water reaching an active column waits there to be turned into particles
+        if (column_types[to] == ColumnType::Active) {
+            inflow_volumes[to] += volume;
+            inflow_momenta[to] += volume * velocity * axis;
+        } else {
+            depth_changes[to] += volume / area;
+        }
+
+        depth_changes[from] -= volume / area;
+    });
+
+    // The active columns' depths are measured from the particles instead, and the limited outflows can leave a
+    // rounding error below zero
+    for (unsigned int c = 0; c < depths.size(); ++c) {
+        if (column_types[c] == ColumnType::Water) {
+            depths[c] = std::max(depths[c] + depth_changes[c], 0.0f);
+        }
+    }
+}
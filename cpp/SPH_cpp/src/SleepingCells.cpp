@@ -0,0 +1,78 @@
+#include "SleepingCells.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+void SleepingCells::update(const Parameters &params, const VoxelGrid &grid, const std::vector<glm::vec3> &velocities) {
+    const unsigned int total_cells = grid.get_total_cells();
+
+    sleep_step_count = params.allow_sleeping ? params.sleep_step_count : 0;
+    asleep_particle_count = 0;
+
+    // Start over with every cell awake if sleeping was turned off, or if the grid changed
+    if (sleep_step_count == 0 || last_active_steps.size() != total_cells) {
+        step = 0;
+        last_active_steps.assign(total_cells, 0);
+        mean_densities.assign(total_cells, 0.0f);
+        density_changes.assign(total_cells, 0.0f);
+    }
+
+    if (sleep_step_count == 0) {
+        return;
+    }
+
+    ++step;
+
+    const float velocity_threshold2 = params.sleep_velocity_threshold * params.sleep_velocity_threshold;
+
+    // Only cells with particles can be active, so empty cells are never visited
+    grid.for_each_occupied_cell([&](unsigned int cell) {
+        bool active = density_changes[cell] > params.sleep_density_threshold;
+
+        grid.for_each_in_cell(cell, [&](unsigned int i) {
+            active = active || glm::dot(velocities[i], velocities[i]) > velocity_threshold2;
+        });
+
+        // An active cell keeps its neighbours awake, so that a splash wakes up the fluid around it
+        if (active) {
+            grid.for_each_neighbour_cell(grid.get_cell_indices(cell), [&](unsigned int neighbour) {
+                last_active_steps[neighbour] = step;
+            });
+        }
+    });
+
+    const std::vector<unsigned int> &cell_start = grid.get_cell_start();
+    grid.for_each_occupied_cell([&](unsigned int cell) {
+        if (is_asleep(cell)) {
+            asleep_particle_count += cell_start[cell + 1] - cell_start[cell];
+        }
+    });
+}
+
+void SleepingCells::update_densities(const Parameters &params, const VoxelGrid &grid,
+                                     const std::vector<float> &densities) {
+    if (sleep_step_count == 0) {
+        return;
+    }
+
+    // Sleeping cells kept their densities. A cell that was active when it emptied stays marked active
+    // until its next particle's density has been calculated, which at most delays its sleep a step
+    grid.for_each_occupied_cell([&](unsigned int cell) {
+        if (is_asleep(cell)) {
+            return;
+        }
+
+        float density_sum = 0.0f;
+        unsigned int count = 0;
+
+        grid.for_each_in_cell(cell, [&](unsigned int i) {
+            density_sum += densities[i];
+            ++count;
+        });
+
+        const float mean_density = density_sum / count;
+        density_changes[cell] = std::abs(mean_density - mean_densities[cell]) /
+                                std::max(mean_density, params.rest_density);
+        mean_densities[cell] = mean_density;
+    });
+}
@@ -0,0 +1,54 @@
+#include "VoxelGrid.hpp"
+
+#include <algorithm>
+
+void VoxelGrid::build(const clVoxelGridInfo &grid_info, const std::vector<glm::vec3> &positions) {
+    dimensions = glm::ivec3(grid_info.grid_dimensions.s[0], grid_info.grid_dimensions.s[1],
+                            grid_info.grid_dimensions.s[2]);
+    origin = glm::vec3(grid_info.grid_origin.s[0], grid_info.grid_origin.s[1], grid_info.grid_origin.s[2]);
+    cell_size = grid_info.grid_cell_size;
+
+    periodic = glm::bvec3(grid_info.periodic_axes.s[0] != 0, grid_info.periodic_axes.s[1] != 0,
+                          grid_info.periodic_axes.s[2] != 0);
+    for (int axis = 0; axis < 3; ++axis) {
+        period[axis] = periodic[axis] ? dimensions[axis] * cell_size : 0.0f;
+        inverse_period[axis] = periodic[axis] ? 1 / period[axis] : 0.0f;
+    }
+
+    const unsigned int total_grid_cells = dimensions.x * dimensions.y * dimensions.z;
+
+    cell_start.assign(total_grid_cells + 1, 0);
+    particle_cells.resize(positions.size());
+    sorted_indices.resize(positions.size());
+
+    // Count the particles in each cell
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        particle_cells[i] = get_cell_index(get_cell_indices(positions[i]));
+        ++cell_start[particle_cells[i] + 1];
+    }
+
+    // Prefix sum gives where each cell starts
+    for (unsigned int cell = 0; cell < total_grid_cells; ++cell) {
+        cell_start[cell + 1] += cell_start[cell];
+    }
+
+    // Scatter the particles into their cells
+    std::vector<unsigned int> cell_fill(cell_start.begin(), cell_start.end() - 1);
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        sorted_indices[cell_fill[particle_cells[i]]++] = i;
+    }
+}
+
+glm::ivec3 VoxelGrid::get_cell_indices(const glm::vec3 &position) const {
+    const glm::ivec3 indices(glm::floor((position - origin) / cell_size));
+    glm::ivec3 cell_indices = glm::clamp(indices, glm::ivec3(0), dimensions - glm::ivec3(1));
+
+    // The positions are wrapped into the grid on the periodic axes, but rounding can leave them a cell outside
+    for (int axis = 0; axis < 3; ++axis) {
+        if (periodic[axis]) {
+            cell_indices[axis] = (indices[axis] % dimensions[axis] + dimensions[axis]) % dimensions[axis];
+        }
+    }
+
+    return cell_indices;
+}
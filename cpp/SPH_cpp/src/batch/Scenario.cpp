@@ -0,0 +1,447 @@
+#include "batch/Scenario.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "CppParticleSimulator.hpp"
+#include "FlipParticleSimulator.hpp"
+#include "PbfParticleSimulator.hpp"
+#include "OpenCL/OpenClParticleSimulator.hpp"
+
+namespace {
+    struct EnumName {
+        const char *name;
+        int value;
+    };
+
+    const EnumName backend_names[] = {
+            {"cpp",    static_cast<int>(SimulatorBackend::Cpp)},
+            {"opencl", static_cast<int>(SimulatorBackend::OpenCL)},
+            {"pbf",    static_cast<int>(SimulatorBackend::Pbf)},
+            {"flip",   static_cast<int>(SimulatorBackend::Flip)}
+    };
+
+    const EnumName dt_policy_names[] = {
+            {"fixed",      static_cast<int>(TimestepPolicy::Fixed)},
+            {"wall_clock", static_cast<int>(TimestepPolicy::WallClock)}
+    };
+
+    const EnumName layout_names[] = {
+            {"random",  static_cast<int>(ParticleLayout::Random)},
+            {"lattice", static_cast<int>(ParticleLayout::Lattice)}
+    };
+
+    const EnumName container_names[] = {
+            {"glass", static_cast<int>(ContainerType::Glass)},
+            {"box",   static_cast<int>(ContainerType::Box)},
+            {"mesh",  static_cast<int>(ContainerType::Mesh)}
+    };
+
+    const EnumName boundary_handling_names[] = {
+            {"penalty",   static_cast<int>(BoundaryHandling::Penalty)},
+            {"particles", static_cast<int>(BoundaryHandling::Particles)}
+    };
+
+    const EnumName pressure_solver_names[] = {
+            {"state_equation", static_cast<int>(PressureSolver::StateEquation)},
+            {"pcisph",         static_cast<int>(PressureSolver::PCISPH)},
+            {"dfsph",          static_cast<int>(PressureSolver::DFSPH)}
+    };
+
+    const EnumName time_integrator_names[] = {
+            {"semi_implicit_euler", static_cast<int>(TimeIntegrator::SemiImplicitEuler)},
+            {"leapfrog",            static_cast<int>(TimeIntegrator::Leapfrog)},
+            {"velocity_verlet",     static_cast<int>(TimeIntegrator::VelocityVerlet)}
+    };
+
+    inline bool read_value(std::istream &in, float &value) {
+        return static_cast<bool>(in >> value);
+    }
+
+    inline bool read_value(std::istream &in, int &value) {
+        return static_cast<bool>(in >> value);
+    }
+
+    inline bool read_value(std::istream &in, unsigned int &value) {
+        // Extracting a negative number into an unsigned wraps it around instead of failing
+        long long signed_value;
+        if (!(in >> signed_value) || signed_value < 0) {
+            return false;
+        }
+
+        value = static_cast<unsigned int>(signed_value);
+        return true;
+    }
+
+    bool read_value(std::istream &in, bool &value) {
+        std::string word;
+        if (!(in >> word)) {
+            return false;
+        }
+
+        if (word == "true" || word == "on" || word == "1") {
+            value = true;
+        } else if (word == "false" || word == "off" || word == "0") {
+            value = false;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    inline bool read_value(std::istream &in, glm::vec2 &value) {
+        return read_value(in, value.x) && read_value(in, value.y);
+    }
+
+    inline bool read_value(std::istream &in, glm::vec3 &value) {
+        return read_value(in, value.x) && read_value(in, value.y) && read_value(in, value.z);
+    }
+
+    bool read_value(std::istream &in, glm::bvec3 &value) {
+        bool x, y, z;
+        if (!read_value(in, x) || !read_value(in, y) || !read_value(in, z)) {
+            return false;
+        }
+
+        value = glm::bvec3(x, y, z);
+        return true;
+    }
+
+    /// The rest of the line without its surrounding whitespace, i.e. a file name with spaces
+    bool read_value(std::istream &in, std::string &value) {
+        std::getline(in >> std::ws, value);
+
+        const size_t end = value.find_last_not_of(" \t\r");
+        value = end == std::string::npos ? "" : value.substr(0, end + 1);
+
+        return !value.empty();
+    }
+
+    template<typename Enum, size_t N>
+    bool read_enum(std::istream &in, Enum &value, const EnumName (&names)[N]) {
+        std::string word;
+        if (!(in >> word)) {
+            return false;
+        }
+
+        for (const EnumName &name : names) {
+            if (word == name.name) {
+                value = static_cast<Enum>(name.value);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template<typename Enum, size_t N>
+    const char *get_enum_name(Enum value, const EnumName (&names)[N]) {
+        for (const EnumName &name : names) {
+            if (name.value == static_cast<int>(value)) {
+                return name.name;
+            }
+        }
+
+        return "unknown";
+    }
+
+    /// Reads the value of the Parameters field with the key's name. Returns false if there is no such field
+    bool read_parameter(const std::string &key, std::istream &in, Parameters &p, bool &valid) {
+        if (key == "total_mass") valid = read_value(in, p.total_mass);
+        else if (key == "kernel_size") valid = read_value(in, p.kernel_size);
+        else if (key == "k_gas") valid = read_value(in, p.k_gas);
+        else if (key == "k_viscosity") valid = read_value(in, p.k_viscosity);
+        else if (key == "rest_density") valid = read_value(in, p.rest_density);
+        else if (key == "sigma") valid = read_value(in, p.sigma);
+        else if (key == "k_threshold") valid = read_value(in, p.k_threshold);
+        else if (key == "surface_neighbour_count") valid = read_value(in, p.surface_neighbour_count);
+        else if (key == "gravity") valid = read_value(in, p.gravity);
+        else if (key == "left_bound") valid = read_value(in, p.left_bound);
+        else if (key == "right_bound") valid = read_value(in, p.right_bound);
+        else if (key == "bottom_bound") valid = read_value(in, p.bottom_bound);
+        else if (key == "top_bound") valid = read_value(in, p.top_bound);
+        else if (key == "near_bound") valid = read_value(in, p.near_bound);
+        else if (key == "far_bound") valid = read_value(in, p.far_bound);
+        else if (key == "k_wall_damper") valid = read_value(in, p.k_wall_damper);
+        else if (key == "k_wall_friction") valid = read_value(in, p.k_wall_friction);
+        else if (key == "container") valid = read_enum(in, p.container, container_names);
+        else if (key == "container_mesh_file") valid = read_value(in, p.container_mesh_file);
+        else if (key == "periodic_axes") valid = read_value(in, p.periodic_axes);
+        else if (key == "boundary_handling") valid = read_enum(in, p.boundary_handling, boundary_handling_names);
+        else if (key == "pressure_solver") valid = read_enum(in, p.pressure_solver, pressure_solver_names);
+        else if (key == "time_integrator") valid = read_enum(in, p.time_integrator, time_integrator_names);
+        else if (key == "multi_rate_timestepping") valid = read_value(in, p.multi_rate_timestepping);
+        else if (key == "max_timestep_level") valid = read_value(in, p.max_timestep_level);
+        else if (key == "courant_number") valid = read_value(in, p.courant_number);
+        else if (key == "density_error_tolerance") valid = read_value(in, p.density_error_tolerance);
+        else if (key == "divergence_error_tolerance") valid = read_value(in, p.divergence_error_tolerance);
+        else if (key == "min_solver_iterations") valid = read_value(in, p.min_solver_iterations);
+        else if (key == "max_solver_iterations") valid = read_value(in, p.max_solver_iterations);
+        else if (key == "implicit_viscosity") valid = read_value(in, p.implicit_viscosity);
+        else if (key == "viscosity_error_tolerance") valid = read_value(in, p.viscosity_error_tolerance);
+        else if (key == "max_viscosity_iterations") valid = read_value(in, p.max_viscosity_iterations);
+        else if (key == "pbf_iterations") valid = read_value(in, p.pbf_iterations);
+        else if (key == "xsph_viscosity") valid = read_value(in, p.xsph_viscosity);
+        else if (key == "flip_ratio") valid = read_value(in, p.flip_ratio);
+        else if (key == "flip_pressure_tolerance") valid = read_value(in, p.flip_pressure_tolerance);
+        else if (key == "adaptive_resolution") valid = read_value(in, p.adaptive_resolution);
+        else if (key == "max_split_level") valid = read_value(in, p.max_split_level);
+        else if (key == "split_vorticity") valid = read_value(in, p.split_vorticity);
+        else if (key == "merge_neighbour_count") valid = read_value(in, p.merge_neighbour_count);
+        else if (key == "sdf_cell_size") valid = read_value(in, p.sdf_cell_size);
+        else if (key == "shallow_water") valid = read_value(in, p.shallow_water);
+        else if (key == "active_region_origin") valid = read_value(in, p.active_region_origin);
+        else if (key == "active_region_size") valid = read_value(in, p.active_region_size);
+        else if (key == "shallow_water_cell_size") valid = read_value(in, p.shallow_water_cell_size);
+        else if (key == "shallow_water_depth") valid = read_value(in, p.shallow_water_depth);
+        else if (key == "allow_sleeping") valid = read_value(in, p.allow_sleeping);
+        else if (key == "sleep_velocity_threshold") valid = read_value(in, p.sleep_velocity_threshold);
+        else if (key == "sleep_density_threshold") valid = read_value(in, p.sleep_density_threshold);
+        else if (key == "sleep_step_count") valid = read_value(in, p.sleep_step_count);
+        else return false;
+
+        return true;
+    }
+}
+
+Scenario::Scenario() : params(0) {
+    Parameters::set_default_parameters(params);
+
+    backend = SimulatorBackend::Cpp;
+
+    // Where the interactive program puts the C++ simulators' particles
+    layout = ParticleLayout::Random;
+    layout_min = glm::vec3(-1.0f, 0.0f, -1.0f);
+    layout_max = glm::vec3(-0.2f, 1.0f, 1.0f);
+    layout_spacing = 0.0f;
+    initial_velocity = glm::vec3(0.0f);
+    seed = 1;
+
+    steps = 1000;
+    warmup_steps = 10;
+    dt_policy = TimestepPolicy::Fixed;
+    dt = 1.0f / 60;
+
+    opencl_device = 1;
+    phase_timings = true;
+
+    has_max_particles = false;
+    has_sdf_cell_size = false;
+    has_shallow_water_cell_size = false;
+}
+
+bool Scenario::load(const std::string &file_name, Scenario &scenario) {
+    std::ifstream file(file_name.c_str());
+    if (!file.is_open()) {
+        std::cerr << "Could not open scenario " << file_name << std::endl;
+        return false;
+    }
+
+    bool success = true;
+    std::string line;
+    unsigned int line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        if (line.find('=') == std::string::npos) {
+            if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                std::cerr << file_name << ":" << line_number << ": expected \"key = value\"" << std::endl;
+                success = false;
+            }
+            continue;
+        }
+
+        std::string error;
+        if (!scenario.set(line, error)) {
+            std::cerr << file_name << ":" << line_number << ": " << error << std::endl;
+            success = false;
+        }
+    }
+
+    std::string error;
+    if (!scenario.finish(error)) {
+        std::cerr << file_name << ": " << error << std::endl;
+        success = false;
+    }
+
+    return success;
+}
+
+bool Scenario::set(const std::string &assignment, std::string &error) {
+    const size_t separator = assignment.find('=');
+    if (separator == std::string::npos) {
+        error = "expected \"key = value\"";
+        return false;
+    }
+
+    Parameters &p = params;
+
+    std::string key;
+    std::istringstream(assignment.substr(0, separator)) >> key;
+    std::istringstream in(assignment.substr(separator + 1));
+
+    bool valid = false;
+    if (key == "backend") {
+        valid = read_enum(in, backend, backend_names);
+    } else if (key == "particles") {
+        valid = read_value(in, p.n_particles) && p.n_particles > 0;
+    } else if (key == "max_particles") {
+        valid = read_value(in, p.max_particles);
+        has_max_particles = true;
+    } else if (key == "layout") {
+        valid = read_enum(in, layout, layout_names);
+    } else if (key == "layout_min") {
+        valid = read_value(in, layout_min);
+    } else if (key == "layout_max") {
+        valid = read_value(in, layout_max);
+    } else if (key == "layout_spacing") {
+        valid = read_value(in, layout_spacing);
+    } else if (key == "initial_velocity") {
+        valid = read_value(in, initial_velocity);
+    } else if (key == "seed") {
+        valid = read_value(in, seed);
+    } else if (key == "steps") {
+        valid = read_value(in, steps);
+    } else if (key == "warmup_steps") {
+        valid = read_value(in, warmup_steps);
+    } else if (key == "dt_policy") {
+        valid = read_enum(in, dt_policy, dt_policy_names);
+    } else if (key == "dt") {
+        valid = read_value(in, dt) && dt > 0.0f;
+    } else if (key == "opencl_device") {
+        valid = read_value(in, opencl_device) && opencl_device >= 1;
+    } else if (key == "phase_timings") {
+        valid = read_value(in, phase_timings);
+    } else if (key == "emitter") {
+        ParticleEmitter emitter;
+        valid = read_value(in, emitter.origin) && read_value(in, emitter.size) &&
+                read_value(in, emitter.velocity) && read_value(in, emitter.rate);
+        if (valid) {
+            p.emitters.push_back(emitter);
+        }
+    } else if (key == "sink") {
+        ParticleSink sink;
+        valid = read_value(in, sink.origin) && read_value(in, sink.size);
+        if (valid) {
+            p.sinks.push_back(sink);
+        }
+    } else if (!read_parameter(key, in, p, valid)) {
+        error = "unknown key \"" + key + "\"";
+        return false;
+    }
+
+    has_sdf_cell_size |= key == "sdf_cell_size";
+    has_shallow_water_cell_size |= key == "shallow_water_cell_size";
+
+    // Anything but whitespace after the value is an error too
+    std::string rest;
+    if (!valid || in >> rest) {
+        error = "invalid value for \"" + key + "\"";
+        return false;
+    }
+
+    return true;
+}
+
+void Scenario::set_parameters(const Parameters &parameters) {
+    params = parameters;
+
+    has_max_particles = true;
+    has_sdf_cell_size = true;
+    has_shallow_water_cell_size = true;
+}
+
+bool Scenario::finish(std::string &error) {
+    Parameters &p = params;
+
+    if (p.n_particles == 0) {
+        error = "the scenario has no particles";
+        return false;
+    }
+
+    // Like the interactive program, leave room in the particle pool for the emitters
+    if (!has_max_particles) {
+        p.max_particles = 2 * p.n_particles;
+    } else if (p.max_particles < p.n_particles) {
+        error = "max_particles is less than particles";
+        return false;
+    }
+
+    if (!has_sdf_cell_size) {
+        p.sdf_cell_size = p.kernel_size / 2;
+    }
+    if (!has_shallow_water_cell_size) {
+        p.shallow_water_cell_size = p.kernel_size;
+    }
+
+    return true;
+}
+
+std::vector<glm::vec3> Scenario::generate_positions() const {
+    std::vector<glm::vec3> positions;
+    positions.reserve(params.n_particles);
+
+    if (layout == ParticleLayout::Random) {
+        std::mt19937 generator(seed);
+        std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+
+        const glm::vec3 size = layout_max - layout_min;
+        while (positions.size() < params.n_particles) {
+            // Drawn one by one so the order of evaluation is fixed
+            const float x = distribution(generator);
+            const float y = distribution(generator);
+            const float z = distribution(generator);
+            positions.push_back(layout_min + size * glm::vec3(x, y, z));
+        }
+    } else {
+        // The spacing latticeDensity assumes, where the fluid is at rest
+        const float spacing = layout_spacing > 0.0f ? layout_spacing : params.kernel_size / 2;
+        const glm::vec3 size = layout_max - layout_min;
+        const unsigned int count_x = std::max(1u, static_cast<unsigned int>(size.x / spacing) + 1);
+        const unsigned int count_z = std::max(1u, static_cast<unsigned int>(size.z / spacing) + 1);
+
+        // The layers are stacked from layout_min.y up, above layout_max if the box is too small to hold them all
+        for (unsigned int iy = 0; positions.size() < params.n_particles; ++iy) {
+            for (unsigned int iz = 0; iz < count_z && positions.size() < params.n_particles; ++iz) {
+                for (unsigned int ix = 0; ix < count_x && positions.size() < params.n_particles; ++ix) {
+                    positions.push_back(layout_min + spacing * glm::vec3(ix, iy, iz));
+                }
+            }
+        }
+    }
+
+    return positions;
+}
+
+ParticleSimulator *Scenario::create_simulator() const {
+    switch (backend) {
+        case SimulatorBackend::OpenCL: {
+            // Plain OpenCL buffers, so that the scenario runs without a window
+            OpenClParticleSimulator *simulator = new OpenClParticleSimulator;
+            simulator->setDeviceId(opencl_device);
+            return simulator;
+        }
+        case SimulatorBackend::Pbf:
+            return new PbfParticleSimulator;
+        case SimulatorBackend::Flip:
+            return new FlipParticleSimulator;
+        default:
+            return new CppParticleSimulator;
+    }
+}
+
+const char *Scenario::get_backend_name(SimulatorBackend backend) {
+    return get_enum_name(backend, backend_names);
+}
+
+const char *Scenario::get_pressure_solver_name(PressureSolver solver) {
+    return get_enum_name(solver, pressure_solver_names);
+}
@@ -0,0 +1,63 @@
+#include "boundary/BoundaryParticles.hpp"
+
+#include <cmath>
+#include <limits>
+
+#include "sph_kernels.h"
+
+void BoundaryParticles::sample(const SignedDistanceField &sdf, const Parameters &params) {
+    const float spacing = params.kernel_size / 2;
+
+    const glm::vec3 lower = sdf.get_origin();
+    const glm::vec3 upper = lower + sdf.get_cell_size() * glm::vec3(sdf.get_dimensions() - glm::uvec3(1));
+    const glm::uvec3 samples = glm::uvec3(glm::ceil((upper - lower) / spacing));
+
+    clVoxelGridInfo grid_info;
+    params.set_voxel_grid_info(grid_info);
+
+    // On the periodic axes the walls are sampled over a single period, the grid finds the neighbours across it
+    glm::vec3 period_lower(-std::numeric_limits<float>::max());
+    glm::vec3 period_upper(std::numeric_limits<float>::max());
+    for (int axis = 0; axis < 3; ++axis) {
+        if (grid_info.periodic_axes.s[axis]) {
+            period_lower[axis] = grid_info.grid_origin.s[axis];
+            period_upper[axis] = period_lower[axis] + grid_info.grid_dimensions.s[axis] * grid_info.grid_cell_size;
+        }
+    }
+
+    positions.clear();
+
+    // Every lattice point in a slab of one spacing around the walls is projected onto them,
+    // which gives roughly one boundary particle per spacing^2 of wall area
+    for (unsigned int z = 0; z <= samples.z; ++z) {
+        for (unsigned int y = 0; y <= samples.y; ++y) {
+            for (unsigned int x = 0; x <= samples.x; ++x) {
+                const glm::vec3 p = lower + spacing * glm::vec3(x, y, z);
+                const glm::vec4 boundary = sdf.sample(p);
+
+                if (std::abs(boundary.w) < spacing / 2 && glm::length(glm::vec3(boundary)) > 0.0f) {
+                    const glm::vec3 position = p - boundary.w * glm::vec3(boundary);
+
+                    if (glm::all(glm::greaterThanEqual(position, period_lower)) &&
+                        glm::all(glm::lessThan(position, period_upper))) {
+                        positions.push_back(position);
+                    }
+                }
+            }
+        }
+    }
+
+    grid.build(grid_info, positions);
+
+    // The volume of a boundary particle is the inverse of its kernel-weighted boundary particle number density
+    volumes.resize(positions.size());
+    for (unsigned int b = 0; b < positions.size(); ++b) {
+        float number_density = 0.0f;
+
+        grid.for_each_neighbour(positions[b], [&](unsigned int k) {
+            number_density += Wpoly6(grid.get_relative_position(positions[b], positions[k]), params.kernel_size);
+        });
+
+        volumes[b] = params.rest_density / number_density;
+    }
+}
@@ -0,0 +1,336 @@
+#include "boundary/SignedDistanceField.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+
+namespace {
+    struct Triangle {
+        glm::vec3 a, b, c;
+    };
+
+    /// Closest point on triangle abc to point p (Ericson, Real-Time Collision Detection, 5.1.5)
+    glm::vec3 closest_point_on_triangle(const glm::vec3 &p, const Triangle &t) {
+        const glm::vec3 ab = t.b - t.a;
+        const glm::vec3 ac = t.c - t.a;
+        const glm::vec3 ap = p - t.a;
+
+        const float d1 = glm::dot(ab, ap);
+        const float d2 = glm::dot(ac, ap);
+        if (d1 <= 0.0f && d2 <= 0.0f) {
+            return t.a;
+        }
+
+        const glm::vec3 bp = p - t.b;
+        const float d3 = glm::dot(ab, bp);
+        const float d4 = glm::dot(ac, bp);
+        if (d3 >= 0.0f && d4 <= d3) {
+            return t.b;
+        }
+
+        const float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+            return t.a + (d1 / (d1 - d3)) * ab;
+        }
+
+        const glm::vec3 cp = p - t.c;
+        const float d5 = glm::dot(ab, cp);
+        const float d6 = glm::dot(ac, cp);
+        if (d6 >= 0.0f && d5 <= d6) {
+            return t.c;
+        }
+
+        const float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+            return t.a + (d2 / (d2 - d6)) * ac;
+        }
+
+        const float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+            return t.b + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (t.c - t.b);
+        }
+
+        const float denominator = 1.0f / (va + vb + vc);
+        return t.a + ab * (vb * denominator) + ac * (vc * denominator);
+    }
+
+    /// Reads vertices and faces from an OBJ file, fan-triangulating polygons
+    std::vector<Triangle> read_obj_triangles(const std::string &file_name) {
+        std::ifstream ifs(file_name.c_str());
+        std::vector<glm::vec3> vertices;
+        std::vector<Triangle> triangles;
+
+        if (!ifs.is_open()) {
+            std::cerr << "Could not open container mesh \"" << file_name << "\"" << std::endl;
+            return triangles;
+        }
+
+        std::string line;
+        unsigned int line_number = 0;
+        while (std::getline(ifs, line)) {
+            ++line_number;
+            std::istringstream ss(line);
+            std::string type;
+            ss >> type;
+
+            if (type == "v") {
+                glm::vec3 vertex;
+                ss >> vertex.x >> vertex.y >> vertex.z;
+                vertices.push_back(vertex);
+            } else if (type == "f") {
+                // Faces are given as "f v1 v2 v3 ..." where each entry may be on the form v/vt/vn
+                std::vector<long> face;
+                std::string entry;
+                bool valid = true;
+                while (valid && ss >> entry) {
+                    const std::string index_text = entry.substr(0, entry.find('/'));
+                    char *end = nullptr;
+                    const long index = std::strtol(index_text.c_str(), &end, 10);
+                    // Negative indices are relative to the end of the vertex list
+                    const long vertex = index < 0 ? static_cast<long>(vertices.size()) + index : index - 1;
+
+                    // Only the vertices read so far can be referred to
+                    valid = !index_text.empty() && *end == '\0' && index != 0 && vertex >= 0 &&
+                            vertex < static_cast<long>(vertices.size());
+                    face.push_back(vertex);
+                }
+
+                if (!valid) {
+                    std::cerr << file_name << ":" << line_number << ": face refers to vertex \"" << entry
+                              << "\", which does not exist, the face is skipped" << std::endl;
+                    continue;
+                }
+
+                for (unsigned int i = 1; i + 1 < face.size(); ++i) {
+                    triangles.push_back({vertices[face[0]], vertices[face[i]], vertices[face[i + 1]]});
+                }
+            }
+        }
+
+        ifs.close();
+        return triangles;
+    }
+}
+
+SignedDistanceField::SignedDistanceField(const Parameters &params) {
+    // Pad the field around the volume so that particles that have left it still get a sensible distance
+    const float padding = 2 * params.kernel_size;
+
+    cell_size = params.sdf_cell_size;
+    origin = glm::vec3(params.left_bound, params.bottom_bound, params.near_bound) - glm::vec3(padding);
+
+    dimensions.x = static_cast<unsigned int>(ceilf((params.get_volume_size_x() + 2 * padding) / cell_size)) + 1;
+    dimensions.y = static_cast<unsigned int>(ceilf((params.get_volume_size_y() + 2 * padding) / cell_size)) + 1;
+    dimensions.z = static_cast<unsigned int>(ceilf((params.get_volume_size_z() + 2 * padding) / cell_size)) + 1;
+
+    data.resize(dimensions.x * dimensions.y * dimensions.z);
+}
+
+SignedDistanceField SignedDistanceField::create_from_parameters(const Parameters &params) {
+    switch (params.container) {
+        case ContainerType::Box:
+            return create_box(params);
+        case ContainerType::Mesh:
+            return create_from_obj(params, params.container_mesh_file);
+        case ContainerType::Glass:
+        default:
+            return create_glass(params);
+    }
+}
+
+SignedDistanceField SignedDistanceField::create_glass(const Parameters &params) {
+    SignedDistanceField sdf(params);
+
+    const float radius = params.get_volume_size_x() / 2;
+    const glm::vec2 center((params.left_bound + params.right_bound) / 2, (params.near_bound + params.far_bound) / 2);
+    const float bottom = params.bottom_bound;
+
+    sdf.voxelize([=](const glm::vec3 &p) {
+        const float wall_distance = radius - glm::length(glm::vec2(p.x, p.z) - center);
+        const float bottom_distance = p.y - bottom;
+
+        return std::min(wall_distance, bottom_distance);
+    });
+
+    return sdf;
+}
+
+SignedDistanceField SignedDistanceField::create_box(const Parameters &params) {
+    SignedDistanceField sdf(params);
+
+    const glm::vec3 lower(params.left_bound, params.bottom_bound, params.near_bound);
+    const glm::vec3 upper(params.right_bound, params.top_bound, params.far_bound);
+    const glm::bvec3 periodic = params.periodic_axes;
+
+    sdf.voxelize([=](const glm::vec3 &p) {
+        glm::vec3 distances = glm::min(p - lower, upper - p);
+
+        // The fluid wraps around on the periodic axes, so the walls across them are left out
+        for (int axis = 0; axis < 3; ++axis) {
+            if (periodic[axis]) {
+                distances[axis] = std::numeric_limits<float>::max();
+            }
+        }
+
+        return std::min(std::min(distances.x, distances.y), distances.z);
+    });
+
+    return sdf;
+}
+
+SignedDistanceField SignedDistanceField::create_from_obj(const Parameters &params, const std::string &file_name) {
+    const std::vector<Triangle> triangles = read_obj_triangles(file_name);
+    if (triangles.empty()) {
+        std::cerr << "Container mesh is empty, falling back to a glass container" << std::endl;
+        return create_glass(params);
+    }
+
+    SignedDistanceField sdf(params);
+
+    // Exact distances are only needed within reach of the boundary forces, further away only the sign matters
+    const float band = 2 * params.kernel_size;
+    const int band_cells = static_cast<int>(ceilf(band / sdf.cell_size));
+
+    std::vector<float> distances(sdf.data.size(), band);
+
+    for (const Triangle &t : triangles) {
+        const glm::vec3 lower = glm::min(glm::min(t.a, t.b), t.c);
+        const glm::vec3 upper = glm::max(glm::max(t.a, t.b), t.c);
+
+        const glm::ivec3 max_indices = glm::ivec3(sdf.dimensions) - glm::ivec3(1);
+        const glm::ivec3 first = glm::clamp(glm::ivec3(glm::floor((lower - sdf.origin) / sdf.cell_size)) - band_cells,
+                                            glm::ivec3(0), max_indices);
+        const glm::ivec3 last = glm::clamp(glm::ivec3(glm::ceil((upper - sdf.origin) / sdf.cell_size)) + band_cells,
+                                           glm::ivec3(0), max_indices);
+
+        for (int z = first.z; z <= last.z; ++z) {
+            for (int y = first.y; y <= last.y; ++y) {
+                for (int x = first.x; x <= last.x; ++x) {
+                    const glm::vec3 p = sdf.get_node_position(x, y, z);
+                    const unsigned int index = sdf.get_node_index(x, y, z);
+
+                    distances[index] = std::min(distances[index], glm::length(p - closest_point_on_triangle(p, t)));
+                }
+            }
+        }
+    }
+
+    // Determine the sign of each node by casting a ray along +x and counting the crossed triangles
+    std::vector<float> crossings;
+    for (unsigned int z = 0; z < sdf.dimensions.z; ++z) {
+        for (unsigned int y = 0; y < sdf.dimensions.y; ++y) {
+            const glm::vec3 row = sdf.get_node_position(0, y, z);
+
+            crossings.clear();
+            for (const Triangle &t : triangles) {
+                // Barycentric coordinates of the row's (y, z) inside the triangle's projection on the yz-plane
+                const float det = (t.b.y - t.a.y) * (t.c.z - t.a.z) - (t.c.y - t.a.y) * (t.b.z - t.a.z);
+                if (std::abs(det) < 1e-12f) {
+                    continue;
+                }
+
+                const float u = ((row.y - t.a.y) * (t.c.z - t.a.z) - (t.c.y - t.a.y) * (row.z - t.a.z)) / det;
+                const float v = ((t.b.y - t.a.y) * (row.z - t.a.z) - (row.y - t.a.y) * (t.b.z - t.a.z)) / det;
+                if (u < 0.0f || v < 0.0f || u + v > 1.0f) {
+                    continue;
+                }
+
+                crossings.push_back(t.a.x + u * (t.b.x - t.a.x) + v * (t.c.x - t.a.x));
+            }
+            std::sort(crossings.begin(), crossings.end());
+
+            unsigned int crossed = 0;
+            for (unsigned int x = 0; x < sdf.dimensions.x; ++x) {
+                const float node_x = sdf.get_node_position(x, y, z).x;
+                while (crossed < crossings.size() && crossings[crossed] < node_x) {
+                    ++crossed;
+                }
+
+                // An odd number of crossings behind the node means it is inside the mesh
+                const unsigned int index = sdf.get_node_index(x, y, z);
+                sdf.data[index].w = (crossed % 2 == 1) ? distances[index] : -distances[index];
+            }
+        }
+    }
+
+    sdf.calculate_normals();
+
+    return sdf;
+}
+
+void SignedDistanceField::voxelize(const std::function<float(const glm::vec3 &)> &distance_function) {
+    for (unsigned int z = 0; z < dimensions.z; ++z) {
+        for (unsigned int y = 0; y < dimensions.y; ++y) {
+            for (unsigned int x = 0; x < dimensions.x; ++x) {
+                data[get_node_index(x, y, z)].w = distance_function(get_node_position(x, y, z));
+            }
+        }
+    }
+
+    calculate_normals();
+}
+
+void SignedDistanceField::calculate_normals() {
+    const glm::ivec3 max_indices = glm::ivec3(dimensions) - glm::ivec3(1);
+
+    for (int z = 0; z <= max_indices.z; ++z) {
+        for (int y = 0; y <= max_indices.y; ++y) {
+            for (int x = 0; x <= max_indices.x; ++x) {
+                // Central differences, one-sided at the border of the field
+                const int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, max_indices.x);
+                const int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, max_indices.y);
+                const int z0 = std::max(z - 1, 0), z1 = std::min(z + 1, max_indices.z);
+
+                const glm::vec3 gradient(
+                        (data[get_node_index(x1, y, z)].w - data[get_node_index(x0, y, z)].w) / (x1 - x0),
+                        (data[get_node_index(x, y1, z)].w - data[get_node_index(x, y0, z)].w) / (y1 - y0),
+                        (data[get_node_index(x, y, z1)].w - data[get_node_index(x, y, z0)].w) / (z1 - z0));
+
+                const float length = glm::length(gradient);
+                const glm::vec3 normal = length > 0.0f ? gradient / length : glm::vec3(0.0f);
+
+                glm::vec4 &node = data[get_node_index(x, y, z)];
+                node = glm::vec4(normal, node.w);
+            }
+        }
+    }
+}
+
+glm::vec4 SignedDistanceField::sample(const glm::vec3 &position) const {
+    const glm::vec3 max_coordinates = glm::vec3(dimensions) - glm::vec3(1.0f);
+    const glm::vec3 coordinates = glm::clamp((position - origin) / cell_size, glm::vec3(0.0f), max_coordinates);
+
+    // The lower corner node of the cell containing the position, kept one node away from the upper border
+    const glm::uvec3 i0 = glm::min(glm::uvec3(coordinates), glm::uvec3(max_coordinates) - glm::uvec3(1));
+    const glm::vec3 t = coordinates - glm::vec3(i0);
+
+    const glm::vec4 c00 = glm::mix(data[get_node_index(i0.x, i0.y, i0.z)], data[get_node_index(i0.x + 1, i0.y, i0.z)], t.x);
+    const glm::vec4 c10 = glm::mix(data[get_node_index(i0.x, i0.y + 1, i0.z)], data[get_node_index(i0.x + 1, i0.y + 1, i0.z)], t.x);
+    const glm::vec4 c01 = glm::mix(data[get_node_index(i0.x, i0.y, i0.z + 1)], data[get_node_index(i0.x + 1, i0.y, i0.z + 1)], t.x);
+    const glm::vec4 c11 = glm::mix(data[get_node_index(i0.x, i0.y + 1, i0.z + 1)], data[get_node_index(i0.x + 1, i0.y + 1, i0.z + 1)], t.x);
+
+    const glm::vec4 value = glm::mix(glm::mix(c00, c10, t.y), glm::mix(c01, c11, t.y), t.z);
+
+    const float length = glm::length(glm::vec3(value));
+    const glm::vec3 normal = length > 0.0f ? glm::vec3(value) / length : glm::vec3(0.0f);
+
+    return glm::vec4(normal, value.w);
+}
+
+void SignedDistanceField::set_boundary_info(clBoundaryInfo &boundary_info, const Parameters &params) const {
+    boundary_info.sdf_dimensions.s[0] = dimensions.x;
+    boundary_info.sdf_dimensions.s[1] = dimensions.y;
+    boundary_info.sdf_dimensions.s[2] = dimensions.z;
+
+    boundary_info.sdf_origin.s[0] = origin.x;
+    boundary_info.sdf_origin.s[1] = origin.y;
+    boundary_info.sdf_origin.s[2] = origin.z;
+
+    boundary_info.sdf_cell_size = cell_size;
+    boundary_info.force_range = params.kernel_size;
+    boundary_info.use_penalty_force = params.boundary_handling == BoundaryHandling::Penalty;
+}
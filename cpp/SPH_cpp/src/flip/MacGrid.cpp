@@ -0,0 +1,277 @@
+#include "flip/MacGrid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// How many layers of air faces get extrapolated velocities, enough for the particles just outside the fluid cells
+static const unsigned int EXTRAPOLATION_LAYERS = 2;
+
+void MacGrid::build(const clVoxelGridInfo &grid_info, const SignedDistanceField &sdf) {
+    dimensions = glm::ivec3(grid_info.grid_dimensions.s[0], grid_info.grid_dimensions.s[1],
+                            grid_info.grid_dimensions.s[2]);
+    origin = glm::vec3(grid_info.grid_origin.s[0], grid_info.grid_origin.s[1], grid_info.grid_origin.s[2]);
+    cell_size = grid_info.grid_cell_size;
+
+    cells.assign(grid_info.total_grid_cells, CellType::Air);
+    solid_cells.assign(grid_info.total_grid_cells, 0);
+
+    for (int z = 0; z < dimensions.z; ++z) {
+        for (int y = 0; y < dimensions.y; ++y) {
+            for (int x = 0; x < dimensions.x; ++x) {
+                const glm::vec3 centre = origin + (glm::vec3(x, y, z) + 0.5f) * cell_size;
+                solid_cells[get_cell_index(glm::ivec3(x, y, z))] = sdf.sample(centre).w < 0.0f;
+            }
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        glm::ivec3 unit(0);
+        unit[axis] = 1;
+
+        FaceField &field = faces[axis];
+        field.dimensions = dimensions + unit;
+        field.offset = glm::vec3(0.5f) - 0.5f * glm::vec3(unit);
+
+        const unsigned int face_count = field.dimensions.x * field.dimensions.y * field.dimensions.z;
+        field.values.assign(face_count, 0.0f);
+        field.weights.assign(face_count, 0.0f);
+        field.valid.assign(face_count, 0);
+        saved_values[axis].assign(face_count, 0.0f);
+    }
+}
+
+void MacGrid::mark_fluid_cells(const std::vector<glm::vec3> &positions) {
+    for (unsigned int i = 0; i < cells.size(); ++i) {
+        cells[i] = solid_cells[i] ? CellType::Solid : CellType::Air;
+    }
+
+    for (const glm::vec3 &position : positions) {
+        const glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(to_grid(position))), glm::ivec3(0),
+                                           dimensions - glm::ivec3(1));
+        CellType &type = cells[get_cell_index(cell)];
+
+        if (type == CellType::Air) {
+            type = CellType::Fluid;
+        }
+    }
+}
+
+void MacGrid::particles_to_grid(const std::vector<glm::vec3> &positions, const std::vector<glm::vec3> &velocities) {
+    for (int axis = 0; axis < 3; ++axis) {
+        FaceField &field = faces[axis];
+        std::fill(field.values.begin(), field.values.end(), 0.0f);
+        std::fill(field.weights.begin(), field.weights.end(), 0.0f);
+
+        for (unsigned int i = 0; i < positions.size(); ++i) {
+            glm::ivec3 first;
+            glm::vec3 t;
+            field.find_stencil(to_grid(positions[i]), first, t);
+
+            for (int corner = 0; corner < 8; ++corner) {
+                const glm::ivec3 d(corner & 1, (corner >> 1) & 1, corner >> 2);
+                const float weight = (d.x ? t.x : 1 - t.x) * (d.y ? t.y : 1 - t.y) * (d.z ? t.z : 1 - t.z);
+                const unsigned int face = field.index(first + d);
+
+                field.values[face] += weight * velocities[i][axis];
+                field.weights[face] += weight;
+            }
+        }
+
+        for (unsigned int face = 0; face < field.values.size(); ++face) {
+            field.valid[face] = field.weights[face] > 0.0f;
+            if (field.valid[face]) {
+                field.values[face] /= field.weights[face];
+            }
+        }
+
+        field.extrapolate(EXTRAPOLATION_LAYERS);
+    }
+}
+
+void MacGrid::save_velocities() {
+    for (int axis = 0; axis < 3; ++axis) {
+        saved_values[axis] = faces[axis].values;
+    }
+}
+
+void MacGrid::add_acceleration(const glm::vec3 &acceleration, float dt_seconds) {
+    for (int axis = 0; axis < 3; ++axis) {
+        for (float &value : faces[axis].values) {
+            value += acceleration[axis] * dt_seconds;
+        }
+    }
+}
+
+void MacGrid::enforce_solid_walls() {
+    for (int axis = 0; axis < 3; ++axis) {
+        glm::ivec3 unit(0);
+        unit[axis] = 1;
+
+        FaceField &field = faces[axis];
+
+        for (int z = 0; z < field.dimensions.z; ++z) {
+            for (int y = 0; y < field.dimensions.y; ++y) {
+                for (int x = 0; x < field.dimensions.x; ++x) {
+                    const glm::ivec3 face(x, y, z);
+
+                    if (get_cell(face - unit) == CellType::Solid || get_cell(face) == CellType::Solid) {
+                        field.values[field.index(face)] = 0.0f;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void MacGrid::calculate_divergence(std::vector<float> &rhs) const {
+    rhs.assign(cells.size(), 0.0f);
+
+    for (int z = 0; z < dimensions.z; ++z) {
+        for (int y = 0; y < dimensions.y; ++y) {
+            for (int x = 0; x < dimensions.x; ++x) {
+                const glm::ivec3 cell(x, y, z);
+                const unsigned int cell_index = get_cell_index(cell);
+
+                if (cells[cell_index] != CellType::Fluid) {
+                    continue;
+                }
+
+                float outflow = 0.0f;
+                for (int axis = 0; axis < 3; ++axis) {
+                    glm::ivec3 unit(0);
+                    unit[axis] = 1;
+
+                    const FaceField &field = faces[axis];
+                    outflow += field.values[field.index(cell + unit)] - field.values[field.index(cell)];
+                }
+
+                // The divergence is outflow / cell_size, and the Laplacian stencil is scaled by cell_size^2
+                rhs[cell_index] = -outflow * cell_size;
+            }
+        }
+    }
+}
+
+void MacGrid::subtract_pressure_gradient(const std::vector<float> &pressure) {
+    for (int axis = 0; axis < 3; ++axis) {
+        glm::ivec3 unit(0);
+        unit[axis] = 1;
+
+        FaceField &field = faces[axis];
+
+        for (int z = 0; z < field.dimensions.z; ++z) {
+            for (int y = 0; y < field.dimensions.y; ++y) {
+                for (int x = 0; x < field.dimensions.x; ++x) {
+                    const glm::ivec3 face(x, y, z);
+                    const unsigned int face_index = field.index(face);
+                    const CellType below = get_cell(face - unit);
+                    const CellType above = get_cell(face);
+
+                    if (below == CellType::Solid || above == CellType::Solid) {
+                        field.values[face_index] = 0.0f;
+                        field.valid[face_index] = 1;
+                    } else if (below == CellType::Fluid || above == CellType::Fluid) {
+                        // The air cells have zero pressure
+                        const float pressure_below = below == CellType::Fluid ?
+                                                     pressure[get_cell_index(face - unit)] : 0.0f;
+                        const float pressure_above = above == CellType::Fluid ?
+                                                     pressure[get_cell_index(face)] : 0.0f;
+
+                        field.values[face_index] -= (pressure_above - pressure_below) / cell_size;
+                        field.valid[face_index] = 1;
+                    } else {
+                        field.valid[face_index] = 0;
+                    }
+                }
+            }
+        }
+
+        field.extrapolate(EXTRAPOLATION_LAYERS);
+    }
+}
+
+glm::vec3 MacGrid::sample_velocity(const glm::vec3 &position) const {
+    const glm::vec3 grid_position = to_grid(position);
+
+    return glm::vec3(faces[0].sample(grid_position, faces[0].values),
+                     faces[1].sample(grid_position, faces[1].values),
+                     faces[2].sample(grid_position, faces[2].values));
+}
+
+glm::vec3 MacGrid::sample_velocity_change(const glm::vec3 &position) const {
+    const glm::vec3 grid_position = to_grid(position);
+
+    return glm::vec3(faces[0].sample(grid_position, faces[0].values) - faces[0].sample(grid_position, saved_values[0]),
+                     faces[1].sample(grid_position, faces[1].values) - faces[1].sample(grid_position, saved_values[1]),
+                     faces[2].sample(grid_position, faces[2].values) - faces[2].sample(grid_position, saved_values[2]));
+}
+
+void MacGrid::FaceField::find_stencil(const glm::vec3 &grid_position, glm::ivec3 &first, glm::vec3 &t) const {
+    // Positions outside the grid are clamped to its border, like in VoxelGrid
+    const glm::vec3 face_position = glm::clamp(grid_position - offset, glm::vec3(0.0f),
+                                               glm::vec3(dimensions - glm::ivec3(1)));
+
+    first = glm::min(glm::ivec3(face_position), dimensions - glm::ivec3(2));
+    t = face_position - glm::vec3(first);
+}
+
+float MacGrid::FaceField::sample(const glm::vec3 &grid_position, const std::vector<float> &field) const {
+    glm::ivec3 first;
+    glm::vec3 t;
+    find_stencil(grid_position, first, t);
+
+    float value = 0.0f;
+    for (int corner = 0; corner < 8; ++corner) {
+        const glm::ivec3 d(corner & 1, (corner >> 1) & 1, corner >> 2);
+        const float weight = (d.x ? t.x : 1 - t.x) * (d.y ? t.y : 1 - t.y) * (d.z ? t.z : 1 - t.z);
+
+        value += weight * field[index(first + d)];
+    }
+
+    return value;
+}
+
+void MacGrid::FaceField::extrapolate(unsigned int layers) {
+    std::vector<char> next_valid;
+
+    for (unsigned int layer = 0; layer < layers; ++layer) {
+        next_valid = valid;
+
+        for (int z = 0; z < dimensions.z; ++z) {
+            for (int y = 0; y < dimensions.y; ++y) {
+                for (int x = 0; x < dimensions.x; ++x) {
+                    const glm::ivec3 face(x, y, z);
+                    const unsigned int face_index = index(face);
+
+                    if (valid[face_index]) {
+                        continue;
+                    }
+
+                    float sum = 0.0f;
+                    unsigned int count = 0;
+
+                    for (int axis = 0; axis < 3; ++axis) {
+                        for (int direction = -1; direction <= 1; direction += 2) {
+                            glm::ivec3 neighbour = face;
+                            neighbour[axis] += direction;
+
+                            if (neighbour[axis] >= 0 && neighbour[axis] < dimensions[axis] && valid[index(neighbour)]) {
+                                sum += values[index(neighbour)];
+                                ++count;
+                            }
+                        }
+                    }
+
+                    if (count > 0) {
+                        values[face_index] = sum / count;
+                        next_valid[face_index] = 1;
+                    } else {
+                        values[face_index] = 0.0f;
+                    }
+                }
+            }
+        }
+
+        valid.swap(next_valid);
+    }
+}
@@ -0,0 +1,257 @@
+#include "flip/MultigridPoissonSolver.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "common/parallel_chunks.hpp"
+
+// Levels are coarsened until one side would be shorter than this
+static const int MIN_LEVEL_SIZE = 4;
+
+static const unsigned int SMOOTHING_SWEEPS = 2;
+static const unsigned int COARSEST_SWEEPS = 20;
+static const float JACOBI_WEIGHT = 2.0f / 3.0f;
+
+static float dot(const std::vector<float> &a, const std::vector<float> &b) {
+    double sum = 0;
+    for (unsigned int i = 0; i < a.size(); ++i) {
+        sum += a[i] * b[i];
+    }
+
+    return static_cast<float>(sum);
+}
+
+void MultigridPoissonSolver::build(const glm::ivec3 &dimensions, const std::vector<CellType> &cells) {
+    levels.resize(1);
+    levels[0].dimensions = dimensions;
+    levels[0].cells = cells;
+    levels[0].scale = 1.0f;
+
+    while (glm::all(glm::greaterThanEqual(levels.back().dimensions, glm::ivec3(2 * MIN_LEVEL_SIZE)))) {
+        const Level &fine = levels.back();
+
+        Level coarse;
+        coarse.dimensions = (fine.dimensions + glm::ivec3(1)) / 2;
+        coarse.cells.assign(coarse.dimensions.x * coarse.dimensions.y * coarse.dimensions.z, CellType::Solid);
+
+        // Twice the cell size makes the unscaled stencil four times larger
+        coarse.scale = fine.scale * 4.0f;
+
+        // A coarse cell is fluid if any of its children is, so that no fluid falls out of the hierarchy
+        for (int z = 0; z < fine.dimensions.z; ++z) {
+            for (int y = 0; y < fine.dimensions.y; ++y) {
+                for (int x = 0; x < fine.dimensions.x; ++x) {
+                    const CellType child = fine.cells[fine.index(glm::ivec3(x, y, z))];
+                    CellType &parent = coarse.cells[coarse.index(glm::ivec3(x, y, z) / 2)];
+
+                    if (child == CellType::Fluid || (child == CellType::Air && parent == CellType::Solid)) {
+                        parent = child;
+                    }
+                }
+            }
+        }
+
+        levels.push_back(coarse);
+    }
+
+    for (Level &level : levels) {
+        level.x.assign(level.cells.size(), 0.0f);
+        level.b.assign(level.cells.size(), 0.0f);
+        level.r.assign(level.cells.size(), 0.0f);
+    }
+}
+
+void MultigridPoissonSolver::apply_laplacian(const Level &level, const std::vector<float> &x,
+                                             std::vector<float> &y) const {
+    const glm::ivec3 &d = level.dimensions;
+
+    // Each cell only writes its own value, so the cells are split over a few threads
+    parallel_chunks(static_cast<unsigned int>(level.cells.size()),
+                    [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; ++i) {
+            if (level.cells[i] != CellType::Fluid) {
+                y[i] = 0.0f;
+                continue;
+            }
+
+            // Every non-solid neighbour adds to the diagonal, only the fluid ones have a pressure
+            const glm::ivec3 cell = level.cell(i);
+            float sum = 0.0f;
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int direction = -1; direction <= 1; direction += 2) {
+                    glm::ivec3 neighbour = cell;
+                    neighbour[axis] += direction;
+
+                    if (neighbour[axis] < 0 || neighbour[axis] >= d[axis]) {
+                        continue;
+                    }
+
+                    const unsigned int j = level.index(neighbour);
+                    if (level.cells[j] == CellType::Fluid) {
+                        sum += x[i] - x[j];
+                    } else if (level.cells[j] == CellType::Air) {
+                        sum += x[i];
+                    }
+                }
+            }
+
+            y[i] = sum / level.scale;
+        }
+    });
+}
+
+void MultigridPoissonSolver::smooth(Level &level, unsigned int sweeps) const {
+    const glm::ivec3 &d = level.dimensions;
+
+    for (unsigned int sweep = 0; sweep < sweeps; ++sweep) {
+        apply_laplacian(level, level.x, level.r);
+
+        // Jacobi only reads the residual, so the cells are updated on a few threads like the Laplacian
+        parallel_chunks(static_cast<unsigned int>(level.cells.size()),
+                        [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+            for (unsigned int i = begin; i < end; ++i) {
+                if (level.cells[i] != CellType::Fluid) {
+                    continue;
+                }
+
+                const glm::ivec3 cell = level.cell(i);
+                unsigned int diagonal = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int direction = -1; direction <= 1; direction += 2) {
+                        glm::ivec3 neighbour = cell;
+                        neighbour[axis] += direction;
+
+                        if (neighbour[axis] >= 0 && neighbour[axis] < d[axis] &&
+                            level.cells[level.index(neighbour)] != CellType::Solid) {
+                            ++diagonal;
+                        }
+                    }
+                }
+
+                // A fluid cell walled in on all sides has no pressure to solve for
+                if (diagonal > 0) {
+                    level.x[i] += JACOBI_WEIGHT * (level.b[i] - level.r[i]) * level.scale / diagonal;
+                }
+            }
+        });
+    }
+}
+
+void MultigridPoissonSolver::apply_preconditioner(const std::vector<float> &r, std::vector<float> &z) {
+    levels[0].b = r;
+
+    // Down: smooth, then restrict the residual by averaging the children
+    for (unsigned int l = 0; l + 1 < levels.size(); ++l) {
+        Level &fine = levels[l];
+        Level &coarse = levels[l + 1];
+
+        std::fill(fine.x.begin(), fine.x.end(), 0.0f);
+        smooth(fine, SMOOTHING_SWEEPS);
+        apply_laplacian(fine, fine.x, fine.r);
+
+        std::fill(coarse.b.begin(), coarse.b.end(), 0.0f);
+        for (int z = 0; z < fine.dimensions.z; ++z) {
+            for (int y = 0; y < fine.dimensions.y; ++y) {
+                for (int x = 0; x < fine.dimensions.x; ++x) {
+                    const glm::ivec3 cell(x, y, z);
+                    const unsigned int i = fine.index(cell);
+
+                    if (fine.cells[i] == CellType::Fluid) {
+                        coarse.b[coarse.index(cell / 2)] += (fine.b[i] - fine.r[i]) / 8.0f;
+                    }
+                }
+            }
+        }
+    }
+
+    Level &coarsest = levels.back();
+    std::fill(coarsest.x.begin(), coarsest.x.end(), 0.0f);
+    smooth(coarsest, COARSEST_SWEEPS);
+
+    // Up: add the coarse correction to every child, then smooth again
+    for (unsigned int l = static_cast<unsigned int>(levels.size()) - 1; l > 0; --l) {
+        Level &fine = levels[l - 1];
+        const Level &coarse = levels[l];
+
+        for (int z = 0; z < fine.dimensions.z; ++z) {
+            for (int y = 0; y < fine.dimensions.y; ++y) {
+                for (int x = 0; x < fine.dimensions.x; ++x) {
+                    const glm::ivec3 cell(x, y, z);
+                    const unsigned int i = fine.index(cell);
+
+                    if (fine.cells[i] == CellType::Fluid) {
+                        fine.x[i] += coarse.x[coarse.index(cell / 2)];
+                    }
+                }
+            }
+        }
+
+        smooth(fine, SMOOTHING_SWEEPS);
+    }
+
+    z = levels[0].x;
+}
+
+unsigned int MultigridPoissonSolver::solve(const std::vector<float> &rhs, std::vector<float> &pressure,
+                                           float tolerance, unsigned int max_iterations) {
+    const unsigned int n = static_cast<unsigned int>(rhs.size());
+    const Level &finest = levels[0];
+
+    pressure.resize(n, 0.0f);
+    residual.resize(n);
+    product.resize(n);
+
+    // Only the fluid cells have a pressure, the rest keep zero for the gradient
+    for (unsigned int i = 0; i < n; ++i) {
+        if (finest.cells[i] != CellType::Fluid) {
+            pressure[i] = 0.0f;
+        }
+    }
+
+    // Start from the last step's pressure, which is usually close
+    apply_laplacian(finest, pressure, product);
+    for (unsigned int i = 0; i < n; ++i) {
+        residual[i] = rhs[i] - product[i];
+    }
+
+    const float threshold = tolerance * std::sqrt(dot(rhs, rhs));
+    if (std::sqrt(dot(residual, residual)) <= threshold) {
+        return 0;
+    }
+
+    apply_preconditioner(residual, preconditioned);
+    search_direction = preconditioned;
+    float rz = dot(residual, preconditioned);
+
+    unsigned int iteration = 0;
+    while (iteration < max_iterations) {
+        ++iteration;
+
+        apply_laplacian(finest, search_direction, product);
+        const float direction_product = dot(search_direction, product);
+        if (direction_product <= 0.0f) {
+            break;
+        }
+
+        const float alpha = rz / direction_product;
+        for (unsigned int i = 0; i < n; ++i) {
+            pressure[i] += alpha * search_direction[i];
+            residual[i] -= alpha * product[i];
+        }
+
+        if (std::sqrt(dot(residual, residual)) <= threshold) {
+            break;
+        }
+
+        apply_preconditioner(residual, preconditioned);
+        const float rz_next = dot(residual, preconditioned);
+        const float beta = rz_next / rz;
+        rz = rz_next;
+
+        for (unsigned int i = 0; i < n; ++i) {
+            search_direction[i] = preconditioned[i] + beta * search_direction[i];
+        }
+    }
+
+    return iteration;
+}
@@ -0,0 +1,470 @@
+#include "io/Checkpoint.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+
+namespace {
+    const char checkpoint_magic[8] = {'S', 'P', 'H', 'C', 'K', 'P', 'T', '\0'};
+
+    // Written as a number, read back in another byte order it comes out differently
+    const uint32_t byte_order_mark = 0x01020304;
+
+    // Every section starts at a multiple of this, so that the mapped particles are aligned for any use
+    const uint64_t section_alignment = 64;
+
+    const size_t section_name_length = 48;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t section_count;
+        uint64_t reserved[5];
+    };
+
+    struct SectionEntry {
+        char name[section_name_length];
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    static_assert(sizeof(FileHeader) == 64 && sizeof(SectionEntry) == 64, "the header layout is part of the format");
+
+    /// Appends the fields of Parameters to a byte buffer, see visit_parameters
+    struct ParameterWriter {
+        std::vector<char> &bytes;
+
+        void append(const void *data, size_t size) {
+            bytes.insert(bytes.end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+        }
+
+        template<typename T>
+        typename std::enable_if<!std::is_enum<T>::value>::type operator()(const T &value) {
+            append(&value, sizeof(T));
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_enum<T>::value>::type operator()(const T &value) {
+            const uint32_t number = static_cast<uint32_t>(value);
+            append(&number, sizeof(number));
+        }
+
+        void operator()(const bool &value) {
+            const uint8_t number = value ? 1 : 0;
+            append(&number, sizeof(number));
+        }
+
+        void operator()(const std::string &value) {
+            const uint32_t size = static_cast<uint32_t>(value.size());
+            append(&size, sizeof(size));
+            append(value.data(), value.size());
+        }
+
+        void operator()(const ParticleEmitter &emitter) {
+            (*this)(emitter.origin);
+            (*this)(emitter.size);
+            (*this)(emitter.velocity);
+            (*this)(emitter.rate);
+        }
+
+        void operator()(const ParticleSink &sink) {
+            (*this)(sink.origin);
+            (*this)(sink.size);
+        }
+
+        template<typename T>
+        void operator()(const std::vector<T> &values) {
+            const uint32_t count = static_cast<uint32_t>(values.size());
+            append(&count, sizeof(count));
+            for (const T &value : values) {
+                (*this)(value);
+            }
+        }
+    };
+
+    /// Reads the fields of Parameters back from a section, valid turns false once it runs past the end
+    struct ParameterReader {
+        const char *bytes;
+        size_t size;
+        size_t offset;
+        bool valid;
+
+        bool take(void *data, size_t length) {
+            if (!valid || length > size - offset) {
+                valid = false;
+                return false;
+            }
+
+            std::memcpy(data, bytes + offset, length);
+            offset += length;
+            return true;
+        }
+
+        template<typename T>
+        typename std::enable_if<!std::is_enum<T>::value>::type operator()(T &value) {
+            take(&value, sizeof(T));
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_enum<T>::value>::type operator()(T &value) {
+            uint32_t number;
+            if (take(&number, sizeof(number))) {
+                value = static_cast<T>(number);
+            }
+        }
+
+        void operator()(bool &value) {
+            uint8_t number;
+            if (take(&number, sizeof(number))) {
+                value = number != 0;
+            }
+        }
+
+        void operator()(std::string &value) {
+            uint32_t length;
+            if (take(&length, sizeof(length)) && length <= size - offset) {
+                value.assign(bytes + offset, length);
+                offset += length;
+            } else {
+                valid = false;
+            }
+        }
+
+        void operator()(ParticleEmitter &emitter) {
+            (*this)(emitter.origin);
+            (*this)(emitter.size);
+            (*this)(emitter.velocity);
+            (*this)(emitter.rate);
+        }
+
+        void operator()(ParticleSink &sink) {
+            (*this)(sink.origin);
+            (*this)(sink.size);
+        }
+
+        template<typename T>
+        void operator()(std::vector<T> &values) {
+            uint32_t count;
+            if (!take(&count, sizeof(count)) || count > size - offset) {
+                valid = false;
+                return;
+            }
+
+            values.resize(count);
+            for (T &value : values) {
+                (*this)(value);
+            }
+        }
+    };
+
+    /// Hands every field of the parameters to the archive in declaration order, which is the layout of the
+    /// "parameters" section. A new field goes at the end, together with a new Checkpoint::version
+    template<typename Archive>
+    void visit_parameters(Archive &archive, Parameters &p) {
+        archive(p.n_particles);
+        archive(p.max_particles);
+        archive(p.total_mass);
+        archive(p.kernel_size);
+        archive(p.k_gas);
+        archive(p.k_viscosity);
+        archive(p.rest_density);
+        archive(p.sigma);
+        archive(p.k_threshold);
+        archive(p.surface_neighbour_count);
+        archive(p.gravity);
+        archive(p.left_bound);
+        archive(p.right_bound);
+        archive(p.bottom_bound);
+        archive(p.top_bound);
+        archive(p.near_bound);
+        archive(p.far_bound);
+        archive(p.k_wall_damper);
+        archive(p.k_wall_friction);
+        archive(p.container);
+        archive(p.container_mesh_file);
+        archive(p.periodic_axes);
+        archive(p.boundary_handling);
+        archive(p.pressure_solver);
+        archive(p.time_integrator);
+        archive(p.multi_rate_timestepping);
+        archive(p.max_timestep_level);
+        archive(p.courant_number);
+        archive(p.density_error_tolerance);
+        archive(p.divergence_error_tolerance);
+        archive(p.min_solver_iterations);
+        archive(p.max_solver_iterations);
+        archive(p.implicit_viscosity);
+        archive(p.viscosity_error_tolerance);
+        archive(p.max_viscosity_iterations);
+        archive(p.pbf_iterations);
+        archive(p.xsph_viscosity);
+        archive(p.flip_ratio);
+        archive(p.flip_pressure_tolerance);
+        archive(p.adaptive_resolution);
+        archive(p.max_split_level);
+        archive(p.split_vorticity);
+        archive(p.merge_neighbour_count);
+        archive(p.sdf_cell_size);
+        archive(p.shallow_water);
+        archive(p.active_region_origin);
+        archive(p.active_region_size);
+        archive(p.shallow_water_cell_size);
+        archive(p.shallow_water_depth);
+        archive(p.allow_sleeping);
+        archive(p.sleep_velocity_threshold);
+        archive(p.sleep_density_threshold);
+        archive(p.sleep_step_count);
+        archive(p.emitters);
+        archive(p.sinks);
+        archive(p.fps);
+        archive(p.bg_color);
+    }
+
+    struct Section {
+        std::string name;
+        const char *data;
+        uint64_t size;
+    };
+
+    /// What CheckpointWriter hands to its thread
+    struct Snapshot {
+        explicit Snapshot(const Parameters &params) : params(params) {}
+
+        Parameters params;
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> velocities;
+        SolverState state;
+    };
+
+    inline uint64_t align_section(uint64_t offset) {
+        return (offset + section_alignment - 1) / section_alignment * section_alignment;
+    }
+}
+
+Checkpoint::Checkpoint() : params(0) {
+}
+
+bool Checkpoint::write(const std::string &file_name, const Parameters &parameters, Span<const glm::vec3> positions,
+                       Span<const glm::vec3> velocities, const SolverState &state, std::string &error) {
+    if (positions.size() != velocities.size()) {
+        error = "the particles have " + std::to_string(positions.size()) + " positions but " +
+                std::to_string(velocities.size()) + " velocities";
+        return false;
+    }
+
+    std::vector<char> parameter_bytes;
+    ParameterWriter parameter_writer = {parameter_bytes};
+    Parameters parameters_copy = parameters;
+    visit_parameters(parameter_writer, parameters_copy);
+
+    std::vector<Section> sections;
+    sections.push_back({"parameters", parameter_bytes.data(), parameter_bytes.size()});
+    sections.push_back({"positions", reinterpret_cast<const char *>(positions.data()),
+                        positions.size() * sizeof(glm::vec3)});
+    sections.push_back({"velocities", reinterpret_cast<const char *>(velocities.data()),
+                        velocities.size() * sizeof(glm::vec3)});
+    for (const SolverState::Array &array : state.get_arrays()) {
+        sections.push_back({"state/" + array.name, array.bytes.data(), array.bytes.size()});
+    }
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = version;
+    header.byte_order = byte_order_mark;
+    header.section_count = sections.size();
+
+    std::vector<SectionEntry> table(sections.size());
+    uint64_t offset = align_section(sizeof(FileHeader) + table.size() * sizeof(SectionEntry));
+    for (size_t i = 0; i < sections.size(); ++i) {
+        if (sections[i].name.size() >= section_name_length) {
+            error = "the section name \"" + sections[i].name + "\" is too long";
+            return false;
+        }
+
+        std::memset(&table[i], 0, sizeof(SectionEntry));
+        std::memcpy(table[i].name, sections[i].name.data(), sections[i].name.size());
+        table[i].offset = offset;
+        table[i].size = sections[i].size;
+        offset = align_section(offset + sections[i].size);
+    }
+
+    const std::string temporary_name = file_name + ".tmp";
+    {
+        std::ofstream file(temporary_name.c_str(), std::ios::binary);
+        if (!file.is_open()) {
+            error = "could not create " + temporary_name;
+            return false;
+        }
+
+        const char padding[section_alignment] = {};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(SectionEntry));
+
+        uint64_t written = sizeof(header) + table.size() * sizeof(SectionEntry);
+        for (size_t i = 0; i < sections.size(); ++i) {
+            file.write(padding, table[i].offset - written);
+            file.write(sections[i].data, sections[i].size);
+            written = table[i].offset + sections[i].size;
+        }
+
+        if (!file) {
+            error = "could not write " + temporary_name;
+            return false;
+        }
+    }
+
+    // Renaming over an existing file fails on Windows
+    std::remove(file_name.c_str());
+    if (std::rename(temporary_name.c_str(), file_name.c_str()) != 0) {
+        error = "could not rename " + temporary_name + " to " + file_name;
+        return false;
+    }
+
+    return true;
+}
+
+bool Checkpoint::open(const std::string &file_name, std::string &error) {
+    positions = Span<const glm::vec3>();
+    velocities = Span<const glm::vec3>();
+    solver_state = SolverState();
+
+    if (!file.open(file_name)) {
+        error = "could not open " + file_name;
+        return false;
+    }
+
+    FileHeader header;
+    if (file.size() < sizeof(header)) {
+        error = "the file is too short for a checkpoint";
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0) {
+        error = "not a checkpoint";
+        return false;
+    }
+    if (header.byte_order != byte_order_mark) {
+        error = "the checkpoint was written on a machine of another byte order";
+        return false;
+    }
+    if (header.version != version) {
+        error = "the checkpoint is version " + std::to_string(header.version) + ", this program reads version " +
+                std::to_string(version);
+        return false;
+    }
+    if (header.section_count > (file.size() - sizeof(header)) / sizeof(SectionEntry)) {
+        error = "the checkpoint is truncated";
+        return false;
+    }
+
+    bool has_parameters = false;
+    bool has_positions = false;
+    bool has_velocities = false;
+
+    for (uint64_t i = 0; i < header.section_count; ++i) {
+        SectionEntry entry;
+        std::memcpy(&entry, file.data() + sizeof(header) + i * sizeof(SectionEntry), sizeof(entry));
+        entry.name[section_name_length - 1] = '\0';
+
+        if (entry.offset > file.size() || entry.size > file.size() - entry.offset) {
+            error = "the checkpoint is truncated";
+            return false;
+        }
+
+        const std::string name = entry.name;
+        const char *data = file.data() + entry.offset;
+        const size_t size = static_cast<size_t>(entry.size);
+
+        if (name == "parameters") {
+            ParameterReader reader = {data, size, 0, true};
+            visit_parameters(reader, params);
+            if (!reader.valid) {
+                error = "the parameters are truncated";
+                return false;
+            }
+            has_parameters = true;
+        } else if (name == "positions" || name == "velocities") {
+            if (size % sizeof(glm::vec3) != 0) {
+                error = "the " + name + " are not whole particles";
+                return false;
+            }
+
+            const Span<const glm::vec3> particles(reinterpret_cast<const glm::vec3 *>(data), size / sizeof(glm::vec3));
+            if (name == "positions") {
+                positions = particles;
+                has_positions = true;
+            } else {
+                velocities = particles;
+                has_velocities = true;
+            }
+        } else if (name.compare(0, 6, "state/") == 0) {
+            solver_state.add_bytes(name.substr(6), data, size);
+        }
+    }
+
+    if (!has_parameters || !has_positions || !has_velocities) {
+        error = "the checkpoint has no parameters or particles";
+        return false;
+    }
+    if (positions.size() != velocities.size()) {
+        error = "the checkpoint has a different number of positions and velocities";
+        return false;
+    }
+
+    return true;
+}
+
+CheckpointWriter::CheckpointWriter() : writing(false) {
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    wait();
+}
+
+void CheckpointWriter::write_async(const std::string &file_name, const Parameters &params,
+                                   ParticleSimulator &simulator) {
+    wait();
+
+    // The snapshot is taken on the caller's thread, the OpenCL simulator has to read its buffers there
+    std::shared_ptr<Snapshot> snapshot(new Snapshot(params));
+    simulator.readParticleState([&](Span<const glm::vec3> particle_positions,
+                                    Span<const glm::vec3> particle_velocities) {
+        snapshot->positions.reserve(particle_positions.size());
+        snapshot->velocities.reserve(particle_positions.size());
+
+        for (size_t i = 0; i < particle_positions.size(); ++i) {
+            if (!std::isnan(particle_positions[i].x)) {
+                snapshot->positions.push_back(particle_positions[i]);
+                snapshot->velocities.push_back(particle_velocities[i]);
+            }
+        }
+    });
+    simulator.getSolverState(snapshot->state);
+
+    writing = true;
+    thread = std::thread([this, file_name, snapshot]() {
+        std::string error;
+        last_write_succeeded = Checkpoint::write(file_name, snapshot->params, snapshot->positions,
+                                                 snapshot->velocities, snapshot->state, error);
+        if (!last_write_succeeded) {
+            std::cerr << "Could not write the checkpoint " << file_name << ": " << error << std::endl;
+        }
+
+        writing = false;
+    });
+}
+
+bool CheckpointWriter::wait() {
+    if (thread.joinable()) {
+        thread.join();
+    }
+
+    return last_write_succeeded;
+}
@@ -0,0 +1,248 @@
+#include "io/HuffmanCodec.hpp"
+
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <utility>
+
+namespace {
+    const unsigned int symbol_count = 256;
+
+    // The code lengths as two nibbles per byte
+    const size_t lengths_size = symbol_count / 2;
+
+    const unsigned int table_size = 1u << HuffmanCodec::max_code_length;
+}
+
+void HuffmanCodec::encode(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+    uint64_t frequencies[symbol_count] = {};
+    for (size_t i = 0; i < size; ++i) {
+        ++frequencies[data[i]];
+    }
+
+    if (size > 0 && frequencies[data[0]] == size) {
+        out.push_back(Repeated);
+        out.push_back(data[0]);
+        return;
+    }
+
+    const size_t start = out.size();
+    if (size > 0) {
+        uint8_t lengths[symbol_count];
+        uint16_t codes[symbol_count];
+        build_code_lengths(frequencies, lengths);
+        build_codes(lengths, codes);
+
+        out.push_back(Coded);
+        for (unsigned int symbol = 0; symbol < symbol_count; symbol += 2) {
+            out.push_back(static_cast<uint8_t>(lengths[symbol] | (lengths[symbol + 1] << 4)));
+        }
+
+        uint64_t bits = 0;
+        unsigned int bit_count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            bits |= static_cast<uint64_t>(codes[data[i]]) << bit_count;
+            bit_count += lengths[data[i]];
+
+            while (bit_count >= 8) {
+                out.push_back(static_cast<uint8_t>(bits));
+                bits >>= 8;
+                bit_count -= 8;
+            }
+        }
+        if (bit_count > 0) {
+            out.push_back(static_cast<uint8_t>(bits));
+        }
+
+        if (out.size() - start < size + 1) {
+            return;
+        }
+    }
+
+    // Noise, or too short for the code lengths to pay off
+    out.resize(start);
+    out.push_back(Stored);
+    out.insert(out.end(), data, data + size);
+}
+
+bool HuffmanCodec::decode(const uint8_t *block, size_t block_size, uint8_t *data, size_t size) {
+    if (block_size < 1) {
+        return false;
+    }
+
+    switch (block[0]) {
+        case Stored:
+            if (block_size - 1 != size) {
+                return false;
+            }
+            if (size > 0) {
+                std::memcpy(data, block + 1, size);
+            }
+            return true;
+        case Repeated:
+            if (block_size != 2) {
+                return false;
+            }
+            std::memset(data, block[1], size);
+            return true;
+        case Coded:
+            break;
+        default:
+            return false;
+    }
+
+    if (block_size < 1 + lengths_size) {
+        return false;
+    }
+
+    uint8_t lengths[symbol_count];
+    for (unsigned int symbol = 0; symbol < symbol_count; symbol += 2) {
+        lengths[symbol] = block[1 + symbol / 2] & 0x0f;
+        lengths[symbol + 1] = block[1 + symbol / 2] >> 4;
+    }
+
+    uint16_t codes[symbol_count];
+    for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+        if (lengths[symbol] > max_code_length) {
+            return false;
+        }
+    }
+    if (!build_codes(lengths, codes)) {
+        return false;
+    }
+
+    // Indexed by the next max_code_length bits: the symbol in the high bits and its length in the low 4, a length
+    // of 0 marks bits no code starts with
+    std::vector<uint16_t> table(table_size, 0);
+    for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+        if (lengths[symbol] > 0) {
+            for (unsigned int bits = codes[symbol]; bits < table_size; bits += 1u << lengths[symbol]) {
+                table[bits] = static_cast<uint16_t>(symbol << 4 | lengths[symbol]);
+            }
+        }
+    }
+
+    size_t position = 1 + lengths_size;
+    uint64_t bits = 0;
+    unsigned int bit_count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        while (bit_count <= 56 && position < block_size) {
+            bits |= static_cast<uint64_t>(block[position++]) << bit_count;
+            bit_count += 8;
+        }
+
+        const uint16_t entry = table[bits & (table_size - 1)];
+        const unsigned int length = entry & 0x0f;
+        if (length == 0 || length > bit_count) {
+            return false;
+        }
+
+        data[i] = static_cast<uint8_t>(entry >> 4);
+        bits >>= length;
+        bit_count -= length;
+    }
+
+    return true;
+}
+
+void HuffmanCodec::build_code_lengths(const uint64_t frequencies[256], uint8_t lengths[256]) {
+    uint64_t weights[symbol_count];
+    std::memcpy(weights, frequencies, sizeof(weights));
+
+    // The leaves are the symbols, the inner nodes follow them
+    int parents[2 * symbol_count];
+
+    while (true) {
+        typedef std::pair<uint64_t, int> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+            parents[symbol] = -1;
+            if (weights[symbol] > 0) {
+                queue.push(Node(weights[symbol], static_cast<int>(symbol)));
+            }
+        }
+
+        int next_node = symbol_count;
+        while (queue.size() > 1) {
+            const Node first = queue.top();
+            queue.pop();
+            const Node second = queue.top();
+            queue.pop();
+
+            parents[first.second] = next_node;
+            parents[second.second] = next_node;
+            parents[next_node] = -1;
+            queue.push(Node(first.first + second.first, next_node));
+            ++next_node;
+        }
+
+        unsigned int longest = 0;
+        for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+            unsigned int length = 0;
+            if (weights[symbol] > 0) {
+                for (int node = parents[symbol]; node >= 0; node = parents[node]) {
+                    ++length;
+                }
+
+                // A lone symbol still needs a bit
+                length = length > 0 ? length : 1;
+            }
+
+            lengths[symbol] = static_cast<uint8_t>(length < 255 ? length : 255);
+            longest = length > longest ? length : longest;
+        }
+
+        if (longest <= max_code_length) {
+            return;
+        }
+
+        // Flatten the distribution until the rarest symbols are no longer too deep. The codes get a little worse,
+        // but this only happens with very skewed blocks
+        for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+            if (weights[symbol] > 0) {
+                weights[symbol] = (weights[symbol] >> 1) | 1;
+            }
+        }
+    }
+}
+
+bool HuffmanCodec::build_codes(const uint8_t lengths[256], uint16_t codes[256]) {
+    unsigned int length_counts[max_code_length + 1] = {};
+    for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+        ++length_counts[lengths[symbol]];
+    }
+    length_counts[0] = 0;
+
+    // Every code of a length takes its share of the table, more than all of it can not be decoded
+    unsigned int used = 0;
+    for (unsigned int length = 1; length <= max_code_length; ++length) {
+        used += length_counts[length] << (max_code_length - length);
+    }
+    if (used > table_size) {
+        return false;
+    }
+
+    unsigned int next_codes[max_code_length + 1] = {};
+    unsigned int code = 0;
+    for (unsigned int length = 1; length <= max_code_length; ++length) {
+        code = (code + length_counts[length - 1]) << 1;
+        next_codes[length] = code;
+    }
+
+    for (unsigned int symbol = 0; symbol < symbol_count; ++symbol) {
+        const unsigned int length = lengths[symbol];
+        codes[symbol] = 0;
+        if (length == 0) {
+            continue;
+        }
+
+        const unsigned int canonical = next_codes[length]++;
+        unsigned int reversed = 0;
+        for (unsigned int bit = 0; bit < length; ++bit) {
+            reversed |= ((canonical >> bit) & 1u) << (length - 1 - bit);
+        }
+        codes[symbol] = static_cast<uint16_t>(reversed);
+    }
+
+    return true;
+}
@@ -0,0 +1,197 @@
+#include "io/TrajectoryFormat.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+#include "io/HuffmanCodec.hpp"
+
+namespace {
+    // Steps per cell, the positions keep 16 bits within the container
+    const float position_steps = 65536.0f;
+    const float velocity_steps = 32767.0f;
+
+    // Of the cells, so that the steps fit in 32 bits
+    const double max_position_steps = 2147483647.0;
+
+    template<typename T>
+    inline T zigzag(T value, T before) {
+        typedef typename std::make_signed<T>::type Signed;
+        const Signed delta = static_cast<Signed>(static_cast<T>(value - before));
+        return static_cast<T>(static_cast<T>(static_cast<T>(delta) << 1) ^
+                              static_cast<T>(delta >> (8 * sizeof(T) - 1)));
+    }
+
+    template<typename T>
+    inline T unzigzag(T coded, T before) {
+        const T delta = static_cast<T>(static_cast<T>(coded >> 1) ^ static_cast<T>(0u - (coded & 1u)));
+        return static_cast<T>(before + delta);
+    }
+}
+
+TrajectoryFrameCodec::TrajectoryFrameCodec(const glm::vec3 &origin, const glm::vec3 &size)
+        : origin(origin), size(size) {
+}
+
+template<typename T>
+void TrajectoryFrameCodec::difference(std::vector<T> &values, std::vector<T> &previous, size_t count,
+                                      bool is_keyframe) {
+    const size_t previous_count = is_keyframe ? 0 : previous.size() / 3;
+    const size_t shared_count = std::min(count, previous_count);
+
+    std::vector<T> current(values);
+    for (int axis = 0; axis < 3; ++axis) {
+        T *axis_values = values.data() + axis * count;
+        const T *axis_previous = previous.data() + axis * previous_count;
+
+        for (size_t i = 0; i < shared_count; ++i) {
+            axis_values[i] = zigzag<T>(axis_values[i], axis_previous[i]);
+        }
+        for (size_t i = shared_count; i < count; ++i) {
+            axis_values[i] = zigzag<T>(axis_values[i], 0);
+        }
+    }
+
+    previous.swap(current);
+}
+
+template<typename T>
+void TrajectoryFrameCodec::accumulate(std::vector<T> &values, std::vector<T> &previous, size_t count,
+                                      bool is_keyframe) {
+    const size_t previous_count = is_keyframe ? 0 : previous.size() / 3;
+    const size_t shared_count = std::min(count, previous_count);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        T *axis_values = values.data() + axis * count;
+        const T *axis_previous = previous.data() + axis * previous_count;
+
+        for (size_t i = 0; i < shared_count; ++i) {
+            axis_values[i] = unzigzag<T>(axis_values[i], axis_previous[i]);
+        }
+        for (size_t i = shared_count; i < count; ++i) {
+            axis_values[i] = unzigzag<T>(axis_values[i], 0);
+        }
+    }
+
+    previous = values;
+}
+
+template<typename T>
+void TrajectoryFrameCodec::encode_planes(const std::vector<T> &values, std::vector<uint8_t> &out,
+                                         uint32_t *block_sizes) {
+    plane.resize(values.size());
+
+    for (unsigned int byte = 0; byte < sizeof(T); ++byte) {
+        for (size_t i = 0; i < values.size(); ++i) {
+            plane[i] = static_cast<uint8_t>(values[i] >> (8 * byte));
+        }
+
+        const size_t start = out.size();
+        HuffmanCodec::encode(plane.data(), plane.size(), out);
+        block_sizes[byte] = static_cast<uint32_t>(out.size() - start);
+    }
+}
+
+template<typename T>
+bool TrajectoryFrameCodec::decode_planes(const uint8_t *blocks, const uint32_t *block_sizes,
+                                         std::vector<T> &values) {
+    plane.resize(values.size());
+    std::fill(values.begin(), values.end(), 0);
+
+    for (unsigned int byte = 0; byte < sizeof(T); ++byte) {
+        if (!HuffmanCodec::decode(blocks, block_sizes[byte], plane.data(), plane.size())) {
+            return false;
+        }
+        blocks += block_sizes[byte];
+
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = static_cast<T>(values[i] | static_cast<T>(plane[i]) << (8 * byte));
+        }
+    }
+
+    return true;
+}
+
+void TrajectoryFrameCodec::encode(Span<const glm::vec3> positions, Span<const glm::vec3> velocities,
+                                  bool is_keyframe, TrajectoryFrameHeader &header, std::vector<uint8_t> &out) {
+    const size_t count = positions.size();
+    header.particle_count = static_cast<uint32_t>(count);
+
+    quantized_positions.resize(3 * count);
+    for (int axis = 0; axis < 3; ++axis) {
+        for (size_t i = 0; i < count; ++i) {
+            const double steps = static_cast<double>(positions[i][axis] - origin[axis]) / size[axis] *
+                                 position_steps;
+            const double clamped = std::max(-max_position_steps, std::min(steps, max_position_steps));
+            quantized_positions[axis * count + i] = static_cast<uint32_t>(static_cast<int32_t>(std::lround(clamped)));
+        }
+    }
+    difference(quantized_positions, previous_positions, count, is_keyframe);
+    encode_planes(quantized_positions, out, header.block_sizes + PositionsByte0);
+
+    float velocity_scale = 0.0f;
+    for (size_t i = 0; i < count; ++i) {
+        const glm::vec3 magnitude = glm::abs(velocities[i]);
+        velocity_scale = std::max(velocity_scale, std::max(magnitude.x, std::max(magnitude.y, magnitude.z)));
+    }
+    header.velocity_scale = velocity_scale;
+
+    const float to_steps = velocity_scale > 0.0f ? velocity_steps / velocity_scale : 0.0f;
+    quantized_velocities.resize(3 * count);
+    for (int axis = 0; axis < 3; ++axis) {
+        for (size_t i = 0; i < count; ++i) {
+            const long steps = std::lround(velocities[i][axis] * to_steps);
+            quantized_velocities[axis * count + i] = static_cast<uint16_t>(static_cast<int16_t>(steps));
+        }
+    }
+    difference(quantized_velocities, previous_velocities, count, is_keyframe);
+    encode_planes(quantized_velocities, out, header.block_sizes + VelocitiesByte0);
+}
+
+bool TrajectoryFrameCodec::decode(const TrajectoryFrameHeader &header, const uint8_t *blocks, size_t blocks_size,
+                                  std::vector<glm::vec3> &positions, std::vector<glm::vec3> &velocities) {
+    const size_t count = header.particle_count;
+
+    uint64_t total_size = 0;
+    for (int block = 0; block < BlockCount; ++block) {
+        total_size += header.block_sizes[block];
+    }
+    if (total_size > blocks_size) {
+        return false;
+    }
+
+    quantized_positions.resize(3 * count);
+    if (!decode_planes(blocks, header.block_sizes + PositionsByte0, quantized_positions)) {
+        return false;
+    }
+    accumulate(quantized_positions, previous_positions, count, header.is_keyframe != 0);
+
+    positions.resize(count);
+    for (int axis = 0; axis < 3; ++axis) {
+        for (size_t i = 0; i < count; ++i) {
+            const int32_t steps = static_cast<int32_t>(quantized_positions[axis * count + i]);
+            positions[i][axis] = origin[axis] + static_cast<float>(steps / position_steps * size[axis]);
+        }
+    }
+
+    const uint8_t *velocity_blocks = blocks;
+    for (int block = PositionsByte0; block < VelocitiesByte0; ++block) {
+        velocity_blocks += header.block_sizes[block];
+    }
+
+    quantized_velocities.resize(3 * count);
+    if (!decode_planes(velocity_blocks, header.block_sizes + VelocitiesByte0, quantized_velocities)) {
+        return false;
+    }
+    accumulate(quantized_velocities, previous_velocities, count, header.is_keyframe != 0);
+
+    const float from_steps = header.velocity_scale / velocity_steps;
+    velocities.resize(count);
+    for (int axis = 0; axis < 3; ++axis) {
+        for (size_t i = 0; i < count; ++i) {
+            velocities[i][axis] = static_cast<int16_t>(quantized_velocities[axis * count + i]) * from_steps;
+        }
+    }
+
+    return true;
+}
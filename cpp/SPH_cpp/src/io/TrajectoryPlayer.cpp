@@ -0,0 +1,239 @@
+#include "io/TrajectoryPlayer.hpp"
+
+#include <algorithm>
+
+#include "profiling/Profiler.hpp"
+
+TrajectoryPlayer::TrajectoryPlayer(unsigned int thread_count) : thread_count(std::max(thread_count, 1u)) {
+}
+
+TrajectoryPlayer::~TrajectoryPlayer() {
+    stop_workers();
+}
+
+bool TrajectoryPlayer::open(const std::string &file_name, std::string &error) {
+    stop_workers();
+
+    time = 0.0;
+    shown_frame.reset();
+    shown_frame_index = 0;
+    playhead = 0;
+    decoded_frames.clear();
+    keyframes_in_progress.clear();
+    damaged_keyframes.clear();
+    stopping = false;
+
+    if (!reader.open(file_name, error)) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        threads.push_back(std::thread(&TrajectoryPlayer::decode_frames, this));
+    }
+
+    return true;
+}
+
+double TrajectoryPlayer::get_duration() const {
+    if (reader.get_frame_count() == 0) {
+        return 0.0;
+    }
+
+    return reader.get_frame(reader.get_frame_count() - 1).time - reader.get_frame(0).time;
+}
+
+void TrajectoryPlayer::seek(double seconds) {
+    if (reader.get_frame_count() == 0) {
+        return;
+    }
+
+    time = std::max(0.0, std::min(seconds, get_duration()));
+    set_playhead(reader.find_frame(reader.get_frame(0).time + time));
+    show_playhead_frame();
+}
+
+bool TrajectoryPlayer::setupSimulation(const Parameters &parameters, Span<const glm::vec3> particle_positions,
+                                       Span<const glm::vec3> particle_velocities, std::string &error) {
+    seek(0.0);
+    return true;
+}
+
+void TrajectoryPlayer::updateSimulation(const Parameters &parameters, float dt_seconds) {
+    PROFILE_ZONE("TrajectoryPlayer::updateSimulation");
+
+    ++counters.steps;
+
+    // Loop, so that a short recording can be watched for a while
+    const double next_time = time + dt_seconds;
+    seek(next_time > get_duration() ? 0.0 : next_time);
+}
+
+unsigned int TrajectoryPlayer::getParticleDrawCount() {
+    return shown_frame ? static_cast<unsigned int>(shown_frame->positions.size()) : 0;
+}
+
+unsigned int TrajectoryPlayer::getSolverIterations() {
+    return 0;
+}
+
+void TrajectoryPlayer::readParticleState(const ParticleStateCallback &callback) {
+    if (shown_frame) {
+        callback(shown_frame->positions, shown_frame->velocities);
+    } else {
+        callback(Span<const glm::vec3>(), Span<const glm::vec3>());
+    }
+}
+
+void TrajectoryPlayer::decode_frames() {
+    const size_t frame_count = reader.get_frame_count();
+
+    // The frames before the playhead, only decoded to get to the ones after it
+    std::vector<glm::vec3> skipped_positions;
+    std::vector<glm::vec3> skipped_velocities;
+
+    while (true) {
+        size_t keyframe = 0;
+        unsigned long long generation = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_changed.wait(lock, [&]() { return stopping || find_keyframe_to_decode(keyframe); });
+            if (stopping) {
+                return;
+            }
+
+            keyframes_in_progress.insert(keyframe);
+            generation = seek_generation;
+        }
+
+        size_t end = keyframe + 1;
+        while (end < frame_count && !reader.get_frame(end).is_keyframe) {
+            ++end;
+        }
+
+        TrajectoryFrameCodec codec = reader.create_codec();
+        bool damaged = false;
+        for (size_t frame = keyframe; frame < end; ++frame) {
+            bool keep = false;
+            {
+                // Stay no more than the lookahead ahead of the playhead
+                std::unique_lock<std::mutex> lock(mutex);
+                work_changed.wait(lock, [&]() {
+                    return stopping || seek_generation != generation || playhead >= end ||
+                           frame < playhead + lookahead_frames;
+                });
+                if (stopping || seek_generation != generation || playhead >= end) {
+                    break;
+                }
+
+                keep = frame >= playhead && decoded_frames.find(frame) == decoded_frames.end();
+            }
+
+            std::shared_ptr<DecodedFrame> decoded;
+            if (keep) {
+                decoded.reset(new DecodedFrame);
+            }
+
+            if (!reader.decode_frame(frame, codec, keep ? decoded->positions : skipped_positions,
+                                     keep ? decoded->velocities : skipped_velocities)) {
+                damaged = true;
+                break;
+            }
+
+            if (keep) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (frame >= playhead && frame < playhead + lookahead_frames) {
+                    decoded_frames[frame] = decoded;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            keyframes_in_progress.erase(keyframe);
+            if (damaged) {
+                damaged_keyframes.insert(keyframe);
+            }
+        }
+        work_changed.notify_all();
+    }
+}
+
+void TrajectoryPlayer::stop_workers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_changed.notify_all();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+bool TrajectoryPlayer::find_keyframe_to_decode(size_t &keyframe) const {
+    const size_t end = std::min(playhead + lookahead_frames, reader.get_frame_count());
+
+    for (size_t frame = playhead; frame < end; ++frame) {
+        if (decoded_frames.find(frame) != decoded_frames.end()) {
+            continue;
+        }
+
+        const size_t frame_keyframe = reader.get_keyframe(frame);
+        if (keyframes_in_progress.find(frame_keyframe) == keyframes_in_progress.end() &&
+            damaged_keyframes.find(frame_keyframe) == damaged_keyframes.end()) {
+            keyframe = frame_keyframe;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void TrajectoryPlayer::set_playhead(size_t frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frame == playhead) {
+            return;
+        }
+
+        if (frame < playhead) {
+            ++seek_generation;
+        }
+        playhead = frame;
+
+        // The shown frame stays alive as long as it is shown
+        std::map<size_t, std::shared_ptr<const DecodedFrame>>::iterator it = decoded_frames.begin();
+        while (it != decoded_frames.end()) {
+            if (it->first < playhead || it->first >= playhead + lookahead_frames) {
+                it = decoded_frames.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    work_changed.notify_all();
+}
+
+void TrajectoryPlayer::show_playhead_frame() {
+    std::shared_ptr<const DecodedFrame> frame;
+    size_t frame_index = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        frame_index = playhead;
+
+        const std::map<size_t, std::shared_ptr<const DecodedFrame>>::const_iterator it =
+                decoded_frames.find(playhead);
+        if (it != decoded_frames.end()) {
+            frame = it->second;
+        }
+    }
+
+    if (!frame || frame == shown_frame) {
+        return;
+    }
+
+    shown_frame = frame;
+    shown_frame_index = frame_index;
+    publishParticleState();
+}
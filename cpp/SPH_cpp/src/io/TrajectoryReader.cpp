@@ -0,0 +1,131 @@
+#include "io/TrajectoryReader.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    inline uint64_t get_blocks_size(const TrajectoryFrameHeader &frame_header) {
+        uint64_t size = 0;
+        for (int block = 0; block < TrajectoryFrameCodec::BlockCount; ++block) {
+            size += frame_header.block_sizes[block];
+        }
+        return size;
+    }
+}
+
+bool TrajectoryReader::open(const std::string &file_name, std::string &error) {
+    index.clear();
+
+    if (!file.open(file_name)) {
+        error = "could not open " + file_name;
+        return false;
+    }
+
+    if (file.size() < sizeof(header)) {
+        error = "the file is too short for a trajectory";
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (std::memcmp(header.magic, trajectory_magic, sizeof(header.magic)) != 0) {
+        error = "not a trajectory";
+        return false;
+    }
+    if (header.byte_order != trajectory_byte_order) {
+        error = "the trajectory was written on a machine of another byte order";
+        return false;
+    }
+    if (header.version != trajectory_version) {
+        error = "the trajectory is version " + std::to_string(header.version) + ", this program reads version " +
+                std::to_string(trajectory_version);
+        return false;
+    }
+
+    if (!read_index()) {
+        scan_frames();
+    }
+
+    if (index.empty()) {
+        error = "the trajectory has no frames";
+        return false;
+    }
+
+    return true;
+}
+
+size_t TrajectoryReader::get_keyframe(size_t frame) const {
+    while (frame > 0 && !index[frame].is_keyframe) {
+        --frame;
+    }
+    return frame;
+}
+
+size_t TrajectoryReader::find_frame(double time) const {
+    const std::vector<TrajectoryIndexEntry>::const_iterator after = std::upper_bound(
+            index.begin(), index.end(), time,
+            [](double t, const TrajectoryIndexEntry &entry) { return t < entry.time; });
+
+    return after == index.begin() ? 0 : static_cast<size_t>(after - index.begin()) - 1;
+}
+
+bool TrajectoryReader::decode_frame(size_t frame, TrajectoryFrameCodec &codec, std::vector<glm::vec3> &positions,
+                                    std::vector<glm::vec3> &velocities) const {
+    const uint64_t offset = index[frame].offset;
+    if (offset > file.size() || file.size() - offset < sizeof(TrajectoryFrameHeader)) {
+        return false;
+    }
+
+    TrajectoryFrameHeader frame_header;
+    std::memcpy(&frame_header, file.data() + offset, sizeof(frame_header));
+    if (frame_header.magic != trajectory_frame_magic || frame_header.particle_count > header.max_particles) {
+        return false;
+    }
+
+    const uint8_t *blocks = reinterpret_cast<const uint8_t *>(file.data() + offset + sizeof(frame_header));
+    return codec.decode(frame_header, blocks, file.size() - offset - sizeof(frame_header), positions, velocities);
+}
+
+bool TrajectoryReader::read_index() {
+    TrajectoryFooter footer;
+    if (file.size() < sizeof(header) + sizeof(footer)) {
+        return false;
+    }
+    std::memcpy(&footer, file.data() + file.size() - sizeof(footer), sizeof(footer));
+
+    if (std::memcmp(footer.magic, trajectory_index_magic, sizeof(footer.magic)) != 0) {
+        return false;
+    }
+
+    const uint64_t index_end = file.size() - sizeof(footer);
+    if (footer.index_offset < sizeof(header) || footer.index_offset > index_end ||
+        (index_end - footer.index_offset) % sizeof(TrajectoryIndexEntry) != 0 ||
+        (index_end - footer.index_offset) / sizeof(TrajectoryIndexEntry) != footer.frame_count) {
+        return false;
+    }
+
+    index.resize(static_cast<size_t>(footer.frame_count));
+    if (!index.empty()) {
+        std::memcpy(index.data(), file.data() + footer.index_offset, index.size() * sizeof(TrajectoryIndexEntry));
+    }
+
+    return true;
+}
+
+void TrajectoryReader::scan_frames() {
+    uint64_t offset = sizeof(header);
+
+    while (file.size() - offset >= sizeof(TrajectoryFrameHeader)) {
+        TrajectoryFrameHeader frame_header;
+        std::memcpy(&frame_header, file.data() + offset, sizeof(frame_header));
+
+        const uint64_t frame_size = sizeof(frame_header) + get_blocks_size(frame_header);
+        if (frame_header.magic != trajectory_frame_magic || frame_size > file.size() - offset) {
+            break;
+        }
+
+        const TrajectoryIndexEntry entry = {offset, frame_header.step, frame_header.time,
+                                            frame_header.particle_count, frame_header.is_keyframe};
+        index.push_back(entry);
+        offset += frame_size;
+    }
+}
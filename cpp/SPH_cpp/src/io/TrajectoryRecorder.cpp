@@ -0,0 +1,192 @@
+#include "io/TrajectoryRecorder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "profiling/Profiler.hpp"
+
+TrajectoryRecorder::TrajectoryRecorder() {
+}
+
+TrajectoryRecorder::~TrajectoryRecorder() {
+    close();
+}
+
+bool TrajectoryRecorder::open(const std::string &file_name, const Parameters &params, unsigned int interval,
+                              std::string &error) {
+    close();
+
+    file.open(file_name.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        error = "could not create " + file_name;
+        return false;
+    }
+
+    const glm::vec3 corner(params.left_bound, params.bottom_bound, params.near_bound);
+    const glm::vec3 opposite_corner(params.right_bound, params.top_bound, params.far_bound);
+    const glm::vec3 origin = glm::min(corner, opposite_corner);
+    const glm::vec3 size = glm::max(glm::max(corner, opposite_corner) - origin, glm::vec3(1e-6f));
+
+    TrajectoryFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, trajectory_magic, sizeof(header.magic));
+    header.version = trajectory_version;
+    header.byte_order = trajectory_byte_order;
+    for (int axis = 0; axis < 3; ++axis) {
+        header.origin[axis] = origin[axis];
+        header.size[axis] = size[axis];
+    }
+    header.step_interval = std::max(interval, 1u);
+    header.keyframe_interval = keyframe_interval;
+    header.max_particles = params.max_particles;
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (!file) {
+        file.close();
+        error = "could not write " + file_name;
+        return false;
+    }
+
+    codec.reset(new TrajectoryFrameCodec(origin, size));
+    recording = true;
+    step_interval = header.step_interval;
+    step = 0;
+    time = 0.0;
+    frame_count = 0;
+    raw_bytes = 0;
+
+    index.clear();
+    file_bytes = sizeof(header);
+    write_failed = false;
+
+    closing = false;
+    queued_frames.clear();
+    free_frames.clear();
+    for (unsigned int i = 0; i < frame_buffer_count; ++i) {
+        free_frames.push_back(std::unique_ptr<Frame>(new Frame));
+    }
+
+    thread = std::thread(&TrajectoryRecorder::write_frames, this);
+    return true;
+}
+
+void TrajectoryRecorder::record_step(ParticleSimulator &simulator, float dt_seconds) {
+    if (!recording) {
+        return;
+    }
+
+    ++step;
+    time += dt_seconds;
+    if (step % step_interval != 0) {
+        return;
+    }
+
+    PROFILE_ZONE("TrajectoryRecorder::record_step");
+
+    std::unique_ptr<Frame> frame;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        frame_written.wait(lock, [this]() { return !free_frames.empty(); });
+        frame = std::move(free_frames.back());
+        free_frames.pop_back();
+    }
+
+    frame->step = step;
+    frame->time = time;
+    frame->positions.clear();
+    frame->velocities.clear();
+    simulator.readParticleState([&](Span<const glm::vec3> positions, Span<const glm::vec3> velocities) {
+        for (size_t i = 0; i < positions.size(); ++i) {
+            if (!std::isnan(positions[i].x)) {
+                frame->positions.push_back(positions[i]);
+                frame->velocities.push_back(velocities[i]);
+            }
+        }
+    });
+
+    raw_bytes += 2 * frame->positions.size() * sizeof(glm::vec3);
+    ++frame_count;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued_frames.push_back(std::move(frame));
+    }
+    frame_queued.notify_one();
+}
+
+bool TrajectoryRecorder::close() {
+    if (!recording) {
+        return !write_failed;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    frame_queued.notify_one();
+    thread.join();
+
+    TrajectoryFooter footer;
+    std::memset(&footer, 0, sizeof(footer));
+    footer.index_offset = file_bytes;
+    footer.frame_count = index.size();
+    std::memcpy(footer.magic, trajectory_index_magic, sizeof(footer.magic));
+
+    file.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(TrajectoryIndexEntry));
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    file_bytes += index.size() * sizeof(TrajectoryIndexEntry) + sizeof(footer);
+
+    file.close();
+    write_failed = write_failed || !file;
+
+    recording = false;
+    codec.reset();
+    free_frames.clear();
+
+    return !write_failed;
+}
+
+void TrajectoryRecorder::write_frames() {
+    std::vector<uint8_t> blocks;
+
+    while (true) {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            frame_queued.wait(lock, [this]() { return closing || !queued_frames.empty(); });
+
+            // The frames queued before closing are written first
+            if (queued_frames.empty()) {
+                return;
+            }
+            frame = std::move(queued_frames.front());
+            queued_frames.pop_front();
+        }
+
+        TrajectoryFrameHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = trajectory_frame_magic;
+        header.is_keyframe = index.size() % keyframe_interval == 0 ? 1 : 0;
+        header.step = frame->step;
+        header.time = frame->time;
+
+        blocks.clear();
+        codec->encode(frame->positions, frame->velocities, header.is_keyframe != 0, header, blocks);
+
+        const TrajectoryIndexEntry entry = {file_bytes, header.step, header.time, header.particle_count,
+                                            header.is_keyframe};
+        index.push_back(entry);
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(blocks.data()), blocks.size());
+        file_bytes += sizeof(header) + blocks.size();
+        write_failed = write_failed || !file;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_frames.push_back(std::move(frame));
+        }
+        frame_written.notify_one();
+    }
+}
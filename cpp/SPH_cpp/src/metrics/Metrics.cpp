@@ -0,0 +1,245 @@
+#include "metrics/Metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include "common/ProcessMemory.hpp"
+#include "metrics/MetricsServer.hpp"
+
+// From a tenth of a millisecond, a small scene on the GPU, to seconds, a large one on the CPU
+const double Metrics::step_buckets[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+                                        0.25, 0.5, 1.0, 2.5};
+const size_t Metrics::step_bucket_count = sizeof(step_buckets) / sizeof(step_buckets[0]);
+
+namespace {
+    /// Sets the named totals to the timings' phases, adding the ones not seen before
+    void update_seconds(std::vector<std::pair<std::string, double>> &seconds, const PhaseTimings *timings) {
+        if (!timings) {
+            return;
+        }
+
+        for (const PhaseTimings::Phase &phase : timings->get_phases()) {
+            bool found = false;
+            for (std::pair<std::string, double> &named : seconds) {
+                if (named.first == phase.name) {
+                    named.second = phase.total_seconds;
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                seconds.push_back(std::make_pair(phase.name, phase.total_seconds));
+            }
+        }
+    }
+
+    double get_seconds(const std::vector<std::pair<std::string, double>> &seconds, const std::string &name) {
+        for (const std::pair<std::string, double> &named : seconds) {
+            if (named.first == name) {
+                return named.second;
+            }
+        }
+        return 0.0;
+    }
+
+    /// The name as a JSON string, or as a Prometheus label value, which escape the same characters
+    std::string quote(const std::string &name) {
+        std::string quoted = "\"";
+        for (char c : name) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            } else if (c == '\n') {
+                quoted += "\\n";
+            } else if (static_cast<unsigned char>(c) >= 0x20) {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    /// Writes the HELP and TYPE lines of a metric
+    void write_header(std::ostream &out, const char *name, const char *type, const char *help) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+    }
+
+    void write_metric(std::ostream &out, const char *name, const char *type, const char *help, double value) {
+        write_header(out, name, type, help);
+        out << name << " " << value << "\n";
+    }
+
+    void write_labelled_metric(std::ostream &out, const char *name, const char *help, const char *label,
+                               const std::vector<std::pair<std::string, double>> &seconds) {
+        if (seconds.empty()) {
+            return;
+        }
+
+        write_header(out, name, "counter", help);
+        for (const std::pair<std::string, double> &named : seconds) {
+            out << name << "{" << label << "=" << quote(named.first) << "} " << named.second << "\n";
+        }
+    }
+
+    /// Writes the per-step means of the differences between the totals as a JSON object (ms)
+    void write_step_means(std::ostream &out, const std::vector<std::pair<std::string, double>> &seconds,
+                          const std::vector<std::pair<std::string, double>> &logged_seconds, double steps) {
+        out << "{";
+        for (size_t i = 0; i < seconds.size(); ++i) {
+            out << (i > 0 ? ", " : "") << quote(seconds[i].first) << ": "
+                << 1e3 * (seconds[i].second - get_seconds(logged_seconds, seconds[i].first)) / steps;
+        }
+        out << "}";
+    }
+}
+
+Metrics::Metrics() : totals(), step_bucket_counts(step_bucket_count + 1, 0), logged_totals() {
+}
+
+Metrics::~Metrics() {
+    // The server's thread builds pages from the totals, it has to stop first
+    server.reset();
+}
+
+bool Metrics::open_log(const std::string &file_name, unsigned int interval) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    log.open(file_name.c_str());
+    log_interval = std::max(1u, interval);
+    logged_totals = totals;
+    log_max_step_seconds = 0.0;
+
+    return log.is_open();
+}
+
+bool Metrics::serve(unsigned short port) {
+    server.reset(new MetricsServer([this]() {
+        return get_prometheus_text();
+    }));
+
+    if (!server->start(port)) {
+        server.reset();
+        return false;
+    }
+    return true;
+}
+
+void Metrics::record_step(ParticleSimulator &simulator, double step_seconds, const PhaseTimings *phases,
+                          const PhaseTimings *kernels) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    ++totals.steps;
+    totals.step_seconds += step_seconds;
+    totals.counters = simulator.getCounters();
+    update_seconds(totals.phase_seconds, phases);
+    update_seconds(totals.kernel_seconds, kernels);
+
+    const size_t bucket = std::lower_bound(step_buckets, step_buckets + step_bucket_count, step_seconds) -
+                          step_buckets;
+    ++step_bucket_counts[bucket];
+
+    last_step_seconds = step_seconds;
+    particles = simulator.getParticleDrawCount();
+    solver_iterations = simulator.getSolverIterations();
+
+    if (log.is_open()) {
+        log_max_step_seconds = std::max(log_max_step_seconds, step_seconds);
+        if (totals.steps - logged_totals.steps >= log_interval) {
+            write_log_line();
+        }
+    }
+}
+
+void Metrics::write_log_line() {
+    const double steps = static_cast<double>(totals.steps - logged_totals.steps);
+    const SimulationCounters &counters = totals.counters;
+    const SimulationCounters &logged = logged_totals.counters;
+    const double unix_seconds = 1e-3 * std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+    // One object per line, the counts are of the steps since the previous line
+    std::stringstream line;
+    line << std::fixed << std::setprecision(3);
+    line << "{\"time\": " << unix_seconds
+         << ", \"steps\": " << totals.steps
+         << ", \"interval_steps\": " << totals.steps - logged_totals.steps
+         << ", \"step_ms\": " << 1e3 * (totals.step_seconds - logged_totals.step_seconds) / steps
+         << ", \"max_step_ms\": " << 1e3 * log_max_step_seconds
+         << ", \"particles\": " << particles
+         << ", \"solver_iterations\": " << solver_iterations
+         << ", \"particle_steps\": " << counters.particle_steps - logged.particle_steps
+         << ", \"neighbour_pairs\": " << counters.neighbour_pairs - logged.neighbour_pairs
+         << ", \"spawned_particles\": " << counters.spawned_particles - logged.spawned_particles
+         << ", \"removed_particles\": " << counters.removed_particles - logged.removed_particles
+         << ", \"dropped_particles\": " << counters.dropped_particles - logged.dropped_particles
+         << ", \"limited_pressure_particles\": "
+         << counters.limited_pressure_particles - logged.limited_pressure_particles
+         << ", \"phase_ms\": ";
+    write_step_means(line, totals.phase_seconds, logged_totals.phase_seconds, steps);
+    line << ", \"kernel_ms\": ";
+    write_step_means(line, totals.kernel_seconds, logged_totals.kernel_seconds, steps);
+    line << ", \"resident_memory_mib\": " << get_resident_memory_bytes() / (1024.0 * 1024.0)
+         << ", \"peak_memory_mib\": " << get_peak_memory_bytes() / (1024.0 * 1024.0) << "}\n";
+
+    // Flushed, so that a run that is killed keeps its lines
+    log << line.str() << std::flush;
+
+    logged_totals = totals;
+    log_max_step_seconds = 0.0;
+}
+
+std::string Metrics::get_prometheus_text() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::stringstream out;
+    out << std::setprecision(12);
+
+    const SimulationCounters &counters = totals.counters;
+
+    write_header(out, "sph_step_duration_seconds", "histogram", "Wall-clock time of the simulation updates.");
+    unsigned long long cumulative_count = 0;
+    for (size_t i = 0; i < step_bucket_count; ++i) {
+        cumulative_count += step_bucket_counts[i];
+        out << "sph_step_duration_seconds_bucket{le=\"" << step_buckets[i] << "\"} " << cumulative_count << "\n";
+    }
+    out << "sph_step_duration_seconds_bucket{le=\"+Inf\"} " << totals.steps << "\n";
+    out << "sph_step_duration_seconds_sum " << totals.step_seconds << "\n";
+    out << "sph_step_duration_seconds_count " << totals.steps << "\n";
+
+    write_metric(out, "sph_last_step_duration_seconds", "gauge", "Wall-clock time of the last update.",
+                 last_step_seconds);
+    write_metric(out, "sph_particles", "gauge", "Particles drawn after the last update.", particles);
+    write_metric(out, "sph_solver_iterations", "gauge", "Pressure solver iterations of the last update.",
+                 solver_iterations);
+    write_metric(out, "sph_particle_steps_total", "counter", "Particles updated, summed over the updates.",
+                 static_cast<double>(counters.particle_steps));
+    write_metric(out, "sph_neighbour_pairs_total", "counter",
+                 "Particle pairs within a kernel size found by the neighbour searches.",
+                 static_cast<double>(counters.neighbour_pairs));
+    write_metric(out, "sph_spawned_particles_total", "counter", "Particles spawned by emitters and the heightfield.",
+                 static_cast<double>(counters.spawned_particles));
+    write_metric(out, "sph_removed_particles_total", "counter",
+                 "Particles removed by sinks or absorbed by the heightfield.",
+                 static_cast<double>(counters.removed_particles));
+    write_metric(out, "sph_dropped_particles_total", "counter",
+                 "Particles that could not be spawned because the particle pool was full.",
+                 static_cast<double>(counters.dropped_particles));
+    write_metric(out, "sph_limited_pressure_particles_total", "counter",
+                 "Particles whose PCISPH or DFSPH pressure acceleration the safety limit cut down, summed over the updates.",
+                 static_cast<double>(counters.limited_pressure_particles));
+
+    write_labelled_metric(out, "sph_phase_seconds_total", "Wall-clock time of the simulator's phases.", "phase",
+                          totals.phase_seconds);
+    write_labelled_metric(out, "sph_kernel_seconds_total", "Device time of the OpenCL kernels.", "kernel",
+                          totals.kernel_seconds);
+
+    write_metric(out, "sph_resident_memory_bytes", "gauge", "Resident memory of the process.",
+                 get_resident_memory_bytes());
+    write_metric(out, "sph_peak_resident_memory_bytes", "gauge", "Most resident memory of the process so far.",
+                 get_peak_memory_bytes());
+
+    return out.str();
+}
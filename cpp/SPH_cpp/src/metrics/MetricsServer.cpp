@@ -0,0 +1,181 @@
+#include "metrics/MetricsServer.hpp"
+
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+typedef SOCKET socket_type;
+typedef int socket_length;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int socket_type;
+typedef socklen_t socket_length;
+#endif
+
+namespace {
+    // How long the server waits for a connection before checking whether it should stop (ms)
+    const long poll_interval_ms = 200;
+
+    // Writing to a client that already hung up raises SIGPIPE on POSIX, which would end the simulation. Linux takes
+    // this per send, macOS per socket (see SO_NOSIGPIPE below), and Windows has no such signal
+#ifdef MSG_NOSIGNAL
+    const int send_flags = MSG_NOSIGNAL;
+#else
+    const int send_flags = 0;
+#endif
+
+    void close_socket(socket_type socket) {
+#ifdef _WIN32
+        closesocket(socket);
+#else
+        close(socket);
+#endif
+    }
+
+    bool is_valid(socket_type socket) {
+#ifdef _WIN32
+        return socket != INVALID_SOCKET;
+#else
+        return socket >= 0;
+#endif
+    }
+
+    /// Waits up to poll_interval_ms for the socket to become readable
+    bool wait_readable(socket_type socket) {
+        fd_set sockets;
+        FD_ZERO(&sockets);
+        FD_SET(socket, &sockets);
+
+        timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = poll_interval_ms * 1000;
+
+        return select(static_cast<int>(socket) + 1, &sockets, NULL, NULL, &timeout) > 0;
+    }
+
+    void send_all(socket_type socket, const std::string &data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            const int result = send(socket, data.data() + sent, static_cast<int>(data.size() - sent), send_flags);
+            if (result <= 0) {
+                return;
+            }
+            sent += static_cast<size_t>(result);
+        }
+    }
+}
+
+MetricsServer::MetricsServer(const PageCallback &page) : page(page), stopping(false) {
+}
+
+MetricsServer::~MetricsServer() {
+    stopping = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+
+    if (listen_socket >= 0) {
+        close_socket(static_cast<socket_type>(listen_socket));
+    }
+
+#ifdef _WIN32
+    if (listen_socket >= 0) {
+        WSACleanup();
+    }
+#endif
+}
+
+bool MetricsServer::start(unsigned short port) {
+    if (listen_socket >= 0) {
+        return false;
+    }
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        return false;
+    }
+#endif
+
+    const socket_type server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (!is_valid(server_socket)) {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+
+    // A restarted program can take the port over from its predecessor's connections in TIME_WAIT
+    const int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+
+    // Only this machine can connect, the page is not meant to be public
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(server_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(server_socket, 4) != 0) {
+        close_socket(server_socket);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+
+    listen_socket = static_cast<long long>(server_socket);
+    thread = std::thread(&MetricsServer::run, this);
+    return true;
+}
+
+void MetricsServer::run() {
+    const socket_type server_socket = static_cast<socket_type>(listen_socket);
+
+    while (!stopping) {
+        if (!wait_readable(server_socket)) {
+            continue;
+        }
+
+        sockaddr_in client_address;
+        socket_length address_length = sizeof(client_address);
+        const socket_type client = accept(server_socket, reinterpret_cast<sockaddr *>(&client_address),
+                                          &address_length);
+        if (!is_valid(client)) {
+            continue;
+        }
+
+#ifdef SO_NOSIGPIPE
+        const int no_sigpipe = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+        // Every path gets the page, so only the request's arrival matters. A client that sends nothing in time is
+        // answered anyway
+        if (wait_readable(client)) {
+            char request[1024];
+            recv(client, request, sizeof(request), 0);
+        }
+
+        const std::string body = page();
+        std::string response = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                               "Connection: close\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+        response += body;
+        send_all(client, response);
+
+        close_socket(client);
+    }
+}
@@ -0,0 +1,201 @@
+#include "profiling/Profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+
+std::atomic<bool> Profiler::enabled(false);
+
+namespace {
+    /// The zones of one thread. The mutex is only contended while the zones are read out
+    struct ThreadBuffer {
+        std::mutex mutex;
+        std::vector<Profiler::Event> events;
+
+        // Where the next zone goes, events wraps around once it holds ring_capacity zones
+        size_t next = 0;
+    };
+
+    /// Owns the buffers, so that the zones of threads that have ended can still be exported
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    };
+
+    Registry &get_registry() {
+        static Registry registry;
+        return registry;
+    }
+
+    ThreadBuffer &get_thread_buffer() {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (!buffer) {
+            Registry &registry = get_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+
+            registry.buffers.emplace_back(new ThreadBuffer);
+            buffer = registry.buffers.back().get();
+            buffer->events.reserve(Profiler::ring_capacity);
+        }
+
+        return *buffer;
+    }
+
+    /// The name as a JSON string
+    void write_json_string(std::ostream &out, const char *name) {
+        out << '"';
+        for (const char *c = name; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\' << *c;
+            } else if (static_cast<unsigned char>(*c) < 0x20) {
+                out << ' ';
+            } else {
+                out << *c;
+            }
+        }
+        out << '"';
+    }
+}
+
+void Profiler::set_enabled(bool enable) {
+    enabled.store(enable, std::memory_order_relaxed);
+}
+
+void Profiler::clear() {
+    Registry &registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (std::unique_ptr<ThreadBuffer> &buffer : registry.buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        buffer->events.clear();
+        buffer->next = 0;
+    }
+}
+
+int64_t Profiler::now_ns() {
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Profiler::record(const char *name, int64_t start_ns, int64_t end_ns) {
+    ThreadBuffer &buffer = get_thread_buffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+
+    const Event event = {name, start_ns, end_ns};
+    if (buffer.events.size() < ring_capacity) {
+        buffer.events.push_back(event);
+    } else {
+        buffer.events[buffer.next] = event;
+    }
+    buffer.next = (buffer.next + 1) % ring_capacity;
+}
+
+std::vector<std::vector<Profiler::Event>> Profiler::get_events() {
+    std::vector<std::vector<Event>> threads;
+
+    Registry &registry = get_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (std::unique_ptr<ThreadBuffer> &buffer : registry.buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        if (buffer->events.empty()) {
+            continue;
+        }
+
+        // A full ring starts at the oldest zone, where the next one would go
+        const size_t oldest = buffer->events.size() < ring_capacity ? 0 : buffer->next;
+        std::vector<Event> events(buffer->events.begin() + oldest, buffer->events.end());
+        events.insert(events.end(), buffer->events.begin(), buffer->events.begin() + oldest);
+        threads.push_back(events);
+    }
+
+    return threads;
+}
+
+std::vector<Profiler::ZoneStatistics> Profiler::get_zone_statistics() {
+    // Zones are grouped by their text, the same name may be used by different literals
+    std::map<std::string, std::vector<double>> durations;
+    for (const std::vector<Event> &events : get_events()) {
+        for (const Event &event : events) {
+            durations[event.name].push_back(1e-6 * (event.end_ns - event.start_ns));
+        }
+    }
+
+    std::vector<ZoneStatistics> statistics;
+    for (std::pair<const std::string, std::vector<double>> &zone : durations) {
+        std::vector<double> &ms = zone.second;
+        std::sort(ms.begin(), ms.end());
+
+        double total_ms = 0.0;
+        for (double duration : ms) {
+            total_ms += duration;
+        }
+
+        // The nearest rank, so that p99 of fewer than a hundred zones is the slowest one
+        const size_t p99_rank = static_cast<size_t>(std::ceil(0.99 * ms.size()));
+
+        statistics.push_back({zone.first, ms.size(), total_ms, ms.front(), total_ms / ms.size(),
+                              ms[std::max<size_t>(p99_rank, 1) - 1], ms.back()});
+    }
+
+    std::sort(statistics.begin(), statistics.end(), [](const ZoneStatistics &a, const ZoneStatistics &b) {
+        return a.total_ms > b.total_ms;
+    });
+
+    return statistics;
+}
+
+bool Profiler::write_chrome_trace(const std::string &file_name) {
+    std::ofstream file(file_name.c_str());
+    if (!file.is_open()) {
+        return false;
+    }
+
+    // Complete events ("X") nest by their times, the viewers draw the zones inside each other
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    bool first = true;
+    const std::vector<std::vector<Event>> threads = get_events();
+    for (size_t thread = 0; thread < threads.size(); ++thread) {
+        file << (first ? "" : ",\n")
+             << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+             << ", \"args\": {\"name\": \"thread " << thread << "\"}}";
+        first = false;
+
+        for (const Event &event : threads[thread]) {
+            file << ",\n{\"name\": ";
+            write_json_string(file, event.name);
+            file << ", \"cat\": \"sph\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread
+                 << ", \"ts\": " << 1e-3 * event.start_ns
+                 << ", \"dur\": " << 1e-3 * (event.end_ns - event.start_ns) << "}";
+        }
+    }
+
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
+
+void Profiler::print_zone_statistics(std::ostream &out) {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+
+    out << std::left << std::setw(44) << "Zone" << std::right << std::setw(10) << "count"
+        << std::setw(12) << "total ms" << std::setw(10) << "min ms" << std::setw(10) << "mean ms"
+        << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << "\n";
+
+    out << std::fixed << std::setprecision(3);
+    for (const ZoneStatistics &zone : get_zone_statistics()) {
+        out << std::left << std::setw(44) << zone.name << std::right << std::setw(10) << zone.count
+            << std::setw(12) << zone.total_ms << std::setw(10) << zone.min_ms << std::setw(10) << zone.mean_ms
+            << std::setw(10) << zone.p99_ms << std::setw(10) << zone.max_ms << "\n";
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
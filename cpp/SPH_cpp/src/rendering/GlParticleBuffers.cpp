@@ -0,0 +1,128 @@
+#include "rendering/GlParticleBuffers.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/OpenGL.h>
+#endif
+
+#include "OpenCL/opencl_context_info.hpp"
+
+GlParticleBuffers::GlParticleBuffers(unsigned int max_particles) : capacity(max_particles) {
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    glGenBuffers(1, &vbo_positions);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_positions);
+    glBufferData(GL_ARRAY_BUFFER, capacity * 3 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(0);
+
+    glGenBuffers(1, &vbo_velocities);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_velocities);
+    glBufferData(GL_ARRAY_BUFFER, capacity * 3 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(1);
+
+    glBindVertexArray(0);
+}
+
+GlParticleBuffers::~GlParticleBuffers() {
+    glDeleteBuffers(1, &vbo_velocities);
+    glDeleteBuffers(1, &vbo_positions);
+    glDeleteVertexArrays(1, &vao);
+}
+
+void GlParticleBuffers::upload(Span<const glm::vec3> positions, Span<const glm::vec3> velocities) {
+    const size_t position_count = std::min(positions.size(), static_cast<size_t>(capacity));
+    const size_t velocity_count = std::min(velocities.size(), static_cast<size_t>(capacity));
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_positions);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, position_count * 3 * sizeof(float), positions.data());
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_velocities);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, velocity_count * 3 * sizeof(float), velocities.data());
+}
+
+ParticleStateCallback GlParticleBuffers::get_upload_callback() {
+    return [this](Span<const glm::vec3> positions, Span<const glm::vec3> velocities) {
+        upload(positions, velocities);
+    };
+}
+
+void GlParticleBuffers::draw(unsigned int count) const {
+    glBindVertexArray(vao);
+    glDrawArrays(GL_POINTS, 0, std::min(count, capacity));
+}
+
+const char *GlParticleBuffers::get_sharing_extension() const {
+#ifdef __APPLE__
+    return "cl_APPLE_gl_sharing";
+#else
+    return "cl_khr_gl_sharing";
+#endif
+}
+
+void GlParticleBuffers::add_context_properties(cl_platform_id platform,
+                                               std::vector<cl_context_properties> &properties) {
+#ifdef __linux__
+    //properties.push_back(CL_GL_CONTEXT_KHR);
+    //properties.push_back((cl_context_properties) glXGetCurrentContext());
+    //properties.push_back(CL_GLX_DISPLAY_KHR);
+    //properties.push_back((cl_context_properties) glXGetCurrentDisplay());
+    //properties.push_back(CL_CONTEXT_PLATFORM);
+    //properties.push_back((cl_context_properties) platform);
+#elif defined _WIN32
+    properties.push_back(CL_GL_CONTEXT_KHR);
+    properties.push_back((cl_context_properties) wglGetCurrentContext());
+    properties.push_back(CL_WGL_HDC_KHR);
+    properties.push_back((cl_context_properties) wglGetCurrentDC());
+    properties.push_back(CL_CONTEXT_PLATFORM);
+    properties.push_back((cl_context_properties) platform);
+#elif defined TARGET_OS_MAC
+    CGLContextObj glContext = CGLGetCurrentContext();
+    CGLShareGroupObj shareGroup = CGLGetShareGroup(glContext);
+    properties.push_back(CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE);
+    properties.push_back((cl_context_properties) shareGroup);
+
+    gcl_gl_set_sharegroup(shareGroup);
+#endif
+}
+
+void GlParticleBuffers::create_buffers(cl_context context, cl_mem &positions, cl_mem &velocities) {
+    cl_int error;
+
+    positions = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, vbo_positions, &error);
+    CheckError(error);
+    error = clRetainMemObject(positions);
+    CheckError(error);
+    velocities = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, vbo_velocities, &error);
+    CheckError(error);
+    error = clRetainMemObject(velocities);
+    CheckError(error);
+
+    shared_buffers.clear();
+    shared_buffers.push_back(positions);
+    shared_buffers.push_back(velocities);
+}
+
+void GlParticleBuffers::acquire_buffers(cl_command_queue queue) {
+    glFlush();
+
+    const cl_int error = clEnqueueAcquireGLObjects(queue, (cl_uint) shared_buffers.size(), shared_buffers.data(),
+                                                   0, NULL, NULL);
+    CheckError(error);
+}
+
+void GlParticleBuffers::release_buffers(cl_command_queue queue) {
+    const cl_int error = clEnqueueReleaseGLObjects(queue, (cl_uint) shared_buffers.size(), shared_buffers.data(),
+                                                   0, NULL, NULL);
+    CheckError(error);
+}
@@ -0,0 +1,104 @@
+#include "rendering/HeightfieldMesh.hpp"
+
+#include <algorithm>
+
+HeightfieldMesh::HeightfieldMesh(const ShallowWater &shallow_water) {
+    const glm::ivec2 &dimensions = shallow_water.get_dimensions();
+    const std::vector<float> &depths = shallow_water.get_depths();
+
+    positions.resize(depths.size());
+    normals.resize(depths.size());
+
+    // Two counter-clockwise triangles (seen from above) per square of four columns, unless all four are active or
+    // one is outside the container
+    std::vector<GLuint> indices;
+    for (int z = 0; z + 1 < dimensions.y; ++z) {
+        for (int x = 0; x + 1 < dimensions.x; ++x) {
+            const GLuint a = x + dimensions.x * z;
+            const GLuint b = a + dimensions.x;
+            const GLuint c = a + 1;
+            const GLuint d = b + 1;
+
+            if (shallow_water.is_active_column(a) && shallow_water.is_active_column(b) &&
+                shallow_water.is_active_column(c) && shallow_water.is_active_column(d)) {
+                continue;
+            }
+
+            if (shallow_water.is_land_column(a) || shallow_water.is_land_column(b) ||
+                shallow_water.is_land_column(c) || shallow_water.is_land_column(d)) {
+                continue;
+            }
+
+            indices.insert(indices.end(), {a, b, c, c, b, d});
+        }
+    }
+    index_count = static_cast<GLsizei>(indices.size());
+
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    glGenBuffers(1, &vbo_positions);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_positions);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * 3 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(0);
+
+    glGenBuffers(1, &vbo_normals);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
+    glBufferData(GL_ARRAY_BUFFER, normals.size() * 3 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(1);
+
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    glBindVertexArray(0);
+}
+
+HeightfieldMesh::~HeightfieldMesh() {
+    glDeleteBuffers(1, &ebo);
+    glDeleteBuffers(1, &vbo_normals);
+    glDeleteBuffers(1, &vbo_positions);
+    glDeleteVertexArrays(1, &vao);
+}
+
+void HeightfieldMesh::update(const ShallowWater &shallow_water) {
+    const glm::ivec2 &dimensions = shallow_water.get_dimensions();
+    const std::vector<float> &depths = shallow_water.get_depths();
+    const glm::vec2 first = shallow_water.get_first_column_centre();
+    const float cell_size = shallow_water.get_cell_size();
+    const float floor = shallow_water.get_floor();
+
+    for (int z = 0; z < dimensions.y; ++z) {
+        for (int x = 0; x < dimensions.x; ++x) {
+            const unsigned int c = x + dimensions.x * z;
+            const glm::vec2 column = first + glm::vec2(x, z) * cell_size;
+
+            positions[c] = glm::vec3(column.x, floor + depths[c], column.y);
+
+            // Central differences, one-sided at the edges of the grid
+            const int left = std::max(x - 1, 0);
+            const int right = std::min(x + 1, dimensions.x - 1);
+            const int front = std::max(z - 1, 0);
+            const int back = std::min(z + 1, dimensions.y - 1);
+
+            const float slope_x = (depths[right + dimensions.x * z] - depths[left + dimensions.x * z]) /
+                                  ((right - left) * cell_size);
+            const float slope_z = (depths[x + dimensions.x * back] - depths[x + dimensions.x * front]) /
+                                  ((back - front) * cell_size);
+
+            normals[c] = glm::normalize(glm::vec3(-slope_x, 1.0f, -slope_z));
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_positions);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, positions.size() * 3 * sizeof(float), positions.data());
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_normals);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, normals.size() * 3 * sizeof(float), normals.data());
+}
+
+void HeightfieldMesh::draw() const {
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, NULL);
+}
@@ -0,0 +1,262 @@
+#include "rendering/PerformanceHud.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "VoxelGrid.hpp"
+#include "common/ProcessMemory.hpp"
+
+namespace {
+    // How often the labels are refreshed (s), often enough to follow a change, rarely enough to be read
+    const double refresh_interval = 0.5;
+
+    // How many kernels and inspected phases get a line
+    const size_t kernel_line_count = 6;
+    const size_t inspect_line_count = 10;
+
+    std::string format_ms(double seconds) {
+        std::stringstream stream;
+        stream << std::fixed << std::setprecision(2) << 1e3 * seconds << " ms";
+        return stream.str();
+    }
+
+    nanogui::Graph *create_graph(nanogui::Widget *parent, const std::string &caption, const nanogui::Color &color) {
+        nanogui::Graph *graph = new nanogui::Graph(parent, caption);
+        graph->setForegroundColor(color);
+        graph->setFixedSize(nanogui::Vector2i(260, 40));
+        return graph;
+    }
+
+    nanogui::Label *create_label(nanogui::Widget *parent, const std::string &caption = "") {
+        nanogui::Label *label = new nanogui::Label(parent, caption);
+        label->setFixedWidth(260);
+        label->setFontSize(15);
+        return label;
+    }
+}
+
+PerformanceHud::PerformanceHud(nanogui::Screen *screen, ParticleSimulator *simulator) : simulator(simulator) {
+    using namespace nanogui;
+
+    window = new Window(screen, "Performance");
+    window->setPosition(Vector2i(250, 15));
+    window->setLayout(new GroupLayout());
+
+    new Label(window, "Frame time", "sans-bold");
+    frame_graph = create_graph(window, "frame", Color(255, 255, 255, 255));
+    simulate_graph = create_graph(window, "simulate", Color(255, 192, 0, 128));
+    upload_graph = create_graph(window, "upload", Color(0, 192, 255, 128));
+    render_graph = create_graph(window, "render", Color(0, 255, 128, 128));
+    gui_graph = create_graph(window, "GUI", Color(255, 96, 192, 128));
+
+    new Label(window, "Simulation", "sans-bold");
+    throughput_label = create_label(window);
+    memory_label = create_label(window);
+    grid_label = create_label(window);
+    grid_cells_label = create_label(window);
+
+    new Label(window, "Device kernels (per frame)", "sans-bold");
+    for (size_t i = 0; i < kernel_line_count; ++i) {
+        kernel_labels.push_back(create_label(window));
+    }
+    kernel_labels.front()->setCaption("Not timed");
+
+    new Label(window, "Inspect", "sans-bold");
+    CheckBox *pause_box = new CheckBox(window, "Pause and inspect", [=](bool state) {
+        paused = state;
+        inspect_slider->setEnabled(paused);
+        inspect_slider->setValue(1.0f);
+        update_inspected_frame();
+    });
+    pause_box->setFontSize(16);
+
+    // From the oldest frame in the graphs (0) to the newest (1)
+    inspect_slider = new Slider(window);
+    inspect_slider->setFixedWidth(260);
+    inspect_slider->setValue(1.0f);
+    inspect_slider->setEnabled(false);
+    inspect_slider->setCallback([=](float) {
+        update_inspected_frame();
+    });
+
+    for (size_t i = 0; i < inspect_line_count; ++i) {
+        inspect_labels.push_back(create_label(window));
+    }
+
+    window->setVisible(false);
+    screen->performLayout();
+}
+
+PerformanceHud::~PerformanceHud() {
+    set_visible(false);
+}
+
+void PerformanceHud::set_visible(bool show) {
+    visible = show;
+    window->setVisible(show);
+
+    phase_timings.clear();
+    simulator->setPhaseTimings(show ? &phase_timings : nullptr);
+    kernel_timings.clear();
+    simulator->setKernelTimings(show ? &kernel_timings : nullptr);
+}
+
+void PerformanceHud::add_frame(const FrameTimes &frame_times) {
+    if (paused) {
+        return;
+    }
+
+    Frame frame;
+    frame.upload = 0.0;
+    for (const PhaseTimings::Phase &phase : phase_timings.get_phases()) {
+        frame.phases.push_back(std::make_pair(phase.name, phase.total_seconds));
+        if (phase.name == "upload") {
+            frame.upload = phase.total_seconds;
+        }
+    }
+    phase_timings.clear();
+
+    frame.simulate = std::max(0.0, frame_times.simulate - frame.upload);
+    frame.render = frame_times.render;
+    frame.gui = frame_times.gui;
+    frame.particle_updates = frame_times.particle_updates;
+
+    frames.push_back(frame);
+    if (frames.size() > history_length) {
+        frames.pop_front();
+    }
+
+    refresh_seconds += frame_times.simulate + frame_times.render + frame_times.gui;
+    refresh_updates += frame_times.particle_updates;
+    ++refresh_frames;
+    kernel_frames += frame_times.particle_updates > 0;
+
+    if (visible) {
+        update_graphs();
+        if (refresh_seconds >= refresh_interval) {
+            update_statistics();
+        }
+    }
+}
+
+void PerformanceHud::update_graphs() {
+    struct Series {
+        nanogui::Graph *graph;
+        double Frame::*part;
+    };
+
+    const Series series[] = {
+            {simulate_graph, &Frame::simulate},
+            {upload_graph,   &Frame::upload},
+            {render_graph,   &Frame::render},
+            {gui_graph,      &Frame::gui}
+    };
+
+    nanogui::VectorXf totals(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        totals[i] = static_cast<float>(frames[i].simulate + frames[i].upload + frames[i].render + frames[i].gui);
+    }
+
+    // Each graph is scaled to its own slowest frame, given in its header, with the newest frame in its footer
+    const float max_total = std::max(totals.maxCoeff(), 1e-9f);
+    frame_graph->setValues(totals / max_total);
+    frame_graph->setHeader("max " + format_ms(max_total));
+    frame_graph->setFooter(format_ms(totals[totals.size() - 1]));
+
+    for (const Series &part : series) {
+        nanogui::VectorXf values(frames.size());
+        for (size_t i = 0; i < frames.size(); ++i) {
+            values[i] = static_cast<float>(frames[i].*part.part);
+        }
+
+        const float max_value = std::max(values.maxCoeff(), 1e-9f);
+        part.graph->setValues(values / max_value);
+        part.graph->setHeader("max " + format_ms(max_value));
+        part.graph->setFooter(format_ms(values[values.size() - 1]));
+    }
+}
+
+void PerformanceHud::update_statistics() {
+    std::stringstream stream;
+    stream << std::fixed << std::setprecision(0);
+
+    stream << "Particle-updates/s: " << std::scientific << std::setprecision(2)
+           << refresh_updates / refresh_seconds << std::fixed << ", "
+           << std::setprecision(0) << refresh_frames / refresh_seconds << " FPS";
+    throughput_label->setCaption(stream.str());
+
+    stream.str("");
+    stream << "Memory: " << get_resident_memory_bytes() / (1024.0 * 1024.0) << " MiB, peak "
+           << get_peak_memory_bytes() / (1024.0 * 1024.0) << " MiB";
+    memory_label->setCaption(stream.str());
+
+    GridOccupancy occupancy;
+    if (simulator->getGridOccupancy(occupancy)) {
+        stream.str("");
+        stream << "Grid: " << occupancy.occupied_cells << " of " << occupancy.total_cells << " cells occupied";
+        grid_label->setCaption(stream.str());
+
+        stream.str("");
+        stream << std::setprecision(1) << "  "
+               << (occupancy.occupied_cells > 0 ? static_cast<double>(occupancy.particles) / occupancy.occupied_cells
+                                                : 0.0)
+               << " mean, " << occupancy.max_cell_particles << " max per cell";
+        if (occupancy.cell_capacity > 0) {
+            stream << ", " << occupancy.full_cells << " full";
+        }
+        grid_cells_label->setCaption(stream.str());
+    } else {
+        grid_label->setCaption("Grid: none");
+        grid_cells_label->setCaption("");
+    }
+
+    // The slowest kernels of the frames since the last refresh, per simulated frame
+    if (!kernel_timings.get_phases().empty() && kernel_frames > 0) {
+        std::vector<PhaseTimings::Phase> kernels = kernel_timings.get_phases();
+        std::sort(kernels.begin(), kernels.end(), [](const PhaseTimings::Phase &a, const PhaseTimings::Phase &b) {
+            return a.total_seconds > b.total_seconds;
+        });
+
+        for (size_t i = 0; i < kernel_labels.size(); ++i) {
+            if (i < kernels.size()) {
+                kernel_labels[i]->setCaption(kernels[i].name + ": " +
+                                             format_ms(kernels[i].total_seconds / kernel_frames));
+            } else {
+                kernel_labels[i]->setCaption("");
+            }
+        }
+    }
+    kernel_timings.clear();
+
+    refresh_seconds = 0.0;
+    refresh_updates = 0.0;
+    refresh_frames = 0;
+    kernel_frames = 0;
+}
+
+void PerformanceHud::update_inspected_frame() {
+    for (nanogui::Label *label : inspect_labels) {
+        label->setCaption("");
+    }
+
+    if (!paused || frames.empty()) {
+        return;
+    }
+
+    const size_t index = std::min(frames.size() - 1,
+                                  static_cast<size_t>(inspect_slider->value() * (frames.size() - 1) + 0.5f));
+    const Frame &frame = frames[index];
+
+    std::stringstream stream;
+    stream << "Frame " << index + 1 << " of " << frames.size() << ": "
+           << format_ms(frame.simulate + frame.upload + frame.render + frame.gui);
+    inspect_labels[0]->setCaption(stream.str());
+    inspect_labels[1]->setCaption("  simulate " + format_ms(frame.simulate) + ", upload " + format_ms(frame.upload));
+    inspect_labels[2]->setCaption("  render " + format_ms(frame.render) + ", GUI " + format_ms(frame.gui));
+
+    // The simulator's phases, if they were timed
+    for (size_t i = 0; i < frame.phases.size() && i + 3 < inspect_labels.size(); ++i) {
+        inspect_labels[i + 3]->setCaption("    " + frame.phases[i].first + ": " + format_ms(frame.phases[i].second));
+    }
+}
@@ -74,3 +74,79 @@ float laplacianWviscosity(glm::vec3 r, float h) {
 
 	return laplacian;
 }
+
+void Wpoly6(const glm::vec3 *r, float *w, size_t count, float h) {
+	const float h2 = h * h;
+	const float normalisation = 315 / (64 * constants::PI * std::pow(h, 9));
+
+	for (size_t i = 0; i < count; ++i) {
+		const float radius2 = glm::dot(r[i], r[i]);
+		const float difference = h2 - radius2;
+
+		w[i] = radius2 < h2 ? normalisation * difference * difference * difference : 0.0f;
+	}
+}
+
+void gradWspiky(const glm::vec3 *r, glm::vec3 *gradients, size_t count, float h) {
+	const float normalisation = -3 * 15 / (constants::PI * std::pow(h, 6));
+
+	for (size_t i = 0; i < count; ++i) {
+		const float radius = glm::length(r[i]);
+		const float difference = h - radius;
+
+		gradients[i] = radius < h && radius > 0 ? (normalisation * difference * difference / radius) * r[i]
+		                                        : glm::vec3(0.0f);
+	}
+}
+
+float latticeDensity(float mass, float h) {
+	const float spacing = h / 2;
+	float density = 0;
+
+	for (int z = -2; z <= 2; ++z) {
+		for (int y = -2; y <= 2; ++y) {
+			for (int x = -2; x <= 2; ++x) {
+				density += mass * Wpoly6(spacing * glm::vec3(x, y, z), h);
+			}
+		}
+	}
+
+	return density;
+}
+
+float pcisphDelta(float mass, float restDensity, float h, float dt) {
+	const float spacing = h / 2;
+	glm::vec3 gradientSum = {0, 0, 0};
+	float gradientDotSum = 0;
+
+	for (int z = -2; z <= 2; ++z) {
+		for (int y = -2; y <= 2; ++y) {
+			for (int x = -2; x <= 2; ++x) {
+				const glm::vec3 gradient = gradWspiky(-spacing * glm::vec3(x, y, z), h);
+
+				gradientSum += gradient;
+				gradientDotSum += glm::dot(gradient, gradient);
+			}
+		}
+	}
+
+	const float beta = 2 * std::pow(dt * mass / restDensity, 2);
+
+	return 1 / (beta * (glm::dot(gradientSum, gradientSum) + gradientDotSum));
+}
+
+float latticeGradientSquaredSum(float mass, float h) {
+	const float spacing = h / 2;
+	float gradientDotSum = 0;
+
+	for (int z = -2; z <= 2; ++z) {
+		for (int y = -2; y <= 2; ++y) {
+			for (int x = -2; x <= 2; ++x) {
+				const glm::vec3 gradient = mass * gradWspiky(spacing * glm::vec3(x, y, z), h);
+				gradientDotSum += glm::dot(gradient, gradient);
+			}
+		}
+	}
+
+	return gradientDotSum;
+}